@@ -1,5 +1,22 @@
+# Build each backend below as a module, loaded the first time an image that
+# may need it is opened, rather than linking it into imv. Launching imv then
+# only pays for the libraries actually used.
+# depends: dlopen
+BACKEND_MODULES=no
+
+# Build in USDT static tracepoints, for attaching bpftrace or perf to a
+# running imv. They cost a nop each until a tracer attaches.
+# depends: sys/sdt.h from systemtap (systemtap-sdt-dev or systemtap-sdt-devel)
+USDT=no
+
 # Configure available backends:
 
+# imv's own decoders, tried before any other backend
+# provides: binary ppm and pgm, qoi, farbfeld, uncompressed bmp
+# depends: none
+# license: MIT
+BACKEND_BUILTIN=yes
+
 # FreeImage http://freeimage.sourceforge.net
 # provides: png, jpg, animated gif, raw, psd, bmp, tiff, webp, etc.
 # depends: libjpeg, openexr, openjpeg2, libwebp, libraw, jxrlib
@@ -24,6 +41,24 @@ BACKEND_LIBPNG=no
 # license: modified bsd
 BACKEND_LIBJPEG=no
 
+# OpenEXR https://www.openexr.com/
+# provides: exr, including tiled, mipmapped and multi-layer images
+# depends: imath zlib
+# license: modified bsd
+BACKEND_OPENEXR=no
+
+# OpenJPEG https://www.openjpeg.org/
+# provides: jpeg 2000 (jp2, j2k), decoding only the resolution and region shown
+# depends: none
+# license: 2-clause bsd
+BACKEND_OPENJPEG=no
+
+# FFmpeg https://ffmpeg.org/
+# provides: video (mp4, mkv, webm, avi, ...), with frame stepping and seeking
+# depends: libavformat libavcodec libswscale libavutil
+# license: LGPL
+BACKEND_FFMPEG=no
+
 # librsvg https://wiki.gnome.org/Projects/LibRsvg
 # provides: svg
 # depends: gdk-pixbuf2 pango libcroco
@@ -0,0 +1,789 @@
+#include "backend_builtin.h"
+#include "backend.h"
+#include "source.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Row conversion is a byte shuffle into the bitmap layout, so use the
+ * byte shuffle instruction where there is one. SSSE3 is picked at run time
+ * as it isn't part of the x86-64 baseline; NEON always is on aarch64.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMV_HAVE_SSSE3
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#define IMV_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Refuse anything larger up front rather than attempt a huge allocation */
+#define MAX_PIXELS 400000000
+
+enum format {
+  FORMAT_PNM,
+  FORMAT_FARBFELD,
+  FORMAT_QOI,
+  FORMAT_BMP,
+};
+
+enum conversion {
+  CONVERT_SWIZZLE, /* each row is a plain byte shuffle */
+  CONVERT_SCALE,   /* PNM samples with an unusual maxval */
+  CONVERT_PALETTE, /* 8 bit BMP */
+  CONVERT_QOI,     /* QOI's own encoding */
+};
+
+/* Describes how to build each 4 byte output pixel from a packed input pixel:
+ * the offset of the input byte to use for each output byte, or -1 to make
+ * it fully opaque.
+ */
+struct swizzle {
+  int in_bpp;
+  signed char map[4];
+
+  /* the same, as byte shuffle masks covering one vector step */
+  int step;
+  unsigned char shuffle[16];
+  unsigned char alpha[16];
+};
+
+struct private {
+  int fd;
+  void *data;
+  size_t len;
+
+  enum format format;
+  enum conversion conversion;
+  enum imv_pixelformat out_format;
+  bool opaque;
+
+  size_t offset; /* start of the pixel data */
+  size_t stride; /* bytes per row of pixel data */
+  bool bottom_up;
+
+  struct swizzle swizzle;
+
+  /* PNM */
+  int channels;
+  unsigned maxval;
+
+  /* BMP */
+  const unsigned char *palette;
+  unsigned palette_len;
+};
+
+static void swizzle_init(struct swizzle *sw, int in_bpp,
+    int r, int g, int b, int a)
+{
+  sw->in_bpp = in_bpp;
+  sw->map[0] = r;
+  sw->map[1] = g;
+  sw->map[2] = b;
+  sw->map[3] = a;
+
+  /* as many pixels as fit in 16 bytes of both input and output */
+  sw->step = in_bpp > 4 ? 2 : 4;
+  memset(sw->shuffle, 0x80, sizeof sw->shuffle);
+  memset(sw->alpha, 0, sizeof sw->alpha);
+  for (int px = 0; px < sw->step; ++px) {
+    for (int c = 0; c < 4; ++c) {
+      const int i = px * 4 + c;
+      if (sw->map[c] < 0) {
+        sw->alpha[i] = 0xff;
+      } else {
+        sw->shuffle[i] = px * in_bpp + sw->map[c];
+      }
+    }
+  }
+}
+
+static void swizzle_scalar(unsigned char *dst, const unsigned char *src,
+    size_t n, const struct swizzle *sw)
+{
+  for (size_t i = 0; i < n; ++i) {
+    for (int c = 0; c < 4; ++c) {
+      dst[c] = sw->map[c] < 0 ? 0xff : src[(int)sw->map[c]];
+    }
+    dst += 4;
+    src += sw->in_bpp;
+  }
+}
+
+/* The vector versions return how many pixels they converted. Every step
+ * loads a full 16 bytes, so they stop short of reading past the row and
+ * leave the tail to swizzle_scalar.
+ */
+#ifdef IMV_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static size_t swizzle_ssse3(unsigned char *dst, const unsigned char *src,
+    size_t n, const struct swizzle *sw)
+{
+  const __m128i shuffle = _mm_loadu_si128((const __m128i*)sw->shuffle);
+  const __m128i alpha = _mm_loadu_si128((const __m128i*)sw->alpha);
+  const size_t step = sw->step;
+  const size_t in_bpp = sw->in_bpp;
+
+  size_t i = 0;
+  for (; (n - i) * in_bpp >= 16; i += step) {
+    __m128i px = _mm_loadu_si128((const __m128i*)(src + i * in_bpp));
+    px = _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha);
+    if (step == 4) {
+      _mm_storeu_si128((__m128i*)(dst + i * 4), px);
+    } else {
+      _mm_storel_epi64((__m128i*)(dst + i * 4), px);
+    }
+  }
+  return i;
+}
+#endif
+
+#ifdef IMV_HAVE_NEON
+static size_t swizzle_neon(unsigned char *dst, const unsigned char *src,
+    size_t n, const struct swizzle *sw)
+{
+  const uint8x16_t shuffle = vld1q_u8(sw->shuffle);
+  const uint8x16_t alpha = vld1q_u8(sw->alpha);
+  const size_t step = sw->step;
+  const size_t in_bpp = sw->in_bpp;
+
+  size_t i = 0;
+  for (; (n - i) * in_bpp >= 16; i += step) {
+    uint8x16_t px = vld1q_u8(src + i * in_bpp);
+    px = vorrq_u8(vqtbl1q_u8(px, shuffle), alpha);
+    if (step == 4) {
+      vst1q_u8(dst + i * 4, px);
+    } else {
+      vst1_u8(dst + i * 4, vget_low_u8(px));
+    }
+  }
+  return i;
+}
+#endif
+
+static bool have_simd(void)
+{
+#if defined(IMV_HAVE_SSSE3)
+  return __builtin_cpu_supports("ssse3");
+#elif defined(IMV_HAVE_NEON)
+  return true;
+#else
+  return false;
+#endif
+}
+
+static void swizzle_row(unsigned char *dst, const unsigned char *src,
+    size_t n, const struct swizzle *sw, bool simd)
+{
+  if (sw->in_bpp == 4 && sw->map[0] == 0 && sw->map[1] == 1
+      && sw->map[2] == 2 && sw->map[3] == 3) {
+    memcpy(dst, src, n * 4);
+    return;
+  }
+
+  size_t done = 0;
+#if defined(IMV_HAVE_SSSE3)
+  if (simd) {
+    done = swizzle_ssse3(dst, src, n, sw);
+  }
+#elif defined(IMV_HAVE_NEON)
+  if (simd) {
+    done = swizzle_neon(dst, src, n, sw);
+  }
+#else
+  (void)simd;
+#endif
+  swizzle_scalar(dst + done * 4, src + done * sw->in_bpp, n - done, sw);
+}
+
+static void scale_row(unsigned char *dst, const unsigned char *src,
+    size_t n, const struct private *private)
+{
+  const unsigned maxval = private->maxval;
+  const int bytes = maxval > 255 ? 2 : 1;
+  for (size_t i = 0; i < n; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      const unsigned char *s = src + (private->channels == 1 ? 0 : c * bytes);
+      unsigned v = bytes == 1 ? s[0] : (unsigned)s[0] << 8 | s[1];
+      if (v > maxval) {
+        v = maxval;
+      }
+      dst[c] = (v * 255 + maxval / 2) / maxval;
+    }
+    dst[3] = 0xff;
+    dst += 4;
+    src += private->channels * bytes;
+  }
+}
+
+static void palette_row(unsigned char *dst, const unsigned char *src,
+    size_t n, const struct private *private)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (src[i] < private->palette_len) {
+      memcpy(dst, private->palette + src[i] * 4, 3);
+    } else {
+      memset(dst, 0, 3);
+    }
+    dst[3] = 0xff;
+    dst += 4;
+  }
+}
+
+static bool decode_qoi(const struct private *private, size_t num_pixels,
+    unsigned char *out)
+{
+  /* the stream is followed by an 8 byte end marker */
+  if (private->len < private->offset + 8) {
+    return false;
+  }
+  const unsigned char *p = (const unsigned char*)private->data + private->offset;
+  const unsigned char *end = (const unsigned char*)private->data + private->len - 8;
+
+  unsigned char index[64][4];
+  memset(index, 0, sizeof index);
+  unsigned char px[4] = {0, 0, 0, 0xff};
+  int run = 0;
+
+  for (size_t i = 0; i < num_pixels; ++i) {
+    if (run > 0) {
+      --run;
+    } else {
+      if (p >= end) {
+        return false;
+      }
+      const unsigned char b1 = *p++;
+
+      if (b1 == 0xfe) {
+        if (end - p < 3) {
+          return false;
+        }
+        memcpy(px, p, 3);
+        p += 3;
+      } else if (b1 == 0xff) {
+        if (end - p < 4) {
+          return false;
+        }
+        memcpy(px, p, 4);
+        p += 4;
+      } else if ((b1 & 0xc0) == 0x00) {
+        memcpy(px, index[b1], 4);
+      } else if ((b1 & 0xc0) == 0x40) {
+        px[0] += ((b1 >> 4) & 0x03) - 2;
+        px[1] += ((b1 >> 2) & 0x03) - 2;
+        px[2] += (b1 & 0x03) - 2;
+      } else if ((b1 & 0xc0) == 0x80) {
+        if (p >= end) {
+          return false;
+        }
+        const unsigned char b2 = *p++;
+        const int vg = (b1 & 0x3f) - 32;
+        px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+        px[1] += vg;
+        px[2] += vg - 8 + (b2 & 0x0f);
+      } else {
+        run = b1 & 0x3f;
+      }
+
+      memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64],
+          px, 4);
+    }
+
+    memcpy(out + i * 4, px, 4);
+  }
+
+  return true;
+}
+
+static bool decode(const struct private *private, int width, int height,
+    unsigned char *out)
+{
+  if (private->conversion == CONVERT_QOI) {
+    return decode_qoi(private, (size_t)width * height, out);
+  }
+
+  const bool simd = have_simd();
+  const unsigned char *data = (const unsigned char*)private->data + private->offset;
+
+  for (int y = 0; y < height; ++y) {
+    const int row = private->bottom_up ? height - 1 - y : y;
+    const unsigned char *src = data + row * private->stride;
+    unsigned char *dst = out + (size_t)y * width * 4;
+
+    switch (private->conversion) {
+      case CONVERT_SWIZZLE:
+        swizzle_row(dst, src, width, &private->swizzle, simd);
+        break;
+      case CONVERT_SCALE:
+        scale_row(dst, src, width, private);
+        break;
+      case CONVERT_PALETTE:
+        palette_row(dst, src, width, private);
+        break;
+      case CONVERT_QOI:
+        break;
+    }
+  }
+
+  return true;
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static unsigned read_le16(const unsigned char *p)
+{
+  return (unsigned)p[1] << 8 | p[0];
+}
+
+/* Reads the next number from a PNM header, skipping whitespace and comments
+ * before it */
+static bool pnm_number(const unsigned char **p, const unsigned char *end,
+    unsigned *value)
+{
+  while (*p < end) {
+    if (**p == '#') {
+      while (*p < end && **p != '\n') {
+        ++*p;
+      }
+    } else if (isspace(**p)) {
+      ++*p;
+    } else {
+      break;
+    }
+  }
+
+  const unsigned char *start = *p;
+  unsigned v = 0;
+  while (*p < end && isdigit(**p)) {
+    if (v > MAX_PIXELS) {
+      return false;
+    }
+    v = v * 10 + (**p - '0');
+    ++*p;
+  }
+
+  *value = v;
+  return *p != start;
+}
+
+static bool parse_pnm(struct private *private, int *width, int *height)
+{
+  const unsigned char *data = private->data;
+  const unsigned char *end = data + private->len;
+
+  /* binary greymap and pixmap only, FreeImage can take the rest */
+  if (data[0] != 'P' || (data[1] != '5' && data[1] != '6')) {
+    return false;
+  }
+  private->channels = data[1] == '5' ? 1 : 3;
+
+  const unsigned char *p = data + 2;
+  unsigned w, h, maxval;
+  if (!pnm_number(&p, end, &w) || !pnm_number(&p, end, &h)
+      || !pnm_number(&p, end, &maxval)) {
+    return false;
+  }
+  if (maxval == 0 || maxval > 65535) {
+    return false;
+  }
+
+  /* a single whitespace character separates the header from the samples */
+  if (p >= end || !isspace(*p)) {
+    return false;
+  }
+  ++p;
+
+  const int bytes = maxval > 255 ? 2 : 1;
+  const int in_bpp = private->channels * bytes;
+
+  *width = w;
+  *height = h;
+  private->format = FORMAT_PNM;
+  private->out_format = IMV_ABGR;
+  private->opaque = true;
+  private->offset = p - data;
+  private->stride = (size_t)w * in_bpp;
+  private->bottom_up = false;
+  private->maxval = maxval;
+
+  /* 16 bit samples are big endian, so their high byte comes first */
+  if (maxval == 255 || maxval == 65535) {
+    private->conversion = CONVERT_SWIZZLE;
+    if (private->channels == 1) {
+      swizzle_init(&private->swizzle, in_bpp, 0, 0, 0, -1);
+    } else {
+      swizzle_init(&private->swizzle, in_bpp, 0, bytes, 2 * bytes, -1);
+    }
+  } else {
+    private->conversion = CONVERT_SCALE;
+  }
+
+  return true;
+}
+
+static bool parse_farbfeld(struct private *private, int *width, int *height)
+{
+  const unsigned char *data = private->data;
+
+  if (private->len < 16 || memcmp(data, "farbfeld", 8)) {
+    return false;
+  }
+
+  const uint32_t w = read_be32(data + 8);
+  const uint32_t h = read_be32(data + 12);
+  if (w > MAX_PIXELS || h > MAX_PIXELS) {
+    return false;
+  }
+
+  *width = w;
+  *height = h;
+  private->format = FORMAT_FARBFELD;
+  private->conversion = CONVERT_SWIZZLE;
+  private->out_format = IMV_ABGR;
+  private->opaque = false;
+  private->offset = 16;
+  private->stride = (size_t)w * 8;
+  private->bottom_up = false;
+
+  /* 16 bit big endian RGBA, keep the high bytes */
+  swizzle_init(&private->swizzle, 8, 0, 2, 4, 6);
+  return true;
+}
+
+static bool parse_qoi(struct private *private, int *width, int *height)
+{
+  const unsigned char *data = private->data;
+
+  if (private->len < 14 || memcmp(data, "qoif", 4)) {
+    return false;
+  }
+
+  const uint32_t w = read_be32(data + 4);
+  const uint32_t h = read_be32(data + 8);
+  const unsigned channels = data[12];
+  if (w > MAX_PIXELS || h > MAX_PIXELS || (channels != 3 && channels != 4)) {
+    return false;
+  }
+
+  *width = w;
+  *height = h;
+  private->format = FORMAT_QOI;
+  private->conversion = CONVERT_QOI;
+  private->out_format = IMV_ABGR;
+  private->opaque = false;
+  private->offset = 14;
+  private->stride = 0;
+  private->bottom_up = false;
+  return true;
+}
+
+static bool parse_bmp(struct private *private, int *width, int *height)
+{
+  const unsigned char *data = private->data;
+
+  if (private->len < 54 || data[0] != 'B' || data[1] != 'M') {
+    return false;
+  }
+
+  const uint32_t offset = read_le32(data + 10);
+  const uint32_t dib_size = read_le32(data + 14);
+  const int32_t w = (int32_t)read_le32(data + 18);
+  const int32_t h = (int32_t)read_le32(data + 22);
+  const unsigned planes = read_le16(data + 26);
+  const unsigned bpp = read_le16(data + 28);
+  const uint32_t compression = read_le32(data + 30);
+
+  /* BITMAPINFOHEADER and its later extensions, uncompressed only */
+  if (dib_size < 40 || planes != 1 || w <= 0 || h == 0 || h == INT32_MIN
+      || w > MAX_PIXELS || h > MAX_PIXELS || -h > MAX_PIXELS) {
+    return false;
+  }
+
+  private->format = FORMAT_BMP;
+  private->conversion = CONVERT_SWIZZLE;
+  private->out_format = IMV_ARGB;
+  private->opaque = true;
+  private->offset = offset;
+  private->stride = ((size_t)w * bpp + 31) / 32 * 4;
+  private->bottom_up = h > 0;
+
+  if (bpp == 8 && compression == 0) {
+    uint32_t colors = read_le32(data + 46);
+    if (colors == 0 || colors > 256) {
+      colors = 256;
+    }
+    /* in size_t, so a huge header size can't wrap around */
+    if (dib_size > private->len
+        || (size_t)14 + dib_size + (size_t)colors * 4 > private->len) {
+      return false;
+    }
+    private->conversion = CONVERT_PALETTE;
+    private->palette = data + 14 + dib_size;
+    private->palette_len = colors;
+  } else if (bpp == 24 && compression == 0) {
+    swizzle_init(&private->swizzle, 3, 0, 1, 2, -1);
+  } else if (bpp == 32 && compression == 0) {
+    /* the fourth byte is unused rather than alpha */
+    swizzle_init(&private->swizzle, 4, 0, 1, 2, -1);
+  } else if (bpp == 32 && compression == 3) {
+    /* bitfields, as long as they describe plain BGRA */
+    if (private->len < 66 || read_le32(data + 54) != 0x00ff0000
+        || read_le32(data + 58) != 0x0000ff00
+        || read_le32(data + 62) != 0x000000ff) {
+      return false;
+    }
+    const uint32_t alpha = dib_size >= 56 && private->len >= 70
+                         ? read_le32(data + 66) : 0;
+    if (alpha == 0xff000000) {
+      swizzle_init(&private->swizzle, 4, 0, 1, 2, 3);
+      private->opaque = false;
+    } else if (alpha == 0) {
+      swizzle_init(&private->swizzle, 4, 0, 1, 2, -1);
+    } else {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  *width = w;
+  *height = h > 0 ? h : -h;
+  return true;
+}
+
+static bool parse_header(struct private *private, int *width, int *height)
+{
+  if (private->len < 8) {
+    return false;
+  }
+
+  if (!parse_pnm(private, width, height)
+      && !parse_farbfeld(private, width, height)
+      && !parse_qoi(private, width, height)
+      && !parse_bmp(private, width, height)) {
+    return false;
+  }
+
+  if (*width <= 0 || *height <= 0
+      || (uint64_t)*width * *height > MAX_PIXELS) {
+    return false;
+  }
+
+  /* make sure all the rows are really there */
+  if (private->conversion != CONVERT_QOI) {
+    if (private->offset > private->len
+        || (private->len - private->offset) / private->stride
+           < (size_t)*height) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void source_free(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->busy);
+  free(src->name);
+  src->name = NULL;
+
+  struct private *private = src->private;
+  if (private->fd >= 0) {
+    munmap(private->data, private->len);
+    close(private->fd);
+  }
+  private->data = NULL;
+
+  free(src->private);
+  src->private = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  pthread_mutex_destroy(&src->busy);
+  free(src);
+}
+
+static struct imv_bitmap *to_imv_bitmap(int width, int height,
+    enum imv_pixelformat format, bool opaque, void *bitmap)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = format;
+  bmp->opaque = opaque;
+  bmp->mapped = 0;
+  bmp->data = bitmap;
+  return bmp;
+}
+
+static void report_error(struct imv_source *src)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding error.\n", src->name);
+    return;
+  }
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = NULL;
+  msg.error = "Internal error";
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static void send_bitmap(struct imv_source *src, void *bitmap)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding result.\n", src->name);
+    return;
+  }
+
+  struct private *private = src->private;
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = to_imv_bitmap(src->width, src->height, private->out_format,
+      private->opaque, bitmap);
+  msg.frametime = 0;
+  msg.frame = 0;
+  msg.error = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static int load_image(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  struct private *private = src->private;
+
+  if (private->fd >= 0) {
+    posix_madvise(private->data, private->len, POSIX_MADV_SEQUENTIAL);
+  }
+
+  void *bitmap = malloc((size_t)src->height * src->width * 4);
+  if (!bitmap || !decode(private, src->width, src->height, bitmap)) {
+    free(bitmap);
+    report_error(src);
+    return -1;
+  }
+
+  send_bitmap(src, bitmap);
+  return 0;
+}
+
+static struct imv_source *create_source(const char *name, int width,
+    int height, struct private *private)
+{
+  struct imv_source *source = calloc(1, sizeof *source);
+  source->name = strdup(name);
+  source->width = width;
+  source->height = height;
+  source->num_frames = 1;
+  source->next_frame = 1;
+  pthread_mutex_init(&source->busy, NULL);
+  source->load_first_frame = &load_image;
+  source->load_next_frame = NULL;
+  source->free = &source_free;
+  source->callback = NULL;
+  source->user_data = NULL;
+  source->private = malloc(sizeof *private);
+  memcpy(source->private, private, sizeof *private);
+  return source;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  struct private private;
+  memset(&private, 0, sizeof private);
+
+  private.fd = open(path, O_RDONLY);
+  if (private.fd < 0) {
+    return BACKEND_BAD_PATH;
+  }
+
+  off_t len = lseek(private.fd, 0, SEEK_END);
+  if (len < 0) {
+    close(private.fd);
+    return BACKEND_BAD_PATH;
+  }
+
+  /* too small to be anything we handle, and can't be mapped if empty */
+  if (len < 8) {
+    close(private.fd);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  private.len = len;
+
+  private.data = mmap(NULL, private.len, PROT_READ, MAP_PRIVATE, private.fd, 0);
+  if (private.data == MAP_FAILED || !private.data) {
+    close(private.fd);
+    return BACKEND_BAD_PATH;
+  }
+
+  int width, height;
+  if (!parse_header(&private, &width, &height)) {
+    munmap(private.data, private.len);
+    close(private.fd);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  *src = create_source(path, width, height, &private);
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  struct private private;
+  memset(&private, 0, sizeof private);
+
+  private.fd = -1;
+  private.data = data;
+  private.len = len;
+
+  int width, height;
+  if (!parse_header(&private, &width, &height)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  *src = create_source("-", width, height, &private);
+  return BACKEND_SUCCESS;
+}
+
+const struct imv_backend builtin_backend = {
+  .name = "built-in",
+  .description = "imv's own decoders for simple uncompressed formats: "
+                 "binary PPM and PGM, QOI, farbfeld and BMP.",
+  .website = "https://github.com/eXeC64/imv",
+  .license = "MIT",
+  .open_path = &open_path,
+  .open_memory = &open_memory,
+};
+
+const struct imv_backend *imv_backend_builtin(void)
+{
+  return &builtin_backend;
+}
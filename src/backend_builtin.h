@@ -0,0 +1,9 @@
+#ifndef IMV_BACKEND_BUILTIN_H
+#define IMV_BACKEND_BUILTIN_H
+
+struct imv_backend;
+
+/* Get an instance of the built-in backend for simple raw formats */
+const struct imv_backend *imv_backend_builtin(void);
+
+#endif
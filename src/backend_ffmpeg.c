@@ -0,0 +1,746 @@
+#include "backend_ffmpeg.h"
+#include "backend.h"
+#include "source.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+/* Number of frames decoded ahead of the one being displayed */
+#define QUEUE_SIZE 4
+
+struct decoded_frame {
+  unsigned char *pixels;
+  int index;
+  /* false if decoded from a pixel format with alpha */
+  bool opaque;
+};
+
+struct private {
+  /* NULL when loading from memory */
+  char *path;
+  void *data;
+  size_t len;
+  size_t pos;
+
+  AVFormatContext *format;
+  AVIOContext *io;
+  AVCodecContext *codec;
+  struct SwsContext *sws;
+  AVPacket *packet;
+  AVFrame *frame;
+  AVRational time_base;
+  int stream;
+  int width;
+  int height;
+
+  /* Seek index, built by the first load: the timestamp of every frame in
+   * presentation order, and the indices of the keyframes among them */
+  bool indexed;
+  int64_t *pts;
+  int num_frames;
+  int *keyframes;
+  int num_keyframes;
+
+  /* Only touched by the decode thread once it's running. Frames before
+   * skip_until are decoded, as needed to reach it, but not kept */
+  int last_index;
+  int skip_until;
+
+  pthread_t thread;
+  bool thread_started;
+
+  /* protects everything below */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct decoded_frame queue[QUEUE_SIZE];
+  int queue_head;
+  int queue_len;
+  /* bumped by each seek, so frames being decoded for the old position are
+   * thrown away */
+  unsigned generation;
+  /* frame to seek to, or -1 */
+  int seek_target;
+  bool quit;
+  bool failed;
+};
+
+/* Recognise the containers video is usually found in, rather than having
+ * libavformat probe every file: it would claim many still formats too */
+static bool is_container(const unsigned char *data, size_t len)
+{
+  return (len >= 8 && !memcmp(data + 4, "ftyp", 4))           /* MP4, MOV */
+      || (len >= 4 && !memcmp(data, "\x1a\x45\xdf\xa3", 4))   /* Matroska */
+      || (len >= 12 && !memcmp(data, "RIFF", 4)
+                    && !memcmp(data + 8, "AVI ", 4))
+      || (len >= 4 && !memcmp(data, "OggS", 4))
+      || (len >= 4 && !memcmp(data, "FLV\x01", 4))
+      || (len >= 4 && !memcmp(data, "\0\0\x01\xba", 4))       /* MPEG-PS */
+      || (len >= 189 && data[0] == 0x47 && data[188] == 0x47); /* MPEG-TS */
+}
+
+static int read_memory(void *opaque, uint8_t *buf, int size)
+{
+  struct private *private = opaque;
+  const size_t left = private->len - private->pos;
+  if (!left) {
+    return AVERROR_EOF;
+  }
+  if ((size_t)size > left) {
+    size = left;
+  }
+  memcpy(buf, (unsigned char*)private->data + private->pos, size);
+  private->pos += size;
+  return size;
+}
+
+static int64_t seek_memory(void *opaque, int64_t offset, int whence)
+{
+  struct private *private = opaque;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return private->len;
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += private->pos;
+      break;
+    case SEEK_END:
+      offset += private->len;
+      break;
+    default:
+      return -1;
+  }
+  if (offset < 0 || (uint64_t)offset > private->len) {
+    return -1;
+  }
+  private->pos = offset;
+  return offset;
+}
+
+static void free_private(struct private *private)
+{
+  avcodec_free_context(&private->codec);
+  avformat_close_input(&private->format);
+  if (private->io) {
+    av_freep(&private->io->buffer);
+    avio_context_free(&private->io);
+  }
+  sws_freeContext(private->sws);
+  av_packet_free(&private->packet);
+  av_frame_free(&private->frame);
+  for (int i = 0; i < private->queue_len; ++i) {
+    free(private->queue[(private->queue_head + i) % QUEUE_SIZE].pixels);
+  }
+  free(private->pts);
+  free(private->keyframes);
+  free(private->path);
+  free(private);
+}
+
+static int compare_pts(const void *a, const void *b)
+{
+  const int64_t x = *(const int64_t*)a;
+  const int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static bool append_pts(int64_t **array, int *len, int *capacity, int64_t pts)
+{
+  if (*len == *capacity) {
+    const int new_capacity = *capacity ? *capacity * 2 : 256;
+    int64_t *new_array = realloc(*array, new_capacity * sizeof *new_array);
+    if (!new_array) {
+      return false;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+  }
+  (*array)[(*len)++] = pts;
+  return true;
+}
+
+/* Index of the first frame at or after the given timestamp */
+static int find_frame(const struct private *private, int64_t pts)
+{
+  int lo = 0;
+  int hi = private->num_frames - 1;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (private->pts[mid] < pts) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Reads every packet of the video stream, without decoding any, to find the
+ * timestamp of each frame and which are keyframes */
+static bool build_index(struct private *private)
+{
+  int64_t *pts = NULL;
+  int num_pts = 0;
+  int pts_capacity = 0;
+  int64_t *key_pts = NULL;
+  int num_keys = 0;
+  int key_capacity = 0;
+  bool ok = true;
+
+  while (ok && av_read_frame(private->format, private->packet) >= 0) {
+    const AVPacket *packet = private->packet;
+    const int64_t t = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if (packet->stream_index == private->stream && t != AV_NOPTS_VALUE) {
+      ok = append_pts(&pts, &num_pts, &pts_capacity, t);
+      if (ok && packet->flags & AV_PKT_FLAG_KEY) {
+        ok = append_pts(&key_pts, &num_keys, &key_capacity, t);
+      }
+    }
+    av_packet_unref(private->packet);
+  }
+
+  if (!ok || !num_pts || !num_keys) {
+    free(pts);
+    free(key_pts);
+    return false;
+  }
+
+  qsort(pts, num_pts, sizeof *pts, &compare_pts);
+  qsort(key_pts, num_keys, sizeof *key_pts, &compare_pts);
+  private->pts = pts;
+  private->num_frames = num_pts;
+
+  private->keyframes = malloc(num_keys * sizeof *private->keyframes);
+  for (int i = 0; i < num_keys; ++i) {
+    private->keyframes[i] = find_frame(private, key_pts[i]);
+  }
+  private->num_keyframes = num_keys;
+  free(key_pts);
+  return true;
+}
+
+/* How long a frame is shown for, from the gap to the next one */
+static int frame_duration(const struct private *private, int index)
+{
+  if (private->num_frames < 2) {
+    return 0;
+  }
+  int64_t delta;
+  if (index + 1 < private->num_frames) {
+    delta = private->pts[index + 1] - private->pts[index];
+  } else {
+    delta = private->pts[index] - private->pts[index - 1];
+  }
+  const int64_t ms = av_rescale_q(delta, private->time_base,
+      (AVRational){1, 1000});
+  return ms > 0 ? ms : 1;
+}
+
+/* Positions the demuxer so that decoding carries on to the target frame */
+static bool seek_to(struct private *private, int target)
+{
+  /* the last keyframe at or before the target */
+  int lo = 0;
+  int hi = private->num_keyframes - 1;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo + 1) / 2;
+    if (private->keyframes[mid] <= target) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  const int keyframe = private->keyframes[lo];
+
+  private->skip_until = target;
+
+  /* decoding forwards is quicker when the target is later in the group of
+   * pictures being decoded */
+  if (private->last_index >= keyframe && private->last_index < target) {
+    return true;
+  }
+
+  if (av_seek_frame(private->format, private->stream, private->pts[keyframe],
+        AVSEEK_FLAG_BACKWARD) < 0) {
+    return false;
+  }
+  avcodec_flush_buffers(private->codec);
+  private->last_index = -1;
+  return true;
+}
+
+static unsigned char *convert(struct private *private, bool *opaque)
+{
+  const AVFrame *frame = private->frame;
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+  *opaque = !desc || !(desc->flags & AV_PIX_FMT_FLAG_ALPHA);
+
+  /* frames that change size mid-stream are scaled to the first's */
+  private->sws = sws_getCachedContext(private->sws,
+      frame->width, frame->height, frame->format,
+      private->width, private->height, AV_PIX_FMT_RGBA,
+      SWS_BILINEAR, NULL, NULL, NULL);
+  if (!private->sws) {
+    return NULL;
+  }
+
+  unsigned char *pixels = malloc((size_t)private->width * private->height * 4);
+  uint8_t *planes[4] = {pixels, NULL, NULL, NULL};
+  int strides[4] = {private->width * 4, 0, 0, 0};
+  sws_scale(private->sws, (const uint8_t * const *)frame->data,
+      frame->linesize, 0, frame->height, planes, strides);
+  return pixels;
+}
+
+/* Decodes the next frame wanted, starting over from the first at the end of
+ * the video as animated images do. Returns NULL on failure */
+static unsigned char *decode_next(struct private *private, int *index,
+    bool *opaque)
+{
+  bool looped = false;
+  while (true) {
+    int ret = avcodec_receive_frame(private->codec, private->frame);
+    if (ret == 0) {
+      const int64_t t = private->frame->best_effort_timestamp;
+      int i = t != AV_NOPTS_VALUE ? find_frame(private, t)
+                                  : private->last_index + 1;
+      if (i >= private->num_frames) {
+        i = private->num_frames - 1;
+      }
+      private->last_index = i;
+
+      if (i < private->skip_until) {
+        av_frame_unref(private->frame);
+        continue;
+      }
+      unsigned char *pixels = convert(private, opaque);
+      av_frame_unref(private->frame);
+      *index = i;
+      return pixels;
+    }
+
+    if (ret == AVERROR_EOF) {
+      /* give up on a video nothing can be decoded from */
+      if (looped || !seek_to(private, 0)) {
+        return NULL;
+      }
+      looped = true;
+      continue;
+    }
+
+    if (ret != AVERROR(EAGAIN)) {
+      return NULL;
+    }
+
+    /* the decoder needs more input, or draining at the end of the file */
+    if (av_read_frame(private->format, private->packet) < 0) {
+      avcodec_send_packet(private->codec, NULL);
+      continue;
+    }
+    if (private->packet->stream_index == private->stream) {
+      ret = avcodec_send_packet(private->codec, private->packet);
+      /* carry on past damaged packets */
+      if (ret < 0 && ret != AVERROR_INVALIDDATA) {
+        av_packet_unref(private->packet);
+        return NULL;
+      }
+    }
+    av_packet_unref(private->packet);
+  }
+}
+
+/* Keeps the queue topped up with the frames that follow the last one taken,
+ * so that playback isn't held up by decoding */
+static void *decode_thread(void *raw)
+{
+  struct private *private = raw;
+  pthread_mutex_lock(&private->lock);
+  while (!private->quit) {
+    if (private->seek_target >= 0) {
+      const int target = private->seek_target;
+      private->seek_target = -1;
+      pthread_mutex_unlock(&private->lock);
+      const bool ok = seek_to(private, target);
+      pthread_mutex_lock(&private->lock);
+      if (!ok) {
+        private->failed = true;
+        break;
+      }
+      continue;
+    }
+
+    if (private->queue_len == QUEUE_SIZE) {
+      pthread_cond_wait(&private->cond, &private->lock);
+      continue;
+    }
+
+    const unsigned generation = private->generation;
+    pthread_mutex_unlock(&private->lock);
+    int index = 0;
+    bool opaque = true;
+    unsigned char *pixels = decode_next(private, &index, &opaque);
+    pthread_mutex_lock(&private->lock);
+
+    if (!pixels) {
+      private->failed = true;
+      break;
+    }
+
+    if (generation != private->generation) {
+      if (index != private->seek_target) {
+        free(pixels);
+        continue;
+      }
+      /* decoded the frame being sought to anyway */
+      private->seek_target = -1;
+    }
+
+    const int tail = (private->queue_head + private->queue_len) % QUEUE_SIZE;
+    private->queue[tail].pixels = pixels;
+    private->queue[tail].index = index;
+    private->queue[tail].opaque = opaque;
+    ++private->queue_len;
+    pthread_cond_broadcast(&private->cond);
+  }
+  pthread_cond_broadcast(&private->cond);
+  pthread_mutex_unlock(&private->lock);
+  return NULL;
+}
+
+/* Waits for the given frame, or the next one if negative. Frames decoded
+ * ahead of one wanted are skipped over, anything else is sought to */
+static unsigned char *take_frame(struct private *private, int wanted,
+    int *index, bool *opaque)
+{
+  pthread_mutex_lock(&private->lock);
+  if (wanted >= 0) {
+    while (private->queue_len
+        && private->queue[private->queue_head].index != wanted) {
+      free(private->queue[private->queue_head].pixels);
+      private->queue_head = (private->queue_head + 1) % QUEUE_SIZE;
+      --private->queue_len;
+    }
+    if (!private->queue_len) {
+      ++private->generation;
+      private->seek_target = wanted;
+    }
+    pthread_cond_broadcast(&private->cond);
+  }
+
+  while (!private->queue_len && !private->failed) {
+    pthread_cond_wait(&private->cond, &private->lock);
+  }
+
+  unsigned char *pixels = NULL;
+  if (private->queue_len) {
+    pixels = private->queue[private->queue_head].pixels;
+    *index = private->queue[private->queue_head].index;
+    *opaque = private->queue[private->queue_head].opaque;
+    private->queue_head = (private->queue_head + 1) % QUEUE_SIZE;
+    --private->queue_len;
+    /* room to decode another */
+    pthread_cond_broadcast(&private->cond);
+  }
+  pthread_mutex_unlock(&private->lock);
+  return pixels;
+}
+
+static void source_free(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->busy);
+  free(src->name);
+  src->name = NULL;
+
+  struct private *private = src->private;
+  if (private->thread_started) {
+    pthread_mutex_lock(&private->lock);
+    private->quit = true;
+    pthread_cond_broadcast(&private->cond);
+    pthread_mutex_unlock(&private->lock);
+    pthread_join(private->thread, NULL);
+  }
+  pthread_cond_destroy(&private->cond);
+  pthread_mutex_destroy(&private->lock);
+  free_private(private);
+  src->private = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  pthread_mutex_destroy(&src->busy);
+  free(src);
+}
+
+static struct imv_bitmap *to_imv_bitmap(int width, int height, void *bitmap,
+    bool opaque)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = IMV_ABGR;
+  bmp->opaque = opaque;
+  bmp->mapped = 0;
+  bmp->data = bitmap;
+  return bmp;
+}
+
+static void report_error(struct imv_source *src)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding error.\n", src->name);
+    return;
+  }
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = NULL;
+  msg.error = "Internal error";
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static void send_bitmap(struct imv_source *src, void *bitmap, bool opaque,
+    int frame)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding result.\n", src->name);
+    return;
+  }
+
+  struct private *private = src->private;
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = to_imv_bitmap(private->width, private->height, bitmap,
+      opaque);
+  msg.frametime = frame_duration(private, frame);
+  msg.frame = frame;
+  msg.error = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+/* Indexes the video and starts decoding, on the first load */
+static bool start_decoding(struct imv_source *src)
+{
+  struct private *private = src->private;
+  if (private->indexed) {
+    return true;
+  }
+  if (!build_index(private)) {
+    return false;
+  }
+  src->num_frames = private->num_frames;
+  private->indexed = true;
+
+  private->seek_target = 0;
+  if (pthread_create(&private->thread, NULL, &decode_thread, private)) {
+    return false;
+  }
+  private->thread_started = true;
+  return true;
+}
+
+/* With busy held, sends the given frame, or the next one if negative */
+static int load_frame(struct imv_source *src, int wanted)
+{
+  struct private *private = src->private;
+  int index = 0;
+  bool opaque = true;
+  unsigned char *pixels = take_frame(private, wanted, &index, &opaque);
+  if (!pixels) {
+    report_error(src);
+    return -1;
+  }
+
+  /* a frame that can't be decoded is stood in for by the one after it */
+  if (wanted >= 0) {
+    index = wanted;
+  }
+  src->next_frame = (index + 1) % private->num_frames;
+  send_bitmap(src, pixels, opaque, index);
+  return 0;
+}
+
+static int load_first_frame(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  if (!start_decoding(src)) {
+    report_error(src);
+    return -1;
+  }
+  return load_frame(src, 0);
+}
+
+static int load_next_frame(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  struct private *private = src->private;
+  if (!private->thread_started) {
+    pthread_mutex_unlock(&src->busy);
+    return -1;
+  }
+  return load_frame(src, -1);
+}
+
+static int seek_frame(struct imv_source *src, int frame)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  if (!start_decoding(src)) {
+    report_error(src);
+    return -1;
+  }
+
+  struct private *private = src->private;
+  if (frame < 0 || frame >= private->num_frames) {
+    report_error(src);
+    return -1;
+  }
+  return load_frame(src, frame);
+}
+
+/* Opens the container and the decoder for its main video stream */
+static enum backend_result open_source(const char *name,
+    struct private *private, struct imv_source **src)
+{
+  av_log_set_level(AV_LOG_QUIET);
+
+  private->format = avformat_alloc_context();
+  if (!private->path) {
+    const int buffer_size = 65536;
+    unsigned char *buffer = av_malloc(buffer_size);
+    private->io = avio_alloc_context(buffer, buffer_size, 0, private,
+        &read_memory, NULL, &seek_memory);
+    private->format->pb = private->io;
+  }
+
+  if (avformat_open_input(&private->format,
+        private->path ? private->path : "", NULL, NULL) < 0
+      || avformat_find_stream_info(private->format, NULL) < 0) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  const AVCodec *decoder = NULL;
+  private->stream = av_find_best_stream(private->format, AVMEDIA_TYPE_VIDEO,
+      -1, -1, &decoder, 0);
+  /* cover art in an audio file isn't a video */
+  if (private->stream < 0 || private->format->streams[private->stream]
+        ->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
+  const AVStream *stream = private->format->streams[private->stream];
+  private->time_base = stream->time_base;
+
+  /* software decoding only, spread over all cores */
+  private->codec = avcodec_alloc_context3(decoder);
+  if (!private->codec
+      || avcodec_parameters_to_context(private->codec, stream->codecpar) < 0) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
+  private->codec->thread_count = 0;
+  private->codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (avcodec_open2(private->codec, decoder, NULL) < 0
+      || private->codec->width <= 0 || private->codec->height <= 0) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
+  private->width = private->codec->width;
+  private->height = private->codec->height;
+
+  private->packet = av_packet_alloc();
+  private->frame = av_frame_alloc();
+  private->last_index = -1;
+  private->seek_target = -1;
+  pthread_mutex_init(&private->lock, NULL);
+  pthread_cond_init(&private->cond, NULL);
+
+  struct imv_source *source = calloc(1, sizeof *source);
+  source->name = strdup(name);
+  source->width = private->width;
+  source->height = private->height;
+  /* an estimate until the first load indexes the video */
+  source->num_frames = stream->nb_frames > 0 ? stream->nb_frames : 1;
+  source->next_frame = 0;
+  pthread_mutex_init(&source->busy, NULL);
+  source->load_first_frame = &load_first_frame;
+  source->load_next_frame = &load_next_frame;
+  source->seek_frame = &seek_frame;
+  source->free = &source_free;
+  source->callback = NULL;
+  source->user_data = NULL;
+  source->private = private;
+  *src = source;
+
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return BACKEND_BAD_PATH;
+  }
+  unsigned char magic[192];
+  const ssize_t len = read(fd, magic, sizeof magic);
+  close(fd);
+  if (len < 0 || !is_container(magic, len)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->path = strdup(path);
+  return open_source(path, private, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  if (!is_container(data, len)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->data = data;
+  private->len = len;
+  return open_source("-", private, src);
+}
+
+const struct imv_backend ffmpeg_backend = {
+  .name = "FFmpeg",
+  .description = "Video decoding with libavformat and libavcodec.",
+  .website = "https://ffmpeg.org/",
+  .license = "GNU Lesser General Public License v2.1+",
+  .open_path = &open_path,
+  .open_memory = &open_memory,
+};
+
+const struct imv_backend *imv_backend_ffmpeg(void)
+{
+  return &ffmpeg_backend;
+}
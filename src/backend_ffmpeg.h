@@ -0,0 +1,9 @@
+#ifndef IMV_BACKEND_FFMPEG_H
+#define IMV_BACKEND_FFMPEG_H
+
+struct imv_backend;
+
+/* Get an instance of the FFmpeg video backend */
+const struct imv_backend *imv_backend_ffmpeg(void);
+
+#endif
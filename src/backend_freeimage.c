@@ -8,11 +8,29 @@
 
 #include <FreeImage.h>
 
+/* Animation frames depend on the ones before them, so to seek without
+ * decoding from the start, a copy of the canvas is kept every so many
+ * frames as they're decoded. The interval is widened for large animations
+ * to keep the copies within the budget. */
+#define SNAPSHOT_INTERVAL 16
+#define SNAPSHOT_BUDGET (64 << 20)
+
 struct private {
   FIMEMORY *memory;
   FREE_IMAGE_FORMAT format;
   FIMULTIBITMAP *multibitmap;
   FIBITMAP *last_frame;
+
+  /* how carefully to decode formats with a faster way */
+  enum imv_source_quality quality;
+
+  /* index of the frame last_frame holds */
+  int current;
+
+  /* per frame: its duration once known, and any snapshot of it */
+  int *frametimes;
+  FIBITMAP **snapshots;
+  int snapshot_interval;
 };
 
 static void source_free(struct imv_source *src)
@@ -38,6 +56,16 @@ static void source_free(struct imv_source *src)
     private->last_frame = NULL;
   }
 
+  if (private->snapshots) {
+    for (int i = 0; i < src->num_frames; ++i) {
+      if (private->snapshots[i]) {
+        FreeImage_Unload(private->snapshots[i]);
+      }
+    }
+    free(private->snapshots);
+  }
+  free(private->frametimes);
+
   free(private);
   src->private = NULL;
 
@@ -52,6 +80,8 @@ static struct imv_bitmap *to_imv_bitmap(FIBITMAP *in_bmp)
   bmp->width = FreeImage_GetWidth(in_bmp);
   bmp->height = FreeImage_GetHeight(in_bmp);
   bmp->format = IMV_ARGB;
+  bmp->opaque = !FreeImage_IsTransparent(in_bmp);
+  bmp->mapped = 0;
   bmp->data = malloc(4 * bmp->width * bmp->height);
   FreeImage_ConvertToRawBits(bmp->data, in_bmp, 4 * bmp->width, 32,
       FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
@@ -76,7 +106,8 @@ static void report_error(struct imv_source *src)
   src->callback(&msg);
 }
 
-static void send_bitmap(struct imv_source *src, FIBITMAP *fibitmap, int frametime)
+static void send_bitmap(struct imv_source *src, FIBITMAP *fibitmap,
+    int frametime, int frame)
 {
   if (!src->callback) {
     fprintf(stderr, "imv_source(%s) has no callback configured. "
@@ -89,12 +120,15 @@ static void send_bitmap(struct imv_source *src, FIBITMAP *fibitmap, int frametim
   msg.user_data = src->user_data;
   msg.bitmap = to_imv_bitmap(fibitmap);
   msg.frametime = frametime;
+  msg.frame = frame;
   msg.error = NULL;
 
   pthread_mutex_unlock(&src->busy);
   src->callback(&msg);
 }
 
+static void composite_frame(struct imv_source *src, int index);
+
 static int first_frame(struct imv_source *src)
 {
   /* Don't run if this source is already active */
@@ -108,20 +142,26 @@ static int first_frame(struct imv_source *src)
 
   int frametime = 0;
 
-  if (private->format == FIF_GIF) {
-    if (src->name) {
+  if (private->format == FIF_GIF && private->multibitmap
+      && src->num_frames > 1) {
+    /* loaded before, so rewind to the start, keeping the frame times and
+     * snapshots already found */
+    composite_frame(src, 0);
+    frametime = private->frametimes[0];
+    bmp = FreeImage_Clone(private->last_frame);
+    src->next_frame = 1;
+  } else if (private->format == FIF_GIF) {
+    /* a single frame gif loaded before is just read again */
+    if (!private->multibitmap && src->name) {
       private->multibitmap = FreeImage_OpenMultiBitmap(FIF_GIF, src->name,
           /* don't create file */ 0,
           /* read only */ 1,
           /* keep in memory */ 1,
           /* flags */ GIF_LOAD256);
-    } else if (private->memory) {
+    } else if (!private->multibitmap && private->memory) {
       private->multibitmap = FreeImage_LoadMultiBitmapFromMemory(FIF_GIF,
           private->memory,
           /* flags */ GIF_LOAD256);
-    } else {
-      report_error(src);
-      return -1;
     }
 
     if (!private->multibitmap) {
@@ -146,11 +186,21 @@ static int first_frame(struct imv_source *src)
 
   } else { /* not a gif */
     src->num_frames = 1;
-    int flags = (private->format == FIF_JPEG) ? JPEG_EXIFROTATE : 0;
+    int flags = 0;
+    if (private->format == FIF_JPEG) {
+      flags = JPEG_EXIFROTATE
+            | (private->quality == IMV_QUALITY_FAST ? JPEG_FAST : JPEG_ACCURATE);
+    } else if (private->format == FIF_PNG
+        && private->quality == IMV_QUALITY_FAST) {
+      /* gamma correction is skipped while browsing */
+      flags = PNG_IGNOREGAMMA;
+    }
     FIBITMAP *fibitmap = NULL;
     if (src->name) {
       fibitmap = FreeImage_Load(private->format, src->name, flags);
     } else if (private->memory) {
+      /* the image may be loaded again, more accurately */
+      FreeImage_SeekMemory(private->memory, 0, SEEK_SET);
       fibitmap = FreeImage_LoadFromMemory(private->format, private->memory, flags);
     }
     if (!fibitmap) {
@@ -163,23 +213,36 @@ static int first_frame(struct imv_source *src)
 
   src->width = FreeImage_GetWidth(bmp);
   src->height = FreeImage_GetHeight(bmp);
+  if (private->last_frame) {
+    FreeImage_Unload(private->last_frame);
+  }
   private->last_frame = bmp;
-  send_bitmap(src, bmp, frametime);
+  private->current = 0;
+
+  if (src->num_frames > 1 && !private->frametimes) {
+    private->frametimes = calloc(src->num_frames, sizeof *private->frametimes);
+    private->snapshots = calloc(src->num_frames, sizeof *private->snapshots);
+    private->frametimes[0] = frametime;
+
+    const size_t snapshot_size = (size_t)4 * src->width * src->height;
+    const size_t max_snapshots = SNAPSHOT_BUDGET / (snapshot_size ? snapshot_size : 1);
+    private->snapshot_interval = SNAPSHOT_INTERVAL;
+    if ((size_t)src->num_frames / SNAPSHOT_INTERVAL > max_snapshots) {
+      private->snapshot_interval = max_snapshots
+                                 ? (int)(src->num_frames / max_snapshots) + 1
+                                 : src->num_frames;
+    }
+  }
+
+  send_bitmap(src, bmp, frametime, 0);
   return 0;
 }
 
-static int next_frame(struct imv_source *src)
+/* Composite the given frame onto the canvas in last_frame, which must hold
+ * the frame before it unless it's the first */
+static void composite_frame(struct imv_source *src, int index)
 {
-  /* Don't run if this source is already active */
-  if (pthread_mutex_trylock(&src->busy)) {
-    return -1;
-  }
-
   struct private *private = src->private;
-  if (src->num_frames == 1) {
-    send_bitmap(src, private->last_frame, 0);
-    return 0;
-  }
 
   FITAG *tag = NULL;
   char disposal_method = 0;
@@ -187,11 +250,11 @@ static int next_frame(struct imv_source *src)
   short top = 0;
   short left = 0;
 
-  FIBITMAP *frame = FreeImage_LockPage(private->multibitmap, src->next_frame);
+  FIBITMAP *frame = FreeImage_LockPage(private->multibitmap, index);
   FIBITMAP *frame32 = FreeImage_ConvertTo32Bits(frame);
 
   /* First frame is always going to use the raw frame */
-  if(src->next_frame > 0) {
+  if(index > 0) {
     FreeImage_GetMetadata(FIMD_ANIMATION, frame, "DisposalMethod", &tag);
     if(FreeImage_GetTagValue(tag)) {
       disposal_method = *(char*)FreeImage_GetTagValue(tag);
@@ -232,7 +295,7 @@ static int next_frame(struct imv_source *src)
   switch(disposal_method) {
     case 0: /* nothing specified, fall through to compositing */
     case 1: /* composite over previous frame */
-      if(private->last_frame && src->next_frame > 0) {
+      if(private->last_frame && index > 0) {
         FIBITMAP *bg_frame = FreeImage_ConvertTo24Bits(private->last_frame);
         FreeImage_Unload(private->last_frame);
         FIBITMAP *comp = FreeImage_Composite(frame32, 1, NULL, bg_frame);
@@ -261,12 +324,87 @@ static int next_frame(struct imv_source *src)
       break;
   }
 
+  private->current = index;
+  private->frametimes[index] = frametime;
+  if (index > 0 && index % private->snapshot_interval == 0
+      && !private->snapshots[index]) {
+    private->snapshots[index] = FreeImage_Clone(private->last_frame);
+  }
+}
+
+static int next_frame(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  struct private *private = src->private;
+  if (src->num_frames == 1) {
+    send_bitmap(src, private->last_frame, 0, 0);
+    return 0;
+  }
+
+  const int frame_index = src->next_frame;
+  composite_frame(src, frame_index);
   src->next_frame = (src->next_frame + 1) % src->num_frames;
 
-  send_bitmap(src, private->last_frame, frametime);
+  send_bitmap(src, private->last_frame, private->frametimes[frame_index],
+      frame_index);
+  return 0;
+}
+
+static int seek_frame(struct imv_source *src, int frame)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  struct private *private = src->private;
+  if (!private->last_frame || frame < 0 || frame >= src->num_frames) {
+    report_error(src);
+    return -1;
+  }
+
+  if (src->num_frames == 1) {
+    send_bitmap(src, private->last_frame, 0, 0);
+    return 0;
+  }
+
+  /* the nearest snapshot at or before the frame wanted */
+  int start = frame - frame % private->snapshot_interval;
+  while (start > 0 && !private->snapshots[start]) {
+    start -= private->snapshot_interval;
+  }
+
+  /* unless carrying on from the current frame is quicker */
+  if (private->current > frame || private->current < start) {
+    if (start > 0) {
+      FreeImage_Unload(private->last_frame);
+      private->last_frame = FreeImage_Clone(private->snapshots[start]);
+      private->current = start;
+    } else {
+      composite_frame(src, 0);
+    }
+  }
+
+  while (private->current < frame) {
+    composite_frame(src, private->current + 1);
+  }
+  src->next_frame = (frame + 1) % src->num_frames;
+
+  send_bitmap(src, private->last_frame, private->frametimes[frame], frame);
   return 0;
 }
 
+static void set_quality_hint(struct imv_source *src,
+    enum imv_source_quality quality)
+{
+  struct private *private = src->private;
+  private->quality = quality;
+}
+
 static enum backend_result open_path(const char *path, struct imv_source **src)
 {
   FREE_IMAGE_FORMAT fmt = FreeImage_GetFileType(path, 0);
@@ -286,6 +424,10 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
   pthread_mutex_init(&source->busy, NULL);
   source->load_first_frame = &first_frame;
   source->load_next_frame = &next_frame;
+  source->seek_frame = &seek_frame;
+  if (fmt == FIF_JPEG || fmt == FIF_PNG) {
+    source->set_quality_hint = &set_quality_hint;
+  }
   source->free = &source_free;
   source->callback = NULL;
   source->user_data = NULL;
@@ -318,6 +460,10 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   pthread_mutex_init(&source->busy, NULL);
   source->load_first_frame = &first_frame;
   source->load_next_frame = &next_frame;
+  source->seek_frame = &seek_frame;
+  if (fmt == FIF_JPEG || fmt == FIF_PNG) {
+    source->set_quality_hint = &set_quality_hint;
+  }
   source->free = &source_free;
   source->callback = NULL;
   source->user_data = NULL;
@@ -7,16 +7,64 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <turbojpeg.h>
 
+/* Decompressors are kept for reuse rather than created for each image, as
+ * setting one up costs a noticeable share of decoding a small image. Sources
+ * borrow one only while reading the header or decoding */
+#define POOL_SIZE 4
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static tjhandle pool[POOL_SIZE];
+static int pool_len;
+
 struct private {
   int fd;
   void *data;
   size_t len;
-  tjhandle jpeg;
+  enum imv_source_quality quality;
 };
 
+static tjhandle acquire_decompressor(void)
+{
+  tjhandle jpeg = NULL;
+  pthread_mutex_lock(&pool_lock);
+  if (pool_len > 0) {
+    jpeg = pool[--pool_len];
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return jpeg ? jpeg : tjInitDecompress();
+}
+
+static void release_decompressor(tjhandle jpeg)
+{
+  pthread_mutex_lock(&pool_lock);
+  if (pool_len < POOL_SIZE) {
+    pool[pool_len++] = jpeg;
+    jpeg = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (jpeg) {
+    tjDestroy(jpeg);
+  }
+}
+
+/* Reads an image's size, returning non-zero if it isn't a JPEG */
+static int read_header(const struct private *private, int *width, int *height)
+{
+  tjhandle jpeg = acquire_decompressor();
+  if (!jpeg) {
+    return -1;
+  }
+  int rcode = tjDecompressHeader(jpeg, private->data, private->len,
+      width, height);
+  release_decompressor(jpeg);
+  return rcode;
+}
+
 static void source_free(struct imv_source *src)
 {
   pthread_mutex_lock(&src->busy);
@@ -24,7 +72,6 @@ static void source_free(struct imv_source *src)
   src->name = NULL;
 
   struct private *private = src->private;
-  tjDestroy(private->jpeg);
   if (private->fd >= 0) {
     munmap(private->data, private->len);
     close(private->fd);
@@ -47,6 +94,8 @@ static struct imv_bitmap *to_imv_bitmap(int width, int height, void *bitmap)
   bmp->width = width;
   bmp->height = height;
   bmp->format = IMV_ABGR;
+  bmp->opaque = true;
+  bmp->mapped = 0;
   bmp->data = bitmap;
   return bmp;
 }
@@ -82,6 +131,7 @@ static void send_bitmap(struct imv_source *src, void *bitmap)
   msg.user_data = src->user_data;
   msg.bitmap = to_imv_bitmap(src->width, src->height, bitmap);
   msg.frametime = 0;
+  msg.frame = 0;
   msg.error = NULL;
 
   pthread_mutex_unlock(&src->busy);
@@ -97,9 +147,18 @@ static int load_image(struct imv_source *src)
 
   struct private *private = src->private;
 
+  /* the fast integer DCT and chroma upsampling are accurate enough to
+   * browse with, but lose a little detail close up */
+  const int flags = private->quality == IMV_QUALITY_FAST
+                  ? TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE : TJFLAG_ACCURATEDCT;
+
+  tjhandle jpeg = acquire_decompressor();
   void *bitmap = malloc(src->height * src->width * 4);
-  int rcode = tjDecompress2(private->jpeg, private->data, private->len,
-      bitmap, src->width, 0, src->height, TJPF_RGBA, TJFLAG_FASTDCT);
+  int rcode = !jpeg || tjDecompress2(jpeg, private->data, private->len,
+      bitmap, src->width, 0, src->height, TJPF_RGBA, flags);
+  if (jpeg) {
+    release_decompressor(jpeg);
+  }
 
   if (rcode) {
     free(bitmap);
@@ -111,9 +170,17 @@ static int load_image(struct imv_source *src)
   return 0;
 }
 
+static void set_quality_hint(struct imv_source *src,
+    enum imv_source_quality quality)
+{
+  struct private *private = src->private;
+  private->quality = quality;
+}
+
 static enum backend_result open_path(const char *path, struct imv_source **src)
 {
   struct private private;
+  private.quality = IMV_QUALITY_FAST;
 
   private.fd = open(path, O_RDONLY);
   if (private.fd < 0) {
@@ -134,18 +201,8 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
     return BACKEND_BAD_PATH;
   }
 
-  private.jpeg = tjInitDecompress();
-  if (!private.jpeg) {
-    munmap(private.data, private.len);
-    close(private.fd);
-    return BACKEND_UNSUPPORTED;
-  }
-
   int width, height;
-  int rcode = tjDecompressHeader(private.jpeg, private.data, private.len,
-      &width, &height);
-  if (rcode) {
-    tjDestroy(private.jpeg);
+  if (read_header(&private, &width, &height)) {
     munmap(private.data, private.len);
     close(private.fd);
     return BACKEND_UNSUPPORTED;
@@ -160,6 +217,7 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
   pthread_mutex_init(&source->busy, NULL);
   source->load_first_frame = &load_image;
   source->load_next_frame = NULL;
+  source->set_quality_hint = &set_quality_hint;
   source->free = &source_free;
   source->callback = NULL;
   source->user_data = NULL;
@@ -173,21 +231,14 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
 {
   struct private private;
+  private.quality = IMV_QUALITY_FAST;
 
   private.fd = -1;
   private.data = data;
   private.len = len;
 
-  private.jpeg = tjInitDecompress();
-  if (!private.jpeg) {
-    return BACKEND_UNSUPPORTED;
-  }
-
   int width, height;
-  int rcode = tjDecompressHeader(private.jpeg, private.data, private.len,
-      &width, &height);
-  if (rcode) {
-    tjDestroy(private.jpeg);
+  if (read_header(&private, &width, &height)) {
     return BACKEND_UNSUPPORTED;
   }
 
@@ -200,6 +251,7 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   pthread_mutex_init(&source->busy, NULL);
   source->load_first_frame = &load_image;
   source->load_next_frame = NULL;
+  source->set_quality_hint = &set_quality_hint;
   source->free = &source_free;
   source->callback = NULL;
   source->user_data = NULL;
@@ -39,6 +39,8 @@ static struct imv_bitmap *to_imv_bitmap(int width, int height, void *bitmap)
   bmp->width = width;
   bmp->height = height;
   bmp->format = IMV_ABGR;
+  bmp->opaque = false;
+  bmp->mapped = 0;
   bmp->data = bitmap;
   return bmp;
 }
@@ -75,6 +77,7 @@ static void send_bitmap(struct imv_source *src, void *bitmap)
   msg.user_data = src->user_data;
   msg.bitmap = to_imv_bitmap(src->width, src->height, bitmap);
   msg.frametime = 0;
+  msg.frame = 0;
   msg.error = NULL;
 
   pthread_mutex_unlock(&src->busy);
@@ -38,6 +38,8 @@ static struct imv_bitmap *to_imv_bitmap(GdkPixbuf *bitmap)
   bmp->width = gdk_pixbuf_get_width(bitmap);
   bmp->height = gdk_pixbuf_get_height(bitmap);
   bmp->format = IMV_ARGB;
+  bmp->opaque = false;
+  bmp->mapped = 0;
   size_t len = bmp->width * bmp->height * 4;
   bmp->data = malloc(len);
   memcpy(bmp->data, gdk_pixbuf_get_pixels(bitmap), len);
@@ -76,6 +78,7 @@ static void send_bitmap(struct imv_source *src, GdkPixbuf *bitmap)
   msg.user_data = src->user_data;
   msg.bitmap = to_imv_bitmap(bitmap);
   msg.frametime = 0;
+  msg.frame = 0;
   msg.error = NULL;
 
   pthread_mutex_unlock(&src->busy);
@@ -0,0 +1,169 @@
+#include "backend_module.h"
+#include "backend.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifndef IMV_MODULE_DIR
+#define IMV_MODULE_DIR "/usr/lib/imv"
+#endif
+
+struct imv_backend_module {
+  /* build name of the backend, the module is backend_<name>.so */
+  const char *name;
+
+  /* Returns true if the file may be supported, given its first bytes.
+   * NULL if the backend can't be ruled out without loading it. */
+  bool (*probe)(const unsigned char *data, size_t len);
+
+  /* loaded state */
+  void *handle;
+  const struct imv_backend *backend;
+  bool failed;
+};
+
+static bool has_prefix(const unsigned char *data, size_t len,
+                       const void *magic, size_t magic_len)
+{
+  return len >= magic_len && !memcmp(data, magic, magic_len);
+}
+
+static bool probe_libjpeg(const unsigned char *data, size_t len)
+{
+  return has_prefix(data, len, "\xff\xd8\xff", 3);
+}
+
+static bool probe_libpng(const unsigned char *data, size_t len)
+{
+  return has_prefix(data, len, "\x89PNG\r\n\x1a\n", 8);
+}
+
+static bool probe_libtiff(const unsigned char *data, size_t len)
+{
+  /* little and big endian, classic and BigTIFF */
+  return has_prefix(data, len, "II*\0", 4)
+      || has_prefix(data, len, "MM\0*", 4)
+      || has_prefix(data, len, "II+\0", 4)
+      || has_prefix(data, len, "MM\0+", 4);
+}
+
+static bool probe_openexr(const unsigned char *data, size_t len)
+{
+  return has_prefix(data, len, "\x76\x2f\x31\x01", 4);
+}
+
+static bool probe_openjpeg(const unsigned char *data, size_t len)
+{
+  /* JP2 container, or a raw codestream */
+  return has_prefix(data, len, "\0\0\0\x0cjP  \r\n\x87\n", 12)
+      || has_prefix(data, len, "\xff\x4f\xff\x51", 4);
+}
+
+static bool probe_ffmpeg(const unsigned char *data, size_t len)
+{
+  /* the containers the backend itself accepts */
+  return (len >= 8 && !memcmp(data + 4, "ftyp", 4))
+      || has_prefix(data, len, "\x1a\x45\xdf\xa3", 4)
+      || (has_prefix(data, len, "RIFF", 4) && len >= 12
+          && !memcmp(data + 8, "AVI ", 4))
+      || has_prefix(data, len, "OggS", 4)
+      || has_prefix(data, len, "FLV\x01", 4)
+      || has_prefix(data, len, "\0\0\x01\xba", 4)
+      || (len >= 189 && data[0] == 0x47 && data[188] == 0x47);
+}
+
+static bool probe_librsvg(const unsigned char *data, size_t len)
+{
+  /* Same test as the backend: an <svg> tag near the start of the file */
+  char header[128];
+  if (!len) {
+    return false;
+  }
+  if (len > sizeof header - 1) {
+    len = sizeof header - 1;
+  }
+  memcpy(header, data, len);
+  header[len] = 0;
+  return strstr(header, "<SVG") || strstr(header, "<svg");
+}
+
+static struct imv_backend_module modules[] = {
+  /* FreeImage supports too many formats to rule anything out */
+  { .name = "freeimage", .probe = NULL },
+  { .name = "libtiff", .probe = &probe_libtiff },
+  { .name = "libpng", .probe = &probe_libpng },
+  { .name = "libjpeg", .probe = &probe_libjpeg },
+  { .name = "librsvg", .probe = &probe_librsvg },
+  { .name = "openexr", .probe = &probe_openexr },
+  { .name = "openjpeg", .probe = &probe_openjpeg },
+  { .name = "ffmpeg", .probe = &probe_ffmpeg },
+};
+
+struct imv_backend_module *imv_backend_module_find(const char *name)
+{
+  for (size_t i = 0; i < sizeof modules / sizeof *modules; ++i) {
+    if (!strcmp(modules[i].name, name)) {
+      return &modules[i];
+    }
+  }
+  return NULL;
+}
+
+const char *imv_backend_module_name(const struct imv_backend_module *module)
+{
+  return module->name;
+}
+
+bool imv_backend_module_probe(const struct imv_backend_module *module,
+                              const void *data, size_t len)
+{
+  if (module->backend) {
+    return true;
+  }
+  return !module->probe || module->probe(data, len);
+}
+
+const struct imv_backend *imv_backend_module_load(struct imv_backend_module *module)
+{
+  if (module->backend || module->failed) {
+    return module->backend;
+  }
+
+  /* allow running from the build directory without installing */
+  const char *dir = getenv("imv_module_dir");
+  if (!dir || !*dir) {
+    dir = IMV_MODULE_DIR;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/backend_%s.so", dir, module->name);
+
+  module->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!module->handle) {
+    fprintf(stderr, "Unable to load backend module: %s\n", dlerror());
+    module->failed = true;
+    return NULL;
+  }
+
+  char symbol[64];
+  snprintf(symbol, sizeof symbol, "%s_backend", module->name);
+  module->backend = dlsym(module->handle, symbol);
+  if (!module->backend) {
+    fprintf(stderr, "Invalid backend module %s: %s\n", path, dlerror());
+    dlclose(module->handle);
+    module->handle = NULL;
+    module->failed = true;
+    return NULL;
+  }
+
+  return module->backend;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,33 @@
+#ifndef IMV_BACKEND_MODULE_H
+#define IMV_BACKEND_MODULE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct imv_backend;
+
+/* A backend built as a shared object, loaded the first time a file that may
+ * need it is opened. This avoids every launch of imv paying the linking
+ * cost and memory of libraries that are never used.
+ */
+struct imv_backend_module;
+
+/* Find the module for a backend by its build name, e.g. "libjpeg". Returns
+ * NULL if no such backend exists. */
+struct imv_backend_module *imv_backend_module_find(const char *name);
+
+/* Name of the module, as passed to imv_backend_module_find */
+const char *imv_backend_module_name(const struct imv_backend_module *module);
+
+/* Cheaply check whether a module's backend may be able to open a file,
+ * given the first len bytes of it, without loading the module. */
+bool imv_backend_module_probe(const struct imv_backend_module *module,
+                              const void *data, size_t len);
+
+/* Load the module, returning its backend. A module is only loaded once;
+ * later calls return the same backend. Returns NULL on failure. */
+const struct imv_backend *imv_backend_module_load(struct imv_backend_module *module);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
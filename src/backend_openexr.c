@@ -0,0 +1,632 @@
+#include "backend_openexr.h"
+#include "backend.h"
+#include "source.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <openexr.h>
+
+/* Upper bound on decode threads, past which reading the file dominates */
+#define MAX_THREADS 16
+
+struct private {
+  exr_context_t exr;
+  int part;
+
+  /* when loading from memory */
+  void *data;
+  size_t len;
+
+  /* full data window */
+  exr_attr_box2i_t window;
+
+  /* channel list index used for each of R, G, B and A, or -1 */
+  int channel[4];
+  /* only a luminance channel, decoded into R and copied into G and B */
+  bool grey;
+
+  pthread_mutex_t hint_lock;
+  double scale_hint;
+};
+
+/* A decode shared between threads, each pulling the next chunk to work on */
+struct job {
+  struct private *private;
+  bool tiled;
+  int level;
+
+  int32_t chunks_wide;  /* tiles per row */
+  int32_t num_chunks;
+  int32_t chunk_width;  /* tile width */
+  int32_t chunk_height; /* tile height, or scanlines per chunk */
+
+  float *out;
+  int width;
+  int height;
+
+  pthread_mutex_t lock;
+  int32_t next;
+  bool failed;
+};
+
+static void quiet_error(exr_const_context_t ctxt, exr_result_t code,
+    const char *msg)
+{
+  /* errors are reported through imv, most are just unsupported files */
+  (void)ctxt;
+  (void)code;
+  (void)msg;
+}
+
+static int64_t read_memory(exr_const_context_t ctxt, void *userdata,
+    void *buffer, uint64_t size, uint64_t offset,
+    exr_stream_error_func_ptr_t error_cb)
+{
+  (void)ctxt;
+  (void)error_cb;
+  struct private *private = userdata;
+  if (offset >= private->len) {
+    return 0;
+  }
+  if (size > private->len - offset) {
+    size = private->len - offset;
+  }
+  memcpy(buffer, (const unsigned char*)private->data + offset, size);
+  return size;
+}
+
+static int64_t query_memory_size(exr_const_context_t ctxt, void *userdata)
+{
+  (void)ctxt;
+  struct private *private = userdata;
+  return private->len;
+}
+
+static bool has_magic(const unsigned char *data, size_t len)
+{
+  return len >= 4 && !memcmp(data, "\x76\x2f\x31\x01", 4);
+}
+
+static bool channel_is(const exr_attr_chlist_entry_t *entry,
+    const char *layer, size_t layer_len, const char *name)
+{
+  const char *str = entry->name.str;
+  const size_t len = entry->name.length;
+  if (layer_len) {
+    if (len <= layer_len || strncmp(str, layer, layer_len) || str[layer_len] != '.') {
+      return false;
+    }
+    str += layer_len + 1;
+  } else if (memchr(str, '.', len)) {
+    return false;
+  }
+  return !strcmp(str, name);
+}
+
+/* Pick the channels of the given layer, "" for the unprefixed one */
+static bool find_layer(struct private *private, const exr_attr_chlist_t *chlist,
+    const char *layer, size_t layer_len)
+{
+  static const char *names[4] = {"R", "G", "B", "A"};
+
+  for (int c = 0; c < 4; ++c) {
+    private->channel[c] = -1;
+  }
+  private->grey = false;
+
+  int y = -1;
+  for (int i = 0; i < chlist->num_channels; ++i) {
+    const exr_attr_chlist_entry_t *entry = chlist->entries + i;
+    /* subsampled channels, e.g. luminance/chroma images, aren't supported */
+    if (entry->x_sampling != 1 || entry->y_sampling != 1) {
+      continue;
+    }
+    for (int c = 0; c < 4; ++c) {
+      if (channel_is(entry, layer, layer_len, names[c])) {
+        private->channel[c] = i;
+      }
+    }
+    if (channel_is(entry, layer, layer_len, "Y")) {
+      y = i;
+    }
+  }
+
+  if (private->channel[0] < 0 && private->channel[1] < 0
+      && private->channel[2] < 0) {
+    if (y < 0) {
+      return false;
+    }
+    private->channel[0] = y;
+    private->grey = true;
+  }
+  return true;
+}
+
+/* Chooses the channels to display: the layer named by $imv_exr_layer if
+ * set, else the unprefixed RGBA channels, else the first layer with any */
+static bool select_channels(struct private *private)
+{
+  const exr_attr_chlist_t *chlist;
+  if (exr_get_channels(private->exr, private->part, &chlist)) {
+    return false;
+  }
+
+  const char *layer = getenv("imv_exr_layer");
+  if (layer && *layer) {
+    return find_layer(private, chlist, layer, strlen(layer));
+  }
+
+  if (find_layer(private, chlist, "", 0)) {
+    return true;
+  }
+
+  for (int i = 0; i < chlist->num_channels; ++i) {
+    const char *name = chlist->entries[i].name.str;
+    const char *dot = strrchr(name, '.');
+    if (dot && find_layer(private, chlist, name, dot - name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The smallest mipmap level that still has the detail needed at scale */
+static int choose_level(struct private *private, double scale)
+{
+  exr_storage_t storage;
+  uint32_t tile_w, tile_h;
+  exr_tile_level_mode_t mode;
+  exr_tile_round_mode_t round;
+  int32_t levels_x, levels_y;
+
+  if (exr_get_storage(private->exr, private->part, &storage)
+      || storage != EXR_STORAGE_TILED
+      || exr_get_tile_descriptor(private->exr, private->part,
+           &tile_w, &tile_h, &mode, &round)
+      || mode == EXR_TILE_ONE_LEVEL
+      || exr_get_tile_levels(private->exr, private->part, &levels_x, &levels_y)) {
+    return 0;
+  }
+
+  const double full_w = private->window.max.x - private->window.min.x + 1;
+  const double full_h = private->window.max.y - private->window.min.y + 1;
+
+  /* ripmaps have independent x and y levels, only the diagonal is used */
+  const int32_t levels = levels_x < levels_y ? levels_x : levels_y;
+  int level = 0;
+  for (int l = 1; l < levels; ++l) {
+    int32_t w, h;
+    if (exr_get_level_sizes(private->exr, private->part, l, l, &w, &h)
+        || w < full_w * scale || h < full_h * scale) {
+      break;
+    }
+    level = l;
+  }
+  return level;
+}
+
+static bool decode_chunk(struct job *job, int32_t index,
+    exr_decode_pipeline_t *decoder, bool *initialised)
+{
+  struct private *private = job->private;
+  exr_chunk_info_t cinfo;
+  int x0, y0;
+
+  if (job->tiled) {
+    const int tx = index % job->chunks_wide;
+    const int ty = index / job->chunks_wide;
+    if (exr_read_tile_chunk_info(private->exr, private->part,
+          tx, ty, job->level, job->level, &cinfo)) {
+      return false;
+    }
+    x0 = tx * job->chunk_width;
+    y0 = ty * job->chunk_height;
+  } else {
+    if (exr_read_scanline_chunk_info(private->exr, private->part,
+          private->window.min.y + index * job->chunk_height, &cinfo)) {
+      return false;
+    }
+    x0 = 0;
+    y0 = index * job->chunk_height;
+  }
+
+  if (x0 + cinfo.width > job->width || y0 + cinfo.height > job->height) {
+    return false;
+  }
+
+  if (*initialised) {
+    if (exr_decoding_update(private->exr, private->part, &cinfo, decoder)) {
+      return false;
+    }
+  } else {
+    if (exr_decoding_initialize(private->exr, private->part, &cinfo, decoder)) {
+      return false;
+    }
+  }
+
+  /* decode the selected channels as float straight into the bitmap, and
+   * skip the rest */
+  float *base = job->out + 4 * ((size_t)y0 * job->width + x0);
+  for (int i = 0; i < decoder->channel_count; ++i) {
+    exr_coding_channel_info_t *channel = decoder->channels + i;
+    channel->decode_to_ptr = NULL;
+    for (int c = 0; c < 4; ++c) {
+      if (private->channel[c] == i) {
+        channel->decode_to_ptr = (uint8_t*)(base + c);
+        channel->user_pixel_stride = 4 * sizeof(float);
+        channel->user_line_stride = 4 * sizeof(float) * job->width;
+        channel->user_bytes_per_element = sizeof(float);
+        channel->user_data_type = EXR_PIXEL_FLOAT;
+      }
+    }
+  }
+
+  if (!*initialised) {
+    if (exr_decoding_choose_default_routines(private->exr, private->part,
+          decoder)) {
+      return false;
+    }
+    *initialised = true;
+  }
+
+  return !exr_decoding_run(private->exr, private->part, decoder);
+}
+
+static void *decode_worker(void *data)
+{
+  struct job *job = data;
+  exr_decode_pipeline_t decoder = EXR_DECODE_PIPELINE_INITIALIZER;
+  bool initialised = false;
+
+  while (true) {
+    pthread_mutex_lock(&job->lock);
+    const int32_t index = job->next++;
+    const bool failed = job->failed;
+    pthread_mutex_unlock(&job->lock);
+
+    if (failed || index >= job->num_chunks) {
+      break;
+    }
+
+    if (!decode_chunk(job, index, &decoder, &initialised)) {
+      pthread_mutex_lock(&job->lock);
+      job->failed = true;
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+  }
+
+  exr_decoding_destroy(job->private->exr, &decoder);
+  return NULL;
+}
+
+static bool setup_job(struct job *job, struct private *private, int level)
+{
+  job->private = private;
+  job->level = level;
+  job->next = 0;
+  job->failed = false;
+
+  exr_storage_t storage;
+  if (exr_get_storage(private->exr, private->part, &storage)) {
+    return false;
+  }
+
+  if (storage == EXR_STORAGE_TILED) {
+    int32_t count_x, count_y;
+    job->tiled = true;
+    if (exr_get_level_sizes(private->exr, private->part, level, level,
+          &job->width, &job->height)
+        || exr_get_tile_sizes(private->exr, private->part, level, level,
+          &job->chunk_width, &job->chunk_height)
+        || exr_get_tile_counts(private->exr, private->part, level, level,
+          &count_x, &count_y)) {
+      return false;
+    }
+    job->chunks_wide = count_x;
+    job->num_chunks = count_x * count_y;
+  } else if (storage == EXR_STORAGE_SCANLINE) {
+    job->tiled = false;
+    job->width = private->window.max.x - private->window.min.x + 1;
+    job->height = private->window.max.y - private->window.min.y + 1;
+    job->chunk_width = job->width;
+    job->chunks_wide = 1;
+    if (exr_get_scanlines_per_chunk(private->exr, private->part,
+          &job->chunk_height)
+        || exr_get_chunk_count(private->exr, private->part, &job->num_chunks)) {
+      return false;
+    }
+  } else {
+    /* deep data has no single value per pixel to show */
+    return false;
+  }
+
+  return job->width > 0 && job->height > 0 && job->chunk_height > 0;
+}
+
+static float *decode(struct private *private, int *width, int *height)
+{
+  pthread_mutex_lock(&private->hint_lock);
+  const double scale = private->scale_hint;
+  pthread_mutex_unlock(&private->hint_lock);
+
+  struct job job;
+  if (!setup_job(&job, private, choose_level(private, scale))) {
+    return NULL;
+  }
+
+  const size_t num_pixels = (size_t)job.width * job.height;
+  job.out = malloc(num_pixels * 4 * sizeof(float));
+  if (!job.out) {
+    return NULL;
+  }
+
+  /* anything not in the file is black and opaque */
+  for (size_t i = 0; i < num_pixels; ++i) {
+    job.out[4 * i + 0] = 0.0f;
+    job.out[4 * i + 1] = 0.0f;
+    job.out[4 * i + 2] = 0.0f;
+    job.out[4 * i + 3] = 1.0f;
+  }
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if (num_threads > MAX_THREADS) {
+    num_threads = MAX_THREADS;
+  }
+  if (num_threads > job.num_chunks) {
+    num_threads = job.num_chunks;
+  }
+
+  pthread_mutex_init(&job.lock, NULL);
+
+  /* this thread is one of the workers */
+  pthread_t threads[MAX_THREADS];
+  long started = 0;
+  for (long i = 1; i < num_threads; ++i) {
+    if (pthread_create(&threads[started], NULL, &decode_worker, &job)) {
+      break;
+    }
+    ++started;
+  }
+  decode_worker(&job);
+  for (long i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&job.lock);
+
+  if (job.failed) {
+    free(job.out);
+    return NULL;
+  }
+
+  if (private->grey) {
+    for (size_t i = 0; i < num_pixels; ++i) {
+      job.out[4 * i + 1] = job.out[4 * i];
+      job.out[4 * i + 2] = job.out[4 * i];
+    }
+  }
+
+  *width = job.width;
+  *height = job.height;
+  return job.out;
+}
+
+static void source_free(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->busy);
+  free(src->name);
+  src->name = NULL;
+
+  struct private *private = src->private;
+  exr_finish(&private->exr);
+  pthread_mutex_destroy(&private->hint_lock);
+
+  free(src->private);
+  src->private = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  pthread_mutex_destroy(&src->busy);
+  free(src);
+}
+
+static struct imv_bitmap *to_imv_bitmap(int width, int height, void *bitmap)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = IMV_RGBA_F32;
+  bmp->opaque = false;
+  bmp->mapped = 0;
+  bmp->data = bitmap;
+  return bmp;
+}
+
+static void report_error(struct imv_source *src)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding error.\n", src->name);
+    return;
+  }
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = NULL;
+  msg.error = "Internal error";
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static void send_bitmap(struct imv_source *src, int width, int height,
+    void *bitmap)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding result.\n", src->name);
+    return;
+  }
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = to_imv_bitmap(width, height, bitmap);
+  msg.frametime = 0;
+  msg.frame = 0;
+  msg.error = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static int load_image(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  int width, height;
+  float *bitmap = decode(src->private, &width, &height);
+  if (!bitmap) {
+    report_error(src);
+    return -1;
+  }
+
+  send_bitmap(src, width, height, bitmap);
+  return 0;
+}
+
+static void set_scale_hint(struct imv_source *src, double scale)
+{
+  struct private *private = src->private;
+  pthread_mutex_lock(&private->hint_lock);
+  private->scale_hint = scale;
+  pthread_mutex_unlock(&private->hint_lock);
+}
+
+/* Finishes opening a file once the exr context has been started */
+static enum backend_result open_source(const char *name,
+    struct private *private, struct imv_source **src)
+{
+  /* the first part with plain, non-deep, data */
+  int num_parts;
+  if (exr_get_count(private->exr, &num_parts)) {
+    exr_finish(&private->exr);
+    free(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  private->part = -1;
+  for (int i = 0; i < num_parts; ++i) {
+    exr_storage_t storage;
+    if (!exr_get_storage(private->exr, i, &storage)
+        && (storage == EXR_STORAGE_SCANLINE || storage == EXR_STORAGE_TILED)) {
+      private->part = i;
+      break;
+    }
+  }
+
+  if (private->part < 0
+      || exr_get_data_window(private->exr, private->part, &private->window)
+      || !select_channels(private)) {
+    exr_finish(&private->exr);
+    free(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  pthread_mutex_init(&private->hint_lock, NULL);
+  private->scale_hint = 1;
+
+  struct imv_source *source = calloc(1, sizeof *source);
+  source->name = strdup(name);
+  source->width = private->window.max.x - private->window.min.x + 1;
+  source->height = private->window.max.y - private->window.min.y + 1;
+  source->num_frames = 1;
+  source->next_frame = 1;
+  pthread_mutex_init(&source->busy, NULL);
+  source->load_first_frame = &load_image;
+  source->load_next_frame = NULL;
+  source->set_scale_hint = &set_scale_hint;
+  source->free = &source_free;
+  source->callback = NULL;
+  source->user_data = NULL;
+  source->private = private;
+
+  *src = source;
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  /* check the magic number first, the library is slower to give up */
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return BACKEND_BAD_PATH;
+  }
+  unsigned char magic[4];
+  const ssize_t len = read(fd, magic, sizeof magic);
+  close(fd);
+  if (len < 0 || !has_magic(magic, len)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+
+  exr_context_initializer_t init = EXR_DEFAULT_CONTEXT_INITIALIZER;
+  init.error_handler_fn = &quiet_error;
+  if (exr_start_read(&private->exr, path, &init)) {
+    free(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  return open_source(path, private, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  if (!has_magic(data, len)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->data = data;
+  private->len = len;
+
+  exr_context_initializer_t init = EXR_DEFAULT_CONTEXT_INITIALIZER;
+  init.error_handler_fn = &quiet_error;
+  init.user_data = private;
+  init.read_fn = &read_memory;
+  init.size_fn = &query_memory_size;
+  if (exr_start_read(&private->exr, "-", &init)) {
+    free(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  return open_source("-", private, src);
+}
+
+const struct imv_backend openexr_backend = {
+  .name = "OpenEXR",
+  .description = "High dynamic range image format developed by "
+                 "Industrial Light & Magic.",
+  .website = "https://www.openexr.com/",
+  .license = "The Modified BSD License",
+  .open_path = &open_path,
+  .open_memory = &open_memory,
+};
+
+const struct imv_backend *imv_backend_openexr(void)
+{
+  return &openexr_backend;
+}
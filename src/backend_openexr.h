@@ -0,0 +1,9 @@
+#ifndef IMV_BACKEND_OPENEXR_H
+#define IMV_BACKEND_OPENEXR_H
+
+struct imv_backend;
+
+/* Get an instance of the OpenEXR backend */
+const struct imv_backend *imv_backend_openexr(void);
+
+#endif
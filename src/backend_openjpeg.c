@@ -0,0 +1,504 @@
+#include "backend_openjpeg.h"
+#include "backend.h"
+#include "source.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <openjpeg.h>
+
+struct private {
+  /* NULL when loading from memory */
+  char *path;
+  void *data;
+  size_t len;
+
+  OPJ_CODEC_FORMAT format;
+
+  /* origin of the image on the codestream's reference grid */
+  int x0;
+  int y0;
+  int width;
+  int height;
+
+  /* number of resolution levels, each half the size of the one before */
+  int num_resolutions;
+
+  pthread_mutex_t hint_lock;
+  double scale_hint;
+  int region_x;
+  int region_y;
+  int region_width;
+  int region_height;
+};
+
+struct memory_stream {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+};
+
+static void quiet_message(const char *msg, void *client_data)
+{
+  /* most failures are just unsupported files, imv reports the rest */
+  (void)msg;
+  (void)client_data;
+}
+
+static OPJ_SIZE_T read_memory(void *buffer, OPJ_SIZE_T len, void *user_data)
+{
+  struct memory_stream *stream = user_data;
+  if (stream->pos >= stream->len) {
+    return (OPJ_SIZE_T)-1;
+  }
+  if (len > stream->len - stream->pos) {
+    len = stream->len - stream->pos;
+  }
+  memcpy(buffer, stream->data + stream->pos, len);
+  stream->pos += len;
+  return len;
+}
+
+static OPJ_OFF_T skip_memory(OPJ_OFF_T len, void *user_data)
+{
+  struct memory_stream *stream = user_data;
+  if (len < 0 && (size_t)-len > stream->pos) {
+    len = -(OPJ_OFF_T)stream->pos;
+  } else if (len > 0 && (size_t)len > stream->len - stream->pos) {
+    len = stream->len - stream->pos;
+  }
+  stream->pos += len;
+  return len;
+}
+
+static OPJ_BOOL seek_memory(OPJ_OFF_T pos, void *user_data)
+{
+  struct memory_stream *stream = user_data;
+  if (pos < 0 || (size_t)pos > stream->len) {
+    return OPJ_FALSE;
+  }
+  stream->pos = pos;
+  return OPJ_TRUE;
+}
+
+static opj_stream_t *create_stream(const struct private *private,
+    struct memory_stream *memory)
+{
+  if (private->path) {
+    return opj_stream_create_default_file_stream(private->path, OPJ_TRUE);
+  }
+
+  memory->data = private->data;
+  memory->len = private->len;
+  memory->pos = 0;
+
+  opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+  if (!stream) {
+    return NULL;
+  }
+  opj_stream_set_read_function(stream, &read_memory);
+  opj_stream_set_skip_function(stream, &skip_memory);
+  opj_stream_set_seek_function(stream, &seek_memory);
+  opj_stream_set_user_data(stream, memory, NULL);
+  opj_stream_set_user_data_length(stream, memory->len);
+  return stream;
+}
+
+static opj_codec_t *create_codec(OPJ_CODEC_FORMAT format)
+{
+  opj_codec_t *codec = opj_create_decompress(format);
+  if (!codec) {
+    return NULL;
+  }
+
+  opj_set_error_handler(codec, &quiet_message, NULL);
+  opj_set_warning_handler(codec, &quiet_message, NULL);
+  opj_set_info_handler(codec, &quiet_message, NULL);
+
+  opj_dparameters_t params;
+  opj_set_default_decoder_parameters(&params);
+  if (!opj_setup_decoder(codec, &params)) {
+    opj_destroy_codec(codec);
+    return NULL;
+  }
+  return codec;
+}
+
+/* Returns the codec for a JP2 file or raw J2K codestream */
+static bool detect_format(const unsigned char *data, size_t len,
+    OPJ_CODEC_FORMAT *format)
+{
+  if (len >= 12 && !memcmp(data, "\0\0\0\x0cjP  \r\n\x87\n", 12)) {
+    *format = OPJ_CODEC_JP2;
+    return true;
+  }
+  if (len >= 4 && !memcmp(data, "\xff\x4f\xff\x51", 4)) {
+    *format = OPJ_CODEC_J2K;
+    return true;
+  }
+  return false;
+}
+
+/* A component's sample, scaled to 8 bits. Subsampled components are
+ * stretched over the output */
+static int sample(const opj_image_comp_t *comp, int x, int y,
+    int width, int height)
+{
+  const int cx = (long)x * comp->w / width;
+  const int cy = (long)y * comp->h / height;
+  int v = comp->data[(size_t)cy * comp->w + cx];
+  if (comp->sgnd) {
+    v += 1 << (comp->prec - 1);
+  }
+  if (comp->prec > 8) {
+    v >>= comp->prec - 8;
+  } else if (comp->prec < 8) {
+    v = v * 255 / ((1 << comp->prec) - 1);
+  }
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static unsigned char clamp_byte(double v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : (unsigned char)(v + 0.5);
+}
+
+static unsigned char *to_rgba(const opj_image_t *image, int width, int height)
+{
+  const unsigned numcomps = image->numcomps;
+  for (unsigned c = 0; c < numcomps && c < 4; ++c) {
+    if (!image->comps[c].data || !image->comps[c].w || !image->comps[c].h
+        || image->comps[c].prec < 1 || image->comps[c].prec > 31) {
+      return NULL;
+    }
+  }
+
+  unsigned char *out = malloc((size_t)width * height * 4);
+  if (!out) {
+    return NULL;
+  }
+
+  const bool colour = numcomps >= 3;
+  const bool ycc = colour && image->color_space == OPJ_CLRSPC_SYCC;
+  const int alpha = numcomps == 2 ? 1 : numcomps >= 4 ? 3 : -1;
+
+  unsigned char *px = out;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (!colour) {
+        px[0] = px[1] = px[2] = sample(image->comps, x, y, width, height);
+      } else if (ycc) {
+        const double l = sample(image->comps, x, y, width, height);
+        const double cb = sample(image->comps + 1, x, y, width, height) - 128;
+        const double cr = sample(image->comps + 2, x, y, width, height) - 128;
+        px[0] = clamp_byte(l + 1.402 * cr);
+        px[1] = clamp_byte(l - 0.344136 * cb - 0.714136 * cr);
+        px[2] = clamp_byte(l + 1.772 * cb);
+      } else {
+        px[0] = sample(image->comps, x, y, width, height);
+        px[1] = sample(image->comps + 1, x, y, width, height);
+        px[2] = sample(image->comps + 2, x, y, width, height);
+      }
+      px[3] = alpha < 0 ? 255 : sample(image->comps + alpha, x, y, width, height);
+      px += 4;
+    }
+  }
+
+  return out;
+}
+
+static unsigned char *decode(struct private *private, int *width, int *height)
+{
+  pthread_mutex_lock(&private->hint_lock);
+  const double scale = private->scale_hint;
+  const int rx = private->region_x;
+  const int ry = private->region_y;
+  const int rw = private->region_width;
+  const int rh = private->region_height;
+  pthread_mutex_unlock(&private->hint_lock);
+
+  /* the smallest resolution level with enough detail */
+  int factor = 0;
+  while (factor + 1 < private->num_resolutions
+      && ldexp(1.0, -(factor + 1)) >= scale) {
+    ++factor;
+  }
+
+  struct memory_stream memory;
+  opj_stream_t *stream = create_stream(private, &memory);
+  if (!stream) {
+    return NULL;
+  }
+
+  opj_codec_t *codec = create_codec(private->format);
+  if (!codec) {
+    opj_stream_destroy(stream);
+    return NULL;
+  }
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads > 1) {
+    opj_codec_set_threads(codec, num_threads);
+  }
+
+  unsigned char *bitmap = NULL;
+  opj_image_t *image = NULL;
+  if (opj_read_header(stream, codec, &image)
+      && opj_set_decoded_resolution_factor(codec, factor)
+      && opj_set_decode_area(codec, image,
+           private->x0 + rx, private->y0 + ry,
+           private->x0 + rx + rw, private->y0 + ry + rh)
+      && opj_decode(codec, stream, image)
+      && opj_end_decompress(codec, stream)
+      && image->numcomps > 0) {
+    *width = image->comps[0].w;
+    *height = image->comps[0].h;
+    bitmap = to_rgba(image, *width, *height);
+  }
+
+  opj_image_destroy(image);
+  opj_destroy_codec(codec);
+  opj_stream_destroy(stream);
+  return bitmap;
+}
+
+static void source_free(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->busy);
+  free(src->name);
+  src->name = NULL;
+
+  struct private *private = src->private;
+  free(private->path);
+  pthread_mutex_destroy(&private->hint_lock);
+
+  free(src->private);
+  src->private = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  pthread_mutex_destroy(&src->busy);
+  free(src);
+}
+
+static struct imv_bitmap *to_imv_bitmap(int width, int height, void *bitmap)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = IMV_ABGR;
+  bmp->opaque = false;
+  bmp->mapped = 0;
+  bmp->data = bitmap;
+  return bmp;
+}
+
+static void report_error(struct imv_source *src)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding error.\n", src->name);
+    return;
+  }
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = NULL;
+  msg.error = "Internal error";
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static void send_bitmap(struct imv_source *src, int width, int height,
+    void *bitmap)
+{
+  if (!src->callback) {
+    fprintf(stderr, "imv_source(%s) has no callback configured. "
+                    "Discarding result.\n", src->name);
+    return;
+  }
+
+  struct imv_source_message msg;
+  msg.source = src;
+  msg.user_data = src->user_data;
+  msg.bitmap = to_imv_bitmap(width, height, bitmap);
+  msg.frametime = 0;
+  msg.frame = 0;
+  msg.error = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static int load_image(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  int width, height;
+  unsigned char *bitmap = decode(src->private, &width, &height);
+  if (!bitmap) {
+    report_error(src);
+    return -1;
+  }
+
+  send_bitmap(src, width, height, bitmap);
+  return 0;
+}
+
+static void set_scale_hint(struct imv_source *src, double scale)
+{
+  struct private *private = src->private;
+  pthread_mutex_lock(&private->hint_lock);
+  private->scale_hint = scale;
+  pthread_mutex_unlock(&private->hint_lock);
+}
+
+static void set_region_hint(struct imv_source *src, int x, int y,
+    int width, int height)
+{
+  struct private *private = src->private;
+
+  /* clip to the image, and never ask for an empty area */
+  int x1 = x + width < private->width ? x + width : private->width;
+  int y1 = y + height < private->height ? y + height : private->height;
+  x = x < 0 ? 0 : x < private->width - 1 ? x : private->width - 1;
+  y = y < 0 ? 0 : y < private->height - 1 ? y : private->height - 1;
+  x1 = x1 > x ? x1 : x + 1;
+  y1 = y1 > y ? y1 : y + 1;
+
+  pthread_mutex_lock(&private->hint_lock);
+  private->region_x = x;
+  private->region_y = y;
+  private->region_width = x1 - x;
+  private->region_height = y1 - y;
+  pthread_mutex_unlock(&private->hint_lock);
+}
+
+/* Reads the image header to finish opening the file */
+static enum backend_result open_source(const char *name,
+    struct private *private, struct imv_source **src)
+{
+  struct memory_stream memory;
+  opj_stream_t *stream = create_stream(private, &memory);
+  if (!stream) {
+    free(private->path);
+    free(private);
+    return BACKEND_BAD_PATH;
+  }
+
+  opj_codec_t *codec = create_codec(private->format);
+  opj_image_t *image = NULL;
+  bool ok = codec && opj_read_header(stream, codec, &image);
+  if (ok) {
+    private->x0 = image->x0;
+    private->y0 = image->y0;
+    private->width = image->x1 - image->x0;
+    private->height = image->y1 - image->y0;
+    ok = private->width > 0 && private->height > 0;
+
+    private->num_resolutions = 1;
+    opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+    if (info) {
+      if (info->m_default_tile_info.tccp_info) {
+        private->num_resolutions =
+          info->m_default_tile_info.tccp_info[0].numresolutions;
+      }
+      opj_destroy_cstr_info(&info);
+    }
+  }
+
+  opj_image_destroy(image);
+  if (codec) {
+    opj_destroy_codec(codec);
+  }
+  opj_stream_destroy(stream);
+
+  if (!ok) {
+    free(private->path);
+    free(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  pthread_mutex_init(&private->hint_lock, NULL);
+  private->scale_hint = 1;
+  private->region_x = 0;
+  private->region_y = 0;
+  private->region_width = private->width;
+  private->region_height = private->height;
+
+  struct imv_source *source = calloc(1, sizeof *source);
+  source->name = strdup(name);
+  source->width = private->width;
+  source->height = private->height;
+  source->num_frames = 1;
+  source->next_frame = 1;
+  pthread_mutex_init(&source->busy, NULL);
+  source->load_first_frame = &load_image;
+  source->load_next_frame = NULL;
+  source->set_scale_hint = &set_scale_hint;
+  source->set_region_hint = &set_region_hint;
+  source->free = &source_free;
+  source->callback = NULL;
+  source->user_data = NULL;
+  source->private = private;
+
+  *src = source;
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return BACKEND_BAD_PATH;
+  }
+  unsigned char magic[12];
+  const ssize_t len = read(fd, magic, sizeof magic);
+  close(fd);
+
+  OPJ_CODEC_FORMAT format;
+  if (len < 0 || !detect_format(magic, len, &format)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->path = strdup(path);
+  private->format = format;
+  return open_source(path, private, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  OPJ_CODEC_FORMAT format;
+  if (!detect_format(data, len, &format)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->data = data;
+  private->len = len;
+  private->format = format;
+  return open_source("-", private, src);
+}
+
+const struct imv_backend openjpeg_backend = {
+  .name = "OpenJPEG",
+  .description = "Open source JPEG 2000 codec.",
+  .website = "https://www.openjpeg.org/",
+  .license = "The 2-clause BSD License",
+  .open_path = &open_path,
+  .open_memory = &open_memory,
+};
+
+const struct imv_backend *imv_backend_openjpeg(void)
+{
+  return &openjpeg_backend;
+}
@@ -0,0 +1,9 @@
+#ifndef IMV_BACKEND_OPENJPEG_H
+#define IMV_BACKEND_OPENJPEG_H
+
+struct imv_backend;
+
+/* Get an instance of the OpenJPEG backend */
+const struct imv_backend *imv_backend_openjpeg(void);
+
+#endif
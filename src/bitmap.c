@@ -1,15 +1,44 @@
 #include "bitmap.h"
 
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+static unsigned char srgb_lut[IMV_SRGB_LUT_SIZE];
+static pthread_once_t srgb_lut_once = PTHREAD_ONCE_INIT;
+
+static void init_srgb_lut(void)
+{
+  for (int i = 0; i < IMV_SRGB_LUT_SIZE; ++i) {
+    const double v = (double)i / (IMV_SRGB_LUT_SIZE - 1);
+    const double e = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - 0.055;
+    srgb_lut[i] = e * 255 + 0.5;
+  }
+}
+
+const unsigned char *imv_srgb_lut(void)
+{
+  pthread_once(&srgb_lut_once, init_srgb_lut);
+  return srgb_lut;
+}
+
+size_t imv_bitmap_pixel_size(enum imv_pixelformat format)
+{
+  return format == IMV_RGBA_F32 ? 4 * sizeof(float) : 4;
+}
 
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp)
 {
   struct imv_bitmap *copy = malloc(sizeof *copy);
-  const size_t num_bytes = 4 * bmp->width * bmp->height;
+  const size_t num_bytes = imv_bitmap_pixel_size(bmp->format)
+                         * bmp->width * bmp->height;
   copy->width = bmp->width;
   copy->height = bmp->height;
   copy->format = bmp->format;
+  copy->opaque = bmp->opaque;
+  copy->mapped = 0;
   copy->data = malloc(num_bytes);
   memcpy(copy->data, bmp->data, num_bytes);
   return copy;
@@ -17,6 +46,10 @@ struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp)
 
 void imv_bitmap_free(struct imv_bitmap *bmp)
 {
-  free(bmp->data);
+  if (bmp->mapped) {
+    munmap(bmp->data, bmp->mapped);
+  } else {
+    free(bmp->data);
+  }
   free(bmp);
 }
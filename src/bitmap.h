@@ -1,18 +1,53 @@
 #ifndef IMV_BITMAP_H
 #define IMV_BITMAP_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 enum imv_pixelformat {
   IMV_ARGB,
   IMV_ABGR,
+  IMV_RGBA_F32, /* linear light, a float per channel */
 };
 
 struct imv_bitmap {
   int width;
   int height;
   enum imv_pixelformat format;
+  /* true if known to have no transparency, e.g. from the file format. When
+   * false it's found out by checking the pixels */
+  bool opaque;
   unsigned char *data;
+  /* if non-zero, data is a shared memory mapping of this many bytes, rather
+   * than malloc'd */
+  size_t mapped;
 };
 
+/* Size of the lookup table from linear light to sRGB encoded bytes. Large
+ * enough that neighbouring entries are at most one step apart in the dark
+ * end, where the curve is steepest */
+#define IMV_SRGB_LUT_SIZE 4096
+
+/* The lookup table from linear light to sRGB encoded bytes, built on first
+ * use by whichever thread gets there first */
+const unsigned char *imv_srgb_lut(void);
+
+/* Encode a linear light value as an sRGB byte using the table above,
+ * clipping it to the displayable range */
+static inline unsigned char imv_to_srgb(const unsigned char *lut, float v)
+{
+  if (!(v > 0.0f)) {
+    return 0;
+  }
+  if (v >= 1.0f) {
+    return 255;
+  }
+  return lut[(int)(v * (IMV_SRGB_LUT_SIZE - 1) + 0.5f)];
+}
+
+/* Size of a single pixel in the given format, in bytes */
+size_t imv_bitmap_pixel_size(enum imv_pixelformat format);
+
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp);
 void imv_bitmap_free(struct imv_bitmap *bmp);
 
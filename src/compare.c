@@ -0,0 +1,357 @@
+#include "compare.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* SSIM is computed over blocks of this size. Rows are split into bands of
+ * whole blocks, one per thread, and processed a row of blocks at a time so
+ * that the pixels are still cached for the SSIM pass */
+#define BLOCK_SIZE 8
+#define MAX_THREADS 16
+
+/* differences of at least this much are shown as white in the heatmap */
+#define HEAT_RANGE 64
+
+/* the SSIM paper's stabilising constants, for 8 bit values */
+#define SSIM_C1 (0.01 * 255 * 0.01 * 255)
+#define SSIM_C2 (0.03 * 255 * 0.03 * 255)
+
+struct band {
+  const uint32_t *a;
+  const uint32_t *b;
+  uint32_t *heatmap;
+  const uint32_t *palette;
+  int width;
+  int first_row;
+  int end_row;
+
+  /* totals over the band */
+  uint64_t sum;
+  uint64_t squares;
+  int max_error;
+  double ssim_sum;
+  long blocks;
+};
+
+/* Difference a row of pixels, totalling the errors of the colour channels.
+ * In both 8 bit formats alpha is the top byte of each native endian pixel */
+static void diff_row(struct band *band, const uint32_t *a, const uint32_t *b,
+    uint32_t *heatmap)
+{
+  const int width = band->width;
+  uint64_t sum = 0;
+  uint64_t squares = 0;
+  uint32_t max = 0;
+  int x = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i colour = _mm_set1_epi32(0x00ffffff);
+  __m128i vsum = zero;
+  __m128i vsquares = zero;
+  __m128i vmax = zero;
+  for (; x + 4 <= width; x += 4) {
+    const __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+    const __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+    const __m128i d = _mm_and_si128(colour,
+        _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)));
+
+    vsum = _mm_add_epi64(vsum, _mm_sad_epu8(d, zero));
+    const __m128i lo = _mm_unpacklo_epi8(d, zero);
+    const __m128i hi = _mm_unpackhi_epi8(d, zero);
+    const __m128i sq = _mm_add_epi32(_mm_madd_epi16(lo, lo),
+                                     _mm_madd_epi16(hi, hi));
+    vsquares = _mm_add_epi64(vsquares, _mm_unpacklo_epi32(sq, zero));
+    vsquares = _mm_add_epi64(vsquares, _mm_unpackhi_epi32(sq, zero));
+
+    /* each pixel's largest channel difference, in its low byte */
+    __m128i m = _mm_max_epu8(d, _mm_srli_epi32(d, 8));
+    m = _mm_max_epu8(m, _mm_srli_epi32(d, 16));
+    vmax = _mm_max_epu8(vmax, m);
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, m);
+    heatmap[x] = band->palette[lanes[0] & 0xff];
+    heatmap[x + 1] = band->palette[lanes[1] & 0xff];
+    heatmap[x + 2] = band->palette[lanes[2] & 0xff];
+    heatmap[x + 3] = band->palette[lanes[3] & 0xff];
+  }
+  uint64_t lanes64[2];
+  _mm_storeu_si128((__m128i*)lanes64, vsum);
+  sum = lanes64[0] + lanes64[1];
+  _mm_storeu_si128((__m128i*)lanes64, vsquares);
+  squares = lanes64[0] + lanes64[1];
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, vmax);
+  for (int i = 0; i < 4; ++i) {
+    max = (lanes[i] & 0xff) > max ? lanes[i] & 0xff : max;
+  }
+#elif defined(__aarch64__)
+  const uint8x16_t colour = vreinterpretq_u8_u32(vdupq_n_u32(0x00ffffff));
+  uint64x2_t vsum = vdupq_n_u64(0);
+  uint64x2_t vsquares = vdupq_n_u64(0);
+  uint8x16_t vmax = vdupq_n_u8(0);
+  for (; x + 4 <= width; x += 4) {
+    const uint8x16_t va = vreinterpretq_u8_u32(vld1q_u32(a + x));
+    const uint8x16_t vb = vreinterpretq_u8_u32(vld1q_u32(b + x));
+    const uint8x16_t d = vandq_u8(colour, vabdq_u8(va, vb));
+
+    vsum = vpadalq_u32(vsum, vpaddlq_u16(vpaddlq_u8(d)));
+    const uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(d));
+    const uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+    vsquares = vpadalq_u32(vsquares, vpaddlq_u16(lo));
+    vsquares = vpadalq_u32(vsquares, vpaddlq_u16(hi));
+
+    /* each pixel's largest channel difference, in its low byte */
+    const uint32x4_t d32 = vreinterpretq_u32_u8(d);
+    uint8x16_t m = vmaxq_u8(d, vreinterpretq_u8_u32(vshrq_n_u32(d32, 8)));
+    m = vmaxq_u8(m, vreinterpretq_u8_u32(vshrq_n_u32(d32, 16)));
+    vmax = vmaxq_u8(vmax, m);
+
+    uint32_t lanes[4];
+    vst1q_u32(lanes, vreinterpretq_u32_u8(m));
+    heatmap[x] = band->palette[lanes[0] & 0xff];
+    heatmap[x + 1] = band->palette[lanes[1] & 0xff];
+    heatmap[x + 2] = band->palette[lanes[2] & 0xff];
+    heatmap[x + 3] = band->palette[lanes[3] & 0xff];
+  }
+  sum = vgetq_lane_u64(vsum, 0) + vgetq_lane_u64(vsum, 1);
+  squares = vgetq_lane_u64(vsquares, 0) + vgetq_lane_u64(vsquares, 1);
+  uint32_t lanes[4];
+  vst1q_u32(lanes, vreinterpretq_u32_u8(vmax));
+  for (int i = 0; i < 4; ++i) {
+    max = (lanes[i] & 0xff) > max ? lanes[i] & 0xff : max;
+  }
+#endif
+  for (; x < width; ++x) {
+    uint32_t pixel_max = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+      const int ca = a[x] >> shift & 0xff;
+      const int cb = b[x] >> shift & 0xff;
+      const uint32_t d = ca > cb ? ca - cb : cb - ca;
+      sum += d;
+      squares += d * d;
+      pixel_max = d > pixel_max ? d : pixel_max;
+    }
+    heatmap[x] = band->palette[pixel_max];
+    max = pixel_max > max ? pixel_max : max;
+  }
+
+  band->sum += sum;
+  band->squares += squares;
+  if ((int)max > band->max_error) {
+    band->max_error = max;
+  }
+}
+
+static inline int luma(uint32_t pixel)
+{
+  return (77 * (pixel & 0xff) + 150 * (pixel >> 8 & 0xff)
+        + 29 * (pixel >> 16 & 0xff) + 128) >> 8;
+}
+
+/* SSIM of a block of luma, given pointers to its top left corners */
+static double ssim_block(const uint32_t *a, const uint32_t *b, int stride,
+    int width, int height)
+{
+  int64_t sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_ab = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const int la = luma(a[(size_t)y * stride + x]);
+      const int lb = luma(b[(size_t)y * stride + x]);
+      sum_a += la;
+      sum_b += lb;
+      sum_aa += la * la;
+      sum_bb += lb * lb;
+      sum_ab += la * lb;
+    }
+  }
+
+  const double n = width * height;
+  const double mean_a = sum_a / n;
+  const double mean_b = sum_b / n;
+  const double var_a = sum_aa / n - mean_a * mean_a;
+  const double var_b = sum_bb / n - mean_b * mean_b;
+  const double covar = sum_ab / n - mean_a * mean_b;
+  return ((2 * mean_a * mean_b + SSIM_C1) * (2 * covar + SSIM_C2))
+       / ((mean_a * mean_a + mean_b * mean_b + SSIM_C1)
+          * (var_a + var_b + SSIM_C2));
+}
+
+static void *compare_band(void *raw)
+{
+  struct band *band = raw;
+  const int width = band->width;
+
+  for (int y = band->first_row; y < band->end_row; y += BLOCK_SIZE) {
+    const int height = band->end_row - y < BLOCK_SIZE
+                     ? band->end_row - y : BLOCK_SIZE;
+    const size_t offset = (size_t)y * width;
+
+    for (int row = 0; row < height; ++row) {
+      const size_t row_offset = offset + (size_t)row * width;
+      diff_row(band, band->a + row_offset, band->b + row_offset,
+          band->heatmap + row_offset);
+    }
+
+    for (int x = 0; x < width; x += BLOCK_SIZE) {
+      const int block_width = width - x < BLOCK_SIZE ? width - x : BLOCK_SIZE;
+      band->ssim_sum += ssim_block(band->a + offset + x, band->b + offset + x,
+          width, block_width, height);
+      band->blocks++;
+    }
+  }
+  return NULL;
+}
+
+/* The pixels of a bitmap as 8 bit sRGB ABGR, as the comparison works on.
+ * Returns the bitmap's own data if it's already in that format, else a
+ * converted copy for the caller to free */
+static uint32_t *abgr_pixels(const struct imv_bitmap *bmp)
+{
+  const size_t count = (size_t)bmp->width * bmp->height;
+  if (bmp->format == IMV_ABGR) {
+    return (uint32_t*)bmp->data;
+  }
+
+  uint32_t *pixels = malloc(count * sizeof *pixels);
+  if (bmp->format == IMV_ARGB) {
+    const uint32_t *in = (const uint32_t*)bmp->data;
+    for (size_t i = 0; i < count; ++i) {
+      pixels[i] = (in[i] & 0xff00ff00) | (in[i] >> 16 & 0xff)
+                | (in[i] & 0xff) << 16;
+    }
+  } else {
+    const unsigned char *lut = imv_srgb_lut();
+    const float *in = (const float*)bmp->data;
+    for (size_t i = 0; i < count; ++i, in += 4) {
+      const uint32_t alpha = in[3] >= 1.0f ? 255
+                           : in[3] > 0.0f ? in[3] * 255 + 0.5f : 0;
+      pixels[i] = (uint32_t)imv_to_srgb(lut, in[0])
+                | (uint32_t)imv_to_srgb(lut, in[1]) << 8
+                | (uint32_t)imv_to_srgb(lut, in[2]) << 16 | alpha << 24;
+    }
+  }
+  return pixels;
+}
+
+/* Black for no difference, through red and yellow to white at HEAT_RANGE */
+static void fill_palette(uint32_t *palette)
+{
+  for (uint32_t d = 0; d < 256; ++d) {
+    const uint32_t t = d >= HEAT_RANGE ? 765 : d * 765 / HEAT_RANGE;
+    const uint32_t r = t < 255 ? t : 255;
+    const uint32_t g = t < 255 ? 0 : t < 510 ? t - 255 : 255;
+    const uint32_t b = t < 510 ? 0 : t - 510;
+    palette[d] = 0xff000000 | b << 16 | g << 8 | r;
+  }
+}
+
+struct imv_bitmap *imv_compare(const struct imv_bitmap *a,
+    const struct imv_bitmap *b, struct imv_compare_stats *stats)
+{
+  if (a->width != b->width || a->height != b->height
+      || a->width <= 0 || a->height <= 0) {
+    return NULL;
+  }
+
+  const int width = a->width;
+  const int height = a->height;
+  const size_t count = (size_t)width * height;
+
+  uint32_t *pixels_a = abgr_pixels(a);
+  uint32_t *pixels_b = abgr_pixels(b);
+
+  struct imv_bitmap *heatmap = malloc(sizeof *heatmap);
+  heatmap->width = width;
+  heatmap->height = height;
+  heatmap->format = IMV_ABGR;
+  heatmap->opaque = true;
+  heatmap->data = malloc(count * sizeof(uint32_t));
+  heatmap->mapped = 0;
+
+  uint32_t palette[256];
+  fill_palette(palette);
+
+  const int block_rows = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) {
+    num_threads = 1;
+  } else if (num_threads > MAX_THREADS) {
+    num_threads = MAX_THREADS;
+  }
+  if (num_threads > block_rows) {
+    num_threads = block_rows;
+  }
+
+  struct band bands[MAX_THREADS] = {{0}};
+  pthread_t threads[MAX_THREADS];
+  bool started[MAX_THREADS] = {false};
+  for (int i = 0; i < num_threads; ++i) {
+    struct band *band = &bands[i];
+    band->a = pixels_a;
+    band->b = pixels_b;
+    band->heatmap = (uint32_t*)heatmap->data;
+    band->palette = palette;
+    band->width = width;
+    band->first_row = block_rows * i / num_threads * BLOCK_SIZE;
+    band->end_row = block_rows * (i + 1) / num_threads * BLOCK_SIZE;
+    if (band->end_row > height) {
+      band->end_row = height;
+    }
+    /* the first band is done on this thread, and any others that can't get
+     * one of their own afterwards */
+    if (i > 0) {
+      started[i] = !pthread_create(&threads[i], NULL, &compare_band, band);
+    }
+  }
+
+  compare_band(&bands[0]);
+  for (int i = 1; i < num_threads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      compare_band(&bands[i]);
+    }
+  }
+
+  uint64_t sum = 0;
+  uint64_t squares = 0;
+  double ssim_sum = 0;
+  long blocks = 0;
+  stats->max_error = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    sum += bands[i].sum;
+    squares += bands[i].squares;
+    ssim_sum += bands[i].ssim_sum;
+    blocks += bands[i].blocks;
+    if (bands[i].max_error > stats->max_error) {
+      stats->max_error = bands[i].max_error;
+    }
+  }
+
+  const double samples = 3.0 * count;
+  const double mse = squares / samples;
+  stats->mean_error = sum / samples;
+  stats->psnr = mse > 0 ? 10 * log10(255 * 255 / mse) : INFINITY;
+  stats->ssim = ssim_sum / blocks;
+
+  if (pixels_a != (uint32_t*)a->data) {
+    free(pixels_a);
+  }
+  if (pixels_b != (uint32_t*)b->data) {
+    free(pixels_b);
+  }
+
+  return heatmap;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,30 @@
+#ifndef IMV_COMPARE_H
+#define IMV_COMPARE_H
+
+#include "bitmap.h"
+
+/* How much two images differ. Errors are of 8 bit sRGB colour channels,
+ * ignoring alpha */
+struct imv_compare_stats {
+  /* largest difference of any channel, 0-255 */
+  int max_error;
+  /* mean difference over all channels */
+  double mean_error;
+  /* peak signal to noise ratio in dB, INFINITY if the images are identical */
+  double psnr;
+  /* mean structural similarity of the images' luma over 8x8 blocks, 1 if
+   * they're identical */
+  double ssim;
+};
+
+/* Compares two bitmaps of the same size, in any formats. Returns a heatmap
+ * of how much each pixel differs, from black where it's identical through
+ * red and yellow to white, and fills in stats. Returns NULL if the bitmaps'
+ * sizes differ.
+ */
+struct imv_bitmap *imv_compare(const struct imv_bitmap *a,
+    const struct imv_bitmap *b, struct imv_compare_stats *stats);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
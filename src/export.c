@@ -0,0 +1,204 @@
+/* for memfd_create and file sealing */
+#define _GNU_SOURCE
+
+#include "export.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Pixels start on a cache line after the header */
+#define DATA_ALIGNMENT 64
+
+struct imv_export {
+  struct imv_export_header header;
+  int fd;
+  /* true if made by shm_open rather than memfd_create, in which case path
+   * is its name, to unlink when done */
+  bool shm;
+  char path[64];
+};
+
+static enum imv_export_format export_format(enum imv_pixelformat format)
+{
+  switch (format) {
+    case IMV_ABGR: return IMV_EXPORT_ABGR;
+    case IMV_RGBA_F32: return IMV_EXPORT_RGBA_F32;
+    default: return IMV_EXPORT_ARGB;
+  }
+}
+
+/* Clip a region to another, returning false if nothing's left */
+static bool clip_region(struct imv_export_region *r,
+    const struct imv_export_region *to)
+{
+  const int x0 = r->x > to->x ? r->x : to->x;
+  const int y0 = r->y > to->y ? r->y : to->y;
+  const int x1 = r->x + r->width < to->x + to->width
+               ? r->x + r->width : to->x + to->width;
+  const int y1 = r->y + r->height < to->y + to->height
+               ? r->y + r->height : to->y + to->height;
+  if (x1 <= x0 || y1 <= y0) {
+    return false;
+  }
+  r->x = x0;
+  r->y = y0;
+  r->width = x1 - x0;
+  r->height = y1 - y0;
+  return true;
+}
+
+/* Open a new segment to write to, filling in the export's path */
+static int open_segment(struct imv_export *export)
+{
+  int fd;
+
+#ifdef __linux__
+  fd = memfd_create("imv-export", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd >= 0) {
+    snprintf(export->path, sizeof export->path, "/proc/%d/fd/%d",
+        (int)getpid(), fd);
+    return fd;
+  }
+#endif
+
+  static unsigned int count = 0;
+  snprintf(export->path, sizeof export->path, "/imv-%d-%u",
+      (int)getpid(), count++);
+  fd = shm_open(export->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    export->shm = true;
+  }
+  return fd;
+}
+
+/* Stop the segment from being changed by anyone it's shared with */
+static bool seal_segment(struct imv_export *export)
+{
+  if (export->shm) {
+    /* shared memory can't be sealed, but can be made read only */
+    return !fchmod(export->fd, 0400);
+  }
+#ifdef __linux__
+  return !fcntl(export->fd, F_ADD_SEALS,
+      F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#else
+  return false;
+#endif
+}
+
+struct imv_export *imv_export_create(const struct imv_bitmap *bmp,
+    int image_width, int image_height,
+    const struct imv_export_region *bitmap_region,
+    const struct imv_export_region *region)
+{
+  if (bitmap_region->width <= 0 || bitmap_region->height <= 0) {
+    return NULL;
+  }
+
+  struct imv_export_region area = *region;
+  if (!clip_region(&area, bitmap_region)) {
+    return NULL;
+  }
+
+  /* the bitmap may cover its region at a reduced resolution, so work out
+   * which of its pixels the area takes in, rounding outwards */
+  const double sx = (double)bmp->width / bitmap_region->width;
+  const double sy = (double)bmp->height / bitmap_region->height;
+  int x0 = (area.x - bitmap_region->x) * sx;
+  int y0 = (area.y - bitmap_region->y) * sy;
+  int x1 = (area.x + area.width - bitmap_region->x) * sx + 0.999;
+  int y1 = (area.y + area.height - bitmap_region->y) * sy + 0.999;
+  if (x1 > bmp->width) {
+    x1 = bmp->width;
+  }
+  if (y1 > bmp->height) {
+    y1 = bmp->height;
+  }
+  if (x1 <= x0 || y1 <= y0) {
+    return NULL;
+  }
+
+  struct imv_export *export = calloc(1, sizeof *export);
+  struct imv_export_header *header = &export->header;
+  const size_t pixel_size = imv_bitmap_pixel_size(bmp->format);
+  header->magic = IMV_EXPORT_MAGIC;
+  header->version = IMV_EXPORT_VERSION;
+  header->header_size = sizeof *header;
+  header->format = export_format(bmp->format);
+  header->bytes_per_pixel = pixel_size;
+  header->width = x1 - x0;
+  header->height = y1 - y0;
+  header->stride = header->width * pixel_size;
+  header->data_offset = (sizeof *header + DATA_ALIGNMENT - 1)
+                      / DATA_ALIGNMENT * DATA_ALIGNMENT;
+  header->image_width = image_width;
+  header->image_height = image_height;
+  header->region_x = area.x;
+  header->region_y = area.y;
+  header->region_width = area.width;
+  header->region_height = area.height;
+
+  export->fd = open_segment(export);
+  if (export->fd < 0) {
+    free(export);
+    return NULL;
+  }
+
+  const size_t len = header->data_offset
+                   + (size_t)header->stride * header->height;
+  unsigned char *data = MAP_FAILED;
+  if (!ftruncate(export->fd, len)) {
+    data = mmap(NULL, len, PROT_WRITE, MAP_SHARED, export->fd, 0);
+  }
+  if (data == MAP_FAILED) {
+    imv_export_free(export);
+    return NULL;
+  }
+
+  memcpy(data, header, sizeof *header);
+  const size_t bmp_stride = bmp->width * pixel_size;
+  for (uint32_t y = 0; y < header->height; ++y) {
+    memcpy(data + header->data_offset + (size_t)y * header->stride,
+        bmp->data + (y0 + y) * bmp_stride + x0 * pixel_size,
+        header->stride);
+  }
+  munmap(data, len);
+
+  if (!seal_segment(export)) {
+    imv_export_free(export);
+    return NULL;
+  }
+
+  return export;
+}
+
+void imv_export_free(struct imv_export *export)
+{
+  if (!export) {
+    return;
+  }
+  if (export->shm) {
+    shm_unlink(export->path);
+  }
+  close(export->fd);
+  free(export);
+}
+
+const char *imv_export_path(const struct imv_export *export)
+{
+  return export->path;
+}
+
+const struct imv_export_header *imv_export_header(
+    const struct imv_export *export)
+{
+  return &export->header;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
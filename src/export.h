@@ -0,0 +1,75 @@
+#ifndef IMV_EXPORT_H
+#define IMV_EXPORT_H
+
+#include <stdint.h>
+
+#include "bitmap.h"
+
+/* Exported frames start with this header, in native byte order, followed by
+ * the pixels at data_offset. The segment is sealed, so is mapped read only.
+ */
+#define IMV_EXPORT_MAGIC 0x46564d49 /* "IMVF" on little endian machines */
+#define IMV_EXPORT_VERSION 1
+
+enum imv_export_format {
+  IMV_EXPORT_ARGB = 0,     /* 32 bit words of 0xAARRGGBB */
+  IMV_EXPORT_ABGR = 1,     /* 32 bit words of 0xAABBGGRR */
+  IMV_EXPORT_RGBA_F32 = 2, /* a float per channel, in linear light */
+};
+
+struct imv_export_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t format;
+  uint32_t bytes_per_pixel;
+  /* size of the pixels, and the length of each row of them in bytes */
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t data_offset;
+  /* the image's full size, and the area of it the pixels cover. These differ
+   * from the above when the image was decoded at reduced resolution */
+  uint32_t image_width;
+  uint32_t image_height;
+  uint32_t region_x;
+  uint32_t region_y;
+  uint32_t region_width;
+  uint32_t region_height;
+};
+
+/* Area of an image, in the image's own pixels */
+struct imv_export_region {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct imv_export;
+
+/* Copies part of a bitmap into a new shared memory segment for other
+ * processes to map. bitmap_region is the area of the image the bitmap
+ * covers, and region the area of the image to export, which is clipped to
+ * it. Returns NULL if there's nothing to export, or the segment can't be
+ * made.
+ */
+struct imv_export *imv_export_create(const struct imv_bitmap *bmp,
+    int image_width, int image_height,
+    const struct imv_export_region *bitmap_region,
+    const struct imv_export_region *region);
+
+/* Withdraws an export. Processes that already have it mapped keep it */
+void imv_export_free(struct imv_export *export);
+
+/* The path other processes can open the export at. For a memfd this is
+ * under /proc, otherwise it's the name to pass to shm_open */
+const char *imv_export_path(const struct imv_export *export);
+
+/* The header written for the export */
+const struct imv_export_header *imv_export_header(
+    const struct imv_export *export);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,453 @@
+/* for copy_file_range */
+#define _GNU_SOURCE
+
+#include "fileops.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+struct queued_op {
+  enum imv_fileop op;
+  char *path;
+  char *dest;
+  struct queued_op *next;
+};
+
+struct imv_fileops {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* operations waiting for the thread, oldest first */
+  struct queued_op *head;
+  struct queued_op *tail;
+  bool quit;
+
+  imv_fileops_callback callback;
+  void *data;
+};
+
+static const char *verbs[IMV_FILEOP_COUNT] = {
+  "copy",
+  "move",
+  "trash",
+};
+
+static const char *base_name(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+/* Writes dir/name to a PATH_MAX sized buffer, failing if it doesn't fit */
+static bool join_path(char *buf, const char *dir, const char *name)
+{
+  if (snprintf(buf, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  return true;
+}
+
+/* Copies the contents of one file to another, sharing the data between them
+ * where the filesystem supports it */
+static bool copy_data(int in, int out)
+{
+#ifdef FICLONE
+  if (!ioctl(out, FICLONE, in)) {
+    return true;
+  }
+#endif
+
+#ifdef __linux__
+  /* copied in the kernel, which lets network filesystems copy on the server.
+   * Carries on with read and write from wherever it got to if unsupported */
+  for (;;) {
+    ssize_t copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    if (copied == 0) {
+      return true;
+    }
+    if (copied < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+          || errno == EOPNOTSUPP) {
+        break;
+      }
+      return false;
+    }
+  }
+#endif
+
+  char buf[1 << 16];
+  for (;;) {
+    ssize_t len = read(in, buf, sizeof buf);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      return len == 0;
+    }
+    for (ssize_t pos = 0; pos < len;) {
+      ssize_t written = write(out, buf + pos, len - pos);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written < 0) {
+        return false;
+      }
+      pos += written;
+    }
+  }
+}
+
+/* Copies a file, keeping its permissions and times. Never overwrites */
+static bool copy_file(const char *src, const char *dst)
+{
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(in, &info)) {
+    close(in);
+    return false;
+  }
+
+  int out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+      info.st_mode & 07777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  bool ok = copy_data(in, out);
+  if (ok) {
+    const struct timespec times[2] = { info.st_atim, info.st_mtim };
+    futimens(out, times);
+  }
+  ok = !close(out) && ok;
+  close(in);
+
+  if (!ok) {
+    const int err = errno;
+    unlink(dst);
+    errno = err;
+  }
+  return ok;
+}
+
+/* Renames a file, failing with EEXIST rather than replacing one that's
+ * already there, even if it appears at the last moment */
+static bool rename_noreplace(const char *src, const char *dst)
+{
+#if defined(SYS_renameat2) && defined(RENAME_NOREPLACE)
+  if (!syscall(SYS_renameat2, AT_FDCWD, src, AT_FDCWD, dst,
+        RENAME_NOREPLACE)) {
+    return true;
+  }
+  /* carry on without it only if the kernel or filesystem lacks it */
+  if (errno != ENOSYS && errno != EINVAL) {
+    return false;
+  }
+#endif
+
+  /* linking fails if dst exists, so is as good once src is removed */
+  if (link(src, dst)) {
+    return false;
+  }
+  if (unlink(src)) {
+    const int err = errno;
+    unlink(dst);
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+/* Moves a file, copying it if it's to another filesystem. Never overwrites */
+static bool move_file(const char *src, const char *dst)
+{
+  if (rename_noreplace(src, dst)) {
+    return true;
+  }
+  /* copying also suits filesystems without hard links */
+  if (errno != EXDEV && errno != EPERM && errno != EOPNOTSUPP
+      && errno != EMLINK) {
+    return false;
+  }
+  if (!copy_file(src, dst)) {
+    return false;
+  }
+  if (unlink(src)) {
+    const int err = errno;
+    unlink(dst);
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+/* mkdir -p, for the trash's directories */
+static bool make_dirs(char *path)
+{
+  for (char *p = path + 1; *p; ++p) {
+    if (*p == '/') {
+      *p = '\0';
+      const bool ok = !mkdir(path, 0700) || errno == EEXIST;
+      *p = '/';
+      if (!ok) {
+        return false;
+      }
+    }
+  }
+  return !mkdir(path, 0700) || errno == EEXIST;
+}
+
+/* Writes the contents of a trash info file and closes it */
+static bool write_trash_info(int fd, const char *abs_path)
+{
+  char date[32];
+  const time_t now = time(NULL);
+  struct tm local;
+  strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", localtime_r(&now, &local));
+
+  FILE *f = fdopen(fd, "w");
+  if (!f) {
+    close(fd);
+    return false;
+  }
+
+  /* the original path is stored URL encoded */
+  fprintf(f, "[Trash Info]\nPath=");
+  for (const unsigned char *c = (const unsigned char*)abs_path; *c; ++c) {
+    if (isalnum(*c) || strchr("/-_.~", *c)) {
+      fputc(*c, f);
+    } else {
+      fprintf(f, "%%%02X", *c);
+    }
+  }
+  fprintf(f, "\nDeletionDate=%s\n", date);
+  return !fclose(f);
+}
+
+/* Moves a file to the user's trash, as the freedesktop.org trash spec
+ * describes, so that desktop environments can show and restore it */
+static bool trash_file(const char *path)
+{
+  char trash[PATH_MAX];
+  const char *data_home = getenv("XDG_DATA_HOME");
+  const char *home = getenv("HOME");
+  bool ok;
+  if (data_home && *data_home) {
+    ok = join_path(trash, data_home, "Trash");
+  } else if (home) {
+    ok = join_path(trash, home, ".local/share/Trash");
+  } else {
+    errno = ENOENT;
+    return false;
+  }
+
+  char files[PATH_MAX];
+  char info[PATH_MAX];
+  char abs_path[PATH_MAX];
+  if (!ok || !join_path(files, trash, "files") || !join_path(info, trash, "info")
+      || !make_dirs(files) || !make_dirs(info) || !realpath(path, abs_path)) {
+    return false;
+  }
+
+  /* claim a name in the trash by creating its info file, then move the
+   * file in. A file already there under that name is never replaced, but
+   * taken as a sign to try the next name */
+  char name[NAME_MAX + 1];
+  char info_name[NAME_MAX + 16];
+  char info_path[PATH_MAX];
+  char dest[PATH_MAX];
+  for (int n = 1; n < 1000; ++n) {
+    const int len = n == 1
+      ? snprintf(name, sizeof name, "%s", base_name(abs_path))
+      : snprintf(name, sizeof name, "%s.%d", base_name(abs_path), n);
+    if (len < 0 || (size_t)len >= sizeof name) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+    snprintf(info_name, sizeof info_name, "%s.trashinfo", name);
+    if (!join_path(info_path, info, info_name)
+        || !join_path(dest, files, name)) {
+      return false;
+    }
+
+    int fd = open(info_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      continue;
+    }
+    if (fd < 0) {
+      return false;
+    }
+
+    if (write_trash_info(fd, abs_path) && move_file(path, dest)) {
+      return true;
+    }
+    const int err = errno;
+    unlink(info_path);
+    if (err != EEXIST) {
+      errno = err;
+      return false;
+    }
+  }
+
+  errno = EEXIST;
+  return false;
+}
+
+static bool perform(const struct queued_op *op)
+{
+  if (op->op == IMV_FILEOP_TRASH) {
+    return trash_file(op->path);
+  }
+
+  char dest[PATH_MAX];
+  if (!join_path(dest, op->dest, base_name(op->path))) {
+    return false;
+  }
+  if (op->op == IMV_FILEOP_COPY) {
+    return copy_file(op->path, dest);
+  }
+  return move_file(op->path, dest);
+}
+
+static void *run_fileops(void *raw)
+{
+  struct imv_fileops *ops = raw;
+
+  pthread_mutex_lock(&ops->lock);
+  for (;;) {
+    while (!ops->head && !ops->quit) {
+      pthread_cond_wait(&ops->cond, &ops->lock);
+    }
+    if (!ops->head) {
+      /* quitting, with nothing left to do */
+      break;
+    }
+
+    /* everything queued so far is done as one batch */
+    struct queued_op *batch = ops->head;
+    ops->head = NULL;
+    ops->tail = NULL;
+    pthread_mutex_unlock(&ops->lock);
+
+    struct imv_fileops_result *result = calloc(1, sizeof *result);
+    result->unmoved = list_create();
+    while (batch) {
+      struct queued_op *op = batch;
+      batch = op->next;
+
+      if (perform(op)) {
+        result->done[op->op]++;
+      } else {
+        fprintf(stderr, "Unable to %s %s: %s\n", verbs[op->op], op->path,
+            strerror(errno));
+        result->failed++;
+        if (op->op != IMV_FILEOP_COPY) {
+          list_append(result->unmoved, op->path);
+          op->path = NULL;
+        }
+      }
+
+      free(op->path);
+      free(op->dest);
+      free(op);
+    }
+
+    ops->callback(result, ops->data);
+    pthread_mutex_lock(&ops->lock);
+  }
+  pthread_mutex_unlock(&ops->lock);
+
+  return NULL;
+}
+
+struct imv_fileops *imv_fileops_create(imv_fileops_callback callback,
+    void *data)
+{
+  struct imv_fileops *ops = calloc(1, sizeof *ops);
+  ops->callback = callback;
+  ops->data = data;
+  pthread_mutex_init(&ops->lock, NULL);
+  pthread_cond_init(&ops->cond, NULL);
+
+  if (pthread_create(&ops->thread, NULL, &run_fileops, ops)) {
+    pthread_mutex_destroy(&ops->lock);
+    pthread_cond_destroy(&ops->cond);
+    free(ops);
+    return NULL;
+  }
+  return ops;
+}
+
+void imv_fileops_free(struct imv_fileops *ops)
+{
+  if (!ops) {
+    return;
+  }
+
+  pthread_mutex_lock(&ops->lock);
+  ops->quit = true;
+  pthread_cond_signal(&ops->cond);
+  pthread_mutex_unlock(&ops->lock);
+  pthread_join(ops->thread, NULL);
+
+  pthread_mutex_destroy(&ops->lock);
+  pthread_cond_destroy(&ops->cond);
+  free(ops);
+}
+
+void imv_fileops_queue(struct imv_fileops *ops, enum imv_fileop op,
+    const char *path, const char *dest)
+{
+  struct queued_op *queued = calloc(1, sizeof *queued);
+  queued->op = op;
+  queued->path = strdup(path);
+  queued->dest = dest ? strdup(dest) : NULL;
+
+  pthread_mutex_lock(&ops->lock);
+  if (ops->tail) {
+    ops->tail->next = queued;
+  } else {
+    ops->head = queued;
+  }
+  ops->tail = queued;
+  pthread_cond_signal(&ops->cond);
+  pthread_mutex_unlock(&ops->lock);
+}
+
+void imv_fileops_result_free(struct imv_fileops_result *result)
+{
+  list_deep_free(result->unmoved);
+  free(result);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
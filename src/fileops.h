@@ -0,0 +1,50 @@
+#ifndef IMV_FILEOPS_H
+#define IMV_FILEOPS_H
+
+#include "list.h"
+
+enum imv_fileop {
+  IMV_FILEOP_COPY,  /* copy into a directory */
+  IMV_FILEOP_MOVE,  /* move into a directory */
+  IMV_FILEOP_TRASH, /* move to the user's trash */
+  IMV_FILEOP_COUNT
+};
+
+/* Outcome of a batch of operations */
+struct imv_fileops_result {
+  /* how many of each operation succeeded */
+  int done[IMV_FILEOP_COUNT];
+  int failed;
+  /* paths that were to be moved or trashed but couldn't be, so are still
+   * where they were */
+  struct list *unmoved;
+};
+
+struct imv_fileops;
+
+/* Called on the I/O thread once the operations queued so far are finished.
+ * The callback takes ownership of the result */
+typedef void (*imv_fileops_callback)(struct imv_fileops_result *result,
+    void *data);
+
+/* Creates an instance of imv_fileops, which carries out file operations on
+ * a thread of its own. Operations queued while others are in progress are
+ * carried out together, with a single result.
+ */
+struct imv_fileops *imv_fileops_create(imv_fileops_callback callback,
+    void *data);
+
+/* Finishes any queued operations and cleans up an imv_fileops instance */
+void imv_fileops_free(struct imv_fileops *ops);
+
+/* Queue an operation on path. dest is the directory to copy or move it to,
+ * ignored for trashing */
+void imv_fileops_queue(struct imv_fileops *ops, enum imv_fileop op,
+    const char *path, const char *dest);
+
+/* Frees a result */
+void imv_fileops_result_free(struct imv_fileops_result *result);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -1,18 +1,57 @@
 #include "image.h"
 
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Chunk textures of recent bitmaps are kept for reuse, as creating them is
+ * slow with most drivers. The pool is bounded by count and total size */
+#define POOL_SIZE 8
+#define POOL_MAX_PIXELS (1 << 25)
+
+struct pooled_texture {
+  SDL_Texture *texture;
+  int format;
+  int width;
+  int height;
+};
 
 struct imv_image {
   int width;              /* width of the image overall */
   int height;             /* height of the image overall */
+  int bitmap_width;       /* width of the bitmap the chunks hold */
+  int bitmap_height;      /* height of the bitmap the chunks hold */
+  SDL_Rect region;        /* area of the image the bitmap covers */
   int num_chunks;         /* number of chunks allocated */
   SDL_Texture **chunks;   /* array of chunks */
+  bool *opaque_chunks;    /* whether each chunk has no transparency */
   int num_chunks_wide;    /* number of chunks per row of the image */
   int num_chunks_tall;    /* number of chunks per column of the image */
   int chunk_width;        /* chunk width */
   int chunk_height;       /* chunk height */
   int last_chunk_width;   /* width of rightmost chunk */
   int last_chunk_height;  /* height of bottommost chunk */
+  int chunk_format;       /* SDL pixel format of the chunks */
+  unsigned char alpha;    /* opacity the image is drawn with */
+  struct pooled_texture pool[POOL_SIZE]; /* unused textures, oldest first */
+  int pool_len;           /* number of textures in the pool */
+  int pool_pixels;        /* total size of the textures in the pool */
+  unsigned long pool_hits;   /* textures taken from the pool */
+  unsigned long pool_misses; /* textures that had to be created */
+  float *edges_x;         /* screen position of each column of chunks' edges */
+  float *edges_y;         /* screen position of each row of chunks' edges */
+  bool layout_valid;      /* whether the edges are for the values below */
+  int layout_x;           /* position and scale the edges were laid out for */
+  int layout_y;
+  double layout_scale;
   SDL_Renderer *renderer; /* SDL renderer to draw to */
 };
 
@@ -21,6 +60,7 @@ struct imv_image *imv_image_create(SDL_Renderer *r)
   struct imv_image *image = malloc(sizeof *image);
   memset(image, 0, sizeof(struct imv_image));
   image->renderer = r;
+  image->alpha = 255;
 
   SDL_RendererInfo ri;
   SDL_GetRendererInfo(r, &ri);
@@ -29,6 +69,82 @@ struct imv_image *imv_image_create(SDL_Renderer *r)
   return image;
 }
 
+static void chunk_size(const struct imv_image *image, int x, int y,
+    int *width, int *height)
+{
+  *width = x == image->num_chunks_wide - 1
+         ? image->last_chunk_width : image->chunk_width;
+  *height = y == image->num_chunks_tall - 1
+          ? image->last_chunk_height : image->chunk_height;
+}
+
+/* Get a texture from the pool, or create one if none match */
+static SDL_Texture *acquire_texture(struct imv_image *image, int format,
+    int width, int height)
+{
+  for (int i = image->pool_len - 1; i >= 0; --i) {
+    struct pooled_texture *entry = &image->pool[i];
+    if (entry->format == format && entry->width == width
+        && entry->height == height) {
+      SDL_Texture *texture = entry->texture;
+      image->pool_pixels -= width * height;
+      memmove(entry, entry + 1,
+          (image->pool_len - i - 1) * sizeof *entry);
+      --image->pool_len;
+      ++image->pool_hits;
+      IMV_TRACE2(texture_hit, width, height);
+      return texture;
+    }
+  }
+
+  ++image->pool_misses;
+  IMV_TRACE2(texture_miss, width, height);
+  return SDL_CreateTexture(image->renderer, format,
+      SDL_TEXTUREACCESS_STATIC, width, height);
+}
+
+/* Put a texture in the pool, making room by destroying the oldest */
+static void release_texture(struct imv_image *image, SDL_Texture *texture,
+    int format, int width, int height)
+{
+  const int pixels = width * height;
+  if (pixels > POOL_MAX_PIXELS) {
+    SDL_DestroyTexture(texture);
+    return;
+  }
+
+  while (image->pool_len == POOL_SIZE
+      || image->pool_pixels + pixels > POOL_MAX_PIXELS) {
+    struct pooled_texture *oldest = &image->pool[0];
+    SDL_DestroyTexture(oldest->texture);
+    image->pool_pixels -= oldest->width * oldest->height;
+    memmove(oldest, oldest + 1, (image->pool_len - 1) * sizeof *oldest);
+    --image->pool_len;
+  }
+
+  struct pooled_texture *entry = &image->pool[image->pool_len++];
+  entry->texture = texture;
+  entry->format = format;
+  entry->width = width;
+  entry->height = height;
+  image->pool_pixels += pixels;
+}
+
+static void release_chunks(struct imv_image *image)
+{
+  for (int y = 0; y < image->num_chunks_tall; ++y) {
+    for (int x = 0; x < image->num_chunks_wide; ++x) {
+      int w, h;
+      chunk_size(image, x, y, &w, &h);
+      release_texture(image, image->chunks[x + y * image->num_chunks_wide],
+          image->chunk_format, w, h);
+    }
+  }
+  free(image->chunks);
+  image->num_chunks = 0;
+  image->chunks = NULL;
+}
+
 void imv_image_free(struct imv_image *image)
 {
   if(!image) {
@@ -41,8 +157,14 @@ void imv_image_free(struct imv_image *image)
     free(image->chunks);
     image->num_chunks = 0;
     image->chunks = NULL;
-    image->renderer = NULL;
   }
+  for(int i = 0; i < image->pool_len; ++i) {
+    SDL_DestroyTexture(image->pool[i].texture);
+  }
+  image->renderer = NULL;
+  free(image->opaque_chunks);
+  free(image->edges_x);
+  free(image->edges_y);
   free(image);
 }
 
@@ -50,7 +172,8 @@ static int convert_pixelformat(enum imv_pixelformat fmt)
 {
   if (fmt == IMV_ARGB) {
     return SDL_PIXELFORMAT_ARGB8888;
-  } else if (fmt == IMV_ABGR) {
+  } else if (fmt == IMV_ABGR || fmt == IMV_RGBA_F32) {
+    /* float bitmaps are converted as they're uploaded */
     return SDL_PIXELFORMAT_ABGR8888;
   } else {
     fprintf(stderr, "Unknown pixel format. Defaulting to ARGB\n");
@@ -58,104 +181,344 @@ static int convert_pixelformat(enum imv_pixelformat fmt)
   }
 }
 
+/* Convert a region of a float bitmap to 8 bit ABGR for display. Colour is
+ * clipped to the displayable range and sRGB encoded; alpha is left linear.
+ */
+static void convert_float_region(unsigned char *dst, const float *src,
+    int width, int height, int src_width)
+{
+  const unsigned char *lut = imv_srgb_lut();
+
+  for (int y = 0; y < height; ++y) {
+    const float *in = src + (size_t)y * src_width * 4;
+    for (int x = 0; x < width; ++x) {
+      dst[0] = imv_to_srgb(lut, in[0]);
+      dst[1] = imv_to_srgb(lut, in[1]);
+      dst[2] = imv_to_srgb(lut, in[2]);
+      dst[3] = in[3] >= 1.0f ? 255 : in[3] > 0.0f ? in[3] * 255 + 0.5f : 0;
+      dst += 4;
+      in += 4;
+    }
+  }
+}
+
+/* Whether every pixel of an area of 32 bit pixels has full alpha. In both
+ * the formats used it's the top byte of each native endian pixel, so the
+ * pixels are ANDed together a vector at a time and the result's checked */
+static bool area_is_opaque(const unsigned char *data, int width, int height,
+    int stride)
+{
+  for (int y = 0; y < height; ++y) {
+    const uint32_t *row = (const uint32_t*)(data + (size_t)y * stride);
+    uint32_t acc = 0xffffffff;
+    int x = 0;
+#if defined(__SSE2__)
+    __m128i vacc = _mm_set1_epi32(-1);
+    for (; x + 4 <= width; x += 4) {
+      vacc = _mm_and_si128(vacc, _mm_loadu_si128((const __m128i*)(row + x)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, vacc);
+    acc = lanes[0] & lanes[1] & lanes[2] & lanes[3];
+#elif defined(__aarch64__)
+    uint32x4_t vacc = vdupq_n_u32(0xffffffff);
+    for (; x + 4 <= width; x += 4) {
+      vacc = vandq_u32(vacc, vld1q_u32(row + x));
+    }
+    uint32_t lanes[4];
+    vst1q_u32(lanes, vacc);
+    acc = lanes[0] & lanes[1] & lanes[2] & lanes[3];
+#endif
+    for (; x < width; ++x) {
+      acc &= row[x];
+    }
+    /* most transparent images show it early on */
+    if ((acc >> 24) != 0xff) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Opaque chunks are drawn without blending, which is much cheaper, unless
+ * the whole image is being faded */
+static void apply_blend_mode(struct imv_image *image, int index)
+{
+  const bool blend = !image->opaque_chunks[index] || image->alpha != 255;
+  SDL_SetTextureBlendMode(image->chunks[index],
+      blend ? SDL_BLENDMODE_BLEND : SDL_BLENDMODE_NONE);
+  SDL_SetTextureAlphaMod(image->chunks[index], image->alpha);
+}
+
+static void upload_chunk(struct imv_image *image, int index,
+    const unsigned char *data, int width, int height, int stride,
+    bool known_opaque)
+{
+  image->opaque_chunks[index] = known_opaque
+                             || area_is_opaque(data, width, height, stride);
+  apply_blend_mode(image, index);
+  SDL_UpdateTexture(image->chunks[index], NULL, data, stride);
+}
+
 int imv_image_set_bitmap(struct imv_image *image, struct imv_bitmap *bmp)
 {
+  /* the chunks of a bitmap the same size and format as the last, such as
+   * the next frame of an animation, can be updated in place */
+  const int format = convert_pixelformat(bmp->format);
+  const bool reuse_chunks = image->num_chunks > 0
+                         && format == image->chunk_format
+                         && bmp->width == image->bitmap_width
+                         && bmp->height == image->bitmap_height;
+  if (!reuse_chunks && image->num_chunks > 0) {
+    release_chunks(image);
+  }
+
   image->width = bmp->width;
   image->height = bmp->height;
+  image->bitmap_width = bmp->width;
+  image->bitmap_height = bmp->height;
+  image->region.x = 0;
+  image->region.y = 0;
+  image->region.w = bmp->width;
+  image->region.h = bmp->height;
+  image->layout_valid = false;
 
-  /* figure out how many chunks are needed, and create them */
-  if(image->num_chunks > 0) {
-    for(int i = 0; i < image->num_chunks; ++i) {
-      SDL_DestroyTexture(image->chunks[i]);
+  if (!reuse_chunks) {
+    /* figure out how many chunks are needed, and create them */
+    image->num_chunks_wide = (image->bitmap_width + image->chunk_width - 1)
+                           / image->chunk_width;
+    image->num_chunks_tall = (image->bitmap_height + image->chunk_height - 1)
+                           / image->chunk_height;
+    if (image->num_chunks_wide < 1) {
+      image->num_chunks_wide = 1;
+    }
+    if (image->num_chunks_tall < 1) {
+      image->num_chunks_tall = 1;
     }
-    free(image->chunks);
-  }
 
-  image->num_chunks_wide = 1 + image->width / image->chunk_width;
-  image->num_chunks_tall = 1 + image->height / image->chunk_height;
+    image->last_chunk_width = image->bitmap_width % image->chunk_width;
+    image->last_chunk_height = image->bitmap_height % image->chunk_height;
 
-  image->last_chunk_width = image->width % image->chunk_width;
-  image->last_chunk_height = image->height % image->chunk_height;
+    if(image->last_chunk_width == 0) {
+      image->last_chunk_width = image->chunk_width;
+    }
+    if(image->last_chunk_height == 0) {
+      image->last_chunk_height = image->chunk_height;
+    }
 
-  if(image->last_chunk_width == 0) {
-    image->last_chunk_width = image->chunk_width;
-  }
-  if(image->last_chunk_height == 0) {
-    image->last_chunk_height = image->chunk_height;
-  }
+    image->chunk_format = format;
+    image->chunks = malloc(sizeof(SDL_Texture*) * image->num_chunks_wide
+                                                * image->num_chunks_tall);
+    free(image->opaque_chunks);
+    image->opaque_chunks = malloc(sizeof(bool) * image->num_chunks_wide
+                                               * image->num_chunks_tall);
 
-  image->num_chunks = image->num_chunks_wide * image->num_chunks_tall;
-  image->chunks = malloc(sizeof(SDL_Texture*) * image->num_chunks);
+    free(image->edges_x);
+    free(image->edges_y);
+    image->edges_x = malloc(sizeof(float) * (image->num_chunks_wide + 1));
+    image->edges_y = malloc(sizeof(float) * (image->num_chunks_tall + 1));
 
-  const int format = convert_pixelformat(bmp->format);
-  size_t failed_at = -1;
-  for(int y = 0; y < image->num_chunks_tall; ++y) {
-    for(int x = 0; x < image->num_chunks_wide; ++x) {
-      const bool is_last_h_chunk = (x == image->num_chunks_wide - 1);
-      const bool is_last_v_chunk = (y == image->num_chunks_tall - 1);
-      const size_t index = x + y * image->num_chunks_wide;
-      image->chunks[index] =
-        SDL_CreateTexture(image->renderer,
-          format,
-          SDL_TEXTUREACCESS_STATIC,
-          is_last_h_chunk ? image->last_chunk_width : image->chunk_width,
-          is_last_v_chunk ? image->last_chunk_height : image->chunk_height);
-      SDL_SetTextureBlendMode(image->chunks[index],
-          SDL_BLENDMODE_BLEND);
-      if (image->chunks[index] == NULL) {
-        failed_at = x + y * image->num_chunks_wide;
-        break;
+    for(int y = 0; y < image->num_chunks_tall; ++y) {
+      for(int x = 0; x < image->num_chunks_wide; ++x) {
+        int w, h;
+        chunk_size(image, x, y, &w, &h);
+        SDL_Texture *chunk = acquire_texture(image, format, w, h);
+        if (!chunk) {
+          const int failed_at = x + y * image->num_chunks_wide;
+          for (int i = 0; i < failed_at; ++i) {
+            SDL_DestroyTexture(image->chunks[i]);
+          }
+          free(image->chunks);
+          image->chunks = NULL;
+          image->num_chunks = 0;
+          return 1;
+        }
+        image->chunks[x + y * image->num_chunks_wide] = chunk;
       }
     }
+    image->num_chunks = image->num_chunks_wide * image->num_chunks_tall;
   }
 
-  if (failed_at != (size_t)-1) {
-    for (size_t i = 0; i < failed_at; ++i) {
-      SDL_DestroyTexture(image->chunks[i]);
+  if (bmp->format == IMV_RGBA_F32) {
+    /* convert one chunk at a time to bound the extra memory needed */
+    const int max_w = image->num_chunks_wide > 1
+                    ? image->chunk_width : image->last_chunk_width;
+    const int max_h = image->num_chunks_tall > 1
+                    ? image->chunk_height : image->last_chunk_height;
+    unsigned char *buf = malloc((size_t)4 * max_w * max_h);
+    const float *data = (const float*)bmp->data;
+    for (int y = 0; y < image->num_chunks_tall; ++y) {
+      for (int x = 0; x < image->num_chunks_wide; ++x) {
+        const bool is_last_h_chunk = (x == image->num_chunks_wide - 1);
+        const bool is_last_v_chunk = (y == image->num_chunks_tall - 1);
+        const int w = is_last_h_chunk ? image->last_chunk_width : image->chunk_width;
+        const int h = is_last_v_chunk ? image->last_chunk_height : image->chunk_height;
+        const float *src = data + 4 * ((size_t)x * image->chunk_width +
+          (size_t)y * image->bitmap_width * image->chunk_height);
+        convert_float_region(buf, src, w, h, image->bitmap_width);
+        upload_chunk(image, x + y * image->num_chunks_wide, buf, w, h, 4 * w,
+            bmp->opaque);
+      }
     }
-    free(image->chunks);
-    image->num_chunks = 0;
-    image->chunks = NULL;
-    return 1;
+    free(buf);
+    return 0;
   }
 
   for (int y = 0; y < image->num_chunks_tall; ++y) {
     for (int x = 0; x < image->num_chunks_wide; ++x) {
       ptrdiff_t offset = 4 * x * image->chunk_width +
-        y * 4 * image->width * image->chunk_height;
+        y * 4 * image->bitmap_width * image->chunk_height;
       unsigned char* addr = bmp->data + offset;
-      SDL_UpdateTexture(image->chunks[x + y * image->num_chunks_wide],
-          NULL, addr, 4 * image->width);
+      int w, h;
+      chunk_size(image, x, y, &w, &h);
+      upload_chunk(image, x + y * image->num_chunks_wide, addr, w, h,
+          4 * image->bitmap_width, bmp->opaque);
     }
   }
 
   return 0;
 }
 
+void imv_image_set_size(struct imv_image *image, int width, int height)
+{
+  image->width = width;
+  image->height = height;
+  image->region.x = 0;
+  image->region.y = 0;
+  image->region.w = width;
+  image->region.h = height;
+  image->layout_valid = false;
+}
+
+void imv_image_set_region(struct imv_image *image, int x, int y,
+    int width, int height)
+{
+  image->region.x = x;
+  image->region.y = y;
+  image->region.w = width;
+  image->region.h = height;
+  image->layout_valid = false;
+}
+
+bool imv_image_covers(const struct imv_image *image, int x, int y,
+    int width, int height)
+{
+  return x >= image->region.x && y >= image->region.y
+      && x + width <= image->region.x + image->region.w
+      && y + height <= image->region.y + image->region.h;
+}
+
+/* Work out where the edges of the chunks fall on screen. Each edge is
+ * placed from the image's origin, rather than by adding up chunk sizes, so
+ * neighbouring chunks meet exactly at any scale */
+static void layout_chunks(struct imv_image *image, int bx, int by, double scale)
+{
+  /* a reduced resolution bitmap is stretched over the region it covers */
+  const double scale_x = image->bitmap_width
+                       ? scale * image->region.w / image->bitmap_width : scale;
+  const double scale_y = image->bitmap_height
+                       ? scale * image->region.h / image->bitmap_height : scale;
+  const double left = bx + image->region.x * scale;
+  const double top = by + image->region.y * scale;
+
+  for (int x = 0; x <= image->num_chunks_wide; ++x) {
+    const int px = x < image->num_chunks_wide
+                 ? x * image->chunk_width : image->bitmap_width;
+    image->edges_x[x] = left + px * scale_x;
+  }
+  for (int y = 0; y <= image->num_chunks_tall; ++y) {
+    const int py = y < image->num_chunks_tall
+                 ? y * image->chunk_height : image->bitmap_height;
+    image->edges_y[y] = top + py * scale_y;
+  }
+
+  image->layout_x = bx;
+  image->layout_y = by;
+  image->layout_scale = scale;
+  image->layout_valid = true;
+}
+
 void imv_image_draw(struct imv_image *image, int bx, int by, double scale)
 {
-  int offset_x = 0;
-  int offset_y = 0;
-  for(int y = 0; y < image->num_chunks_tall; ++y) {
-    for(int x = 0; x < image->num_chunks_wide; ++x) {
-      int img_w, img_h;
-      SDL_QueryTexture(image->chunks[x + y * image->num_chunks_wide], NULL, NULL,
-        &img_w, &img_h);
-      SDL_Rect view_area = {
-        bx + offset_x,
-        by + offset_y,
-        img_w * scale,
-        img_h * scale
+  if (!image->num_chunks) {
+    return;
+  }
+
+  if (!image->layout_valid || image->layout_x != bx || image->layout_y != by
+      || image->layout_scale != scale) {
+    layout_chunks(image, bx, by, scale);
+  }
+
+  for (int y = 0; y < image->num_chunks_tall; ++y) {
+    for (int x = 0; x < image->num_chunks_wide; ++x) {
+      SDL_Texture *chunk = image->chunks[x + y * image->num_chunks_wide];
+#if SDL_VERSION_ATLEAST(2, 0, 10)
+      const SDL_FRect view_area = {
+        image->edges_x[x],
+        image->edges_y[y],
+        image->edges_x[x + 1] - image->edges_x[x],
+        image->edges_y[y + 1] - image->edges_y[y]
       };
-      SDL_RenderCopy(image->renderer,
-          image->chunks[x + y * image->num_chunks_wide], NULL, &view_area);
-      offset_x += image->chunk_width * scale;
+      SDL_RenderCopyF(image->renderer, chunk, NULL, &view_area);
+#else
+      /* round the edges, not the sizes, to keep chunks touching */
+      const int x0 = lroundf(image->edges_x[x]);
+      const int y0 = lroundf(image->edges_y[y]);
+      const SDL_Rect view_area = {
+        x0,
+        y0,
+        lroundf(image->edges_x[x + 1]) - x0,
+        lroundf(image->edges_y[y + 1]) - y0
+      };
+      SDL_RenderCopy(image->renderer, chunk, NULL, &view_area);
+#endif
     }
-    offset_x = 0;
-    offset_y += image->chunk_height * scale;
   }
 }
 
+void imv_image_set_alpha(struct imv_image *image, unsigned char alpha)
+{
+  if (alpha == image->alpha) {
+    return;
+  }
+  image->alpha = alpha;
+  for (int i = 0; i < image->num_chunks; ++i) {
+    apply_blend_mode(image, i);
+  }
+}
+
+bool imv_image_hides(struct imv_image *image, int bx, int by, double scale,
+    const SDL_Rect *area)
+{
+  if (!image->num_chunks || image->alpha != 255) {
+    return false;
+  }
+
+  if (!image->layout_valid || image->layout_x != bx || image->layout_y != by
+      || image->layout_scale != scale) {
+    layout_chunks(image, bx, by, scale);
+  }
+
+  /* the area has to be within a single chunk, which must be opaque */
+  int cx = 0;
+  while (cx < image->num_chunks_wide && image->edges_x[cx + 1] <= area->x) {
+    ++cx;
+  }
+  int cy = 0;
+  while (cy < image->num_chunks_tall && image->edges_y[cy + 1] <= area->y) {
+    ++cy;
+  }
+  if (cx == image->num_chunks_wide || cy == image->num_chunks_tall) {
+    return false;
+  }
+
+  return image->edges_x[cx] <= area->x
+      && image->edges_y[cy] <= area->y
+      && area->x + area->w <= image->edges_x[cx + 1]
+      && area->y + area->h <= image->edges_y[cy + 1]
+      && image->opaque_chunks[cx + cy * image->num_chunks_wide];
+}
+
 int imv_image_width(const struct imv_image *image)
 {
   return image->width;
@@ -166,4 +529,36 @@ int imv_image_height(const struct imv_image *image)
   return image->height;
 }
 
+void imv_image_stats(const struct imv_image *image,
+    struct imv_image_stats *stats)
+{
+  stats->pool_hits = image->pool_hits;
+  stats->pool_misses = image->pool_misses;
+
+  long long bytes = 0;
+  for (int y = 0; image->num_chunks > 0 && y < image->num_chunks_tall; ++y) {
+    for (int x = 0; x < image->num_chunks_wide; ++x) {
+      int w, h;
+      chunk_size(image, x, y, &w, &h);
+      bytes += (long long)w * h * SDL_BYTESPERPIXEL(image->chunk_format);
+    }
+  }
+  for (int i = 0; i < image->pool_len; ++i) {
+    const struct pooled_texture *entry = &image->pool[i];
+    bytes += (long long)entry->width * entry->height
+           * SDL_BYTESPERPIXEL(entry->format);
+  }
+  stats->texture_bytes = bytes;
+}
+
+double imv_image_detail(const struct imv_image *image)
+{
+  if (!image->region.w || !image->region.h) {
+    return 1;
+  }
+  const double dx = (double)image->bitmap_width / image->region.w;
+  const double dy = (double)image->bitmap_height / image->region.h;
+  return dx < dy ? dx : dy;
+}
+
 /* vim:set ts=2 sts=2 sw=2 et: */
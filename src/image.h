@@ -2,10 +2,18 @@
 #define IMV_IMAGE_H
 
 #include "bitmap.h"
+#include <stdbool.h>
 #include <SDL2/SDL.h>
 
 struct imv_image;
 
+/* Use of an image's textures */
+struct imv_image_stats {
+  unsigned long pool_hits;   /* textures reused from earlier bitmaps */
+  unsigned long pool_misses; /* textures that had to be created */
+  long long texture_bytes;   /* size of the textures held, in use or not */
+};
+
 /* Creates an instance of imv_image */
 struct imv_image *imv_image_create(SDL_Renderer *r);
 
@@ -15,15 +23,46 @@ void imv_image_free(struct imv_image *image);
 /* Updates the image to contain the data in the bitmap parameter */
 int imv_image_set_bitmap(struct imv_image *image, struct imv_bitmap *bmp);
 
+/* Set the size the image is displayed at, when it's larger than the bitmap
+ * given to imv_image_set_bitmap, e.g. a reduced resolution version of it.
+ * Reset by imv_image_set_bitmap */
+void imv_image_set_size(struct imv_image *image, int width, int height);
+
+/* Set the area of the image the bitmap covers, when it's only a region of
+ * it, in the coordinates of the size set by imv_image_set_size. Reset by
+ * imv_image_set_bitmap and imv_image_set_size */
+void imv_image_set_region(struct imv_image *image, int x, int y,
+    int width, int height);
+
+/* Whether the bitmap covers the given area of the image */
+bool imv_image_covers(const struct imv_image *image, int x, int y,
+    int width, int height);
+
 /* Draw the image at the given position with the given scale */
 void imv_image_draw(struct imv_image *image, int x, int y, double scale);
 
+/* Set the opacity the image is drawn with, from 0 to 255 */
+void imv_image_set_alpha(struct imv_image *image, unsigned char alpha);
+
+/* Whether the image, drawn at the given position and scale, completely
+ * hides the given area of the screen, so nothing need be drawn under it */
+bool imv_image_hides(struct imv_image *image, int x, int y, double scale,
+    const SDL_Rect *area);
+
 /* Get the image width */
 int imv_image_width(const struct imv_image *image);
 
 /* Get the image height */
 int imv_image_height(const struct imv_image *image);
 
+/* Get the image's texture usage so far */
+void imv_image_stats(const struct imv_image *image,
+    struct imv_image_stats *stats);
+
+/* Get how much of the image's detail the bitmap holds over the region it
+ * covers: 1 at full resolution, 0.5 at half, and so on */
+double imv_image_detail(const struct imv_image *image);
+
 #endif
 
 
@@ -1,8 +1,10 @@
 #include "imv.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -14,13 +16,25 @@
 
 #include "binds.h"
 #include "commands.h"
+#include "compare.h"
+#include "export.h"
+#include "fileops.h"
 #include "ini.h"
 #include "list.h"
+#include "metrics.h"
 #include "source.h"
 #include "backend.h"
+#include "backend_module.h"
 #include "image.h"
 #include "navigator.h"
+#include "resample.h"
+#include "sandbox.h"
+#include "session.h"
+#include "soak.h"
+#include "terminal.h"
+#include "trace.h"
 #include "viewport.h"
+#include "watchdog.h"
 #include "util.h"
 
 /* Some systems like GNU/Hurd don't define PATH_MAX */
@@ -28,6 +42,13 @@
 #define PATH_MAX 4096
 #endif
 
+/* milliseconds the view has to be still for before it's resampled */
+#define RESAMPLE_DELAY 150
+
+/* milliseconds an image has to be looked at before it's decoded again
+ * accurately */
+#define ACCURATE_DELAY 500
+
 enum scaling_mode {
   SCALING_NONE,
   SCALING_DOWN,
@@ -53,6 +74,21 @@ enum background_type {
   BACKGROUND_TYPE_COUNT
 };
 
+/* animation between one image and the next */
+enum transition_type {
+  TRANSITION_NONE,
+  TRANSITION_FADE,
+  TRANSITION_SLIDE
+};
+
+/* how carefully to decode images: quickly, accurately, or quickly and then
+ * accurately once it's being looked at closely */
+enum decode_quality {
+  DECODE_FAST,
+  DECODE_ACCURATE,
+  DECODE_AUTO
+};
+
 /* window behaviour on image change */
 enum resize_mode {
   RESIZE_NONE,  /* do nothing */
@@ -60,8 +96,29 @@ enum resize_mode {
   RESIZE_CENTER /* resize to fit the new image and recenter */
 };
 
+/* an extra window showing the same image as the main one */
+struct mirror {
+  SDL_Window *window;
+  SDL_Renderer *renderer;
+  SDL_Texture *background_image;
+  struct imv_image *image;
+  struct imv_viewport *view;
+};
+
+/* where an image is shown in the main window, to tell when the view has
+ * changed */
+struct resample_view {
+  int x, y;
+  double scale;
+  int width, height;
+};
+
+struct resample_job;
+
 struct backend_chain {
+  /* NULL until loaded if the backend is provided by a module */
   const struct imv_backend *backend;
+  struct imv_backend_module *module;
   struct backend_chain *next;
 };
 
@@ -72,6 +129,19 @@ struct imv {
   /* indicates a new image is being loaded */
   bool loading;
 
+  /* a more detailed version of the current image is being loaded */
+  bool refining;
+
+  /* how carefully to decode, whether the current image has been asked to
+   * be decoded accurately, and the GetTicks() time it was first shown */
+  enum decode_quality decode_quality;
+  bool accurate;
+  unsigned int shown_time;
+
+  /* area of the image last hinted to a source that can load regions, which
+   * its next bitmap will cover */
+  struct { int x, y, width, height; } load_region;
+
   /* fullscreen state */
   bool fullscreen;
 
@@ -79,6 +149,16 @@ struct imv {
   int initial_width;
   int initial_height;
 
+  /* number of windows to show the image in, each on its own display where
+   * there are enough. All but the main window are mirrors of it */
+  int num_outputs;
+  struct mirror *mirrors;
+
+  /* show images in the terminal imv was run from instead of a window,
+   * using the given protocol */
+  bool terminal_mode;
+  enum imv_terminal_protocol terminal_protocol;
+
   /* display some textual info onscreen */
   bool overlay_enabled;
 
@@ -116,6 +196,20 @@ struct imv {
   /* the aforementioned background colour */
   struct { unsigned char r, g, b; } background_color;
 
+  /* transition from one image to the next, and its length in milliseconds */
+  enum transition_type transition;
+  unsigned int transition_duration;
+  /* GetTicks() time the current transition began, 0 if there isn't one */
+  unsigned int transition_start;
+  /* the outgoing image during a transition, and where it was shown. Kept
+   * afterwards to reuse its textures for the next image */
+  struct imv_image *prev_image;
+  int prev_x;
+  int prev_y;
+  double prev_scale;
+  /* milliseconds between the display's refreshes */
+  unsigned int frame_interval;
+
   /* slideshow state tracking */
   unsigned long slideshow_image_duration;
   unsigned long slideshow_time_elapsed;
@@ -126,6 +220,76 @@ struct imv {
   int next_frame_duration;
   /* the next frame of an animated image, pre-fetched */
   struct imv_bitmap *next_frame;
+  int next_frame_index;
+
+  /* index of the frame of an animated image being displayed, and of the
+   * frame being sought to, or -1 */
+  int current_frame;
+  int seek_target;
+
+  /* run the backends in separate processes, keeping this many ready */
+  bool sandboxed;
+  int sandbox_workers;
+
+  /* path of the image shown before the current one, compared against by
+   * default */
+  char *previous_path;
+
+  /* showing how another image differs in place of the current one, and the
+   * statistics for $imv_compare */
+  bool comparing;
+  char compare_text[128];
+  /* a copy of the image's own bitmap to go back to, and the area of the
+   * image it covers */
+  struct imv_bitmap *compare_bitmap;
+  struct { int x, y, width, height; } compare_region;
+
+  /* once the view has been still for a moment, the visible area of a
+   * downscaled image is resampled with a better filter than the renderer's
+   * and drawn in its place. The bitmap shown is kept for this, or once an
+   * export has been asked for, along with the area of the image it covers.
+   * Otherwise it's freed once uploaded */
+  bool resample;
+  bool keep_bitmap;
+  struct imv_bitmap *bitmap;
+  struct { int x, y, width, height; } bitmap_region;
+  /* the bitmap, or part of it, last shared with other processes */
+  struct imv_export *export;
+  /* the resampled area, the view it was last made or tried for, and the
+   * resample in progress, if any */
+  struct imv_image *sharp;
+  bool sharp_valid;
+  struct resample_view sharp_view;
+  struct resample_job *resample_job;
+  /* the view as last seen, and the GetTicks() time it last changed */
+  struct resample_view idle_view;
+  unsigned int idle_since;
+
+  /* outcome of the last file operations, for $imv_fileops, and the
+   * GetTicks() time it came in. Cleared after a few seconds */
+  char fileops_text[128];
+  unsigned int fileops_time;
+
+  /* soak testing: where to log resource usage, how often, and for how long
+   * in milliseconds. Disabled when soak_log is NULL */
+  char *soak_log;
+  unsigned long soak_interval;
+  unsigned long soak_duration;
+
+  /* metrics export: the file to write them to and how often, in
+   * milliseconds. Disabled when metrics_file is NULL */
+  char *metrics_file;
+  unsigned long metrics_interval;
+
+  /* stall detection: how long an iteration of the main loop may take, in
+   * milliseconds, and whether to print a backtrace when one takes longer.
+   * Disabled when stall_threshold is 0 */
+  unsigned long stall_threshold;
+  bool stall_backtrace;
+
+  /* when the image being loaded was asked for, by
+   * SDL_GetPerformanceCounter(), or 0 if none is */
+  Uint64 load_start;
 
   /* overlay font name */
   char *font_name;
@@ -154,6 +318,13 @@ struct imv {
   struct imv_commands *commands;
   struct imv_image *image;
   struct imv_viewport *view;
+  struct imv_soak *soak;
+  struct imv_metrics *metrics;
+  struct imv_watchdog *watchdog;
+  struct imv_terminal *terminal;
+  struct imv_session *session;
+  struct imv_sandbox *sandbox;
+  struct imv_fileops *fileops;
 
   /* if reading an image from stdin, this is the buffer for it */
   void *stdin_image_data;
@@ -171,6 +342,12 @@ struct imv {
     unsigned int BAD_IMAGE;
     unsigned int NEW_PATH;
     unsigned int ENABLE_INPUT;
+    unsigned int COMPARE;
+    unsigned int FILEOPS;
+    unsigned int RESAMPLED;
+    unsigned int TERMINAL;
+    unsigned int LOAD_SKIPPED;
+    unsigned int SEEK_SKIPPED;
   } events;
   struct {
     int width;
@@ -191,14 +368,35 @@ void command_exec(struct list *args, const char *argstr, void *data);
 void command_center(struct list *args, const char *argstr, void *data);
 void command_reset(struct list *args, const char *argstr, void *data);
 void command_next_frame(struct list *args, const char *argstr, void *data);
+void command_prev_frame(struct list *args, const char *argstr, void *data);
+void command_goto_frame(struct list *args, const char *argstr, void *data);
 void command_toggle_playing(struct list *args, const char *argstr, void *data);
 void command_set_scaling_mode(struct list *args, const char *argstr, void *data);
 void command_set_slideshow_duration(struct list *args, const char *argstr, void *data);
+void command_compare(struct list *args, const char *argstr, void *data);
+void command_copy(struct list *args, const char *argstr, void *data);
+void command_move(struct list *args, const char *argstr, void *data);
+void command_trash(struct list *args, const char *argstr, void *data);
+void command_export(struct list *args, const char *argstr, void *data);
 
 static bool setup_window(struct imv *imv);
+static bool setup_mirrors(struct imv *imv);
+static void rescale_view(struct imv *imv, SDL_Window *window,
+    struct imv_viewport *view, struct imv_image *image);
 static void handle_event(struct imv *imv, SDL_Event *event);
+static void terminal_callback(void *data);
+static unsigned int replay_session(struct imv *imv);
+static void hint_initial_scale(struct imv *imv);
+static void update_detail(struct imv *imv);
+static unsigned int update_resample(struct imv *imv, unsigned int now);
+static unsigned int update_quality(struct imv *imv, unsigned int now);
 static void render_window(struct imv *imv);
+static void render_mirror(struct imv *imv, struct mirror *mirror);
+static void present_terminal(struct imv *imv);
+static void set_image_bitmap(struct imv *imv, struct imv_bitmap *bitmap);
+static void drop_bitmap(struct imv *imv);
 static void update_env_vars(struct imv *imv);
+static void write_metrics(struct imv *imv, unsigned int now);
 static size_t generate_env_text(struct imv *imv, char *buf, size_t len, const char *format);
 
 
@@ -303,12 +501,71 @@ static void async_free_source(struct imv_source *src)
   SDL_DetachThread(thread);
 }
 
-static void async_load_first_frame(struct imv_source *src)
+struct load_request {
+  struct imv *imv;
+  struct imv_source *src;
+};
+
+static int async_load_first_frame_thread(void *raw)
+{
+  struct load_request *req = raw;
+  if (req->src->load_first_frame(req->src) < 0) {
+    /* nothing may come back, so say so rather than leave imv waiting */
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = req->imv->events.LOAD_SKIPPED;
+    event.user.data1 = req->src;
+    SDL_PushEvent(&event);
+  }
+  free(req);
+  return 0;
+}
+
+static void async_load_first_frame(struct imv *imv, struct imv_source *src)
 {
-  typedef int (*thread_func)(void*);
-  SDL_Thread *thread = SDL_CreateThread((thread_func)src->load_first_frame,
-      "async_load_first_frame",
-      src);
+  imv->load_start = SDL_GetPerformanceCounter();
+  IMV_TRACE1(decode_start, src->name);
+  struct load_request *req = malloc(sizeof *req);
+  req->imv = imv;
+  req->src = src;
+  SDL_Thread *thread = SDL_CreateThread(async_load_first_frame_thread,
+      "async_load_first_frame", req);
+  SDL_DetachThread(thread);
+}
+
+struct seek_request {
+  struct imv *imv;
+  struct imv_source *src;
+  int frame;
+};
+
+static int async_seek_frame_thread(void *raw)
+{
+  struct seek_request *req = raw;
+  if (req->src->seek_frame(req->src, req->frame)) {
+    /* the source was busy, or failed and has said so. Give a load in
+     * progress a moment to finish, then let imv decide whether to try again,
+     * as the source may be freed by then */
+    SDL_Delay(5);
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = req->imv->events.SEEK_SKIPPED;
+    event.user.data1 = req->src;
+    SDL_PushEvent(&event);
+  }
+  free(req);
+  return 0;
+}
+
+static void async_seek_frame(struct imv *imv, struct imv_source *src,
+    int frame)
+{
+  struct seek_request *req = malloc(sizeof *req);
+  req->imv = imv;
+  req->src = src;
+  req->frame = frame;
+  SDL_Thread *thread = SDL_CreateThread(async_seek_frame_thread,
+      "async_seek_frame", req);
   SDL_DetachThread(thread);
 }
 
@@ -321,6 +578,130 @@ static void async_load_next_frame(struct imv_source *src)
   SDL_DetachThread(thread);
 }
 
+/* Comparison of the image being shown with another, loaded afresh at full
+ * resolution on a thread of its own */
+struct compare_job {
+  struct imv *imv;
+  /* the source being shown when the comparison was asked for. The result is
+   * dropped if it's been moved on from */
+  struct imv_source *current;
+  struct imv_source *sources[2];
+  struct imv_bitmap *bitmaps[2];
+  int num_loaded;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* the result, heatmap is NULL on failure. original is the current image
+   * as it was decoded for it, to go back to if imv hasn't kept its own */
+  struct imv_bitmap *heatmap;
+  struct imv_bitmap *original;
+  struct imv_compare_stats stats;
+};
+
+static void compare_source_callback(struct imv_source_message *msg)
+{
+  struct compare_job *job = msg->user_data;
+  pthread_mutex_lock(&job->lock);
+  job->bitmaps[msg->source == job->sources[1]] = msg->bitmap;
+  job->num_loaded++;
+  pthread_cond_signal(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static int compare_thread(void *raw)
+{
+  struct compare_job *job = raw;
+
+  for (int i = 0; i < 2; ++i) {
+    struct imv_source *src = job->sources[i];
+    const bool started = !src->load_first_frame(src);
+    pthread_mutex_lock(&job->lock);
+    if (!started) {
+      job->num_loaded++;
+    }
+    while (job->num_loaded <= i) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+    src->free(src);
+  }
+
+  if (job->bitmaps[0] && job->bitmaps[1]) {
+    job->heatmap = imv_compare(job->bitmaps[0], job->bitmaps[1], &job->stats);
+  }
+  if (job->heatmap) {
+    job->original = job->bitmaps[0];
+    job->bitmaps[0] = NULL;
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (job->bitmaps[i]) {
+      imv_bitmap_free(job->bitmaps[i]);
+    }
+  }
+
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = job->imv->events.COMPARE;
+  event.user.data1 = job;
+  SDL_PushEvent(&event);
+  return 0;
+}
+
+static void fileops_callback(struct imv_fileops_result *result, void *data)
+{
+  struct imv *imv = data;
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = imv->events.FILEOPS;
+  event.user.data1 = result;
+  SDL_PushEvent(&event);
+}
+
+/* resampling the visible area of the bitmap being shown */
+struct resample_job {
+  unsigned int event_type;
+  /* the bitmap shown when it started. If that's replaced in the meantime the
+   * job is cancelled and takes it over, to free once it's finished */
+  struct imv_bitmap *bitmap;
+  bool owns_bitmap;
+  bool cancelled;
+  pthread_mutex_t lock;
+
+  /* the area of the bitmap to resample, and the area of the image it shows
+   * in the view it's for */
+  double bx, by, bw, bh;
+  int x, y, width, height;
+  struct resample_view view;
+  int out_width;
+  int out_height;
+
+  /* NULL if cancelled, or if it failed */
+  struct imv_bitmap *result;
+};
+
+static bool resample_cancelled(void *data)
+{
+  struct resample_job *job = data;
+  pthread_mutex_lock(&job->lock);
+  const bool cancelled = job->cancelled;
+  pthread_mutex_unlock(&job->lock);
+  return cancelled;
+}
+
+static int resample_thread(void *raw)
+{
+  struct resample_job *job = raw;
+  job->result = imv_resample(job->bitmap, job->bx, job->by, job->bw, job->bh,
+      job->out_width, job->out_height, &resample_cancelled, job);
+
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = job->event_type;
+  event.user.data1 = job;
+  SDL_PushEvent(&event);
+  return 0;
+}
+
 static void source_callback(struct imv_source_message *msg)
 {
   struct imv *imv = msg->user_data;
@@ -344,10 +725,10 @@ static void source_callback(struct imv_source_message *msg)
 
     /* Keep track of the last source to send us a bitmap in order to detect
      * when we're getting a new image, as opposed to a new frame from the
-     * same image.
+     * same image. That's packed into data2 along with the frame's index.
      */
     uintptr_t is_new_image = msg->source != imv->last_source;
-    event.user.data2 = (void*)is_new_image;
+    event.user.data2 = (void*)(is_new_image | (uintptr_t)msg->frame << 1);
     imv->last_source = msg->source;
   } else {
     event.type = imv->events.BAD_IMAGE;
@@ -367,6 +748,15 @@ struct imv *imv_create(void)
   imv->need_rescale = true;
   imv->scaling_mode = SCALING_FULL;
   imv->loop_input = true;
+  imv->soak_interval = 10000;
+  imv->metrics_interval = 15000;
+  imv->sandbox_workers = 2;
+  imv->resample = true;
+  imv->decode_quality = DECODE_AUTO;
+  imv->num_outputs = 1;
+  imv->transition_duration = 500;
+  imv->frame_interval = 16;
+  imv->seek_target = -1;
   imv->font_name = strdup("Monospace:24");
   imv->binds = imv_binds_create();
   imv->navigator = imv_navigator_create();
@@ -379,7 +769,7 @@ struct imv *imv_create(void)
   imv->overlay_text = strdup(
       "[${imv_current_index}/${imv_file_count}]"
       " [${imv_width}x${imv_height}] [${imv_scale}%]"
-      " $imv_current_file [$imv_scaling_mode]"
+      " $imv_current_file [$imv_scaling_mode] $imv_compare $imv_fileops"
   );
 
   imv_command_register(imv->commands, "quit", &command_quit);
@@ -395,9 +785,16 @@ struct imv *imv_create(void)
   imv_command_register(imv->commands, "center", &command_center);
   imv_command_register(imv->commands, "reset", &command_reset);
   imv_command_register(imv->commands, "next_frame", &command_next_frame);
+  imv_command_register(imv->commands, "prev_frame", &command_prev_frame);
+  imv_command_register(imv->commands, "goto_frame", &command_goto_frame);
   imv_command_register(imv->commands, "toggle_playing", &command_toggle_playing);
   imv_command_register(imv->commands, "scaling_mode", &command_set_scaling_mode);
   imv_command_register(imv->commands, "slideshow_duration", &command_set_slideshow_duration);
+  imv_command_register(imv->commands, "compare", &command_compare);
+  imv_command_register(imv->commands, "copy", &command_copy);
+  imv_command_register(imv->commands, "move", &command_move);
+  imv_command_register(imv->commands, "trash", &command_trash);
+  imv_command_register(imv->commands, "export", &command_export);
 
   add_bind(imv, "q", "quit");
   add_bind(imv, "<Left>", "select_rel -1");
@@ -426,6 +823,7 @@ struct imv *imv_create(void)
   add_bind(imv, "a", "zoom actual");
   add_bind(imv, "r", "reset");
   add_bind(imv, ".", "next_frame");
+  add_bind(imv, ",", "prev_frame");
   add_bind(imv, "<Space>", "toggle_playing");
   add_bind(imv, "t", "slideshow_duration +1");
   add_bind(imv, "<Shift+t>", "slideshow_duration -1");
@@ -435,19 +833,45 @@ struct imv *imv_create(void)
 
 void imv_free(struct imv *imv)
 {
+  /* first, as the main loop may have been left mid-iteration, and shutting
+   * down isn't a stall */
+  imv_watchdog_free(imv->watchdog);
   free(imv->font_name);
   free(imv->title_text);
   free(imv->overlay_text);
+  free(imv->soak_log);
+  free(imv->previous_path);
+  imv_fileops_free(imv->fileops);
+  imv_export_free(imv->export);
+  imv_soak_free(imv->soak);
+  if (imv->metrics) {
+    write_metrics(imv, SDL_GetTicks());
+    imv_metrics_free(imv->metrics);
+  }
+  free(imv->metrics_file);
+  imv_session_free(imv->session);
+  imv_terminal_free(imv->terminal);
   imv_binds_free(imv->binds);
   imv_navigator_free(imv->navigator);
   if (imv->source) {
     imv->source->free(imv->source);
   }
+  imv_sandbox_free(imv->sandbox);
   imv_commands_free(imv->commands);
   imv_viewport_free(imv->view);
   if (imv->image) {
     imv_image_free(imv->image);
   }
+  if (imv->prev_image) {
+    imv_image_free(imv->prev_image);
+  }
+  if (imv->compare_bitmap) {
+    imv_bitmap_free(imv->compare_bitmap);
+  }
+  if (imv->sharp) {
+    imv_image_free(imv->sharp);
+  }
+  drop_bitmap(imv);
   if (imv->next_frame) {
     imv_bitmap_free(imv->next_frame);
   }
@@ -457,6 +881,23 @@ void imv_free(struct imv *imv)
   if(imv->input_buffer) {
     free(imv->input_buffer);
   }
+  if(imv->mirrors) {
+    for(int i = 0; i < imv->num_outputs - 1; ++i) {
+      struct mirror *mirror = &imv->mirrors[i];
+      imv_viewport_free(mirror->view);
+      imv_image_free(mirror->image);
+      if(mirror->background_image) {
+        SDL_DestroyTexture(mirror->background_image);
+      }
+      if(mirror->renderer) {
+        SDL_DestroyRenderer(mirror->renderer);
+      }
+      if(mirror->window) {
+        SDL_DestroyWindow(mirror->window);
+      }
+    }
+    free(imv->mirrors);
+  }
   if(imv->renderer) {
     SDL_DestroyRenderer(imv->renderer);
   }
@@ -482,10 +923,142 @@ void imv_install_backend(struct imv *imv, const struct imv_backend *backend)
 {
   struct backend_chain *chain = malloc(sizeof *chain);
   chain->backend = backend;
+  chain->module = NULL;
+  chain->next = imv->backends;
+  imv->backends = chain;
+}
+
+void imv_install_backend_module(struct imv *imv, const char *name)
+{
+  struct imv_backend_module *module = imv_backend_module_find(name);
+  if (!module) {
+    fprintf(stderr, "Unknown backend module: %s\n", name);
+    return;
+  }
+
+  struct backend_chain *chain = malloc(sizeof *chain);
+  chain->backend = NULL;
+  chain->module = module;
   chain->next = imv->backends;
   imv->backends = chain;
 }
 
+/* Resolve a chain entry to its backend, loading its module if needed. Modules
+ * are only loaded if the data given may be supported by them. */
+static const struct imv_backend *chain_backend(struct backend_chain *chain,
+    const void *header, size_t header_len)
+{
+  if (!chain->backend && chain->module
+      && imv_backend_module_probe(chain->module, header, header_len)) {
+    chain->backend = imv_backend_module_load(chain->module);
+  }
+  return chain->backend;
+}
+
+/* Read the start of a file for probing backend modules */
+static size_t read_header(const char *path, void *buf, size_t len)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t ret = read(fd, buf, len);
+  close(fd);
+  return ret > 0 ? (size_t)ret : 0;
+}
+
+/* Open an image with the first backend that supports it, from path, or from
+ * data when it isn't NULL. Also called in decoder processes when sandboxed */
+static enum backend_result open_source(void *raw, const char *path,
+    void *data, size_t len, struct imv_source **src)
+{
+  struct imv *imv = raw;
+  enum backend_result result = BACKEND_UNSUPPORTED;
+
+  if (!imv->backends) {
+    fprintf(stderr, "No backends installed. Unable to load image.\n");
+  }
+
+  /* the start of the file, read on demand to decide which backend
+   * modules are worth loading */
+  unsigned char header_buf[512];
+  const void *header = NULL;
+  size_t header_len = 0;
+
+  for (struct backend_chain *chain = imv->backends; chain; chain = chain->next) {
+    if (!chain->backend && !header) {
+      if (data) {
+        header = data;
+        header_len = len;
+      } else {
+        header = header_buf;
+        header_len = read_header(path, header_buf, sizeof header_buf);
+      }
+    }
+
+    const struct imv_backend *backend = chain_backend(chain, header, header_len);
+    if (!backend) {
+      /* module not needed for this file, or failed to load */
+      continue;
+    }
+
+    if (data) {
+
+      if (!backend->open_memory) {
+        /* memory loading unsupported by backend */
+        continue;
+      }
+
+      result = backend->open_memory(data, len, src);
+    } else {
+
+      if (!backend->open_path) {
+        /* path loading unsupported by backend */
+        continue;
+      }
+
+      result = backend->open_path(path, src);
+    }
+    if (result == BACKEND_UNSUPPORTED) {
+      /* Try the next backend */
+      continue;
+    } else {
+      if (result == BACKEND_SUCCESS) {
+        (*src)->backend = backend->name;
+      }
+      break;
+    }
+  }
+
+  return result;
+}
+
+/* Open an image from a path, or stdin if it's "-", in a decoder process if
+ * sandboxed */
+static enum backend_result open_image(struct imv *imv, const char *path,
+    struct imv_source **src)
+{
+  IMV_TRACE1(open, path);
+
+  enum backend_result result;
+  const bool path_is_stdin = !strcmp("-", path);
+  if (imv->sandbox && path_is_stdin) {
+    result = imv_sandbox_open_memory(imv->sandbox, imv->stdin_image_data,
+        imv->stdin_image_data_len, src);
+  } else if (imv->sandbox) {
+    result = imv_sandbox_open_path(imv->sandbox, path, src);
+  } else if (path_is_stdin) {
+    result = open_source(imv, NULL, imv->stdin_image_data,
+        imv->stdin_image_data_len, src);
+  } else {
+    result = open_source(imv, path, NULL, 0, src);
+  }
+
+  IMV_TRACE3(open_done, path, (int)result,
+      result == BACKEND_SUCCESS ? (*src)->backend : NULL);
+  return result;
+}
+
 static bool parse_bg(struct imv *imv, const char *bg)
 {
   if(strcmp("checks", bg) == 0) {
@@ -566,6 +1139,46 @@ static bool parse_upscaling_method(struct imv *imv, const char *method)
   return false;
 }
 
+static bool parse_transition(struct imv *imv, const char *transition)
+{
+  if (!strcmp(transition, "none")) {
+    imv->transition = TRANSITION_NONE;
+    return true;
+  }
+
+  if (!strcmp(transition, "fade")) {
+    imv->transition = TRANSITION_FADE;
+    return true;
+  }
+
+  if (!strcmp(transition, "slide")) {
+    imv->transition = TRANSITION_SLIDE;
+    return true;
+  }
+
+  return false;
+}
+
+static bool parse_decode_quality(struct imv *imv, const char *quality)
+{
+  if (!strcmp(quality, "fast")) {
+    imv->decode_quality = DECODE_FAST;
+    return true;
+  }
+
+  if (!strcmp(quality, "accurate")) {
+    imv->decode_quality = DECODE_ACCURATE;
+    return true;
+  }
+
+  if (!strcmp(quality, "auto")) {
+    imv->decode_quality = DECODE_AUTO;
+    return true;
+  }
+
+  return false;
+}
+
 static bool parse_resizing_mode(struct imv *imv, const char *method)
 {
   if (!strcmp(method, "none")) {
@@ -586,6 +1199,34 @@ static bool parse_resizing_mode(struct imv *imv, const char *method)
   return false;
 }
 
+static bool parse_terminal(struct imv *imv, const char *protocol)
+{
+  if (!strcmp(protocol, "none")) {
+    imv->terminal_mode = false;
+    return true;
+  }
+
+  if (!strcmp(protocol, "auto")) {
+    imv->terminal_mode = true;
+    imv->terminal_protocol = imv_terminal_detect();
+    return true;
+  }
+
+  if (!strcmp(protocol, "kitty")) {
+    imv->terminal_mode = true;
+    imv->terminal_protocol = IMV_TERMINAL_KITTY;
+    return true;
+  }
+
+  if (!strcmp(protocol, "sixel")) {
+    imv->terminal_mode = true;
+    imv->terminal_protocol = IMV_TERMINAL_SIXEL;
+    return true;
+  }
+
+  return false;
+}
+
 static int load_paths_from_stdin(void *data)
 {
   struct imv *imv = data;
@@ -618,6 +1259,14 @@ static void print_help(struct imv *imv)
   for (struct backend_chain *chain = imv->backends;
        chain;
        chain = chain->next) {
+    if (chain->module && !chain->backend) {
+      chain->backend = imv_backend_module_load(chain->module);
+    }
+    if (!chain->backend) {
+      printf("Name: %s (module failed to load)\n\n",
+             imv_backend_module_name(chain->module));
+      continue;
+    }
     printf("Name: %s\n"
            "Description: %s\n"
            "Website: %s\n"
@@ -639,12 +1288,26 @@ static void print_help(struct imv *imv)
 
 bool imv_parse_args(struct imv *imv, int argc, char **argv)
 {
+  /* a replayed session brings the arguments it was recorded with */
+  if(imv->session && imv_session_is_replay(imv->session)) {
+    if(argc > 1) {
+      fprintf(stderr, "Ignoring arguments while replaying a session.\n");
+    }
+    struct list *args = imv_session_args(imv->session);
+    argc = args->len;
+    argv = (char**)args->items;
+  } else if(imv->session) {
+    for(int i = 1; i < argc; ++i) {
+      imv_session_add_arg(imv->session, argv[i]);
+    }
+  }
+
   /* Do not print getopt errors */
   opterr = 0;
 
   int o;
 
-  while((o = getopt(argc, argv, "frdwWxhlu:s:n:b:t:")) != -1) {
+  while((o = getopt(argc, argv, "frdwWxhlu:s:n:b:t:T:")) != -1) {
     switch(o) {
       case 'f': imv->fullscreen = true;                          break;
       case 'r': imv->recursive_load = true;                      break;
@@ -682,6 +1345,12 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
           return false;
         }
         break;
+      case 'T':
+        if(!parse_terminal(imv, optarg)) {
+          fprintf(stderr, "Invalid terminal protocol. Aborting.\n");
+          return false;
+        }
+        break;
       case '?':
         fprintf(stderr, "Unknown argument '%c'. Aborting.\n", optopt);
         return false;
@@ -730,12 +1399,23 @@ int imv_run(struct imv *imv)
   if(imv->quit)
     return 0;
 
+  /* decoder processes are forked from one started before there are any
+   * other threads or windows */
+  if(imv->sandboxed) {
+    imv->sandbox = imv_sandbox_create(imv->sandbox_workers, &open_source, imv);
+    if(!imv->sandbox) {
+      fprintf(stderr, "Unable to start decoder processes. Aborting.\n");
+      return 1;
+    }
+  }
+
   if(!setup_window(imv))
     return 1;
 
   /* if loading paths from stdin, kick off a thread to do that - we'll receive
    * events back via SDL */
-  if(imv->paths_from_stdin) {
+  if(imv->paths_from_stdin
+      && !(imv->session && imv_session_is_replay(imv->session))) {
     SDL_Thread *thread;
     thread = SDL_CreateThread(load_paths_from_stdin, "load_paths_from_stdin", imv);
     SDL_DetachThread(thread);
@@ -758,6 +1438,37 @@ int imv_run(struct imv *imv)
     }
   }
 
+  /* soak testing cycles through the images indefinitely, using the slideshow
+   * to drive navigation */
+  if(imv->soak_log) {
+    imv->soak = imv_soak_create(imv->soak_log, imv->soak_interval,
+        imv->soak_duration);
+    if(!imv->soak) {
+      fprintf(stderr, "Unable to open soak log: %s\n", imv->soak_log);
+      return 1;
+    }
+    imv->loop_input = true;
+    if(imv->slideshow_image_duration == 0) {
+      imv->slideshow_image_duration = 1000;
+    }
+  }
+
+  if(imv->metrics_file) {
+    imv->metrics = imv_metrics_create(imv->metrics_file, imv->metrics_interval);
+    if(!imv->metrics) {
+      fprintf(stderr, "Unable to write metrics to: %s\n", imv->metrics_file);
+      return 1;
+    }
+  }
+
+  if(imv->stall_threshold) {
+    imv->watchdog = imv_watchdog_create(imv->stall_threshold,
+        imv->stall_backtrace);
+    if(!imv->watchdog) {
+      fprintf(stderr, "Unable to start stall detection.\n");
+    }
+  }
+
   /* cache current image's dimensions */
   imv->current_image.width = 0;
   imv->current_image.height = 0;
@@ -765,21 +1476,42 @@ int imv_run(struct imv *imv)
   /* time keeping */
   unsigned int last_time = SDL_GetTicks();
   unsigned int current_time;
+  if(imv->session) {
+    imv_session_start(imv->session);
+  }
 
   while(!imv->quit) {
 
+    if(imv->watchdog) {
+      imv_watchdog_begin(imv->watchdog);
+    }
+
     SDL_Event e;
     while(!imv->quit && SDL_PollEvent(&e)) {
-      handle_event(imv, &e);
+      if(!imv->session || imv_session_filter_event(imv->session, &e)) {
+        handle_event(imv, &e);
+      }
+    }
+
+    /* feed in a replayed session's input at the times it was recorded */
+    unsigned int replay_wait = 0;
+    if(imv->session && imv_session_is_replay(imv->session)) {
+      replay_wait = replay_session(imv);
     }
 
     /* if we're quitting, don't bother drawing any more images */
     if(imv->quit) {
+      if(imv->watchdog) {
+        imv_watchdog_end(imv->watchdog);
+      }
       break;
     }
 
     /* Check if navigator wrapped around paths lists */
     if(!imv->loop_input && imv_navigator_wrapped(imv->navigator)) {
+      if(imv->watchdog) {
+        imv_watchdog_end(imv->watchdog);
+      }
       break;
     }
 
@@ -787,9 +1519,16 @@ int imv_run(struct imv *imv)
     if(!imv->paths_from_stdin && imv_navigator_length(imv->navigator) == 0) {
       fprintf(stderr, "No input files left. Exiting.\n");
       imv->quit = true;
+      if(imv->watchdog) {
+        imv_watchdog_end(imv->watchdog);
+      }
       continue;
     }
 
+    if(imv->watchdog) {
+      imv_watchdog_stage(imv->watchdog, IMV_STAGE_NAVIGATION);
+    }
+
     /* If the user has changed image, start loading the new one. It's possible
      * that there are lots of unsupported files listed back to back, so we
      * may immediate close one and navigate onto the next. So we attempt to
@@ -797,55 +1536,37 @@ int imv_run(struct imv *imv)
      */
     while (imv_navigator_poll_changed(imv->navigator)) {
       const char *current_path = imv_navigator_selection(imv->navigator);
+      IMV_TRACE2(navigate, (long)imv_navigator_index(imv->navigator),
+          current_path);
       /* check we got a path back */
       if(strcmp("", current_path)) {
 
-        const bool path_is_stdin = !strcmp("-", current_path);
-        struct imv_source *new_source;
-
-        enum backend_result result = BACKEND_UNSUPPORTED;
-
-        if (!imv->backends) {
-          fprintf(stderr, "No backends installed. Unable to load image.\n");
+        if(imv->watchdog) {
+          imv_watchdog_set_image(imv->watchdog, current_path);
         }
-        for (struct backend_chain *chain = imv->backends; chain; chain = chain->next) {
-          const struct imv_backend *backend = chain->backend;
-          if (path_is_stdin) {
-
-            if (!backend->open_memory) {
-              /* memory loading unsupported by backend */
-              continue;
-            }
 
-            result = backend->open_memory(imv->stdin_image_data,
-                imv->stdin_image_data_len, &new_source);
-          } else {
-
-            if (!backend->open_path) {
-              /* path loading unsupported by backend */
-              continue;
-            }
-
-            result = backend->open_path(current_path, &new_source);
-          }
-          if (result == BACKEND_UNSUPPORTED) {
-            /* Try the next backend */
-            continue;
-          } else {
-            break;
-          }
-        }
+        struct imv_source *new_source;
+        enum backend_result result = open_image(imv, current_path, &new_source);
 
         if (result == BACKEND_SUCCESS) {
           if (imv->source) {
+            free(imv->previous_path);
+            imv->previous_path = strdup(imv->source->name);
             async_free_source(imv->source);
           }
           imv->source = new_source;
           imv->source->callback = &source_callback;
           imv->source->user_data = imv;
-          async_load_first_frame(imv->source);
+          hint_initial_scale(imv);
+          imv->accurate = imv->decode_quality == DECODE_ACCURATE;
+          if (imv->source->set_quality_hint) {
+            imv->source->set_quality_hint(imv->source, imv->accurate
+                ? IMV_QUALITY_ACCURATE : IMV_QUALITY_FAST);
+          }
+          async_load_first_frame(imv, imv->source);
 
           imv->loading = true;
+          imv->refining = false;
           imv_viewport_set_playing(imv->view, true);
 
           char title[1024];
@@ -858,43 +1579,75 @@ int imv_run(struct imv *imv)
       }
     }
 
-    if(imv->need_rescale) {
-      int ww, wh;
-      SDL_GetWindowSize(imv->window, &ww, &wh);
+    if(imv->watchdog) {
+      imv_watchdog_stage(imv->watchdog, IMV_STAGE_UPDATE);
+    }
 
+    if(imv->need_rescale) {
       imv->need_rescale = false;
-      if(imv->scaling_mode == SCALING_NONE ||
-          (imv->scaling_mode == SCALING_DOWN
-           && ww > imv->current_image.width
-           && wh > imv->current_image.height)) {
-        imv_viewport_scale_to_actual(imv->view, imv->image);
-      } else {
-        imv_viewport_scale_to_window(imv->view, imv->image);
-      }
+      rescale_view(imv, imv->window, imv->view, imv->image);
     }
 
-    current_time = SDL_GetTicks();
+    if (imv->source && imv->source->set_scale_hint
+        && !imv->loading && !imv->refining && !imv->comparing) {
+      update_detail(imv);
+    }
 
-    /* Check if a new frame is due */
-    if (imv_viewport_is_playing(imv->view) && imv->next_frame
-        && imv->next_frame_due && imv->next_frame_due <= current_time) {
-      imv_image_set_bitmap(imv->image, imv->next_frame);
-      imv->current_image.width = imv->next_frame->width;
-      imv->current_image.height = imv->next_frame->height;
-      imv_bitmap_free(imv->next_frame);
-      imv->next_frame = NULL;
-      imv->next_frame_due = current_time + imv->next_frame_duration;
-      imv->next_frame_duration = 0;
+    current_time = SDL_GetTicks();
 
-      imv->need_redraw = true;
+    const unsigned int resample_wait = update_resample(imv, current_time);
+    const unsigned int quality_wait = update_quality(imv, current_time);
 
-      /* Trigger loading of a new frame, now this one's being displayed */
-      if (imv->source && imv->source->load_next_frame) {
-        async_load_next_frame(imv->source);
+    if(imv->soak && imv_soak_update(imv->soak, current_time)) {
+      imv->quit = true;
+      if(imv->watchdog) {
+        imv_watchdog_end(imv->watchdog);
       }
+      break;
     }
 
-    /* handle slideshow */
+    if(imv->metrics && imv_metrics_due(imv->metrics, current_time)) {
+      write_metrics(imv, current_time);
+    }
+
+    /* file operations are only reported for a while */
+    if (imv->fileops_text[0] && current_time - imv->fileops_time > 3000) {
+      imv->fileops_text[0] = '\0';
+      imv->need_redraw = true;
+    }
+
+    /* keep animating a transition between images */
+    if (imv->transition_start) {
+      imv->need_redraw = true;
+    }
+
+    /* Check if a new frame is due */
+    if (imv_viewport_is_playing(imv->view) && imv->next_frame
+        && imv->next_frame_due && imv->next_frame_due <= current_time) {
+      set_image_bitmap(imv, imv->next_frame);
+      imv->next_frame = NULL;
+      imv->current_frame = imv->next_frame_index;
+      if(imv->metrics) {
+        /* each whole frame's time it's shown late by is a frame missed */
+        const unsigned int late = current_time - imv->next_frame_due;
+        imv_metrics_frame_shown(imv->metrics, imv->next_frame_duration > 0
+            ? late / imv->next_frame_duration : 0);
+      }
+      imv->next_frame_due = current_time + imv->next_frame_duration;
+      imv->next_frame_duration = 0;
+
+      imv->need_redraw = true;
+      if(imv->soak) {
+        imv_soak_frame_shown(imv->soak);
+      }
+
+      /* Trigger loading of a new frame, now this one's being displayed */
+      if (imv->source && imv->source->load_next_frame) {
+        async_load_next_frame(imv->source);
+      }
+    }
+
+    /* handle slideshow */
     if(imv->slideshow_image_duration != 0) {
       unsigned int dt = current_time - last_time;
 
@@ -913,9 +1666,44 @@ int imv_run(struct imv *imv)
       imv->need_redraw = true;
     }
 
+    for(int i = 0; i < imv->num_outputs - 1; ++i) {
+      struct mirror *mirror = &imv->mirrors[i];
+      if(imv->need_redraw || imv_viewport_needs_redraw(mirror->view)) {
+        if(imv->watchdog) {
+          imv_watchdog_stage(imv->watchdog, IMV_STAGE_RENDER);
+        }
+        render_mirror(imv, mirror);
+        if(imv->watchdog) {
+          imv_watchdog_stage(imv->watchdog, IMV_STAGE_PRESENT);
+        }
+        SDL_RenderPresent(mirror->renderer);
+      }
+    }
+
     if(imv->need_redraw) {
+      if(imv->session) {
+        imv_session_frame_begin(imv->session);
+      }
+      if(imv->watchdog) {
+        imv_watchdog_stage(imv->watchdog, IMV_STAGE_RENDER);
+      }
       render_window(imv);
+      if(imv->watchdog) {
+        imv_watchdog_stage(imv->watchdog, IMV_STAGE_PRESENT);
+      }
+      IMV_TRACE0(present_start);
+      if(imv->terminal) {
+        present_terminal(imv);
+      }
       SDL_RenderPresent(imv->renderer);
+      IMV_TRACE0(present_done);
+      if(imv->session) {
+        imv_session_frame_end(imv->session);
+      }
+    }
+
+    if(imv->watchdog) {
+      imv_watchdog_end(imv->watchdog);
     }
 
     /* sleep until we have something to do */
@@ -928,6 +1716,27 @@ int imv_run(struct imv *imv)
       timeout = imv->next_frame_due - current_time;
     }
 
+    /* or until it's time for the next step of a transition */
+    if (imv->transition_start && timeout > imv->frame_interval) {
+      timeout = imv->frame_interval;
+    }
+
+    /* or until the view has been still for long enough to resample it */
+    if (resample_wait && timeout > resample_wait) {
+      timeout = resample_wait;
+    }
+
+    /* or until the image has been looked at for long enough to decode it
+     * accurately */
+    if (quality_wait && timeout > quality_wait) {
+      timeout = quality_wait;
+    }
+
+    /* or until the next input of a replayed session is due */
+    if (replay_wait && timeout > replay_wait) {
+      timeout = replay_wait;
+    }
+
     /* go to sleep until an input event, etc. or the timeout expires */
     SDL_WaitEventTimeout(NULL, timeout);
   }
@@ -942,6 +1751,11 @@ int imv_run(struct imv *imv)
 
 static bool setup_window(struct imv *imv)
 {
+  /* in the terminal, frames are rendered offscreen and read back */
+  if(imv->terminal_mode) {
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+  }
+
   if(SDL_Init(SDL_INIT_VIDEO) != 0) {
     fprintf(stderr, "SDL Failed to Init: %s\n", SDL_GetError());
     return false;
@@ -952,9 +1766,34 @@ static bool setup_window(struct imv *imv)
   imv->events.BAD_IMAGE = SDL_RegisterEvents(1);
   imv->events.NEW_PATH = SDL_RegisterEvents(1);
   imv->events.ENABLE_INPUT = SDL_RegisterEvents(1);
+  imv->events.COMPARE = SDL_RegisterEvents(1);
+  imv->events.FILEOPS = SDL_RegisterEvents(1);
+  imv->events.RESAMPLED = SDL_RegisterEvents(1);
+  imv->events.TERMINAL = SDL_RegisterEvents(1);
+  imv->events.LOAD_SKIPPED = SDL_RegisterEvents(1);
+  imv->events.SEEK_SKIPPED = SDL_RegisterEvents(1);
 
   imv->sdl_init = true;
 
+  Uint32 renderer_flags = 0;
+  if(imv->terminal_mode) {
+    imv->terminal = imv_terminal_create(imv->terminal_protocol,
+        &terminal_callback, imv);
+    if(!imv->terminal) {
+      fprintf(stderr, "Unable to use the terminal to show images in.\n");
+      return false;
+    }
+
+    /* the window is only ever as big as the terminal, so isn't resized to
+     * fit images or made fullscreen, and only one is shown */
+    imv_terminal_get_size(imv->terminal,
+        &imv->initial_width, &imv->initial_height);
+    imv->resize_mode = RESIZE_NONE;
+    imv->fullscreen = false;
+    imv->num_outputs = 1;
+    renderer_flags = SDL_RENDERER_SOFTWARE;
+  }
+
   imv->window = SDL_CreateWindow(
         "imv",
         SDL_WINDOWPOS_CENTERED,
@@ -968,7 +1807,7 @@ static bool setup_window(struct imv *imv)
   }
 
   /* we'll use SDL's built-in renderer, hardware accelerated if possible */
-  imv->renderer = SDL_CreateRenderer(imv->window, -1, 0);
+  imv->renderer = SDL_CreateRenderer(imv->window, -1, renderer_flags);
   if(!imv->renderer) {
     fprintf(stderr, "SDL Failed to create renderer: %s\n", SDL_GetError());
     return false;
@@ -997,13 +1836,25 @@ static bool setup_window(struct imv *imv)
   }
 
   imv->image = imv_image_create(imv->renderer);
+  imv->sharp = imv_image_create(imv->renderer);
   imv->view = imv_viewport_create(imv->window);
 
+  /* transitions are animated at the display's refresh rate */
+  SDL_DisplayMode mode;
+  if(SDL_GetWindowDisplayMode(imv->window, &mode) == 0
+      && mode.refresh_rate > 0) {
+    imv->frame_interval = 1000 / mode.refresh_rate;
+  }
+
   /* put us in fullscren mode to begin with if requested */
   if(imv->fullscreen) {
     imv_viewport_toggle_fullscreen(imv->view);
   }
 
+  if(!setup_mirrors(imv)) {
+    return false;
+  }
+
   /* start outside of command mode */
   SDL_StopTextInput();
 
@@ -1011,14 +1862,481 @@ static bool setup_window(struct imv *imv)
 }
 
 
-static void handle_new_image(struct imv *imv, struct imv_bitmap *bitmap, int frametime)
+/* Create the windows for any extra outputs. Images are only decoded once,
+ * for the main window, and uploaded to each of these too */
+static bool setup_mirrors(struct imv *imv)
 {
-  imv_image_set_bitmap(imv->image, bitmap);
-  imv->current_image.width = bitmap->width;
-  imv->current_image.height = bitmap->height;
-  imv_bitmap_free(bitmap);
+  if(imv->num_outputs < 2) {
+    return true;
+  }
+
+  imv->mirrors = calloc(imv->num_outputs - 1, sizeof *imv->mirrors);
+  const int num_displays = SDL_GetNumVideoDisplays();
+
+  for(int i = 0; i < imv->num_outputs - 1; ++i) {
+    struct mirror *mirror = &imv->mirrors[i];
+    const int display = num_displays > 0 ? (i + 1) % num_displays : 0;
+
+    mirror->window = SDL_CreateWindow(
+          "imv",
+          SDL_WINDOWPOS_CENTERED_DISPLAY(display),
+          SDL_WINDOWPOS_CENTERED_DISPLAY(display),
+          imv->initial_width, imv->initial_height,
+          SDL_WINDOW_RESIZABLE);
+    if(!mirror->window) {
+      fprintf(stderr, "SDL Failed to create window: %s\n", SDL_GetError());
+      return false;
+    }
+
+    mirror->renderer = SDL_CreateRenderer(mirror->window, -1, 0);
+    if(!mirror->renderer) {
+      fprintf(stderr, "SDL Failed to create renderer: %s\n", SDL_GetError());
+      return false;
+    }
+
+    if(imv->background_type == BACKGROUND_CHEQUERED) {
+      mirror->background_image = create_chequered(mirror->renderer);
+    }
+
+    mirror->image = imv_image_create(mirror->renderer);
+    mirror->view = imv_viewport_create(mirror->window);
+
+    if(imv->fullscreen) {
+      imv_viewport_toggle_fullscreen(mirror->view);
+    }
+  }
+
+  return true;
+}
+
+static struct mirror *find_mirror(struct imv *imv, Uint32 window_id)
+{
+  for(int i = 0; i < imv->num_outputs - 1; ++i) {
+    if(SDL_GetWindowID(imv->mirrors[i].window) == window_id) {
+      return &imv->mirrors[i];
+    }
+  }
+  return NULL;
+}
+
+/* Scale an image to a window by the current scaling mode */
+static void rescale_view(struct imv *imv, SDL_Window *window,
+    struct imv_viewport *view, struct imv_image *image)
+{
+  int ww, wh;
+  SDL_GetWindowSize(window, &ww, &wh);
+
+  if(imv->scaling_mode == SCALING_NONE ||
+      (imv->scaling_mode == SCALING_DOWN
+       && ww > imv_image_width(image)
+       && wh > imv_image_height(image))) {
+    imv_viewport_scale_to_actual(view, image);
+  } else {
+    imv_viewport_scale_to_window(view, image);
+  }
+}
+
+/* Tell a source that can load reduced resolution versions of its image how
+ * large it's about to be shown, so it can skip detail that won't be seen */
+static void hint_initial_scale(struct imv *imv)
+{
+  struct imv_source *src = imv->source;
+  imv->load_region.x = 0;
+  imv->load_region.y = 0;
+  imv->load_region.width = src->width;
+  imv->load_region.height = src->height;
+  if (!src->set_scale_hint || src->width <= 0 || src->height <= 0) {
+    return;
+  }
+
+  double scale = 1;
+  if (imv->scaling_mode != SCALING_NONE && imv->resize_mode == RESIZE_NONE) {
+    int ww, wh;
+    SDL_GetWindowSize(imv->window, &ww, &wh);
+    const double sx = (double)ww / src->width;
+    const double sy = (double)wh / src->height;
+    scale = sx < sy ? sx : sy;
+    if (scale > 1) {
+      scale = 1;
+    }
+  }
+  src->set_scale_hint(src, scale);
+  if (src->set_region_hint) {
+    src->set_region_hint(src, 0, 0, src->width, src->height);
+  }
+}
+
+/* Area of the image currently visible in the window */
+static void visible_region(struct imv *imv, int *x, int *y, int *w, int *h)
+{
+  int ww, wh, vx, vy;
+  double scale;
+  SDL_GetWindowSize(imv->window, &ww, &wh);
+  imv_viewport_get_offset(imv->view, &vx, &vy);
+  imv_viewport_get_scale(imv->view, &scale);
+
+  const int width = imv_image_width(imv->image);
+  const int height = imv_image_height(imv->image);
+  int x0 = vx < 0 ? -vx / scale : 0;
+  int y0 = vy < 0 ? -vy / scale : 0;
+  int x1 = ceil((ww - vx) / scale);
+  int y1 = ceil((wh - vy) / scale);
+  x1 = x1 < width ? x1 : width;
+  y1 = y1 < height ? y1 : height;
+  x0 = x0 < x1 ? x0 : x1;
+  y0 = y0 < y1 ? y0 : y1;
+
+  *x = x0;
+  *y = y0;
+  *w = x1 - x0;
+  *h = y1 - y0;
+}
+
+/* If the view has moved on from what the current bitmap can show, either
+ * zoomed in past its detail or panned outside the region it covers, load
+ * one that can */
+static void update_detail(struct imv *imv)
+{
+  struct imv_source *src = imv->source;
+
+  double scale;
+  imv_viewport_get_scale(imv->view, &scale);
+  if (scale > 1) {
+    scale = 1;
+  }
+  bool outdated = imv_image_detail(imv->image) < scale * 0.99;
+
+  int x = 0, y = 0, w = src->width, h = src->height;
+  if (src->set_region_hint) {
+    visible_region(imv, &x, &y, &w, &h);
+    outdated = outdated || !imv_image_covers(imv->image, x, y, w, h);
+  }
+
+  if (!outdated) {
+    return;
+  }
+
+  if (src->set_region_hint) {
+    /* load a margin around the visible area, so that small pans can be
+     * served without loading again */
+    const int mx = w / 4 + 1;
+    const int my = h / 4 + 1;
+    const int x1 = x + w + mx < src->width ? x + w + mx : src->width;
+    const int y1 = y + h + my < src->height ? y + h + my : src->height;
+    x = x > mx ? x - mx : 0;
+    y = y > my ? y - my : 0;
+    w = x1 - x;
+    h = y1 - y;
+    src->set_region_hint(src, x, y, w, h);
+  }
+  imv->load_region.x = x;
+  imv->load_region.y = y;
+  imv->load_region.width = w;
+  imv->load_region.height = h;
+
+  src->set_scale_hint(src, scale);
+  imv->refining = true;
+  async_load_first_frame(imv, src);
+}
+
+/* Once an image browsed with a fast decode has been looked at for a moment,
+ * or zoomed in to actual size or more, decode it again accurately to replace
+ * it. Returns how many milliseconds until it wants to be called again, or 0
+ * if it doesn't */
+static unsigned int update_quality(struct imv *imv, unsigned int now)
+{
+  struct imv_source *src = imv->source;
+  if (imv->decode_quality != DECODE_AUTO || imv->accurate || !src
+      || !src->set_quality_hint || src->num_frames > 1 || imv->loading
+      || imv->refining || imv->comparing) {
+    return 0;
+  }
+
+  double scale;
+  imv_viewport_get_scale(imv->view, &scale);
+  if (scale < 1 && now - imv->shown_time < ACCURATE_DELAY) {
+    return ACCURATE_DELAY - (now - imv->shown_time);
+  }
+
+  /* loaded with the same scale and region hints as before, so it replaces
+   * the fast decode as a refinement */
+  imv->accurate = true;
+  src->set_quality_hint(src, IMV_QUALITY_ACCURATE);
+  imv->refining = true;
+  async_load_first_frame(imv, src);
+  return 0;
+}
+
+static bool same_view(const struct resample_view *a,
+    const struct resample_view *b)
+{
+  return a->x == b->x && a->y == b->y && a->scale == b->scale
+      && a->width == b->width && a->height == b->height;
+}
+
+static void current_view(struct imv *imv, struct resample_view *view)
+{
+  imv_viewport_get_offset(imv->view, &view->x, &view->y);
+  imv_viewport_get_scale(imv->view, &view->scale);
+  SDL_GetWindowSize(imv->window, &view->width, &view->height);
+}
+
+/* Resample the visible area of the bitmap at the size it's shown, if it's
+ * being scaled down */
+static void start_resample(struct imv *imv, const struct resample_view *view)
+{
+  /* whether or not there's anything to do, it's been looked at */
+  imv->sharp_view = *view;
+
+  int x, y, w, h;
+  visible_region(imv, &x, &y, &w, &h);
+  const int out_width = lround(w * view->scale);
+  const int out_height = lround(h * view->scale);
+  if (out_width < 1 || out_height < 1
+      || !imv_image_covers(imv->image, x, y, w, h)) {
+    return;
+  }
+
+  /* the bitmap may be a reduced resolution version of a region of the
+   * image, in which case there may be no more detail than the screen shows */
+  const double sx = (double)imv->bitmap->width / imv->bitmap_region.width;
+  const double sy = (double)imv->bitmap->height / imv->bitmap_region.height;
+  if (w * sx <= out_width && h * sy <= out_height) {
+    return;
+  }
+
+  struct resample_job *job = calloc(1, sizeof *job);
+  job->event_type = imv->events.RESAMPLED;
+  job->bitmap = imv->bitmap;
+  pthread_mutex_init(&job->lock, NULL);
+  job->bx = (x - imv->bitmap_region.x) * sx;
+  job->by = (y - imv->bitmap_region.y) * sy;
+  job->bw = w * sx;
+  job->bh = h * sy;
+  job->x = x;
+  job->y = y;
+  job->width = w;
+  job->height = h;
+  job->view = *view;
+  job->out_width = out_width;
+  job->out_height = out_height;
+  imv->resample_job = job;
+
+  SDL_Thread *thread = SDL_CreateThread(resample_thread, "resample", job);
+  SDL_DetachThread(thread);
+}
+
+/* Once the view has been still for a moment, resample what's visible to be
+ * drawn instead of the renderer's scaling of the bitmap. Returns how many
+ * milliseconds until it wants to be called again, or 0 if it doesn't */
+static unsigned int update_resample(struct imv *imv, unsigned int now)
+{
+  if (!imv->resample || !imv->bitmap) {
+    return 0;
+  }
+
+  struct resample_view view;
+  current_view(imv, &view);
+  if (!same_view(&view, &imv->idle_view)) {
+    imv->idle_view = view;
+    imv->idle_since = now;
+  }
+
+  struct resample_job *job = imv->resample_job;
+  if (job) {
+    /* only one runs at a time, and it ends in an event */
+    if (!same_view(&view, &job->view)) {
+      pthread_mutex_lock(&job->lock);
+      job->cancelled = true;
+      pthread_mutex_unlock(&job->lock);
+    }
+    return 0;
+  }
+
+  if (same_view(&view, &imv->sharp_view) || imv->loading || imv->refining
+      || imv->transition_start) {
+    return 0;
+  }
+  if (now - imv->idle_since < RESAMPLE_DELAY) {
+    return RESAMPLE_DELAY - (now - imv->idle_since);
+  }
+  if (view.scale < 1) {
+    start_resample(imv, &view);
+  } else {
+    imv->sharp_view = view;
+  }
+  return 0;
+}
+
+/* Let go of the bitmap being shown, and so anything resampled from it. A
+ * resample still reading it is cancelled and takes it over */
+static void drop_bitmap(struct imv *imv)
+{
+  imv->sharp_valid = false;
+  imv->sharp_view.scale = 0;
+  if (!imv->bitmap) {
+    return;
+  }
+
+  struct resample_job *job = imv->resample_job;
+  if (job && job->bitmap == imv->bitmap) {
+    pthread_mutex_lock(&job->lock);
+    job->cancelled = true;
+    job->owns_bitmap = true;
+    pthread_mutex_unlock(&job->lock);
+  } else {
+    imv_bitmap_free(imv->bitmap);
+  }
+  imv->bitmap = NULL;
+}
+
+static void apply_bitmap(struct imv *imv, struct imv_image *image,
+    struct imv_bitmap *bitmap)
+{
+  imv_image_set_bitmap(image, bitmap);
+
+  /* a reduced resolution bitmap is shown at the image's full size, over
+   * the region it covers */
+  if (imv->source && imv->source->set_scale_hint) {
+    imv_image_set_size(image, imv->source->width, imv->source->height);
+    if (imv->source->set_region_hint) {
+      imv_image_set_region(image, imv->load_region.x, imv->load_region.y,
+          imv->load_region.width, imv->load_region.height);
+    }
+  }
+}
+
+/* Show a bitmap, taking ownership of it */
+static void set_image_bitmap(struct imv *imv, struct imv_bitmap *bitmap)
+{
+  enum imv_watchdog_stage stage = IMV_STAGE_UPLOAD;
+  if (imv->watchdog) {
+    stage = imv_watchdog_stage(imv->watchdog, IMV_STAGE_UPLOAD);
+  }
+
+  IMV_TRACE2(upload_start, bitmap->width, bitmap->height);
+  const Uint64 upload_start = SDL_GetPerformanceCounter();
+  apply_bitmap(imv, imv->image, bitmap);
+
+  /* mirrors show the same bitmap, fitted to their own windows */
+  for (int i = 0; i < imv->num_outputs - 1; ++i) {
+    struct mirror *mirror = &imv->mirrors[i];
+    apply_bitmap(imv, mirror->image, bitmap);
+    rescale_view(imv, mirror->window, mirror->view, mirror->image);
+  }
+
+  if (imv->metrics) {
+    imv_metrics_upload(imv->metrics,
+        (double)(SDL_GetPerformanceCounter() - upload_start)
+        / SDL_GetPerformanceFrequency());
+  }
+  IMV_TRACE2(upload_done, bitmap->width, bitmap->height);
+  if (imv->watchdog) {
+    imv_watchdog_stage(imv->watchdog, stage);
+  }
+
+  imv->current_image.width = imv_image_width(imv->image);
+  imv->current_image.height = imv_image_height(imv->image);
+
+  drop_bitmap(imv);
+  if (!imv->resample && !imv->keep_bitmap) {
+    imv_bitmap_free(bitmap);
+    return;
+  }
+  imv->bitmap = bitmap;
+  if (imv->source && imv->source->set_scale_hint
+      && imv->source->set_region_hint) {
+    imv->bitmap_region.x = imv->load_region.x;
+    imv->bitmap_region.y = imv->load_region.y;
+    imv->bitmap_region.width = imv->load_region.width;
+    imv->bitmap_region.height = imv->load_region.height;
+  } else {
+    imv->bitmap_region.x = 0;
+    imv->bitmap_region.y = 0;
+    imv->bitmap_region.width = imv->current_image.width;
+    imv->bitmap_region.height = imv->current_image.height;
+  }
+}
+
+/* Write out the metrics, with the texture usage of all the images */
+static void write_metrics(struct imv *imv, unsigned int now)
+{
+  struct imv_image_stats total = {0, 0, 0};
+  struct imv_image *images[] = {imv->image, imv->prev_image, imv->sharp};
+  const int num_images = sizeof images / sizeof images[0];
+  const int num_mirrors = imv->mirrors ? imv->num_outputs - 1 : 0;
+
+  for (int i = 0; i < num_images + num_mirrors; ++i) {
+    const struct imv_image *image = i < num_images ? images[i]
+                                  : imv->mirrors[i - num_images].image;
+    if (!image) {
+      continue;
+    }
+    struct imv_image_stats stats;
+    imv_image_stats(image, &stats);
+    total.pool_hits += stats.pool_hits;
+    total.pool_misses += stats.pool_misses;
+    total.texture_bytes += stats.texture_bytes;
+  }
+
+  if (!imv_metrics_write(imv->metrics, now, &total)) {
+    fprintf(stderr, "Unable to write metrics to: %s\n", imv->metrics_file);
+  }
+}
+
+/* Keep the image being shown to transition from, and put the next one in
+ * an image of its own */
+static void begin_transition(struct imv *imv)
+{
+  imv_viewport_get_offset(imv->view, &imv->prev_x, &imv->prev_y);
+  imv_viewport_get_scale(imv->view, &imv->prev_scale);
+
+  struct imv_image *next = imv->prev_image;
+  if (!next) {
+    next = imv_image_create(imv->renderer);
+  }
+  imv->prev_image = imv->image;
+  imv->image = next;
+  imv_image_set_alpha(imv->prev_image, 255);
+}
+
+static void handle_new_image(struct imv *imv, struct imv_bitmap *bitmap,
+    int frametime, int frame)
+{
+  const bool transition = imv->transition != TRANSITION_NONE
+                       && imv->current_image.width > 0;
+  imv->comparing = false;
+  imv->compare_text[0] = '\0';
+  if (imv->compare_bitmap) {
+    imv_bitmap_free(imv->compare_bitmap);
+    imv->compare_bitmap = NULL;
+  }
+  if (transition) {
+    begin_transition(imv);
+  }
+  set_image_bitmap(imv, bitmap);
+
+  /* only once the new image is uploaded, so that the transition runs
+   * smoothly */
+  if (transition) {
+    imv->transition_start = SDL_GetTicks();
+    imv_image_set_alpha(imv->image, 0);
+  }
+  imv->current_frame = frame;
+  imv->seek_target = -1;
+  imv->shown_time = SDL_GetTicks();
+  if (imv->next_frame) {
+    imv_bitmap_free(imv->next_frame);
+    imv->next_frame = NULL;
+  }
   imv->need_redraw = true;
   imv->need_rescale = true;
+  if (imv->soak) {
+    imv_soak_image_shown(imv->soak);
+  }
+  if (imv->metrics) {
+    imv_metrics_image_shown(imv->metrics);
+  }
   /* If autoresizing on every image is enabled, make sure we do so */
   if (imv->resize_mode != RESIZE_NONE) {
     imv->need_resize = true;
@@ -1040,30 +2358,260 @@ static void handle_new_image(struct imv *imv, struct imv_bitmap *bitmap, int fra
   }
 }
 
-static void handle_new_frame(struct imv *imv, struct imv_bitmap *bitmap, int frametime)
+static void handle_refined_image(struct imv *imv, struct imv_bitmap *bitmap)
+{
+  /* same image, more detail: keep the view as it is */
+  set_image_bitmap(imv, bitmap);
+  imv->refining = false;
+  imv->need_redraw = true;
+}
+
+static void handle_new_frame(struct imv *imv, struct imv_bitmap *bitmap,
+    int frametime, int frame)
 {
+  if (imv->seek_target >= 0) {
+    if (frame != imv->seek_target) {
+      /* loaded before the seek, and no longer wanted */
+      imv_bitmap_free(bitmap);
+      return;
+    }
+
+    /* show the frame sought to straight away, even when paused */
+    set_image_bitmap(imv, bitmap);
+    imv->current_frame = frame;
+    imv->seek_target = -1;
+    imv->need_redraw = true;
+
+    /* carry on from here, whether playing now or later */
+    if (imv->source->load_next_frame) {
+      imv->next_frame_due = SDL_GetTicks() + frametime;
+      async_load_next_frame(imv->source);
+    }
+    return;
+  }
+
   if (imv->next_frame) {
     imv_bitmap_free(imv->next_frame);
   }
   imv->next_frame = bitmap;
+  imv->next_frame_index = frame;
 
   imv->next_frame_duration = frametime;
 }
 
+static void handle_compare_result(struct imv *imv, struct compare_job *job)
+{
+  if (job->current != imv->source) {
+    /* moved on to another image since */
+  } else if (!job->heatmap) {
+    fprintf(stderr, "Unable to compare images. They must load, and be the same size.\n");
+  } else {
+    /* the heatmap is at full resolution, whatever was shown before */
+    imv->load_region.x = 0;
+    imv->load_region.y = 0;
+    imv->load_region.width = imv->source->width;
+    imv->load_region.height = imv->source->height;
+    if (imv->bitmap && !imv->comparing) {
+      /* copied, as a resample may still be reading it */
+      imv->compare_bitmap = imv_bitmap_clone(imv->bitmap);
+      imv->compare_region.x = imv->bitmap_region.x;
+      imv->compare_region.y = imv->bitmap_region.y;
+      imv->compare_region.width = imv->bitmap_region.width;
+      imv->compare_region.height = imv->bitmap_region.height;
+    } else if (!imv->comparing) {
+      /* not kept, so go back to the one decoded for the comparison */
+      imv->compare_bitmap = job->original;
+      job->original = NULL;
+      imv->compare_region.x = 0;
+      imv->compare_region.y = 0;
+      imv->compare_region.width = imv->source->width;
+      imv->compare_region.height = imv->source->height;
+    }
+    set_image_bitmap(imv, job->heatmap);
+    job->heatmap = NULL;
+
+    imv->comparing = true;
+    imv_viewport_set_playing(imv->view, false);
+    snprintf(imv->compare_text, sizeof imv->compare_text,
+        "[PSNR %.2fdB SSIM %.4f max %d mean %.3f]", job->stats.psnr,
+        job->stats.ssim, job->stats.max_error, job->stats.mean_error);
+    imv->need_redraw = true;
+  }
+
+  if (job->heatmap) {
+    imv_bitmap_free(job->heatmap);
+  }
+  if (job->original) {
+    imv_bitmap_free(job->original);
+  }
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  free(job);
+}
+
+static void handle_resampled(struct imv *imv, struct resample_job *job)
+{
+  imv->resample_job = NULL;
+  if (job->owns_bitmap) {
+    imv_bitmap_free(job->bitmap);
+  }
+
+  if (job->result && !job->cancelled) {
+    /* drawn over the area of the image it shows */
+    imv_image_set_bitmap(imv->sharp, job->result);
+    imv_image_set_size(imv->sharp, imv_image_width(imv->image),
+        imv_image_height(imv->image));
+    imv_image_set_region(imv->sharp, job->x, job->y, job->width, job->height);
+    imv->sharp_valid = true;
+    imv->need_redraw = true;
+  }
+
+  if (job->result) {
+    imv_bitmap_free(job->result);
+  }
+  pthread_mutex_destroy(&job->lock);
+  free(job);
+}
+
+/* Called from the terminal's input thread, so all it can do is wake the
+ * main loop */
+static void terminal_callback(void *data)
+{
+  struct imv *imv = data;
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = imv->events.TERMINAL;
+  SDL_PushEvent(&event);
+}
+
+/* Feed keys typed in the terminal through as if they'd been typed in the
+ * window, and follow it when it's resized */
+static void handle_terminal(struct imv *imv)
+{
+  if (imv_terminal_poll_resize(imv->terminal)) {
+    int width, height;
+    imv_terminal_get_size(imv->terminal, &width, &height);
+    SDL_SetWindowSize(imv->window, width, height);
+    imv->need_redraw = true;
+  }
+
+  struct imv_terminal_key key;
+  while (imv_terminal_next_key(imv->terminal, &key)) {
+    const bool in_command_mode = imv->input_buffer != NULL;
+
+    if (key.sym != SDLK_UNKNOWN) {
+      SDL_Event event;
+      SDL_zero(event);
+      event.type = SDL_KEYDOWN;
+      event.key.windowID = SDL_GetWindowID(imv->window);
+      event.key.state = SDL_PRESSED;
+      event.key.keysym.sym = key.sym;
+      event.key.keysym.mod = key.mod;
+      /* binds look at the modifier state rather than the event */
+      SDL_SetModState(key.mod);
+      handle_event(imv, &event);
+      SDL_SetModState(KMOD_NONE);
+    }
+
+    /* the key that starts command mode isn't part of the command */
+    if (in_command_mode && imv->input_buffer && key.text[0]) {
+      SDL_Event event;
+      SDL_zero(event);
+      event.type = SDL_TEXTINPUT;
+      event.text.windowID = SDL_GetWindowID(imv->window);
+      snprintf(event.text.text, sizeof event.text.text, "%s", key.text);
+      handle_event(imv, &event);
+    }
+  }
+}
+
+static void handle_fileops_result(struct imv *imv,
+    struct imv_fileops_result *result)
+{
+  /* files that couldn't be moved were taken off the list when they were
+   * queued, so put them back */
+  for (size_t i = 0; i < result->unmoved->len; ++i) {
+    imv_add_path(imv, result->unmoved->items[i]);
+  }
+
+  static const char *done_labels[IMV_FILEOP_COUNT] = {
+    "copied",
+    "moved",
+    "trashed",
+  };
+  char *text = imv->fileops_text;
+  const size_t text_len = sizeof imv->fileops_text;
+  size_t len = snprintf(text, text_len, "[");
+  for (int op = 0; op < IMV_FILEOP_COUNT; ++op) {
+    if (result->done[op] && len < text_len) {
+      len += snprintf(text + len, text_len - len, "%s%s %d",
+          len > 1 ? ", " : "", done_labels[op], result->done[op]);
+    }
+  }
+  if (result->failed && len < text_len) {
+    len += snprintf(text + len, text_len - len, "%s%d failed",
+        len > 1 ? ", " : "", result->failed);
+  }
+  if (len < text_len) {
+    snprintf(text + len, text_len - len, "]");
+  }
+
+  imv->fileops_time = SDL_GetTicks();
+  imv->need_redraw = true;
+  imv_fileops_result_free(result);
+}
+
 static void handle_event(struct imv *imv, SDL_Event *event)
 {
   const int command_buffer_len = 1024;
 
   if (event->type == imv->events.NEW_IMAGE) {
     /* new image vs just a new frame of the same image */
-    bool is_new_image = !!event->user.data2;
-    if (is_new_image) {
-      handle_new_image(imv, event->user.data1, event->user.code);
+    const uintptr_t info = (uintptr_t)event->user.data2;
+    const bool is_new_image = info & 1;
+    const int frame = info >> 1;
+    if (is_new_image || imv->refining) {
+      const struct imv_bitmap *bmp = event->user.data1;
+      IMV_TRACE5(decode_done, imv->source->name, imv->source->backend,
+          bmp->width, bmp->height, (long)bmp->width * bmp->height
+          * imv_bitmap_pixel_size(bmp->format));
+    }
+    if (imv->metrics && imv->load_start && (is_new_image || imv->refining)) {
+      imv_metrics_decode(imv->metrics, imv->source->backend,
+          (double)(SDL_GetPerformanceCounter() - imv->load_start)
+          / SDL_GetPerformanceFrequency());
+      imv->load_start = 0;
+    }
+    if (imv->comparing && !is_new_image) {
+      /* the difference is being shown in place of the image */
+      imv->refining = false;
+      imv_bitmap_free(event->user.data1);
+    } else if (is_new_image) {
+      handle_new_image(imv, event->user.data1, event->user.code, frame);
+    } else if (imv->refining) {
+      handle_refined_image(imv, event->user.data1);
     } else {
-      handle_new_frame(imv, event->user.data1, event->user.code);
+      handle_new_frame(imv, event->user.data1, event->user.code, frame);
     }
     return;
   } else if (event->type == imv->events.BAD_IMAGE) {
+    IMV_TRACE5(decode_done, imv->source ? imv->source->name : NULL,
+        imv->source ? imv->source->backend : NULL, 0, 0, 0L);
+    imv->load_start = 0;
+    if (imv->metrics) {
+      imv_metrics_decode_failed(imv->metrics);
+    }
+    if (imv->refining) {
+      /* keep showing what we have */
+      imv->refining = false;
+      return;
+    }
+    if (imv->seek_target >= 0) {
+      /* the frame sought couldn't be loaded, so stay on this one */
+      imv->seek_target = -1;
+      return;
+    }
+
     /* an image failed to load, remove it from our image list */
     const char *err_path = imv_navigator_selection(imv->navigator);
 
@@ -1081,6 +2629,9 @@ static void handle_event(struct imv *imv, SDL_Event *event)
     return;
   } else if (event->type == imv->events.NEW_PATH) {
     /* received a new path from the stdin reading thread */
+    if (imv->session) {
+      imv_session_add_path(imv->session, event->user.data1);
+    }
     imv_add_path(imv, event->user.data1);
     free(event->user.data1);
     /* need to update image count */
@@ -1089,6 +2640,31 @@ static void handle_event(struct imv *imv, SDL_Event *event)
   } else if (event->type == imv->events.ENABLE_INPUT) {
     imv->ignore_window_events = false;
     return;
+  } else if (event->type == imv->events.COMPARE) {
+    handle_compare_result(imv, event->user.data1);
+    return;
+  } else if (event->type == imv->events.FILEOPS) {
+    handle_fileops_result(imv, event->user.data1);
+    return;
+  } else if (event->type == imv->events.RESAMPLED) {
+    handle_resampled(imv, event->user.data1);
+    return;
+  } else if (event->type == imv->events.TERMINAL) {
+    handle_terminal(imv);
+    return;
+  } else if (event->type == imv->events.LOAD_SKIPPED) {
+    /* a refinement that never started mustn't hold up later ones */
+    if (event->user.data1 == imv->source) {
+      imv->refining = false;
+    }
+    return;
+  } else if (event->type == imv->events.SEEK_SKIPPED) {
+    /* a failed seek has already cleared seek_target, so this only retries
+     * one that found the source busy */
+    if (event->user.data1 == imv->source && imv->seek_target >= 0) {
+      async_seek_frame(imv, imv->source, imv->seek_target);
+    }
+    return;
   } else if (imv->ignore_window_events) {
     /* Don't try and process this input event, we're in event ignoring mode */
     return;
@@ -1161,6 +2737,12 @@ static void handle_event(struct imv *imv, SDL_Event *event)
       SDL_ShowCursor(SDL_ENABLE);
       break;
     case SDL_WINDOWEVENT:
+      /* closing any window closes them all */
+      if (event->window.event == SDL_WINDOWEVENT_CLOSE) {
+        imv_command_exec(imv->commands, "quit", imv);
+        break;
+      }
+
       /* For some reason SDL passes events to us that occurred before we
        * gained focus, and passes them *after* the focus gained event.
        * Due to behavioural quirks from such events, whenever we gain focus
@@ -1177,50 +2759,171 @@ static void handle_event(struct imv *imv, SDL_Event *event)
         SDL_PushEvent(&event);
       }
 
-      imv_viewport_update(imv->view, imv->image);
+      struct mirror *mirror = find_mirror(imv, event->window.windowID);
+      if (mirror) {
+        imv_viewport_update(mirror->view, mirror->image);
+      } else {
+        imv_viewport_update(imv->view, imv->image);
+      }
       break;
   }
 }
 
-static void render_window(struct imv *imv)
+/* Handle whatever's due of a replayed session. Returns how many milliseconds
+ * until the next step is, or 0 if there are no more */
+static unsigned int replay_session(struct imv *imv)
+{
+  struct imv_session_step step;
+  unsigned int wait;
+  while(!imv->quit && imv_session_next(imv->session, &step, &wait)) {
+    switch(step.type) {
+      case IMV_SESSION_INPUT:
+        if(step.event.type == SDL_MOUSEWHEEL
+            || step.event.type == SDL_MOUSEMOTION) {
+          /* zooming is centred on the pointer, so it's put back where it was */
+          SDL_WarpMouseInWindow(imv->window, step.mouse_x, step.mouse_y);
+        }
+        step.event.key.windowID = SDL_GetWindowID(imv->window);
+        handle_event(imv, &step.event);
+        break;
+      case IMV_SESSION_PATH:
+        imv_add_path(imv, step.path);
+        imv->need_redraw = true;
+        break;
+      case IMV_SESSION_RESIZE:
+        SDL_SetWindowSize(imv->window, step.width, step.height);
+        break;
+      case IMV_SESSION_END:
+        imv->quit = true;
+        break;
+    }
+  }
+  return wait;
+}
+
+static void render_background(struct imv *imv, SDL_Renderer *renderer,
+    SDL_Texture *background_image, int ww, int wh,
+    struct imv_viewport *view, struct imv_image *image)
 {
-  int ww, wh;
-  SDL_GetWindowSize(imv->window, &ww, &wh);
-
-  /* update window title */
-  char title_text[1024];
-  generate_env_text(imv, title_text, sizeof title_text, imv->title_text);
-  imv_viewport_set_title(imv->view, title_text);
-
-  /* first we draw the background */
   if(imv->background_type == BACKGROUND_SOLID) {
     /* solid background */
-    SDL_SetRenderDrawColor(imv->renderer,
+    SDL_SetRenderDrawColor(renderer,
         imv->background_color.r,
         imv->background_color.g,
         imv->background_color.b,
         255);
-    SDL_RenderClear(imv->renderer);
+    SDL_RenderClear(renderer);
   } else {
     /* chequered background */
     int img_w, img_h;
-    SDL_QueryTexture(imv->background_image, NULL, NULL, &img_w, &img_h);
-    /* tile the image so it fills the window */
+    SDL_QueryTexture(background_image, NULL, NULL, &img_w, &img_h);
+    int ix, iy;
+    double scale;
+    imv_viewport_get_offset(view, &ix, &iy);
+    imv_viewport_get_scale(view, &scale);
+    /* tile the image so it fills the window, except where an opaque image
+     * will be drawn over it */
     for(int y = 0; y < wh; y += img_h) {
       for(int x = 0; x < ww; x += img_w) {
         SDL_Rect dst_rect = {x,y,img_w,img_h};
-        SDL_RenderCopy(imv->renderer, imv->background_image, NULL, &dst_rect);
+        if(!image || !imv_image_hides(image, ix, iy, scale, &dst_rect)) {
+          SDL_RenderCopy(renderer, background_image, NULL, &dst_rect);
+        }
       }
     }
   }
+}
 
-  /* draw our actual image */
-  {
-    int x, y;
-    double scale;
-    imv_viewport_get_offset(imv->view, &x, &y);
-    imv_viewport_get_scale(imv->view, &scale);
+static void render_image(struct imv_viewport *view, struct imv_image *image)
+{
+  int x, y;
+  double scale;
+  imv_viewport_get_offset(view, &x, &y);
+  imv_viewport_get_scale(view, &scale);
+  imv_image_draw(image, x, y, scale);
+}
+
+/* Draw both images of a transition, ending it once it's complete */
+static void render_transition(struct imv *imv, int ww)
+{
+  const unsigned int elapsed = SDL_GetTicks() - imv->transition_start;
+  if (elapsed >= imv->transition_duration) {
+    imv->transition_start = 0;
+    imv_image_set_alpha(imv->image, 255);
+    render_image(imv->view, imv->image);
+    return;
+  }
+
+  const double t = (double)elapsed / imv->transition_duration;
+  int x, y;
+  double scale;
+  imv_viewport_get_offset(imv->view, &x, &y);
+  imv_viewport_get_scale(imv->view, &scale);
+
+  if (imv->transition == TRANSITION_FADE) {
+    /* fade the new image in over the old one */
+    imv_image_draw(imv->prev_image, imv->prev_x, imv->prev_y, imv->prev_scale);
+    imv_image_set_alpha(imv->image, t * 255);
     imv_image_draw(imv->image, x, y, scale);
+  } else {
+    /* the new image pushes the old one out to the left */
+    imv_image_set_alpha(imv->image, 255);
+    const int shift = t * ww;
+    imv_image_draw(imv->prev_image, imv->prev_x - shift, imv->prev_y,
+        imv->prev_scale);
+    imv_image_draw(imv->image, x + ww - shift, y, scale);
+  }
+}
+
+static void render_mirror(struct imv *imv, struct mirror *mirror)
+{
+  int ww, wh;
+  SDL_GetWindowSize(mirror->window, &ww, &wh);
+  render_background(imv, mirror->renderer, mirror->background_image, ww, wh,
+      mirror->view, mirror->image);
+  render_image(mirror->view, mirror->image);
+}
+
+/* Read back the frame just rendered and send it to the terminal, with the
+ * window title as the status line */
+static void present_terminal(struct imv *imv)
+{
+  int pitch;
+  unsigned char *frame = imv_terminal_frame(imv->terminal, &pitch);
+  SDL_Rect rect = {0, 0, 0, 0};
+  imv_terminal_get_size(imv->terminal, &rect.w, &rect.h);
+  if (SDL_RenderReadPixels(imv->renderer, &rect, SDL_PIXELFORMAT_RGBA32,
+        frame, pitch)) {
+    fprintf(stderr, "Failed to read back frame: %s\n", SDL_GetError());
+    return;
+  }
+  imv_terminal_set_status(imv->terminal, SDL_GetWindowTitle(imv->window));
+  imv_terminal_present(imv->terminal);
+}
+
+static void render_window(struct imv *imv)
+{
+  int ww, wh;
+  SDL_GetWindowSize(imv->window, &ww, &wh);
+
+  /* update window title */
+  char title_text[1024];
+  generate_env_text(imv, title_text, sizeof title_text, imv->title_text);
+  imv_viewport_set_title(imv->view, title_text);
+
+  /* first we draw the background */
+  render_background(imv, imv->renderer, imv->background_image, ww, wh,
+      imv->view, imv->transition_start ? NULL : imv->image);
+
+  /* draw our actual image, resampled if that's up to date */
+  struct resample_view view;
+  current_view(imv, &view);
+  if (imv->transition_start) {
+    render_transition(imv, ww);
+  } else if (imv->sharp_valid && same_view(&view, &imv->sharp_view)) {
+    render_image(imv->view, imv->sharp);
+  } else {
+    render_image(imv->view, imv->image);
   }
 
   /* if the overlay needs to be drawn, draw that too */
@@ -1321,6 +3024,11 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return 1;
     }
 
+    if(!strcmp(name, "outputs")) {
+      imv->num_outputs = strtol(value, NULL, 10);
+      return imv->num_outputs > 0;
+    }
+
     if(!strcmp(name, "overlay")) {
       imv->overlay_enabled = parse_bool(value);
       return 1;
@@ -1334,11 +3042,43 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return parse_upscaling_method(imv, value);
     }
 
+    if(!strcmp(name, "decode_quality")) {
+      return parse_decode_quality(imv, value);
+    }
+
+    if(!strcmp(name, "transition")) {
+      return parse_transition(imv, value);
+    }
+
+    if(!strcmp(name, "transition_duration")) {
+      const double duration = strtod(value, NULL);
+      if(duration <= 0) {
+        return 0;
+      }
+      imv->transition_duration = 1000 * duration;
+      return 1;
+    }
+
     if(!strcmp(name, "stay_fullscreen_on_focus_loss")) {
       imv->stay_fullscreen_on_focus_loss = parse_bool(value);
       return 1;
     }
 
+    if(!strcmp(name, "resample")) {
+      imv->resample = parse_bool(value);
+      return 1;
+    }
+
+    if(!strcmp(name, "sandbox")) {
+      imv->sandboxed = parse_bool(value);
+      return 1;
+    }
+
+    if(!strcmp(name, "sandbox_workers")) {
+      imv->sandbox_workers = strtol(value, NULL, 10);
+      return imv->sandbox_workers > 0;
+    }
+
     if(!strcmp(name, "recursive")) {
       imv->recursive_load = parse_bool(value);
       return 1;
@@ -1390,6 +3130,51 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return 1;
     }
 
+    if(!strcmp(name, "soak_log")) {
+      free(imv->soak_log);
+      imv->soak_log = strdup(value);
+      return 1;
+    }
+
+    if(!strcmp(name, "soak_interval")) {
+      imv->soak_interval = 1000 * strtoul(value, NULL, 10);
+      return imv->soak_interval > 0;
+    }
+
+    if(!strcmp(name, "soak_duration")) {
+      imv->soak_duration = 1000 * strtoul(value, NULL, 10);
+      return 1;
+    }
+
+    if(!strcmp(name, "terminal")) {
+      return parse_terminal(imv, value);
+    }
+
+    if(!strcmp(name, "stall_threshold")) {
+      const double threshold = strtod(value, NULL);
+      if(threshold < 0) {
+        return 0;
+      }
+      imv->stall_threshold = 1000 * threshold;
+      return 1;
+    }
+
+    if(!strcmp(name, "stall_backtrace")) {
+      imv->stall_backtrace = parse_bool(value);
+      return 1;
+    }
+
+    if(!strcmp(name, "metrics_file")) {
+      free(imv->metrics_file);
+      imv->metrics_file = strdup(value);
+      return 1;
+    }
+
+    if(!strcmp(name, "metrics_interval")) {
+      imv->metrics_interval = 1000 * strtoul(value, NULL, 10);
+      return imv->metrics_interval > 0;
+    }
+
     if(!strcmp(name, "suppress_default_binds")) {
       const bool suppress_default_binds = parse_bool(value);
       if(suppress_default_binds) {
@@ -1406,15 +3191,67 @@ static int handle_ini_value(void *user, const char *section, const char *name,
   return 0;
 }
 
+/* Record each config value of a session being recorded as it's handled */
+static int record_ini_value(void *user, const char *section, const char *name,
+                            const char *value)
+{
+  struct imv *imv = user;
+  imv_session_add_config(imv->session, section, name, value);
+  return handle_ini_value(user, section, name, value);
+}
+
+/* Start recording or replaying a session if asked to by the environment.
+ * The variables are removed so that programs run by imv don't inherit them */
+static bool setup_session(struct imv *imv)
+{
+  const char *replay_path = getenv("imv_replay");
+  const char *record_path = getenv("imv_record");
+
+  if(replay_path) {
+    char report_path[PATH_MAX];
+    snprintf(report_path, sizeof report_path, "%s.latency.csv", replay_path);
+    imv->session = imv_session_replay(replay_path, report_path);
+    if(!imv->session) {
+      fprintf(stderr, "Unable to replay session: %s\n", replay_path);
+      return false;
+    }
+  } else if(record_path) {
+    imv->session = imv_session_record(record_path);
+    if(!imv->session) {
+      fprintf(stderr, "Unable to record session: %s\n", record_path);
+      return false;
+    }
+  }
+
+  unsetenv("imv_replay");
+  unsetenv("imv_record");
+  return true;
+}
+
 bool imv_load_config(struct imv *imv)
 {
+  if(!setup_session(imv)) {
+    return false;
+  }
+
+  /* a replayed session brings the config it was recorded with */
+  if(imv->session && imv_session_is_replay(imv->session)) {
+    const int err = imv_session_load_config(imv->session, handle_ini_value, imv);
+    if(err) {
+      fprintf(stderr, "Error in replayed config, value %d\n", err);
+      return false;
+    }
+    return true;
+  }
+
   char *path = get_config_path();
   if(!path) {
     /* no config, no problem - we have defaults */
     return true;
   }
 
-  const int err = ini_parse(path, handle_ini_value, imv);
+  const int err = ini_parse(path,
+      imv->session ? record_ini_value : handle_ini_value, imv);
   if (err == -1) {
     fprintf(stderr, "Unable to open config file: %s\n", path);
     return false;
@@ -1533,7 +3370,14 @@ void command_fullscreen(struct list *args, const char *argstr, void *data)
   (void)args;
   (void)argstr;
   struct imv *imv = data;
+  if (imv->terminal) {
+    /* the window has to stay the size of the terminal */
+    return;
+  }
   imv_viewport_toggle_fullscreen(imv->view);
+  for(int i = 0; i < imv->num_outputs - 1; ++i) {
+    imv_viewport_toggle_fullscreen(imv->mirrors[i].view);
+  }
 }
 
 void command_overlay(struct list *args, const char *argstr, void *data)
@@ -1570,17 +3414,74 @@ void command_reset(struct list *args, const char *argstr, void *data)
   imv->need_redraw = true;
 }
 
+/* Show the given frame of a source that can seek, as soon as it's loaded */
+static void seek_frame(struct imv *imv, int frame)
+{
+  const int num_frames = imv->source->num_frames;
+  if (num_frames < 1) {
+    return;
+  }
+  frame %= num_frames;
+  if (frame < 0) {
+    frame += num_frames;
+  }
+
+  /* drop anything loaded ahead of the old position */
+  if (imv->next_frame) {
+    imv_bitmap_free(imv->next_frame);
+    imv->next_frame = NULL;
+  }
+  imv->next_frame_due = 0;
+  imv->seek_target = frame;
+  async_seek_frame(imv, imv->source, frame);
+}
+
+/* Relative to any seek still in progress, so that holding a key down steps
+ * through frames rather than asking for the same one repeatedly */
+static int frame_position(struct imv *imv)
+{
+  return imv->seek_target >= 0 ? imv->seek_target : imv->current_frame;
+}
+
 void command_next_frame(struct list *args, const char *argstr, void *data)
 {
   (void)args;
   (void)argstr;
   struct imv *imv = data;
-  if (imv->source && imv->source->load_next_frame) {
+  if (imv->source && imv->source->seek_frame) {
+    seek_frame(imv, frame_position(imv) + 1);
+  } else if (imv->source && imv->source->load_next_frame) {
     async_load_next_frame(imv->source);
     imv->next_frame_due = 1; /* Earliest possible non-zero timestamp */
   }
 }
 
+void command_prev_frame(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  struct imv *imv = data;
+  if (imv->source && imv->source->seek_frame) {
+    seek_frame(imv, frame_position(imv) - 1);
+  }
+}
+
+void command_goto_frame(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+  if (args->len != 2 || !imv->source || !imv->source->seek_frame) {
+    return;
+  }
+
+  /* negative indices count back from the end, as with select_abs */
+  long frame = strtol(args->items[1], NULL, 10);
+  if (frame < 0) {
+    frame += imv->source->num_frames;
+  }
+  seek_frame(imv, frame);
+}
+
 void command_toggle_playing(struct list *args, const char *argstr, void *data)
 {
   (void)args;
@@ -1637,6 +3538,268 @@ void command_set_slideshow_duration(struct list *args, const char *argstr, void
   }
 }
 
+void command_compare(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+
+  if (!imv->source) {
+    return;
+  }
+
+  if (imv->comparing) {
+    /* back to the image itself, as it was before */
+    imv->comparing = false;
+    imv->compare_text[0] = '\0';
+    if (imv->compare_bitmap) {
+      imv->load_region.x = imv->compare_region.x;
+      imv->load_region.y = imv->compare_region.y;
+      imv->load_region.width = imv->compare_region.width;
+      imv->load_region.height = imv->compare_region.height;
+      set_image_bitmap(imv, imv->compare_bitmap);
+      imv->compare_bitmap = NULL;
+    }
+    imv->need_redraw = true;
+    return;
+  }
+
+  const char *other = imv->previous_path;
+  if (args->len == 2) {
+    /* a path, or a 1-based index as in $imv_current_index */
+    other = args->items[1];
+    char *end;
+    const long index = strtol(other, &end, 10);
+    if (*end == '\0' && index >= 1
+        && (size_t)index <= imv_navigator_length(imv->navigator)) {
+      other = imv_navigator_at(imv->navigator, index - 1);
+    }
+  }
+  if (!other) {
+    fprintf(stderr, "No image to compare with.\n");
+    return;
+  }
+
+  struct compare_job *job = calloc(1, sizeof *job);
+  job->imv = imv;
+  job->current = imv->source;
+  const char *paths[2] = { imv_navigator_selection(imv->navigator), other };
+  for (int i = 0; i < 2; ++i) {
+    if (open_image(imv, paths[i], &job->sources[i]) != BACKEND_SUCCESS) {
+      fprintf(stderr, "Unable to open %s for comparison.\n", paths[i]);
+      if (i == 1) {
+        job->sources[0]->free(job->sources[0]);
+      }
+      free(job);
+      return;
+    }
+    job->sources[i]->callback = &compare_source_callback;
+    job->sources[i]->user_data = job;
+  }
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+
+  SDL_Thread *thread = SDL_CreateThread(compare_thread, "compare", job);
+  SDL_DetachThread(thread);
+}
+
+/* Queue an operation on the current file. Files being moved or trashed are
+ * taken off the list straight away, moving on to the next, rather than once
+ * the operation's done */
+static void queue_fileop(struct imv *imv, enum imv_fileop op, const char *dest)
+{
+  const char *path = imv_navigator_selection(imv->navigator);
+  if (!strcmp(path, "") || !strcmp(path, "-")) {
+    fprintf(stderr, "No file to operate on.\n");
+    return;
+  }
+
+  if (!imv->fileops) {
+    imv->fileops = imv_fileops_create(&fileops_callback, imv);
+    if (!imv->fileops) {
+      fprintf(stderr, "Unable to start file operation thread.\n");
+      return;
+    }
+  }
+
+  imv_fileops_queue(imv->fileops, op, path, dest);
+
+  if (op != IMV_FILEOP_COPY) {
+    char *removed = strdup(path);
+    imv_navigator_remove(imv->navigator, removed);
+    free(removed);
+    imv->slideshow_time_elapsed = 0;
+  }
+}
+
+/* Expand the directory given to copy or move, e.g. "~/keep" */
+static char *expand_dir(const char *str)
+{
+  char *dir = NULL;
+  wordexp_t word;
+  if (wordexp(str, &word, WRDE_NOCMD) == 0) {
+    if (word.we_wordc == 1) {
+      dir = strdup(word.we_wordv[0]);
+    }
+    wordfree(&word);
+  }
+  if (!dir) {
+    fprintf(stderr, "Invalid directory: %s\n", str);
+  }
+  return dir;
+}
+
+void command_copy(struct list *args, const char *argstr, void *data)
+{
+  struct imv *imv = data;
+  if (args->len < 2) {
+    return;
+  }
+  char *dir = expand_dir(argstr);
+  if (dir) {
+    queue_fileop(imv, IMV_FILEOP_COPY, dir);
+    free(dir);
+  }
+}
+
+void command_move(struct list *args, const char *argstr, void *data)
+{
+  struct imv *imv = data;
+  if (args->len < 2) {
+    return;
+  }
+  char *dir = expand_dir(argstr);
+  if (dir) {
+    queue_fileop(imv, IMV_FILEOP_MOVE, dir);
+    free(dir);
+  }
+}
+
+void command_trash(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  struct imv *imv = data;
+  queue_fileop(imv, IMV_FILEOP_TRASH, NULL);
+}
+
+/* A bitmap being decoded afresh, waited for where it's needed */
+struct decode_wait {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool loaded;
+  /* NULL on failure */
+  struct imv_bitmap *bitmap;
+};
+
+static void decode_wait_callback(struct imv_source_message *msg)
+{
+  struct decode_wait *wait = msg->user_data;
+  pthread_mutex_lock(&wait->lock);
+  wait->bitmap = msg->bitmap;
+  wait->loaded = true;
+  pthread_cond_signal(&wait->cond);
+  pthread_mutex_unlock(&wait->lock);
+}
+
+/* Share a bitmap covering bitmap_region of the image shown, or region of it,
+ * with other processes, as $imv_export */
+static void export_bitmap(struct imv *imv, const struct imv_bitmap *bitmap,
+    const struct imv_export_region *bitmap_region,
+    const struct imv_export_region *region)
+{
+  struct imv_export *export = imv_export_create(bitmap,
+      imv->current_image.width, imv->current_image.height,
+      bitmap_region, region);
+  if (!export) {
+    fprintf(stderr, "Unable to export the image.\n");
+    return;
+  }
+
+  imv_export_free(imv->export);
+  imv->export = export;
+  setenv("imv_export", imv_export_path(export), 1);
+}
+
+/* Decode the first frame of an image again, from scratch, returning NULL if
+ * it can't be */
+static struct imv_bitmap *decode_afresh(struct imv *imv, const char *path)
+{
+  struct imv_source *src;
+  if (open_image(imv, path, &src) != BACKEND_SUCCESS) {
+    return NULL;
+  }
+
+  struct decode_wait wait = { .loaded = false, .bitmap = NULL };
+  pthread_mutex_init(&wait.lock, NULL);
+  pthread_cond_init(&wait.cond, NULL);
+  src->callback = &decode_wait_callback;
+  src->user_data = &wait;
+
+  const bool started = !src->load_first_frame(src);
+  pthread_mutex_lock(&wait.lock);
+  while (started && !wait.loaded) {
+    pthread_cond_wait(&wait.cond, &wait.lock);
+  }
+  pthread_mutex_unlock(&wait.lock);
+  src->free(src);
+
+  pthread_mutex_destroy(&wait.lock);
+  pthread_cond_destroy(&wait.cond);
+  return wait.bitmap;
+}
+
+/* Share the pixels decoded for the image shown, or an area of it, with
+ * other processes, as $imv_export */
+void command_export(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+
+  if (args->len != 1 && args->len != 5) {
+    fprintf(stderr, "Usage: export [<x> <y> <width> <height>]\n");
+    return;
+  }
+
+  if (!imv->source) {
+    fprintf(stderr, "No image to export.\n");
+    return;
+  }
+
+  struct imv_export_region region = {0, 0, 0, 0};
+  if (args->len == 5) {
+    region.x = strtol(args->items[1], NULL, 10);
+    region.y = strtol(args->items[2], NULL, 10);
+    region.width = strtol(args->items[3], NULL, 10);
+    region.height = strtol(args->items[4], NULL, 10);
+  }
+
+  if (imv->bitmap) {
+    const struct imv_export_region bitmap_region = {
+      imv->bitmap_region.x, imv->bitmap_region.y,
+      imv->bitmap_region.width, imv->bitmap_region.height
+    };
+    export_bitmap(imv, imv->bitmap, &bitmap_region,
+        args->len == 5 ? &region : &bitmap_region);
+    return;
+  }
+
+  /* the bitmap shown wasn't kept, so decode the image again, and keep them
+   * from now on in case there are more exports to come */
+  imv->keep_bitmap = true;
+  struct imv_bitmap *bitmap = decode_afresh(imv,
+      imv_navigator_selection(imv->navigator));
+  if (!bitmap) {
+    fprintf(stderr, "Unable to export the image.\n");
+    return;
+  }
+  /* at full resolution, whatever was shown */
+  const struct imv_export_region all = {
+    0, 0, imv->current_image.width, imv->current_image.height
+  };
+  export_bitmap(imv, bitmap, &all, args->len == 5 ? &region : &all);
+  imv_bitmap_free(bitmap);
+}
+
 static void update_env_vars(struct imv *imv)
 {
   char str[64];
@@ -1669,6 +3832,10 @@ static void update_env_vars(struct imv *imv)
 
   snprintf(str, sizeof str, "%zu", imv->slideshow_time_elapsed / 1000);
   setenv("imv_slidshow_elapsed", str, 1);
+
+  setenv("imv_compare", imv->compare_text, 1);
+  setenv("imv_fileops", imv->fileops_text, 1);
+  setenv("imv_export", imv->export ? imv_export_path(imv->export) : "", 1);
 }
 
 static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len, const char *format)
@@ -12,6 +12,10 @@ void imv_free(struct imv *imv);
 /* Used in reverse addition order. Most recently added is the first used. */
 void imv_install_backend(struct imv *imv, const struct imv_backend *backend);
 
+/* As imv_install_backend, but the backend is built as a module by the given
+ * name, and only loaded once a file that may need it is opened. */
+void imv_install_backend_module(struct imv *imv, const char *name);
+
 bool imv_load_config(struct imv *imv);
 bool imv_parse_args(struct imv *imv, int argc, char **argv);
 
@@ -2,11 +2,21 @@
 
 #include "backend.h"
 
+#include "backend_builtin.h"
+#include "backend_ffmpeg.h"
 #include "backend_freeimage.h"
 #include "backend_libtiff.h"
 #include "backend_libpng.h"
 #include "backend_libjpeg.h"
 #include "backend_librsvg.h"
+#include "backend_openexr.h"
+#include "backend_openjpeg.h"
+
+#ifdef IMV_BACKEND_MODULES
+#define INSTALL_BACKEND(imv, name) imv_install_backend_module(imv, #name)
+#else
+#define INSTALL_BACKEND(imv, name) imv_install_backend(imv, imv_backend_##name())
+#endif
 
 int main(int argc, char** argv)
 {
@@ -16,24 +26,43 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  /* only tried once no image backend claims a file */
+#ifdef IMV_BACKEND_FFMPEG
+  INSTALL_BACKEND(imv, ffmpeg);
+#endif
+
 #ifdef IMV_BACKEND_FREEIMAGE
-  imv_install_backend(imv, imv_backend_freeimage());
+  INSTALL_BACKEND(imv, freeimage);
 #endif
 
 #ifdef IMV_BACKEND_LIBTIFF
-  imv_install_backend(imv, imv_backend_libtiff());
+  INSTALL_BACKEND(imv, libtiff);
 #endif
 
 #ifdef IMV_BACKEND_LIBPNG
-  imv_install_backend(imv, imv_backend_libpng());
+  INSTALL_BACKEND(imv, libpng);
 #endif
 
 #ifdef IMV_BACKEND_LIBJPEG
-  imv_install_backend(imv, imv_backend_libjpeg());
+  INSTALL_BACKEND(imv, libjpeg);
 #endif
 
 #ifdef IMV_BACKEND_LIBRSVG
-  imv_install_backend(imv, imv_backend_librsvg());
+  INSTALL_BACKEND(imv, librsvg);
+#endif
+
+#ifdef IMV_BACKEND_OPENEXR
+  INSTALL_BACKEND(imv, openexr);
+#endif
+
+#ifdef IMV_BACKEND_OPENJPEG
+  INSTALL_BACKEND(imv, openjpeg);
+#endif
+
+  /* installed last so that it's tried first: it only claims formats it can
+   * decode faster than the general purpose libraries */
+#ifdef IMV_BACKEND_BUILTIN
+  imv_install_backend(imv, imv_backend_builtin());
 #endif
 
   if(!imv_load_config(imv)) {
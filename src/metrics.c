@@ -0,0 +1,283 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "procstat.h"
+
+/* Upper bounds of the histograms' buckets, in seconds, as Prometheus'
+ * client libraries default to. Each has a final +Inf bucket besides */
+static const double buckets[] = {
+  0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define NUM_BUCKETS (sizeof buckets / sizeof buckets[0])
+
+/* Backends are few, so decode times are kept for this many by name, and
+ * any beyond them are lumped together */
+#define MAX_BACKENDS 16
+
+struct histogram {
+  unsigned long counts[NUM_BUCKETS + 1];
+  unsigned long count;
+  double sum;
+};
+
+struct backend_stats {
+  char name[32];
+  struct histogram decode;
+};
+
+struct imv_metrics {
+  char *path;
+  char *tmp_path;
+  unsigned long interval;
+
+  bool written;
+  unsigned int last_write;
+
+  unsigned long images;
+  unsigned long frames;
+  unsigned long dropped_frames;
+  unsigned long decode_failures;
+
+  struct backend_stats backends[MAX_BACKENDS];
+  int num_backends;
+  struct histogram upload;
+};
+
+struct imv_metrics *imv_metrics_create(const char *path,
+                                       unsigned long interval)
+{
+  const size_t len = strlen(path) + sizeof ".tmp";
+  char *tmp_path = malloc(len);
+  snprintf(tmp_path, len, "%s.tmp", path);
+
+  /* fail early rather than on the first write */
+  FILE *f = fopen(tmp_path, "w");
+  if (!f) {
+    free(tmp_path);
+    return NULL;
+  }
+  fclose(f);
+  unlink(tmp_path);
+
+  struct imv_metrics *metrics = calloc(1, sizeof *metrics);
+  metrics->path = strdup(path);
+  metrics->tmp_path = tmp_path;
+  metrics->interval = interval;
+  return metrics;
+}
+
+void imv_metrics_free(struct imv_metrics *metrics)
+{
+  if (!metrics) {
+    return;
+  }
+
+  free(metrics->path);
+  free(metrics->tmp_path);
+  free(metrics);
+}
+
+static void observe(struct histogram *hist, double value)
+{
+  size_t i = 0;
+  while (i < NUM_BUCKETS && value > buckets[i]) {
+    ++i;
+  }
+  hist->counts[i]++;
+  hist->count++;
+  hist->sum += value;
+}
+
+void imv_metrics_image_shown(struct imv_metrics *metrics)
+{
+  metrics->images++;
+}
+
+void imv_metrics_frame_shown(struct imv_metrics *metrics, int dropped)
+{
+  metrics->frames++;
+  if (dropped > 0) {
+    metrics->dropped_frames += dropped;
+  }
+}
+
+void imv_metrics_decode(struct imv_metrics *metrics, const char *backend,
+                        double seconds)
+{
+  if (!backend) {
+    backend = "unknown";
+  }
+
+  struct backend_stats *stats = NULL;
+  for (int i = 0; i < metrics->num_backends && !stats; ++i) {
+    if (!strcmp(metrics->backends[i].name, backend)) {
+      stats = &metrics->backends[i];
+    }
+  }
+
+  if (!stats) {
+    if (metrics->num_backends < MAX_BACKENDS) {
+      stats = &metrics->backends[metrics->num_backends++];
+      snprintf(stats->name, sizeof stats->name, "%s", backend);
+    } else {
+      stats = &metrics->backends[MAX_BACKENDS - 1];
+      snprintf(stats->name, sizeof stats->name, "other");
+    }
+  }
+
+  observe(&stats->decode, seconds);
+}
+
+void imv_metrics_decode_failed(struct imv_metrics *metrics)
+{
+  metrics->decode_failures++;
+}
+
+void imv_metrics_upload(struct imv_metrics *metrics, double seconds)
+{
+  observe(&metrics->upload, seconds);
+}
+
+bool imv_metrics_due(const struct imv_metrics *metrics, unsigned int now)
+{
+  return !metrics->written || now - metrics->last_write >= metrics->interval;
+}
+
+/* Write a label value, escaped as the text format requires */
+static void write_label(FILE *f, const char *value)
+{
+  for (const char *c = value; *c; ++c) {
+    if (*c == '\\' || *c == '"') {
+      fprintf(f, "\\%c", *c);
+    } else if (*c == '\n') {
+      fputs("\\n", f);
+    } else {
+      fputc(*c, f);
+    }
+  }
+}
+
+static void write_header(FILE *f, const char *name, const char *type,
+                         const char *help)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_counter(FILE *f, const char *name, const char *help,
+                          unsigned long value)
+{
+  write_header(f, name, "counter", help);
+  fprintf(f, "%s %lu\n", name, value);
+}
+
+static void write_gauge(FILE *f, const char *name, const char *help,
+                        long long value)
+{
+  /* values that couldn't be determined are left out */
+  if (value < 0) {
+    return;
+  }
+  write_header(f, name, "gauge", help);
+  fprintf(f, "%s %lld\n", name, value);
+}
+
+/* Write a histogram's samples, labelled with the backend if not NULL. The
+ * header is written separately, as several backends share it */
+static void write_histogram(FILE *f, const char *name, const char *backend,
+                            const struct histogram *hist)
+{
+  unsigned long cumulative = 0;
+  for (size_t i = 0; i <= NUM_BUCKETS; ++i) {
+    cumulative += hist->counts[i];
+    fprintf(f, "%s_bucket{", name);
+    if (backend) {
+      fputs("backend=\"", f);
+      write_label(f, backend);
+      fputs("\",", f);
+    }
+    if (i < NUM_BUCKETS) {
+      fprintf(f, "le=\"%g\"} %lu\n", buckets[i], cumulative);
+    } else {
+      fprintf(f, "le=\"+Inf\"} %lu\n", cumulative);
+    }
+  }
+
+  const char *suffixes[] = {"_sum", "_count"};
+  for (int i = 0; i < 2; ++i) {
+    fprintf(f, "%s%s", name, suffixes[i]);
+    if (backend) {
+      fputs("{backend=\"", f);
+      write_label(f, backend);
+      fputs("\"}", f);
+    }
+    if (i == 0) {
+      fprintf(f, " %.6f\n", hist->sum);
+    } else {
+      fprintf(f, " %lu\n", hist->count);
+    }
+  }
+}
+
+bool imv_metrics_write(struct imv_metrics *metrics, unsigned int now,
+                       const struct imv_image_stats *textures)
+{
+  metrics->written = true;
+  metrics->last_write = now;
+
+  FILE *f = fopen(metrics->tmp_path, "w");
+  if (!f) {
+    return false;
+  }
+
+  struct imv_procstat stats;
+  imv_procstat_read(&stats);
+
+  write_counter(f, "imv_images_shown_total",
+      "Images displayed.", metrics->images);
+  write_counter(f, "imv_frames_shown_total",
+      "Frames of animated images displayed.", metrics->frames);
+  write_counter(f, "imv_frames_dropped_total",
+      "Frames of animated images skipped by showing the next one late.",
+      metrics->dropped_frames);
+  write_counter(f, "imv_decode_failures_total",
+      "Images that failed to decode.", metrics->decode_failures);
+
+  write_header(f, "imv_decode_seconds", "histogram",
+      "Time from asking for an image to decode to its bitmap arriving.");
+  for (int i = 0; i < metrics->num_backends; ++i) {
+    write_histogram(f, "imv_decode_seconds", metrics->backends[i].name,
+        &metrics->backends[i].decode);
+  }
+
+  write_header(f, "imv_upload_seconds", "histogram",
+      "Time taken to upload a bitmap to textures.");
+  write_histogram(f, "imv_upload_seconds", NULL, &metrics->upload);
+
+  write_counter(f, "imv_texture_cache_hits_total",
+      "Textures reused from earlier bitmaps.", textures->pool_hits);
+  write_counter(f, "imv_texture_cache_misses_total",
+      "Textures that had to be created.", textures->pool_misses);
+  write_gauge(f, "imv_texture_bytes",
+      "Size of the textures held, in use or cached.", textures->texture_bytes);
+
+  write_gauge(f, "imv_resident_memory_bytes",
+      "Resident set size of the process.",
+      stats.rss_kb < 0 ? -1 : stats.rss_kb * 1024LL);
+  write_gauge(f, "imv_threads",
+      "Threads in the process.", stats.threads);
+  write_gauge(f, "imv_heap_used_bytes",
+      "Memory allocated by the process.", stats.heap_used);
+
+  const bool ok = !ferror(f);
+  if (fclose(f) || !ok || rename(metrics->tmp_path, metrics->path)) {
+    unlink(metrics->tmp_path);
+    return false;
+  }
+  return true;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,51 @@
+#ifndef IMV_METRICS_H
+#define IMV_METRICS_H
+
+#include <stdbool.h>
+
+#include "image.h"
+
+struct imv_metrics;
+
+/* Creates an instance of imv_metrics, which counts what imv does and how
+ * long it takes, and periodically writes it to the file at path in the
+ * Prometheus text format, as read by node_exporter's textfile collector.
+ * interval is in milliseconds. Returns NULL if path is unusable.
+ */
+struct imv_metrics *imv_metrics_create(const char *path,
+                                       unsigned long interval);
+
+/* Cleans up an imv_metrics instance. The file is left as last written */
+void imv_metrics_free(struct imv_metrics *metrics);
+
+/* Record that a new image has been displayed */
+void imv_metrics_image_shown(struct imv_metrics *metrics);
+
+/* Record that a new frame of an animated image has been displayed, and how
+ * many frames' worth of time it was late by */
+void imv_metrics_frame_shown(struct imv_metrics *metrics, int dropped);
+
+/* Record how long an image took to decode with the named backend, in
+ * seconds */
+void imv_metrics_decode(struct imv_metrics *metrics, const char *backend,
+                        double seconds);
+
+/* Record that an image failed to decode */
+void imv_metrics_decode_failed(struct imv_metrics *metrics);
+
+/* Record how long a bitmap took to upload to textures, in seconds */
+void imv_metrics_upload(struct imv_metrics *metrics, double seconds);
+
+/* Whether it's time to write the metrics out again. now is a millisecond
+ * timestamp */
+bool imv_metrics_due(const struct imv_metrics *metrics, unsigned int now);
+
+/* Write the metrics out, along with the given texture usage. The file is
+ * replaced atomically so it's never read half written. Returns false if it
+ * can't be written */
+bool imv_metrics_write(struct imv_metrics *metrics, unsigned int now,
+                       const struct imv_image_stats *textures);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
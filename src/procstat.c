@@ -0,0 +1,90 @@
+#include "procstat.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/* mallinfo2 replaced mallinfo's int fields in glibc 2.33 */
+#if defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define IMV_HAVE_MALLINFO2
+#endif
+
+static void read_rss(struct imv_procstat *stats)
+{
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    long size, resident;
+    if (fscanf(f, "%ld %ld", &size, &resident) == 2) {
+      stats->rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+    fclose(f);
+    if (stats->rss_kb >= 0) {
+      return;
+    }
+  }
+
+  /* No procfs, fall back to the peak value */
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    stats->rss_kb = usage.ru_maxrss;
+  }
+}
+
+static void read_threads(struct imv_procstat *stats)
+{
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f) {
+    return;
+  }
+
+  char line[256];
+  while (fgets(line, sizeof line, f)) {
+    if (!strncmp(line, "Threads:", 8)) {
+      sscanf(line + 8, "%ld", &stats->threads);
+      break;
+    }
+  }
+  fclose(f);
+}
+
+static void read_heap(struct imv_procstat *stats)
+{
+#if defined(IMV_HAVE_MALLINFO2)
+  struct mallinfo2 mi = mallinfo2();
+#elif defined(__GLIBC__)
+  struct mallinfo mi = mallinfo();
+#endif
+
+#ifdef __GLIBC__
+  stats->heap_arena = mi.arena;
+  stats->heap_used = mi.uordblks;
+  stats->heap_free = mi.fordblks;
+  stats->heap_mmap = mi.hblkhd;
+  stats->heap_releasable = mi.keepcost;
+#else
+  (void)stats;
+#endif
+}
+
+void imv_procstat_read(struct imv_procstat *stats)
+{
+  stats->rss_kb = -1;
+  stats->threads = -1;
+  stats->heap_arena = -1;
+  stats->heap_used = -1;
+  stats->heap_free = -1;
+  stats->heap_mmap = -1;
+  stats->heap_releasable = -1;
+
+  read_rss(stats);
+  read_threads(stats);
+  read_heap(stats);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
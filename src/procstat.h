@@ -0,0 +1,28 @@
+#ifndef IMV_PROCSTAT_H
+#define IMV_PROCSTAT_H
+
+/* Resource usage of the imv process at a point in time. Any value that
+ * can't be determined on the current platform is set to -1.
+ */
+struct imv_procstat {
+  /* resident set size, in KiB. Peak RSS where the current value can't be
+   * read */
+  long rss_kb;
+
+  /* number of threads in the process */
+  long threads;
+
+  /* allocator statistics, in bytes */
+  long long heap_arena;      /* non-mmapped memory obtained from the system */
+  long long heap_used;       /* allocated by the program */
+  long long heap_free;       /* held by the allocator but not in use */
+  long long heap_mmap;       /* held in individually mmapped chunks */
+  long long heap_releasable; /* free memory at the top of the heap */
+};
+
+/* Fill stats in with the current process' resource usage */
+void imv_procstat_read(struct imv_procstat *stats);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,205 @@
+#include "resample.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+static float linear_lut[256];
+static pthread_once_t lut_once = PTHREAD_ONCE_INIT;
+
+static void init_lut(void)
+{
+  for (int i = 0; i < 256; ++i) {
+    const double e = i / 255.0;
+    linear_lut[i] = e <= 0.04045 ? e / 12.92 : pow((e + 0.055) / 1.055, 2.4);
+  }
+}
+
+/* The source pixels an output pixel covers along one axis. The first and
+ * last may be partly covered, those between are wholly */
+struct span {
+  int first;
+  int last;
+  float first_weight;
+  float last_weight;
+  float total;
+};
+
+static void make_spans(struct span *spans, int count, double start,
+    double step, int limit)
+{
+  for (int i = 0; i < count; ++i) {
+    const double a = start + i * step;
+    const double b = a + step;
+    struct span *span = &spans[i];
+    span->first = floor(a);
+    span->last = ceil(b) - 1;
+    /* rounding can take the ends a hair past the edge */
+    if (span->first > limit - 1) {
+      span->first = limit - 1;
+    }
+    if (span->last > limit - 1) {
+      span->last = limit - 1;
+    }
+    if (span->last < span->first) {
+      span->last = span->first;
+    }
+    if (span->first == span->last) {
+      span->first_weight = b - a;
+      span->last_weight = 0;
+    } else {
+      span->first_weight = span->first + 1 - a;
+      span->last_weight = b - span->last;
+    }
+    span->total = b - a;
+  }
+}
+
+/* Average a row of the bitmap horizontally into premultiplied linear
+ * colour, four floats per output pixel */
+static void filter_row(const struct imv_bitmap *bmp, int row,
+    const struct span *spans, int count, float *out)
+{
+  const size_t stride = (size_t)bmp->width * imv_bitmap_pixel_size(bmp->format);
+  const unsigned char *bytes = bmp->data + row * stride;
+  const float *floats = (const float*)bytes;
+  const bool is_float = bmp->format == IMV_RGBA_F32;
+
+  for (int i = 0; i < count; ++i) {
+    const struct span *span = &spans[i];
+    float acc[4] = {0, 0, 0, 0};
+    for (int x = span->first; x <= span->last; ++x) {
+      const float w = x == span->first ? span->first_weight
+                    : x == span->last ? span->last_weight : 1.0f;
+      float c[3], a;
+      if (is_float) {
+        const float *p = floats + (size_t)x * 4;
+        a = p[3] > 0.0f ? p[3] < 1.0f ? p[3] : 1.0f : 0.0f;
+        c[0] = p[0];
+        c[1] = p[1];
+        c[2] = p[2];
+      } else {
+        const unsigned char *p = bytes + (size_t)x * 4;
+        a = p[3] * (1.0f / 255);
+        c[0] = linear_lut[p[0]];
+        c[1] = linear_lut[p[1]];
+        c[2] = linear_lut[p[2]];
+      }
+      const float wa = w * a;
+      acc[0] += wa * c[0];
+      acc[1] += wa * c[1];
+      acc[2] += wa * c[2];
+      acc[3] += wa;
+    }
+    out[i * 4 + 0] = acc[0];
+    out[i * 4 + 1] = acc[1];
+    out[i * 4 + 2] = acc[2];
+    out[i * 4 + 3] = acc[3];
+  }
+}
+
+/* Divide out the weights and alpha, and store a row of the result */
+static void store_row(struct imv_bitmap *out, int row, const float *acc,
+    const struct span *spans, float vertical_total)
+{
+  const bool is_float = out->format == IMV_RGBA_F32;
+  float *floats = (float*)out->data + (size_t)row * out->width * 4;
+  unsigned char *bytes = out->data + (size_t)row * out->width * 4;
+  const unsigned char *lut = imv_srgb_lut();
+
+  for (int x = 0; x < out->width; ++x) {
+    const float *p = acc + x * 4;
+    const float alpha = p[3] / (spans[x].total * vertical_total);
+    const float unpremultiply = p[3] > 0.0f ? 1.0f / p[3] : 0.0f;
+    if (is_float) {
+      floats[x * 4 + 0] = p[0] * unpremultiply;
+      floats[x * 4 + 1] = p[1] * unpremultiply;
+      floats[x * 4 + 2] = p[2] * unpremultiply;
+      floats[x * 4 + 3] = alpha;
+    } else {
+      bytes[x * 4 + 0] = imv_to_srgb(lut, p[0] * unpremultiply);
+      bytes[x * 4 + 1] = imv_to_srgb(lut, p[1] * unpremultiply);
+      bytes[x * 4 + 2] = imv_to_srgb(lut, p[2] * unpremultiply);
+      bytes[x * 4 + 3] = alpha >= 1.0f ? 255 : alpha * 255 + 0.5f;
+    }
+  }
+}
+
+struct imv_bitmap *imv_resample(const struct imv_bitmap *bmp,
+    double x, double y, double width, double height,
+    int out_width, int out_height,
+    imv_resample_cancelled cancelled, void *data)
+{
+  if (out_width <= 0 || out_height <= 0 || width <= 0 || height <= 0
+      || x < 0 || y < 0 || x + width > bmp->width + 1e-6
+      || y + height > bmp->height + 1e-6) {
+    return NULL;
+  }
+
+  pthread_once(&lut_once, init_lut);
+
+  struct span *columns = malloc(out_width * sizeof *columns);
+  struct span *rows = malloc(out_height * sizeof *rows);
+  float *acc = malloc(out_width * 4 * sizeof *acc);
+  float *line = malloc(out_width * 4 * sizeof *line);
+  struct imv_bitmap *out = malloc(sizeof *out);
+  const size_t pixel_size = imv_bitmap_pixel_size(bmp->format);
+  unsigned char *pixels = malloc((size_t)out_width * out_height * pixel_size);
+
+  if (!columns || !rows || !acc || !line || !out || !pixels) {
+    free(columns);
+    free(rows);
+    free(acc);
+    free(line);
+    free(out);
+    free(pixels);
+    return NULL;
+  }
+
+  out->width = out_width;
+  out->height = out_height;
+  out->format = bmp->format;
+  out->opaque = bmp->opaque;
+  out->data = pixels;
+  out->mapped = 0;
+
+  make_spans(columns, out_width, x, width / out_width, bmp->width);
+  make_spans(rows, out_height, y, height / out_height, bmp->height);
+
+  /* a source row on the boundary between two output rows is used by both,
+   * so the last one filtered is kept */
+  int line_row = -1;
+
+  for (int oy = 0; oy < out_height; ++oy) {
+    if (cancelled && cancelled(data)) {
+      imv_bitmap_free(out);
+      out = NULL;
+      break;
+    }
+
+    const struct span *span = &rows[oy];
+    for (int i = 0; i < out_width * 4; ++i) {
+      acc[i] = 0;
+    }
+    for (int row = span->first; row <= span->last; ++row) {
+      const float w = row == span->first ? span->first_weight
+                    : row == span->last ? span->last_weight : 1.0f;
+      if (row != line_row) {
+        filter_row(bmp, row, columns, out_width, line);
+        line_row = row;
+      }
+      for (int i = 0; i < out_width * 4; ++i) {
+        acc[i] += w * line[i];
+      }
+    }
+    store_row(out, oy, acc, columns, span->total);
+  }
+
+  free(columns);
+  free(rows);
+  free(acc);
+  free(line);
+  return out;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,24 @@
+#ifndef IMV_RESAMPLE_H
+#define IMV_RESAMPLE_H
+
+#include "bitmap.h"
+
+/* Polled while resampling, returning true to give up part way through */
+typedef bool (*imv_resample_cancelled)(void *data);
+
+/* Resamples an area of a bitmap to the given size by averaging the pixels
+ * each output pixel covers, in linear light and weighted by alpha. The area
+ * may start and end part way through pixels. The result is in the same
+ * format as the bitmap.
+ *
+ * Returns NULL if cancelled, which may be NULL to never cancel, returns true,
+ * or if the area isn't within the bitmap.
+ */
+struct imv_bitmap *imv_resample(const struct imv_bitmap *bmp,
+    double x, double y, double width, double height,
+    int out_width, int out_height,
+    imv_resample_cancelled cancelled, void *data);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,1161 @@
+/* for memfd_create and file sealing */
+#define _GNU_SOURCE
+
+#include "sandbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "source.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#if defined(__x86_64__)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_AARCH64
+#elif defined(__arm__)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_ARM
+#elif defined(__riscv) && __riscv_xlen == 64
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_RISCV64
+#endif
+
+enum request_type {
+  REQUEST_OPEN_PATH,   /* sent with the opened file */
+  REQUEST_OPEN_MEMORY, /* sent with a memfd holding the file's contents */
+  REQUEST_LOAD_FIRST_FRAME,
+  REQUEST_LOAD_NEXT_FRAME,
+  REQUEST_SEEK_FRAME,
+  REQUEST_CLOSE,       /* not replied to */
+};
+
+struct request {
+  enum request_type type;
+
+  /* frame to seek to */
+  int frame;
+
+  /* hints applied before loading the first frame. scale is 0 if unset */
+  double scale;
+  bool has_region;
+  int x, y, width, height;
+  enum imv_source_quality quality;
+};
+
+struct reply {
+  /* a backend_result for opens, else 0 if a frame was loaded */
+  int result;
+
+  /* the source opened, and which optional calls it has */
+  int width;
+  int height;
+  int num_frames;
+  bool can_load_next_frame;
+  bool can_seek_frame;
+  bool can_hint_scale;
+  bool can_hint_region;
+  bool can_hint_quality;
+  char backend[32];
+
+  /* the frame loaded, its pixels sent along in a sealed memfd */
+  int next_frame;
+  int frame;
+  int frametime;
+  int bitmap_width;
+  int bitmap_height;
+  enum imv_pixelformat format;
+  bool opaque;
+};
+
+struct worker {
+  /* connection to the decoder process */
+  int sock;
+  struct worker *next;
+};
+
+struct imv_sandbox {
+  /* connection to the process decoder processes are forked from */
+  int zygote;
+  pid_t zygote_pid;
+
+  /* decoder processes kept ready, at most num_workers */
+  pthread_mutex_t lock;
+  struct worker *idle;
+  int num_idle;
+  int num_workers;
+};
+
+/* state of a decoder process */
+struct worker_state {
+  imv_sandbox_open_func open;
+  void *user_data;
+
+  /* the source being decoded, and the file or memory it's from */
+  struct imv_source *source;
+  int fd;
+  void *data;
+  size_t len;
+
+  /* the source's last message, waited on after each load */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool loaded;
+  struct imv_bitmap *bitmap;
+  int frametime;
+  int frame;
+};
+
+struct private {
+  struct imv_sandbox *sandbox;
+
+  /* the process decoding the image, NULL once it's crashed */
+  struct worker *worker;
+
+  /* hints to pass along with requests for the first frame */
+  double scale;
+  bool has_region;
+  int x, y, width, height;
+  enum imv_source_quality quality;
+
+  /* name of the backend the decoder process opened the image with */
+  char backend[32];
+};
+
+static bool send_message(int sock, const void *buf, size_t len, int fd)
+{
+  struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  if (fd >= 0) {
+    memset(&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+  }
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  return sent == (ssize_t)len;
+}
+
+/* Receives a message of exactly len bytes. If fd isn't NULL it's set to the
+ * file descriptor sent along, or -1 if there wasn't one */
+static bool recv_message(int sock, void *buf, size_t len, int *fd)
+{
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof control.buf,
+  };
+
+  if (fd) {
+    *fd = -1;
+  }
+
+  ssize_t received;
+  do {
+    received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received < 0) {
+    return false;
+  }
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int received_fd;
+      memcpy(&received_fd, CMSG_DATA(cmsg), sizeof received_fd);
+      if (fd && *fd < 0) {
+        *fd = received_fd;
+      } else {
+        close(received_fd);
+      }
+    }
+  }
+
+  if ((size_t)received != len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    if (fd && *fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+/* Loads the low 32 bits of a syscall's argument */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ARG_LOW(n) (offsetof(struct seccomp_data, args) + (n) * 8 + 4)
+#else
+#define ARG_LOW(n) (offsetof(struct seccomp_data, args) + (n) * 8)
+#endif
+#define LOAD_NR BPF_STMT(BPF_LD | BPF_W | BPF_ABS, \
+    offsetof(struct seccomp_data, nr))
+#define LOAD_ARG(n) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ARG_LOW(n))
+#define ALLOW BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+#define FAIL(err) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | (err))
+
+/* Allows the syscall if it's nr */
+#define PERMIT(nr) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), ALLOW
+
+/* Fails the syscall with err if it's nr */
+#define REFUSE(nr, err) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), \
+  FAIL(err)
+
+/* Allows the syscall if it's nr and none of flags are set in argument n */
+#define PERMIT_WITHOUT_FLAGS(nr, n, flags) \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 4), \
+  LOAD_ARG(n), \
+  BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, (flags), 0, 1), \
+  FAIL(EPERM), \
+  ALLOW
+
+/* Allows the syscall if it's nr and any of flags are set in argument n */
+#define PERMIT_WITH_FLAGS(nr, n, flags) \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 4), \
+  LOAD_ARG(n), \
+  BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, (flags), 1, 0), \
+  FAIL(EPERM), \
+  ALLOW
+
+/* Allows the syscall if it's nr and argument n is value */
+#define PERMIT_ARG(nr, n, value) \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 4), \
+  LOAD_ARG(n), \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (value), 1, 0), \
+  FAIL(EPERM), \
+  ALLOW
+
+#define WRITE_FLAGS (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)
+
+/* Limits the process to what decoding needs: reading the files it's sent,
+ * allocating memory, running threads, and talking to imv over sock. Anything
+ * else fails with EPERM, so a decoder taken over by a malicious file can't
+ * start programs, use the network, change files or reach the terminal */
+static bool restrict_syscalls(int sock)
+{
+#ifdef AUDIT_ARCH_NATIVE
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_NATIVE, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+    LOAD_NR,
+#ifdef __x86_64__
+    /* x32 syscall numbers would slip past the checks below */
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+#endif
+
+    /* files, read only */
+    PERMIT_WITHOUT_FLAGS(__NR_openat, 2, WRITE_FLAGS),
+#ifdef __NR_open
+    PERMIT_WITHOUT_FLAGS(__NR_open, 1, WRITE_FLAGS),
+#endif
+#ifdef __NR_openat2
+    /* its flags are in a struct that can't be inspected, so make libc fall
+     * back to openat */
+    REFUSE(__NR_openat2, ENOSYS),
+#endif
+    PERMIT(__NR_read),
+    PERMIT(__NR_readv),
+    PERMIT(__NR_pread64),
+    PERMIT(__NR_lseek),
+#ifdef __NR__llseek
+    PERMIT(__NR__llseek),
+#endif
+    PERMIT(__NR_close),
+    PERMIT(__NR_fstat),
+#ifdef __NR_fstat64
+    PERMIT(__NR_fstat64),
+#endif
+#ifdef __NR_stat
+    PERMIT(__NR_stat),
+#endif
+#ifdef __NR_stat64
+    PERMIT(__NR_stat64),
+#endif
+#ifdef __NR_lstat
+    PERMIT(__NR_lstat),
+#endif
+#ifdef __NR_lstat64
+    PERMIT(__NR_lstat64),
+#endif
+#ifdef __NR_newfstatat
+    PERMIT(__NR_newfstatat),
+#endif
+#ifdef __NR_fstatat64
+    PERMIT(__NR_fstatat64),
+#endif
+#ifdef __NR_statx
+    PERMIT(__NR_statx),
+#endif
+    PERMIT(__NR_fstatfs),
+#ifdef __NR_access
+    PERMIT(__NR_access),
+#endif
+    PERMIT(__NR_faccessat),
+#ifdef __NR_faccessat2
+    PERMIT(__NR_faccessat2),
+#endif
+#ifdef __NR_readlink
+    PERMIT(__NR_readlink),
+#endif
+    PERMIT(__NR_readlinkat),
+    PERMIT(__NR_getdents64),
+    PERMIT(__NR_getcwd),
+    PERMIT(__NR_fcntl),
+#ifdef __NR_fcntl64
+    PERMIT(__NR_fcntl64),
+#endif
+    /* only /dev/null is left on 0-2, so what decoders print goes nowhere */
+    PERMIT(__NR_write),
+    PERMIT(__NR_writev),
+    /* isatty() and the like just get told there's no terminal */
+    REFUSE(__NR_ioctl, ENOTTY),
+
+    /* memory, including the memfds frames are shared with imv in */
+    PERMIT(__NR_brk),
+    PERMIT(__NR_mmap),
+#ifdef __NR_mmap2
+    PERMIT(__NR_mmap2),
+#endif
+    PERMIT(__NR_munmap),
+    PERMIT(__NR_mremap),
+    PERMIT(__NR_mprotect),
+    PERMIT(__NR_madvise),
+    PERMIT(__NR_memfd_create),
+    PERMIT(__NR_ftruncate),
+#ifdef __NR_ftruncate64
+    PERMIT(__NR_ftruncate64),
+#endif
+
+    /* threads only */
+    PERMIT_WITH_FLAGS(__NR_clone, 0, CLONE_THREAD),
+#ifdef __NR_clone3
+    /* its flags can't be inspected, so make libc fall back to clone */
+    REFUSE(__NR_clone3, ENOSYS),
+#endif
+    PERMIT(__NR_futex),
+#ifdef __NR_futex_time64
+    PERMIT(__NR_futex_time64),
+#endif
+    PERMIT(__NR_set_robust_list),
+    PERMIT(__NR_set_tid_address),
+#ifdef __NR_rseq
+    PERMIT(__NR_rseq),
+#endif
+    PERMIT(__NR_sched_yield),
+    PERMIT(__NR_sched_getaffinity),
+    PERMIT_ARG(__NR_prctl, 0, PR_SET_NAME),
+    PERMIT(__NR_exit),
+    PERMIT(__NR_exit_group),
+    PERMIT(__NR_getpid),
+    PERMIT(__NR_gettid),
+
+    /* signals, to this process only. raise() and abort() use tgkill */
+    PERMIT(__NR_rt_sigaction),
+    PERMIT(__NR_rt_sigprocmask),
+    PERMIT(__NR_rt_sigreturn),
+#ifdef __NR_sigreturn
+    PERMIT(__NR_sigreturn),
+#endif
+    PERMIT(__NR_sigaltstack),
+    PERMIT(__NR_restart_syscall),
+    PERMIT_ARG(__NR_tgkill, 0, (uint32_t)getpid()),
+
+    /* time, and odds and ends libraries look up */
+    PERMIT(__NR_clock_gettime),
+#ifdef __NR_clock_gettime64
+    PERMIT(__NR_clock_gettime64),
+#endif
+    PERMIT(__NR_clock_getres),
+    PERMIT(__NR_gettimeofday),
+    PERMIT(__NR_nanosleep),
+    PERMIT(__NR_clock_nanosleep),
+#ifdef __NR_clock_nanosleep_time64
+    PERMIT(__NR_clock_nanosleep_time64),
+#endif
+#ifdef __NR_poll
+    PERMIT(__NR_poll),
+#endif
+    PERMIT(__NR_ppoll),
+    PERMIT(__NR_eventfd2),
+    PERMIT(__NR_pipe2),
+    PERMIT(__NR_getrandom),
+    PERMIT(__NR_uname),
+    PERMIT(__NR_sysinfo),
+    PERMIT(__NR_prlimit64),
+#ifdef __NR_getrlimit
+    PERMIT(__NR_getrlimit),
+#endif
+#ifdef __NR_ugetrlimit
+    PERMIT(__NR_ugetrlimit),
+#endif
+    PERMIT(__NR_getuid),
+    PERMIT(__NR_geteuid),
+    PERMIT(__NR_getgid),
+    PERMIT(__NR_getegid),
+
+    /* imv's connection, and nothing else. socketcall, which some 32 bit
+     * architectures make these through, isn't allowed at all */
+    PERMIT_ARG(__NR_recvmsg, 0, sock),
+    PERMIT_ARG(__NR_sendmsg, 0, sock),
+
+    FAIL(EPERM),
+  };
+  struct sock_fprog program = {
+    .len = sizeof filter / sizeof filter[0],
+    .filter = filter,
+  };
+
+  return !prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)
+      && !prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program);
+#else
+  return false;
+#endif
+}
+
+static void worker_callback(struct imv_source_message *msg)
+{
+  struct worker_state *state = msg->user_data;
+  pthread_mutex_lock(&state->lock);
+  state->loaded = true;
+  state->bitmap = msg->bitmap;
+  state->frametime = msg->frametime;
+  state->frame = msg->frame;
+  pthread_cond_signal(&state->cond);
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void close_source(struct worker_state *state)
+{
+  if (state->source) {
+    state->source->free(state->source);
+    state->source = NULL;
+  }
+  if (state->data) {
+    munmap(state->data, state->len);
+    state->data = NULL;
+  }
+  if (state->fd >= 0) {
+    close(state->fd);
+    state->fd = -1;
+  }
+}
+
+static void worker_open(struct worker_state *state, int sock,
+    const struct request *req, int fd)
+{
+  close_source(state);
+  state->fd = fd;
+
+  struct reply reply = { .result = BACKEND_BAD_PATH };
+  struct imv_source *src = NULL;
+
+  if (fd < 0) {
+    /* nothing to open */
+  } else if (req->type == REQUEST_OPEN_PATH) {
+    /* backends open the path themselves, so give them one to the file */
+    char path[64];
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    reply.result = state->open(state->user_data, path, NULL, 0, &src);
+  } else {
+    struct stat info;
+    if (!fstat(fd, &info) && info.st_size > 0) {
+      void *data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        state->data = data;
+        state->len = info.st_size;
+        reply.result = state->open(state->user_data, NULL, data,
+            state->len, &src);
+      }
+    }
+  }
+
+  if (reply.result == BACKEND_SUCCESS) {
+    state->source = src;
+    src->callback = &worker_callback;
+    src->user_data = state;
+    reply.width = src->width;
+    reply.height = src->height;
+    reply.num_frames = src->num_frames;
+    reply.next_frame = src->next_frame;
+    reply.can_load_next_frame = src->load_next_frame != NULL;
+    reply.can_seek_frame = src->seek_frame != NULL;
+    reply.can_hint_scale = src->set_scale_hint != NULL;
+    reply.can_hint_region = src->set_region_hint != NULL;
+    reply.can_hint_quality = src->set_quality_hint != NULL;
+    snprintf(reply.backend, sizeof reply.backend, "%s",
+        src->backend ? src->backend : "");
+  } else {
+    close_source(state);
+  }
+
+  send_message(sock, &reply, sizeof reply, -1);
+}
+
+/* Copies a bitmap's pixels into a memfd sealed against any further change,
+ * so that imv can map them directly. Returns -1 on failure */
+static int share_bitmap(const struct imv_bitmap *bmp)
+{
+  const size_t len = imv_bitmap_pixel_size(bmp->format)
+                   * bmp->width * bmp->height;
+  int memfd = memfd_create("imv-bitmap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    return -1;
+  }
+
+  void *data = MAP_FAILED;
+  if (!ftruncate(memfd, len)) {
+    data = mmap(NULL, len, PROT_WRITE, MAP_SHARED, memfd, 0);
+  }
+  if (data == MAP_FAILED) {
+    close(memfd);
+    return -1;
+  }
+  memcpy(data, bmp->data, len);
+  munmap(data, len);
+
+  if (fcntl(memfd, F_ADD_SEALS,
+        F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+    close(memfd);
+    return -1;
+  }
+  return memfd;
+}
+
+static void worker_load(struct worker_state *state, int sock,
+    const struct request *req)
+{
+  struct reply reply = { .result = -1 };
+  struct imv_source *src = state->source;
+  int memfd = -1;
+
+  pthread_mutex_lock(&state->lock);
+  state->loaded = false;
+  state->bitmap = NULL;
+  pthread_mutex_unlock(&state->lock);
+
+  int ret = 1;
+  if (!src) {
+    /* nothing open */
+  } else if (req->type == REQUEST_LOAD_FIRST_FRAME) {
+    if (req->scale > 0 && src->set_scale_hint) {
+      src->set_scale_hint(src, req->scale);
+    }
+    if (req->has_region && src->set_region_hint) {
+      src->set_region_hint(src, req->x, req->y, req->width, req->height);
+    }
+    if (src->set_quality_hint) {
+      src->set_quality_hint(src, req->quality);
+    }
+    ret = src->load_first_frame(src);
+  } else if (req->type == REQUEST_LOAD_NEXT_FRAME && src->load_next_frame) {
+    ret = src->load_next_frame(src);
+  } else if (req->type == REQUEST_SEEK_FRAME && src->seek_frame) {
+    ret = src->seek_frame(src, req->frame);
+  }
+
+  if (ret == 0) {
+    pthread_mutex_lock(&state->lock);
+    while (!state->loaded) {
+      pthread_cond_wait(&state->cond, &state->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    struct imv_bitmap *bmp = state->bitmap;
+    if (bmp) {
+      memfd = share_bitmap(bmp);
+      if (memfd >= 0) {
+        reply.result = 0;
+        reply.bitmap_width = bmp->width;
+        reply.bitmap_height = bmp->height;
+        reply.format = bmp->format;
+        reply.opaque = bmp->opaque;
+        reply.frametime = state->frametime;
+        reply.frame = state->frame;
+      }
+      imv_bitmap_free(bmp);
+    }
+    reply.next_frame = src->next_frame;
+  }
+
+  send_message(sock, &reply, sizeof reply, memfd);
+  if (memfd >= 0) {
+    close(memfd);
+  }
+}
+
+static void run_worker(int sock, imv_sandbox_open_func open, void *user_data)
+{
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  /* nothing a decoder does should reach imv's terminal, so 0-2 are pointed
+   * at /dev/null. A copy of stderr is kept until the process is restricted,
+   * to say if anything goes wrong before then */
+  int err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+  int null = openat(AT_FDCWD, "/dev/null", O_RDWR | O_CLOEXEC);
+  if (null < 0 || dup2(null, STDIN_FILENO) < 0
+      || dup2(null, STDOUT_FILENO) < 0 || dup2(null, STDERR_FILENO) < 0) {
+    dprintf(err, "Unable to detach decoder process from the terminal\n");
+    _exit(1);
+  }
+  close(null);
+
+  if (!restrict_syscalls(sock)) {
+    dprintf(err, "Unable to restrict decoder process\n");
+    _exit(1);
+  }
+  close(err);
+
+  struct worker_state state = {
+    .open = open,
+    .user_data = user_data,
+    .fd = -1,
+  };
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.cond, NULL);
+
+  struct request req;
+  int fd;
+  while (recv_message(sock, &req, sizeof req, &fd)) {
+    switch (req.type) {
+      case REQUEST_OPEN_PATH:
+      case REQUEST_OPEN_MEMORY:
+        worker_open(&state, sock, &req, fd);
+        continue;
+      case REQUEST_CLOSE:
+        close_source(&state);
+        break;
+      default:
+        worker_load(&state, sock, &req);
+        break;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  /* imv has gone, or given up on this process */
+  _exit(0);
+}
+
+/* Forks a decoder process for each byte received, sending back a connection
+ * to it. Forking from here rather than imv means they start out single
+ * threaded, with none of imv's windows or files */
+static void run_zygote(int sock, imv_sandbox_open_func open, void *user_data)
+{
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  /* decoder processes are reaped automatically */
+  signal(SIGCHLD, SIG_IGN);
+
+  char c;
+  while (recv_message(sock, &c, 1, NULL)) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair)) {
+      send_message(sock, &c, 1, -1);
+      continue;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      close(pair[0]);
+      run_worker(pair[1], open, user_data);
+    }
+    close(pair[1]);
+    send_message(sock, &c, 1, pid > 0 ? pair[0] : -1);
+    close(pair[0]);
+  }
+
+  _exit(0);
+}
+
+/* Must be called with the lock held */
+static struct worker *spawn_worker(struct imv_sandbox *sandbox)
+{
+  char c = 0;
+  int sock;
+  if (!send_message(sandbox->zygote, &c, 1, -1)
+      || !recv_message(sandbox->zygote, &c, 1, &sock) || sock < 0) {
+    fprintf(stderr, "Unable to start decoder process\n");
+    return NULL;
+  }
+
+  struct worker *worker = calloc(1, sizeof *worker);
+  worker->sock = sock;
+  return worker;
+}
+
+static struct worker *acquire_worker(struct imv_sandbox *sandbox)
+{
+  pthread_mutex_lock(&sandbox->lock);
+  struct worker *worker = sandbox->idle;
+  if (worker) {
+    sandbox->idle = worker->next;
+    sandbox->num_idle--;
+  } else {
+    /* all busy, so this one's extra and won't be kept */
+    worker = spawn_worker(sandbox);
+  }
+  pthread_mutex_unlock(&sandbox->lock);
+  return worker;
+}
+
+static void release_worker(struct imv_sandbox *sandbox, struct worker *worker)
+{
+  pthread_mutex_lock(&sandbox->lock);
+  if (sandbox->num_idle < sandbox->num_workers) {
+    worker->next = sandbox->idle;
+    sandbox->idle = worker;
+    sandbox->num_idle++;
+    worker = NULL;
+  }
+  pthread_mutex_unlock(&sandbox->lock);
+
+  if (worker) {
+    close(worker->sock);
+    free(worker);
+  }
+}
+
+/* Gets rid of a worker that's crashed, starting a replacement */
+static void discard_worker(struct imv_sandbox *sandbox, struct worker *worker)
+{
+  close(worker->sock);
+  free(worker);
+
+  pthread_mutex_lock(&sandbox->lock);
+  if (sandbox->num_idle < sandbox->num_workers) {
+    struct worker *replacement = spawn_worker(sandbox);
+    if (replacement) {
+      replacement->next = sandbox->idle;
+      sandbox->idle = replacement;
+      sandbox->num_idle++;
+    }
+  }
+  pthread_mutex_unlock(&sandbox->lock);
+}
+
+/* Checks that a bitmap sent by a worker is what it claims and can't change
+ * under us, then maps its pixels */
+static struct imv_bitmap *map_bitmap(const struct reply *reply, int memfd)
+{
+  if (memfd < 0 || reply->bitmap_width <= 0 || reply->bitmap_height <= 0) {
+    return NULL;
+  }
+  if (reply->format != IMV_ARGB && reply->format != IMV_ABGR
+      && reply->format != IMV_RGBA_F32) {
+    return NULL;
+  }
+
+  const size_t pixel_size = imv_bitmap_pixel_size(reply->format);
+  if ((size_t)reply->bitmap_width
+      > SIZE_MAX / pixel_size / (size_t)reply->bitmap_height) {
+    return NULL;
+  }
+  const size_t len = pixel_size * reply->bitmap_width * reply->bitmap_height;
+
+  const int required_seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+  const int seals = fcntl(memfd, F_GET_SEALS);
+  struct stat info;
+  if (seals < 0 || (seals & required_seals) != required_seals
+      || fstat(memfd, &info) || (size_t)info.st_size < len) {
+    return NULL;
+  }
+
+  void *data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, memfd, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = reply->bitmap_width;
+  bmp->height = reply->bitmap_height;
+  bmp->format = reply->format;
+  bmp->opaque = reply->opaque;
+  bmp->data = data;
+  bmp->mapped = len;
+  return bmp;
+}
+
+/* Sends a request for a frame and passes on the result. Called with the
+ * source's busy lock held, which it releases */
+static void request_frame(struct imv_source *src, const struct request *req)
+{
+  struct private *private = src->private;
+  struct imv_source_message msg = {
+    .source = src,
+    .user_data = src->user_data,
+  };
+  struct reply reply;
+  int memfd = -1;
+
+  if (!private->worker) {
+    msg.error = "Decoder process crashed";
+  } else if (!send_message(private->worker->sock, req, sizeof *req, -1)
+      || !recv_message(private->worker->sock, &reply, sizeof reply, &memfd)) {
+    fprintf(stderr, "Decoder process crashed loading %s\n", src->name);
+    discard_worker(private->sandbox, private->worker);
+    private->worker = NULL;
+    msg.error = "Decoder process crashed";
+  } else if (reply.result != 0) {
+    msg.error = "Failed to decode image";
+  } else {
+    msg.bitmap = map_bitmap(&reply, memfd);
+    msg.error = msg.bitmap ? NULL : "Invalid bitmap from decoder process";
+    msg.frametime = reply.frametime;
+    msg.frame = reply.frame;
+    src->next_frame = reply.next_frame;
+  }
+
+  if (memfd >= 0) {
+    close(memfd);
+  }
+
+  pthread_mutex_unlock(&src->busy);
+  src->callback(&msg);
+}
+
+static int load_first_frame(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  struct private *private = src->private;
+  struct request req = {
+    .type = REQUEST_LOAD_FIRST_FRAME,
+    .scale = private->scale,
+    .has_region = private->has_region,
+    .x = private->x,
+    .y = private->y,
+    .width = private->width,
+    .height = private->height,
+    .quality = private->quality,
+  };
+  request_frame(src, &req);
+  return 0;
+}
+
+static int load_next_frame(struct imv_source *src)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+
+  struct request req = { .type = REQUEST_LOAD_NEXT_FRAME };
+  request_frame(src, &req);
+  return 0;
+}
+
+static int seek_frame(struct imv_source *src, int frame)
+{
+  /* Don't run if this source is already active */
+  if (pthread_mutex_trylock(&src->busy)) {
+    return -1;
+  }
+  struct request req = { .type = REQUEST_SEEK_FRAME, .frame = frame };
+  request_frame(src, &req);
+  return 0;
+}
+
+static void set_scale_hint(struct imv_source *src, double scale)
+{
+  struct private *private = src->private;
+  private->scale = scale;
+}
+
+static void set_region_hint(struct imv_source *src, int x, int y,
+    int width, int height)
+{
+  struct private *private = src->private;
+  private->has_region = true;
+  private->x = x;
+  private->y = y;
+  private->width = width;
+  private->height = height;
+}
+
+static void set_quality_hint(struct imv_source *src,
+    enum imv_source_quality quality)
+{
+  struct private *private = src->private;
+  private->quality = quality;
+}
+
+static void source_free(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->busy);
+  free(src->name);
+  src->name = NULL;
+
+  struct private *private = src->private;
+  if (private->worker) {
+    /* let the process free the image while it waits to be reused */
+    struct request req = { .type = REQUEST_CLOSE };
+    if (send_message(private->worker->sock, &req, sizeof req, -1)) {
+      release_worker(private->sandbox, private->worker);
+    } else {
+      discard_worker(private->sandbox, private->worker);
+    }
+  }
+
+  free(src->private);
+  src->private = NULL;
+
+  pthread_mutex_unlock(&src->busy);
+  pthread_mutex_destroy(&src->busy);
+  free(src);
+}
+
+/* Opens the file fd in a worker. Takes ownership of fd */
+static enum backend_result open_fd(struct imv_sandbox *sandbox,
+    enum request_type type, int fd, const char *name,
+    struct imv_source **src)
+{
+  struct request req = { .type = type };
+  struct worker *worker = NULL;
+
+  /* an idle worker may have crashed since it was last used, so give a
+   * second one a go if the first can't be reached */
+  for (int attempt = 0; attempt < 2 && !worker; ++attempt) {
+    worker = acquire_worker(sandbox);
+    if (worker && !send_message(worker->sock, &req, sizeof req, fd)) {
+      discard_worker(sandbox, worker);
+      worker = NULL;
+    }
+  }
+  close(fd);
+
+  if (!worker) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct reply reply;
+  if (!recv_message(worker->sock, &reply, sizeof reply, NULL)) {
+    fprintf(stderr, "Decoder process crashed opening %s\n", name);
+    discard_worker(sandbox, worker);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  if (reply.result != BACKEND_SUCCESS) {
+    release_worker(sandbox, worker);
+    return reply.result == BACKEND_BAD_PATH
+      ? BACKEND_BAD_PATH : BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->sandbox = sandbox;
+  private->worker = worker;
+
+  struct imv_source *source = calloc(1, sizeof *source);
+  source->name = strdup(name);
+  reply.backend[sizeof reply.backend - 1] = '\0';
+  memcpy(private->backend, reply.backend, sizeof private->backend);
+  source->backend = private->backend;
+  source->width = reply.width;
+  source->height = reply.height;
+  source->num_frames = reply.num_frames;
+  source->next_frame = reply.next_frame;
+  pthread_mutex_init(&source->busy, NULL);
+  source->load_first_frame = &load_first_frame;
+  if (reply.can_load_next_frame) {
+    source->load_next_frame = &load_next_frame;
+  }
+  if (reply.can_seek_frame) {
+    source->seek_frame = &seek_frame;
+  }
+  if (reply.can_hint_scale) {
+    source->set_scale_hint = &set_scale_hint;
+  }
+  if (reply.can_hint_region) {
+    source->set_region_hint = &set_region_hint;
+  }
+  if (reply.can_hint_quality) {
+    source->set_quality_hint = &set_quality_hint;
+  }
+  source->free = &source_free;
+  source->callback = NULL;
+  source->user_data = NULL;
+  source->private = private;
+
+  *src = source;
+  return BACKEND_SUCCESS;
+}
+
+enum backend_result imv_sandbox_open_path(struct imv_sandbox *sandbox,
+    const char *path, struct imv_source **src)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return BACKEND_BAD_PATH;
+  }
+  return open_fd(sandbox, REQUEST_OPEN_PATH, fd, path, src);
+}
+
+enum backend_result imv_sandbox_open_memory(struct imv_sandbox *sandbox,
+    const void *data, size_t len, struct imv_source **src)
+{
+  int fd = memfd_create("imv-image", MFD_CLOEXEC);
+  if (fd < 0) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  const char *pos = data;
+  while (len > 0) {
+    ssize_t written = write(fd, pos, len);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      close(fd);
+      return BACKEND_UNSUPPORTED;
+    }
+    pos += written;
+    len -= written;
+  }
+
+  return open_fd(sandbox, REQUEST_OPEN_MEMORY, fd, "-", src);
+}
+
+struct imv_sandbox *imv_sandbox_create(int num_workers,
+    imv_sandbox_open_func open, void *user_data)
+{
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair)) {
+    return NULL;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(pair[0]);
+    close(pair[1]);
+    return NULL;
+  }
+  if (pid == 0) {
+    close(pair[0]);
+    run_zygote(pair[1], open, user_data);
+  }
+  close(pair[1]);
+
+  struct imv_sandbox *sandbox = calloc(1, sizeof *sandbox);
+  sandbox->zygote = pair[0];
+  sandbox->zygote_pid = pid;
+  sandbox->num_workers = num_workers;
+  pthread_mutex_init(&sandbox->lock, NULL);
+
+  for (int i = 0; i < num_workers; ++i) {
+    struct worker *worker = spawn_worker(sandbox);
+    if (!worker) {
+      imv_sandbox_free(sandbox);
+      return NULL;
+    }
+    worker->next = sandbox->idle;
+    sandbox->idle = worker;
+    sandbox->num_idle++;
+  }
+
+  return sandbox;
+}
+
+void imv_sandbox_free(struct imv_sandbox *sandbox)
+{
+  if (!sandbox) {
+    return;
+  }
+
+  /* each process exits once its connection is closed */
+  while (sandbox->idle) {
+    struct worker *worker = sandbox->idle;
+    sandbox->idle = worker->next;
+    close(worker->sock);
+    free(worker);
+  }
+  close(sandbox->zygote);
+  waitpid(sandbox->zygote_pid, NULL, 0);
+
+  pthread_mutex_destroy(&sandbox->lock);
+  free(sandbox);
+}
+
+#else
+
+struct imv_sandbox *imv_sandbox_create(int num_workers,
+    imv_sandbox_open_func open, void *user_data)
+{
+  (void)num_workers;
+  (void)open;
+  (void)user_data;
+  fprintf(stderr, "Decoder processes are only supported on Linux\n");
+  return NULL;
+}
+
+void imv_sandbox_free(struct imv_sandbox *sandbox)
+{
+  (void)sandbox;
+}
+
+enum backend_result imv_sandbox_open_path(struct imv_sandbox *sandbox,
+    const char *path, struct imv_source **src)
+{
+  (void)sandbox;
+  (void)path;
+  (void)src;
+  return BACKEND_UNSUPPORTED;
+}
+
+enum backend_result imv_sandbox_open_memory(struct imv_sandbox *sandbox,
+    const void *data, size_t len, struct imv_source **src)
+{
+  (void)sandbox;
+  (void)data;
+  (void)len;
+  (void)src;
+  return BACKEND_UNSUPPORTED;
+}
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,38 @@
+#ifndef IMV_SANDBOX_H
+#define IMV_SANDBOX_H
+
+#include <stddef.h>
+
+#include "backend.h"
+
+struct imv_sandbox;
+
+/* Opens an image with the installed backends, from path, or from data when
+ * it isn't NULL. Called in the decoder processes */
+typedef enum backend_result (*imv_sandbox_open_func)(void *user_data,
+    const char *path, void *data, size_t len, struct imv_source **src);
+
+/* Creates an instance of imv_sandbox, which runs the backends in separate,
+ * restricted processes so that a file that crashes one can't take imv down.
+ * num_workers processes are kept ready, forked from one started now, so this
+ * must be called before any other threads are. open is called in them to
+ * open each image. Returns NULL if the processes can't be started.
+ */
+struct imv_sandbox *imv_sandbox_create(int num_workers,
+    imv_sandbox_open_func open, void *user_data);
+
+/* Stops the decoder processes and cleans up an imv_sandbox instance. Any
+ * sources opened with it must be freed first */
+void imv_sandbox_free(struct imv_sandbox *sandbox);
+
+/* Open an image in a decoder process. The source returned behaves as the
+ * backend's would, with its bitmaps' pixels shared from the process rather
+ * than copied */
+enum backend_result imv_sandbox_open_path(struct imv_sandbox *sandbox,
+    const char *path, struct imv_source **src);
+enum backend_result imv_sandbox_open_memory(struct imv_sandbox *sandbox,
+    const void *data, size_t len, struct imv_source **src);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,462 @@
+#include "session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SESSION_HEADER "imv-session 1"
+
+/* a config value, as the ini parser gives them */
+struct config_value {
+  char *section;
+  char *name;
+  char *value;
+};
+
+/* a step of a replay, and when it's due in milliseconds */
+struct timed_step {
+  unsigned int time;
+  struct imv_session_step step;
+  char *path;
+};
+
+struct frame {
+  double time;    /* when it was presented */
+  double draw;    /* how long drawing and presenting it took */
+  double latency; /* since the input it first shows was due, or -1 */
+};
+
+struct imv_session {
+  bool replaying;
+  Uint64 start;
+
+  /* where a recording is written */
+  FILE *file;
+
+  /* a recording being replayed */
+  struct list *config;
+  struct list *args;
+  struct timed_step *steps;
+  size_t num_steps;
+  size_t next_step;
+
+  /* the frames of the replay, and the time the earliest input not yet
+   * shown was due, or -1 */
+  char *report_path;
+  struct frame *frames;
+  size_t num_frames;
+  size_t frames_cap;
+  double frame_start;
+  double pending_input;
+};
+
+/* Milliseconds since the session started */
+static double elapsed(const struct imv_session *session)
+{
+  if (!session->start) {
+    return 0;
+  }
+  return (double)(SDL_GetPerformanceCounter() - session->start) * 1000
+       / SDL_GetPerformanceFrequency();
+}
+
+/* Fields are tab separated, so tabs, newlines and backslashes in them are
+ * escaped */
+static void write_field(FILE *f, const char *str)
+{
+  fputc('\t', f);
+  for (const char *c = str; *c; ++c) {
+    if (*c == '\t') {
+      fputs("\\t", f);
+    } else if (*c == '\n') {
+      fputs("\\n", f);
+    } else if (*c == '\\') {
+      fputs("\\\\", f);
+    } else {
+      fputc(*c, f);
+    }
+  }
+}
+
+/* Split a line into its fields, unescaping them in place */
+static int split_fields(char *line, char **fields, int max)
+{
+  int count = 0;
+  char *out = line;
+  fields[count++] = out;
+  for (char *in = line; *in && *in != '\n'; ++in) {
+    if (*in == '\t') {
+      *out++ = '\0';
+      if (count == max) {
+        return count;
+      }
+      fields[count++] = out;
+    } else if (*in == '\\' && in[1]) {
+      ++in;
+      *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+  return count;
+}
+
+struct imv_session *imv_session_record(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return NULL;
+  }
+  fprintf(file, "%s\n", SESSION_HEADER);
+
+  struct imv_session *session = calloc(1, sizeof *session);
+  session->file = file;
+  return session;
+}
+
+/* Parse a recorded step from its fields after the time and type */
+static bool parse_step(struct timed_step *timed, const char *type,
+    char **fields, int count)
+{
+  struct imv_session_step *step = &timed->step;
+  SDL_Event *e = &step->event;
+  if (!strcmp(type, "key") && count == 4) {
+    step->type = IMV_SESSION_INPUT;
+    e->type = SDL_KEYDOWN;
+    e->key.state = SDL_PRESSED;
+    e->key.keysym.sym = strtol(fields[0], NULL, 10);
+    e->key.keysym.scancode = strtol(fields[1], NULL, 10);
+    e->key.keysym.mod = strtol(fields[2], NULL, 10);
+    e->key.repeat = strtol(fields[3], NULL, 10);
+  } else if (!strcmp(type, "text") && count == 1) {
+    step->type = IMV_SESSION_INPUT;
+    e->type = SDL_TEXTINPUT;
+    snprintf(e->text.text, sizeof e->text.text, "%s", fields[0]);
+  } else if (!strcmp(type, "wheel") && count == 4) {
+    step->type = IMV_SESSION_INPUT;
+    e->type = SDL_MOUSEWHEEL;
+    e->wheel.x = strtol(fields[0], NULL, 10);
+    e->wheel.y = strtol(fields[1], NULL, 10);
+    step->mouse_x = strtol(fields[2], NULL, 10);
+    step->mouse_y = strtol(fields[3], NULL, 10);
+  } else if (!strcmp(type, "motion") && count == 5) {
+    step->type = IMV_SESSION_INPUT;
+    e->type = SDL_MOUSEMOTION;
+    e->motion.x = step->mouse_x = strtol(fields[0], NULL, 10);
+    e->motion.y = step->mouse_y = strtol(fields[1], NULL, 10);
+    e->motion.xrel = strtol(fields[2], NULL, 10);
+    e->motion.yrel = strtol(fields[3], NULL, 10);
+    e->motion.state = strtoul(fields[4], NULL, 10);
+  } else if (!strcmp(type, "resize") && count == 2) {
+    step->type = IMV_SESSION_RESIZE;
+    step->width = strtol(fields[0], NULL, 10);
+    step->height = strtol(fields[1], NULL, 10);
+  } else if (!strcmp(type, "path") && count == 1) {
+    step->type = IMV_SESSION_PATH;
+    timed->path = strdup(fields[0]);
+    step->path = timed->path;
+  } else if (!strcmp(type, "end") && count == 0) {
+    step->type = IMV_SESSION_END;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct imv_session *imv_session_replay(const char *path,
+    const char *report_path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return NULL;
+  }
+
+  struct imv_session *session = calloc(1, sizeof *session);
+  session->replaying = true;
+  session->config = list_create();
+  session->args = list_create();
+  session->report_path = strdup(report_path);
+  session->pending_input = -1;
+  list_append(session->args, strdup("imv"));
+
+  char line[4096];
+  size_t steps_cap = 0;
+  int line_num = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof line, file)) {
+    ++line_num;
+    if (line_num == 1) {
+      ok = !strncmp(line, SESSION_HEADER "\n", sizeof line);
+      continue;
+    }
+
+    char *fields[8];
+    const int count = split_fields(line, fields, 8);
+    if (!strcmp(fields[0], "config") && count == 4) {
+      struct config_value *value = malloc(sizeof *value);
+      value->section = strdup(fields[1]);
+      value->name = strdup(fields[2]);
+      value->value = strdup(fields[3]);
+      list_append(session->config, value);
+    } else if (!strcmp(fields[0], "arg") && count == 2) {
+      list_append(session->args, strdup(fields[1]));
+    } else if (count >= 2) {
+      if (session->num_steps == steps_cap) {
+        steps_cap = steps_cap ? steps_cap * 2 : 256;
+        session->steps = realloc(session->steps,
+            steps_cap * sizeof *session->steps);
+      }
+      struct timed_step *timed = &session->steps[session->num_steps];
+      memset(timed, 0, sizeof *timed);
+      timed->time = strtoul(fields[0], NULL, 10);
+      ok = parse_step(timed, fields[1], fields + 2, count - 2);
+      session->num_steps += ok;
+    } else {
+      ok = false;
+    }
+  }
+  fclose(file);
+
+  if (!ok) {
+    fprintf(stderr, "Invalid session recording: %s:%d\n", path, line_num);
+    imv_session_free(session);
+    return NULL;
+  }
+  return session;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  const double x = *(const double*)a;
+  const double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/* Write each frame's timings, and summarise them on stderr */
+static void write_report(struct imv_session *session)
+{
+  FILE *f = fopen(session->report_path, "w");
+  if (!f) {
+    fprintf(stderr, "Unable to write replay report: %s\n",
+        session->report_path);
+    return;
+  }
+
+  double *latencies = malloc((session->num_frames + 1) * sizeof *latencies);
+  size_t num_latencies = 0;
+  double total_draw = 0;
+  double max_draw = 0;
+
+  fprintf(f, "frame,time_ms,draw_ms,latency_ms\n");
+  for (size_t i = 0; i < session->num_frames; ++i) {
+    const struct frame *frame = &session->frames[i];
+    fprintf(f, "%zu,%.3f,%.3f,", i, frame->time, frame->draw);
+    if (frame->latency >= 0) {
+      fprintf(f, "%.3f\n", frame->latency);
+      latencies[num_latencies++] = frame->latency;
+    } else {
+      fprintf(f, "\n");
+    }
+    total_draw += frame->draw;
+    max_draw = frame->draw > max_draw ? frame->draw : max_draw;
+  }
+  fclose(f);
+
+  fprintf(stderr, "Replay: %zu frames, draw mean %.2fms max %.2fms",
+      session->num_frames,
+      session->num_frames ? total_draw / session->num_frames : 0, max_draw);
+  if (num_latencies) {
+    qsort(latencies, num_latencies, sizeof *latencies, &compare_doubles);
+    fprintf(stderr, ", input latency p50 %.2fms p95 %.2fms p99 %.2fms max %.2fms",
+        latencies[num_latencies / 2],
+        latencies[num_latencies * 95 / 100],
+        latencies[num_latencies * 99 / 100],
+        latencies[num_latencies - 1]);
+  }
+  fprintf(stderr, "\n");
+  free(latencies);
+}
+
+void imv_session_free(struct imv_session *session)
+{
+  if (!session) {
+    return;
+  }
+
+  if (session->file) {
+    fprintf(session->file, "%.0f\tend\n", elapsed(session));
+    fclose(session->file);
+  }
+
+  if (session->replaying) {
+    if (session->start) {
+      write_report(session);
+    }
+    for (size_t i = 0; i < session->config->len; ++i) {
+      struct config_value *value = session->config->items[i];
+      free(value->section);
+      free(value->name);
+      free(value->value);
+    }
+    list_deep_free(session->config);
+    list_deep_free(session->args);
+    for (size_t i = 0; i < session->num_steps; ++i) {
+      free(session->steps[i].path);
+    }
+    free(session->steps);
+    free(session->frames);
+    free(session->report_path);
+  }
+  free(session);
+}
+
+bool imv_session_is_replay(const struct imv_session *session)
+{
+  return session->replaying;
+}
+
+void imv_session_add_config(struct imv_session *session, const char *section,
+    const char *name, const char *value)
+{
+  fputs("config", session->file);
+  write_field(session->file, section);
+  write_field(session->file, name);
+  write_field(session->file, value);
+  fputc('\n', session->file);
+}
+
+void imv_session_add_arg(struct imv_session *session, const char *arg)
+{
+  fputs("arg", session->file);
+  write_field(session->file, arg);
+  fputc('\n', session->file);
+}
+
+void imv_session_add_path(struct imv_session *session, const char *path)
+{
+  fprintf(session->file, "%.0f\tpath", elapsed(session));
+  write_field(session->file, path);
+  fputc('\n', session->file);
+}
+
+int imv_session_load_config(struct imv_session *session, ini_handler handler,
+    void *user)
+{
+  for (size_t i = 0; i < session->config->len; ++i) {
+    struct config_value *value = session->config->items[i];
+    if (!handler(user, value->section, value->name, value->value)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+struct list *imv_session_args(struct imv_session *session)
+{
+  return session->args;
+}
+
+void imv_session_start(struct imv_session *session)
+{
+  session->start = SDL_GetPerformanceCounter();
+}
+
+bool imv_session_filter_event(struct imv_session *session,
+    const SDL_Event *event)
+{
+  const bool input = event->type == SDL_KEYDOWN
+                  || event->type == SDL_TEXTINPUT
+                  || event->type == SDL_MOUSEWHEEL
+                  || event->type == SDL_MOUSEMOTION;
+  if (session->replaying) {
+    return !input;
+  }
+
+  FILE *f = session->file;
+  const double time = elapsed(session);
+  int mx, my;
+  switch (event->type) {
+    case SDL_KEYDOWN:
+      fprintf(f, "%.0f\tkey\t%d\t%d\t%d\t%d\n", time,
+          (int)event->key.keysym.sym, (int)event->key.keysym.scancode,
+          (int)event->key.keysym.mod, (int)event->key.repeat);
+      break;
+    case SDL_TEXTINPUT:
+      fprintf(f, "%.0f\ttext", time);
+      write_field(f, event->text.text);
+      fputc('\n', f);
+      break;
+    case SDL_MOUSEWHEEL:
+      /* zooming is centred on the pointer */
+      SDL_GetMouseState(&mx, &my);
+      fprintf(f, "%.0f\twheel\t%d\t%d\t%d\t%d\n", time,
+          (int)event->wheel.x, (int)event->wheel.y, mx, my);
+      break;
+    case SDL_MOUSEMOTION:
+      fprintf(f, "%.0f\tmotion\t%d\t%d\t%d\t%d\t%u\n", time,
+          (int)event->motion.x, (int)event->motion.y,
+          (int)event->motion.xrel, (int)event->motion.yrel,
+          (unsigned)event->motion.state);
+      break;
+    case SDL_WINDOWEVENT:
+      if (event->window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+        fprintf(f, "%.0f\tresize\t%d\t%d\n", time,
+            (int)event->window.data1, (int)event->window.data2);
+      }
+      break;
+  }
+  return true;
+}
+
+bool imv_session_next(struct imv_session *session,
+    struct imv_session_step *step, unsigned int *wait)
+{
+  *wait = 0;
+  if (session->next_step == session->num_steps) {
+    return false;
+  }
+
+  const struct timed_step *timed = &session->steps[session->next_step];
+  const double now = elapsed(session);
+  if (timed->time > now) {
+    *wait = timed->time - now + 1;
+    return false;
+  }
+
+  if (timed->step.type == IMV_SESSION_INPUT && session->pending_input < 0) {
+    session->pending_input = timed->time;
+  }
+  *step = timed->step;
+  session->next_step++;
+  return true;
+}
+
+void imv_session_frame_begin(struct imv_session *session)
+{
+  if (session->replaying) {
+    session->frame_start = elapsed(session);
+  }
+}
+
+void imv_session_frame_end(struct imv_session *session)
+{
+  if (!session->replaying) {
+    return;
+  }
+
+  if (session->num_frames == session->frames_cap) {
+    session->frames_cap = session->frames_cap ? session->frames_cap * 2 : 1024;
+    session->frames = realloc(session->frames,
+        session->frames_cap * sizeof *session->frames);
+  }
+
+  struct frame *frame = &session->frames[session->num_frames++];
+  frame->time = elapsed(session);
+  frame->draw = frame->time - session->frame_start;
+  frame->latency = session->pending_input >= 0
+                 ? frame->time - session->pending_input : -1;
+  session->pending_input = -1;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
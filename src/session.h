@@ -0,0 +1,90 @@
+#ifndef IMV_SESSION_H
+#define IMV_SESSION_H
+
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+#include "ini.h"
+#include "list.h"
+
+/* A recording of the input given to imv, along with its config, arguments
+ * and any paths read from stdin, for replaying with the same timing. While
+ * replaying, the latency of each frame is measured for a report.
+ */
+struct imv_session;
+
+enum imv_session_step_type {
+  IMV_SESSION_INPUT,  /* an input event to handle */
+  IMV_SESSION_PATH,   /* a path that was read from stdin */
+  IMV_SESSION_RESIZE, /* the window was resized */
+  IMV_SESSION_END     /* the recording is over */
+};
+
+/* Something that happened during a recorded session */
+struct imv_session_step {
+  enum imv_session_step_type type;
+  /* the input event. For mouse events, where the pointer was */
+  SDL_Event event;
+  int mouse_x;
+  int mouse_y;
+  /* the path read, owned by the session */
+  const char *path;
+  /* the window's new size */
+  int width;
+  int height;
+};
+
+/* Creates a session recording to the file at path. Returns NULL if it can't
+ * be created */
+struct imv_session *imv_session_record(const char *path);
+
+/* Opens the recording at path to replay. The latency report is written to
+ * report_path once the session is freed. Returns NULL if the recording can't
+ * be read */
+struct imv_session *imv_session_replay(const char *path,
+    const char *report_path);
+
+/* Finishes the recording, or writes the report of a replay, and cleans up
+ * an imv_session instance */
+void imv_session_free(struct imv_session *session);
+
+bool imv_session_is_replay(const struct imv_session *session);
+
+/* Record a config value, an argument imv was given, or a path read from
+ * stdin */
+void imv_session_add_config(struct imv_session *session, const char *section,
+    const char *name, const char *value);
+void imv_session_add_arg(struct imv_session *session, const char *arg);
+void imv_session_add_path(struct imv_session *session, const char *path);
+
+/* Pass the recorded config values to handler, as ini_parse does. Returns 0
+ * on success, or the index of the first value rejected, counting from 1 */
+int imv_session_load_config(struct imv_session *session, ini_handler handler,
+    void *user);
+
+/* The recorded arguments, starting with the program's name as argv would */
+struct list *imv_session_args(struct imv_session *session);
+
+/* Start the session's clock. Recorded times are relative to this */
+void imv_session_start(struct imv_session *session);
+
+/* Called with each event from SDL. When recording, records any input.
+ * Returns false if the event should be ignored: real input is while
+ * replaying */
+bool imv_session_filter_event(struct imv_session *session,
+    const SDL_Event *event);
+
+/* Get the next step of a replay if it's due. Returns false if none is, and
+ * sets *wait to the number of milliseconds until the next one */
+bool imv_session_next(struct imv_session *session,
+    struct imv_session_step *step, unsigned int *wait);
+
+/* Mark the start and end of drawing and presenting a frame. A replay's
+ * report has each frame's time to draw, and how long after it was due the
+ * earliest input it's the first to show was */
+void imv_session_frame_begin(struct imv_session *session);
+void imv_session_frame_end(struct imv_session *session);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
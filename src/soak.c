@@ -0,0 +1,128 @@
+#include "soak.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "procstat.h"
+
+struct imv_soak {
+  FILE *log;
+  unsigned long interval;
+  unsigned long duration;
+
+  /* timestamps, in milliseconds */
+  bool started;
+  unsigned int start_time;
+  unsigned int last_sample;
+  unsigned int last_update;
+
+  /* activity counters */
+  unsigned long images;
+  unsigned long frames;
+
+  /* first and most recent RSS, for the summary */
+  long first_rss_kb;
+  long last_rss_kb;
+};
+
+struct imv_soak *imv_soak_create(const char *path, unsigned long interval,
+                                 unsigned long duration)
+{
+  FILE *log = fopen(path, "w");
+  if (!log) {
+    return NULL;
+  }
+
+  struct imv_soak *soak = calloc(1, sizeof *soak);
+  soak->log = log;
+  soak->interval = interval;
+  soak->duration = duration;
+  soak->first_rss_kb = -1;
+  soak->last_rss_kb = -1;
+
+  fprintf(log, "elapsed_s,images,frames,rss_kb,threads,"
+               "heap_arena,heap_used,heap_free,heap_mmap,heap_releasable,"
+               "fragmentation\n");
+  fflush(log);
+  return soak;
+}
+
+static void sample(struct imv_soak *soak, unsigned int now)
+{
+  struct imv_procstat stats;
+  imv_procstat_read(&stats);
+
+  /* share of the allocator's heap that is free but trapped below live
+   * allocations, so can't be trimmed; the closer to 1, the more fragmented */
+  double fragmentation = -1;
+  if (stats.heap_arena > 0) {
+    fragmentation = (double)(stats.heap_free - stats.heap_releasable)
+                  / stats.heap_arena;
+  }
+
+  fprintf(soak->log, "%.1f,%lu,%lu,%ld,%ld,%lld,%lld,%lld,%lld,%lld,%.3f\n",
+      (now - soak->start_time) / 1000.0,
+      soak->images,
+      soak->frames,
+      stats.rss_kb,
+      stats.threads,
+      stats.heap_arena,
+      stats.heap_used,
+      stats.heap_free,
+      stats.heap_mmap,
+      stats.heap_releasable,
+      fragmentation);
+  fflush(soak->log);
+
+  if (soak->first_rss_kb == -1) {
+    soak->first_rss_kb = stats.rss_kb;
+  }
+  soak->last_rss_kb = stats.rss_kb;
+  soak->last_sample = now;
+}
+
+void imv_soak_free(struct imv_soak *soak)
+{
+  if (!soak) {
+    return;
+  }
+
+  if (soak->started) {
+    sample(soak, soak->last_update);
+    fprintf(stderr, "Soak test: %lu images, %lu frames, RSS %ld KiB -> %ld KiB\n",
+        soak->images, soak->frames, soak->first_rss_kb, soak->last_rss_kb);
+  }
+
+  fclose(soak->log);
+  free(soak);
+}
+
+void imv_soak_image_shown(struct imv_soak *soak)
+{
+  soak->images++;
+}
+
+void imv_soak_frame_shown(struct imv_soak *soak)
+{
+  soak->frames++;
+}
+
+bool imv_soak_update(struct imv_soak *soak, unsigned int now)
+{
+  soak->last_update = now;
+
+  if (!soak->started) {
+    soak->started = true;
+    soak->start_time = now;
+    sample(soak, now);
+    return false;
+  }
+
+  if (now - soak->last_sample >= soak->interval) {
+    sample(soak, now);
+  }
+
+  return soak->duration && now - soak->start_time >= soak->duration;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,32 @@
+#ifndef IMV_SOAK_H
+#define IMV_SOAK_H
+
+#include <stdbool.h>
+
+struct imv_soak;
+
+/* Creates an instance of imv_soak, which periodically samples the process'
+ * memory and thread usage and writes it to the file at path as a CSV time
+ * series, replacing anything already there. interval and duration are in
+ * milliseconds. A duration of 0 runs indefinitely. Returns NULL if the log
+ * can't be opened.
+ */
+struct imv_soak *imv_soak_create(const char *path, unsigned long interval,
+                                 unsigned long duration);
+
+/* Writes a final sample and cleans up an imv_soak instance */
+void imv_soak_free(struct imv_soak *soak);
+
+/* Record that a new image has been displayed */
+void imv_soak_image_shown(struct imv_soak *soak);
+
+/* Record that a new frame of an animated image has been displayed */
+void imv_soak_frame_shown(struct imv_soak *soak);
+
+/* Take a sample if one is due. now is a millisecond timestamp. Returns true
+ * once the soak duration has elapsed. */
+bool imv_soak_update(struct imv_soak *soak, unsigned int now);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
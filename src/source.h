@@ -5,6 +5,14 @@
 #include <stdbool.h>
 #include "bitmap.h"
 
+/* How carefully a source decodes its image */
+enum imv_source_quality {
+  /* quickly, perhaps slightly less accurately, for browsing */
+  IMV_QUALITY_FAST,
+  /* as accurately as the backend can, for close inspection */
+  IMV_QUALITY_ACCURATE,
+};
+
 struct imv_source_message {
   /* Pointer to sender of message */
   struct imv_source *source;
@@ -18,6 +26,9 @@ struct imv_source_message {
   /* If an animated gif, the frame's duration in milliseconds, else 0 */
   int frametime;
 
+  /* Index of the frame the bitmap is of, 0 if not animated */
+  int frame;
+
   /* Error message if bitmap was NULL */
   const char *error;
 };
@@ -27,6 +38,10 @@ struct imv_source {
   /* usually the path of the image this is the source of */
   char *name; 
 
+  /* name of the backend that opened it, set by imv rather than the
+   * backend */
+  const char *backend;
+
   /* source's image dimensions */
   int width;
   int height;
@@ -50,6 +65,34 @@ struct imv_source {
   /* Trigger loading of next frame. Returns 0 on success. */
   int (*load_next_frame)(struct imv_source *src);
 
+  /* Optional. Trigger loading of the given frame, after which
+   * load_next_frame continues on from it. Like the others, doesn't run if a
+   * load is already in progress. Returns 0 on success. */
+  int (*seek_frame)(struct imv_source *src, int frame);
+
+  /* Optional. Hint at the scale the image will be displayed at, at most 1.
+   * Sources with reduced resolution versions of the image, e.g. mipmaps,
+   * use it to load the smallest one with enough detail, so their bitmaps
+   * may be smaller than width and height. Takes effect from the next call
+   * to load_first_frame, which may be made again to load more detail.
+   */
+  void (*set_scale_hint)(struct imv_source *src, double scale);
+
+  /* Optional. Hint at the area of the image that's visible, in full
+   * resolution pixels. Sources that can decode part of an image use it to
+   * load only that area, and their bitmaps then cover exactly the hinted
+   * area, clipped to the image. Takes effect as set_scale_hint does.
+   */
+  void (*set_region_hint)(struct imv_source *src, int x, int y,
+      int width, int height);
+
+  /* Optional. Hint at how carefully to decode. Sources with faster but less
+   * accurate ways of decoding use them for IMV_QUALITY_FAST, and are fast
+   * until told otherwise. Takes effect as set_scale_hint does.
+   */
+  void (*set_quality_hint)(struct imv_source *src,
+      enum imv_source_quality quality);
+
   /* Safely free contents of this source. After this returns
    * it is safe to dealocate/overwrite the imv_source instance.
    */
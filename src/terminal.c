@@ -0,0 +1,835 @@
+/* for struct winsize and TIOCGWINSZ */
+#define _DEFAULT_SOURCE
+
+#include "terminal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Cell size assumed when the terminal doesn't report its size in pixels */
+#define DEFAULT_CELL_WIDTH 10
+#define DEFAULT_CELL_HEIGHT 20
+
+/* The screen is divided into tiles of this many cells, and only those that
+ * change between frames are sent again */
+#define TILE_COLS 16
+#define TILE_ROWS 4
+
+/* Bytes of pixels per chunk of a kitty image. A multiple of 3, so that
+ * only the last chunk's base64 is padded */
+#define KITTY_CHUNK 3072
+
+/* Milliseconds to wait for the rest of an escape sequence split across
+ * reads, as happens over slow connections, before taking what's come so far
+ * as keys on their own */
+#define SEQUENCE_TIMEOUT 100
+
+/* The sixel palette is a colour cube with this many levels of each */
+#define RED_LEVELS 6
+#define GREEN_LEVELS 7
+#define BLUE_LEVELS 6
+#define PALETTE_SIZE (RED_LEVELS * GREEN_LEVELS * BLUE_LEVELS)
+
+/* 4x4 ordered dither matrix */
+static const unsigned char bayer[16] = {
+   0,  8,  2, 10,
+  12,  4, 14,  6,
+   3, 11,  1,  9,
+  15,  7, 13,  5,
+};
+
+struct buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct imv_terminal {
+  enum imv_terminal_protocol protocol;
+  int fd;
+  struct termios saved;
+
+  /* size of the terminal and its cells, and of the image area, which is
+   * all but the bottom line */
+  int cols;
+  int rows;
+  int cell_width;
+  int cell_height;
+  int width;
+  int height;
+
+  /* the frame being drawn, and a hash of each tile of it as last sent */
+  unsigned char *frame;
+  int tiles_wide;
+  int tiles_tall;
+  uint64_t *hashes;
+  bool redraw_all;
+
+  char status[512];
+  bool status_dirty;
+
+  /* output waiting to be written, and space for encoding a tile */
+  struct buffer out;
+  unsigned char *scratch;
+  unsigned char *masks;
+
+  /* dithered palette index of each channel, by dither threshold */
+  unsigned char lut_red[16][256];
+  unsigned char lut_green[16][256];
+  unsigned char lut_blue[16][256];
+
+  /* input thread, and the input it's read but not been decoded */
+  pthread_t thread;
+  int wake[2];
+  pthread_mutex_t lock;
+  char input[4096];
+  size_t input_len;
+  /* when input was last read, in milliseconds */
+  long input_time;
+  bool resized;
+  imv_terminal_callback callback;
+  void *data;
+};
+
+static void buffer_reserve(struct buffer *buf, size_t len)
+{
+  if (buf->len + len <= buf->cap) {
+    return;
+  }
+  while (buf->len + len > buf->cap) {
+    buf->cap = buf->cap ? buf->cap * 2 : 65536;
+  }
+  buf->data = realloc(buf->data, buf->cap);
+}
+
+static void buffer_append(struct buffer *buf, const void *data, size_t len)
+{
+  buffer_reserve(buf, len);
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void buffer_printf(struct buffer *buf, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  const int len = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (len <= 0) {
+    return;
+  }
+
+  buffer_reserve(buf, len + 1);
+  va_start(args, format);
+  vsnprintf(buf->data + buf->len, len + 1, format, args);
+  va_end(args);
+  buf->len += len;
+}
+
+static void buffer_base64(struct buffer *buf, const unsigned char *data,
+    size_t len)
+{
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  buffer_reserve(buf, (len + 2) / 3 * 4);
+  char *out = buf->data + buf->len;
+  size_t i = 0;
+  for (; i + 2 < len; i += 3) {
+    const uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+    *out++ = digits[v >> 18];
+    *out++ = digits[(v >> 12) & 63];
+    *out++ = digits[(v >> 6) & 63];
+    *out++ = digits[v & 63];
+  }
+  if (i < len) {
+    const uint32_t v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0);
+    *out++ = digits[v >> 18];
+    *out++ = digits[(v >> 12) & 63];
+    *out++ = i + 1 < len ? digits[(v >> 6) & 63] : '=';
+    *out++ = '=';
+  }
+  buf->len = out - buf->data;
+}
+
+/* Write out everything waiting, however long the terminal takes */
+static void flush(struct imv_terminal *terminal)
+{
+  size_t done = 0;
+  while (done < terminal->out.len) {
+    const ssize_t ret = write(terminal->fd, terminal->out.data + done,
+        terminal->out.len - done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    } else if (ret <= 0) {
+      break;
+    }
+    done += ret;
+  }
+  terminal->out.len = 0;
+}
+
+static void make_lut(unsigned char lut[16][256], int levels)
+{
+  const double step = 255.0 / (levels - 1);
+  for (int t = 0; t < 16; ++t) {
+    const double offset = ((bayer[t] + 0.5) / 16 - 0.5) * step;
+    for (int v = 0; v < 256; ++v) {
+      int level = floor((v + offset) / step + 0.5);
+      if (level < 0) {
+        level = 0;
+      } else if (level > levels - 1) {
+        level = levels - 1;
+      }
+      lut[t][v] = level;
+    }
+  }
+}
+
+/* Pick up the terminal's size, and start everything afresh for it */
+static void read_size(struct imv_terminal *terminal)
+{
+  struct winsize ws;
+  memset(&ws, 0, sizeof ws);
+  ioctl(terminal->fd, TIOCGWINSZ, &ws);
+
+  terminal->cols = ws.ws_col > 0 ? ws.ws_col : 80;
+  terminal->rows = ws.ws_row > 1 ? ws.ws_row : 24;
+  terminal->cell_width = ws.ws_xpixel > 0 && ws.ws_col > 0
+                       ? ws.ws_xpixel / ws.ws_col : DEFAULT_CELL_WIDTH;
+  terminal->cell_height = ws.ws_ypixel > 0 && ws.ws_row > 0
+                        ? ws.ws_ypixel / ws.ws_row : DEFAULT_CELL_HEIGHT;
+  if (terminal->cell_width < 1) {
+    terminal->cell_width = 1;
+  }
+  if (terminal->cell_height < 1) {
+    terminal->cell_height = 1;
+  }
+
+  const int image_rows = terminal->rows - 1;
+  terminal->width = terminal->cols * terminal->cell_width;
+  terminal->height = image_rows * terminal->cell_height;
+  terminal->tiles_wide = (terminal->cols + TILE_COLS - 1) / TILE_COLS;
+  terminal->tiles_tall = (image_rows + TILE_ROWS - 1) / TILE_ROWS;
+
+  free(terminal->frame);
+  free(terminal->hashes);
+  free(terminal->scratch);
+  free(terminal->masks);
+  const int tile_width = TILE_COLS * terminal->cell_width;
+  const int tile_height = TILE_ROWS * terminal->cell_height;
+  terminal->frame = calloc((size_t)terminal->width * terminal->height, 4);
+  terminal->hashes = calloc((size_t)terminal->tiles_wide
+      * terminal->tiles_tall, sizeof *terminal->hashes);
+  terminal->scratch = malloc((size_t)tile_width * tile_height * 3);
+  terminal->masks = calloc((size_t)PALETTE_SIZE * tile_width, 1);
+
+  terminal->redraw_all = true;
+  terminal->status_dirty = true;
+
+  /* anything drawn for the old size has to go */
+  if (terminal->protocol == IMV_TERMINAL_KITTY) {
+    buffer_printf(&terminal->out, "\x1b_Ga=d,d=A,q=2\x1b\\");
+  }
+  buffer_printf(&terminal->out, "\x1b[2J");
+}
+
+static long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void *read_input(void *data)
+{
+  struct imv_terminal *terminal = data;
+
+  struct winsize last;
+  memset(&last, 0, sizeof last);
+  ioctl(terminal->fd, TIOCGWINSZ, &last);
+
+  /* resizes are looked for every so often, as there's no telling which
+   * thread SIGWINCH would arrive on */
+  struct pollfd fds[2] = {
+    { .fd = terminal->fd, .events = POLLIN },
+    { .fd = terminal->wake[0], .events = POLLIN },
+  };
+
+  while (true) {
+    /* input left over is only part of a sequence, so wake up to hand it
+     * over as it is if no more comes */
+    pthread_mutex_lock(&terminal->lock);
+    const bool partial = terminal->input_len > 0;
+    pthread_mutex_unlock(&terminal->lock);
+
+    const int ret = poll(fds, 2, partial ? SEQUENCE_TIMEOUT : 250);
+    if (ret < 0 && errno != EINTR) {
+      break;
+    }
+    if (ret > 0 && fds[1].revents) {
+      break;
+    }
+
+    bool notify = ret == 0 && partial;
+    if (ret > 0 && fds[0].revents & POLLIN) {
+      pthread_mutex_lock(&terminal->lock);
+      const size_t room = sizeof terminal->input - terminal->input_len;
+      ssize_t len = 0;
+      if (room > 0) {
+        len = read(terminal->fd, terminal->input + terminal->input_len, room);
+        if (len > 0) {
+          terminal->input_len += len;
+          terminal->input_time = now_ms();
+          notify = true;
+        }
+      }
+      pthread_mutex_unlock(&terminal->lock);
+      if (len == 0 && room > 0) {
+        /* the terminal's gone */
+        break;
+      }
+    } else if (ret > 0 && fds[0].revents & (POLLHUP | POLLERR)) {
+      break;
+    }
+
+    struct winsize ws;
+    if (!ioctl(terminal->fd, TIOCGWINSZ, &ws)
+        && (ws.ws_col != last.ws_col || ws.ws_row != last.ws_row
+            || ws.ws_xpixel != last.ws_xpixel
+            || ws.ws_ypixel != last.ws_ypixel)) {
+      last = ws;
+      pthread_mutex_lock(&terminal->lock);
+      terminal->resized = true;
+      pthread_mutex_unlock(&terminal->lock);
+      notify = true;
+    }
+
+    if (notify) {
+      terminal->callback(terminal->data);
+    }
+  }
+  return NULL;
+}
+
+enum imv_terminal_protocol imv_terminal_detect(void)
+{
+  const char *term = getenv("TERM");
+  const char *program = getenv("TERM_PROGRAM");
+  if (getenv("KITTY_WINDOW_ID")
+      || (term && (strstr(term, "kitty") || strstr(term, "ghostty")))
+      || (program && (!strcmp(program, "WezTerm")
+                      || !strcmp(program, "ghostty")))) {
+    return IMV_TERMINAL_KITTY;
+  }
+  return IMV_TERMINAL_SIXEL;
+}
+
+struct imv_terminal *imv_terminal_create(enum imv_terminal_protocol protocol,
+    imv_terminal_callback callback, void *data)
+{
+  const int fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct imv_terminal *terminal = calloc(1, sizeof *terminal);
+  terminal->protocol = protocol;
+  terminal->fd = fd;
+  terminal->callback = callback;
+  terminal->data = data;
+  pthread_mutex_init(&terminal->lock, NULL);
+
+  if (tcgetattr(fd, &terminal->saved) || pipe(terminal->wake)) {
+    pthread_mutex_destroy(&terminal->lock);
+    close(fd);
+    free(terminal);
+    return NULL;
+  }
+
+  /* keys are read as they're pressed, without echoing them, but ^C still
+   * interrupts */
+  struct termios raw = terminal->saved;
+  raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+  raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(fd, TCSAFLUSH, &raw);
+
+  make_lut(terminal->lut_red, RED_LEVELS);
+  make_lut(terminal->lut_green, GREEN_LEVELS);
+  make_lut(terminal->lut_blue, BLUE_LEVELS);
+
+  /* alternate screen, with the cursor hidden */
+  buffer_printf(&terminal->out, "\x1b[?1049h\x1b[?25l");
+  read_size(terminal);
+  flush(terminal);
+
+  if (pthread_create(&terminal->thread, NULL, &read_input, terminal)) {
+    close(terminal->wake[0]);
+    close(terminal->wake[1]);
+    terminal->wake[0] = -1;
+    imv_terminal_free(terminal);
+    return NULL;
+  }
+
+  return terminal;
+}
+
+void imv_terminal_free(struct imv_terminal *terminal)
+{
+  if (!terminal) {
+    return;
+  }
+
+  if (terminal->wake[0] >= 0) {
+    const char wake = 0;
+    if (write(terminal->wake[1], &wake, 1) == 1) {
+      pthread_join(terminal->thread, NULL);
+    }
+    close(terminal->wake[0]);
+    close(terminal->wake[1]);
+  }
+
+  if (terminal->protocol == IMV_TERMINAL_KITTY) {
+    buffer_printf(&terminal->out, "\x1b_Ga=d,d=A,q=2\x1b\\");
+  }
+  buffer_printf(&terminal->out, "\x1b[?25h\x1b[?1049l");
+  flush(terminal);
+  tcsetattr(terminal->fd, TCSAFLUSH, &terminal->saved);
+  close(terminal->fd);
+
+  pthread_mutex_destroy(&terminal->lock);
+  free(terminal->out.data);
+  free(terminal->frame);
+  free(terminal->hashes);
+  free(terminal->scratch);
+  free(terminal->masks);
+  free(terminal);
+}
+
+void imv_terminal_get_size(const struct imv_terminal *terminal,
+    int *width, int *height)
+{
+  *width = terminal->width;
+  *height = terminal->height;
+}
+
+bool imv_terminal_poll_resize(struct imv_terminal *terminal)
+{
+  pthread_mutex_lock(&terminal->lock);
+  const bool resized = terminal->resized;
+  terminal->resized = false;
+  pthread_mutex_unlock(&terminal->lock);
+
+  if (resized) {
+    read_size(terminal);
+  }
+  return resized;
+}
+
+bool imv_terminal_next_key(struct imv_terminal *terminal,
+    struct imv_terminal_key *key)
+{
+  pthread_mutex_lock(&terminal->lock);
+  const bool wait = now_ms() - terminal->input_time < SEQUENCE_TIMEOUT;
+  const size_t len = imv_terminal_decode_key(terminal->input,
+      terminal->input_len, wait, key);
+  terminal->input_len -= len;
+  memmove(terminal->input, terminal->input + len, terminal->input_len);
+  pthread_mutex_unlock(&terminal->lock);
+  return len > 0;
+}
+
+/* Decode a single byte as a key, as a US keyboard would type it */
+static void decode_char(unsigned char c, struct imv_terminal_key *key)
+{
+  static const char shifted[][2] = {
+    {'!', '1'}, {'@', '2'}, {'#', '3'}, {'$', '4'}, {'%', '5'}, {'^', '6'},
+    {'&', '7'}, {'*', '8'}, {'(', '9'}, {')', '0'}, {'_', '-'}, {'+', '='},
+    {':', ';'}, {'"', '\''}, {'<', ','}, {'>', '.'}, {'?', '/'}, {'{', '['},
+    {'}', ']'}, {'|', '\\'}, {'~', '`'},
+  };
+
+  if (c == '\r' || c == '\n') {
+    key->sym = SDLK_RETURN;
+  } else if (c == '\t') {
+    key->sym = SDLK_TAB;
+  } else if (c == 0x7f || c == '\b') {
+    key->sym = SDLK_BACKSPACE;
+  } else if (c == 0x1b) {
+    key->sym = SDLK_ESCAPE;
+  } else if (c == 0) {
+    key->sym = SDLK_SPACE;
+    key->mod |= KMOD_LCTRL;
+  } else if (c < 27) {
+    key->sym = 'a' + c - 1;
+    key->mod |= KMOD_LCTRL;
+  } else if (c >= 'A' && c <= 'Z') {
+    key->sym = c - 'A' + 'a';
+    key->mod |= KMOD_LSHIFT;
+  } else if (c >= ' ' && c < 0x7f) {
+    key->sym = c;
+    for (size_t i = 0; i < sizeof shifted / sizeof shifted[0]; ++i) {
+      if (c == shifted[i][0]) {
+        key->sym = shifted[i][1];
+        key->mod |= KMOD_LSHIFT;
+        break;
+      }
+    }
+  }
+
+  if (c >= ' ' && c < 0x7f) {
+    key->text[0] = c;
+    key->text[1] = '\0';
+  }
+}
+
+/* Decode a CSI or SS3 sequence, whose parameters start at buf. Returns the
+ * number of bytes used, or 0 if it's incomplete */
+static size_t decode_sequence(const char *buf, size_t len,
+    struct imv_terminal_key *key)
+{
+  int params[2] = {0, 0};
+  int num_params = 0;
+  size_t i = 0;
+  for (; i < len && buf[i] >= 0x20 && buf[i] < 0x40; ++i) {
+    if (buf[i] >= '0' && buf[i] <= '9' && num_params < 3) {
+      if (num_params == 0) {
+        num_params = 1;
+      }
+      if (num_params <= 2) {
+        params[num_params - 1] = params[num_params - 1] * 10 + buf[i] - '0';
+      }
+    } else if (buf[i] == ';') {
+      num_params = num_params ? num_params + 1 : 2;
+    }
+  }
+  if (i == len) {
+    return 0;
+  }
+
+  static const SDL_Keycode tilde_keys[] = {
+    [1] = SDLK_HOME, [2] = SDLK_INSERT, [3] = SDLK_DELETE, [4] = SDLK_END,
+    [5] = SDLK_PAGEUP, [6] = SDLK_PAGEDOWN, [7] = SDLK_HOME, [8] = SDLK_END,
+    [11] = SDLK_F1, [12] = SDLK_F2, [13] = SDLK_F3, [14] = SDLK_F4,
+    [15] = SDLK_F5, [17] = SDLK_F6, [18] = SDLK_F7, [19] = SDLK_F8,
+    [20] = SDLK_F9, [21] = SDLK_F10, [23] = SDLK_F11, [24] = SDLK_F12,
+  };
+
+  switch (buf[i]) {
+    case 'A': key->sym = SDLK_UP;    break;
+    case 'B': key->sym = SDLK_DOWN;  break;
+    case 'C': key->sym = SDLK_RIGHT; break;
+    case 'D': key->sym = SDLK_LEFT;  break;
+    case 'H': key->sym = SDLK_HOME;  break;
+    case 'F': key->sym = SDLK_END;   break;
+    case 'P': key->sym = SDLK_F1;    break;
+    case 'Q': key->sym = SDLK_F2;    break;
+    case 'R': key->sym = SDLK_F3;    break;
+    case 'S': key->sym = SDLK_F4;    break;
+    case 'Z':
+      key->sym = SDLK_TAB;
+      key->mod |= KMOD_LSHIFT;
+      break;
+    case '~':
+      if (params[0] > 0
+          && params[0] < (int)(sizeof tilde_keys / sizeof tilde_keys[0])) {
+        key->sym = tilde_keys[params[0]];
+      }
+      break;
+  }
+
+  /* modifiers are given as one more than a bitmask */
+  const int modifiers = params[1] - 1;
+  if (modifiers > 0) {
+    key->mod |= (modifiers & 1 ? KMOD_LSHIFT : 0)
+              | (modifiers & 2 ? KMOD_LALT : 0)
+              | (modifiers & 4 ? KMOD_LCTRL : 0);
+  }
+  return i + 1;
+}
+
+size_t imv_terminal_decode_key(const char *buf, size_t len, bool wait,
+    struct imv_terminal_key *key)
+{
+  memset(key, 0, sizeof *key);
+  if (len == 0) {
+    return 0;
+  }
+
+  const unsigned char c = buf[0];
+
+  if (c == 0x1b && len == 1 && wait) {
+    /* may be the start of a sequence, or Alt and a key */
+    return 0;
+  }
+
+  if (c == 0x1b && len > 1) {
+    if (buf[1] == '[' || buf[1] == 'O') {
+      const size_t used = decode_sequence(buf + 2, len - 2, key);
+      if (used > 0) {
+        return used + 2;
+      }
+      if (wait) {
+        /* the rest may be on its way */
+        return 0;
+      }
+      /* an incomplete sequence is taken as it comes */
+      key->sym = SDLK_ESCAPE;
+      return 1;
+    }
+    /* escape before a key is how Alt is sent */
+    decode_char(buf[1], key);
+    key->mod |= KMOD_LALT;
+    key->text[0] = '\0';
+    return 2;
+  }
+
+  if (c >= 0x80) {
+    /* a UTF-8 character is only typed as text */
+    size_t n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    if (n > len && wait) {
+      return 0;
+    }
+    if (n > len) {
+      n = len;
+    }
+    if (n > 1) {
+      memcpy(key->text, buf, n);
+      key->text[n] = '\0';
+    }
+    return n;
+  }
+
+  decode_char(c, key);
+  return 1;
+}
+
+unsigned char *imv_terminal_frame(struct imv_terminal *terminal, int *pitch)
+{
+  *pitch = terminal->width * 4;
+  return terminal->frame;
+}
+
+void imv_terminal_set_status(struct imv_terminal *terminal, const char *text)
+{
+  if (strncmp(terminal->status, text, sizeof terminal->status - 1)) {
+    snprintf(terminal->status, sizeof terminal->status, "%s", text);
+    terminal->status_dirty = true;
+  }
+}
+
+static uint64_t hash_tile(const struct imv_terminal *terminal,
+    int x, int y, int width, int height)
+{
+  const size_t pitch = (size_t)terminal->width * 4;
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int row = 0; row < height; ++row) {
+    const unsigned char *pixels = terminal->frame + (y + row) * pitch + x * 4;
+    /* a pixel at a time, 8 bytes at a time */
+    int i = 0;
+    for (; i + 1 < width; i += 2) {
+      uint64_t v;
+      memcpy(&v, pixels + i * 4, sizeof v);
+      hash = (hash ^ v) * 0x100000001b3;
+    }
+    if (i < width) {
+      uint32_t v;
+      memcpy(&v, pixels + i * 4, sizeof v);
+      hash = (hash ^ v) * 0x100000001b3;
+    }
+  }
+  return hash;
+}
+
+static void send_kitty(struct imv_terminal *terminal, int id,
+    int x, int y, int width, int height)
+{
+  const size_t pitch = (size_t)terminal->width * 4;
+  unsigned char *rgb = terminal->scratch;
+  for (int row = 0; row < height; ++row) {
+    const unsigned char *pixels = terminal->frame + (y + row) * pitch + x * 4;
+    for (int i = 0; i < width; ++i) {
+      *rgb++ = pixels[i * 4 + 0];
+      *rgb++ = pixels[i * 4 + 1];
+      *rgb++ = pixels[i * 4 + 2];
+    }
+  }
+
+  /* replaces the tile's previous image, without moving the cursor */
+  const size_t len = (size_t)width * height * 3;
+  for (size_t offset = 0; offset < len; offset += KITTY_CHUNK) {
+    const size_t chunk = len - offset < KITTY_CHUNK ? len - offset : KITTY_CHUNK;
+    const int more = offset + chunk < len;
+    if (offset == 0) {
+      buffer_printf(&terminal->out,
+          "\x1b_Ga=T,f=24,s=%d,v=%d,i=%d,q=2,C=1,m=%d;",
+          width, height, id, more);
+    } else {
+      buffer_printf(&terminal->out, "\x1b_Gm=%d;", more);
+    }
+    buffer_base64(&terminal->out, terminal->scratch + offset, chunk);
+    buffer_append(&terminal->out, "\x1b\\", 2);
+  }
+}
+
+static void put_run(struct buffer *buf, char c, int count)
+{
+  if (count > 3) {
+    buffer_printf(buf, "!%d%c", count, c);
+  } else {
+    while (count-- > 0) {
+      buffer_append(buf, &c, 1);
+    }
+  }
+}
+
+static void send_sixel(struct imv_terminal *terminal,
+    int x, int y, int width, int height)
+{
+  /* dither to the palette, by the pixels' position on screen so that the
+   * pattern lines up across tiles */
+  const size_t pitch = (size_t)terminal->width * 4;
+  unsigned char *indices = terminal->scratch;
+  bool used[PALETTE_SIZE] = {false};
+  for (int row = 0; row < height; ++row) {
+    const unsigned char *pixels = terminal->frame + (y + row) * pitch + x * 4;
+    const int dither_row = ((y + row) & 3) << 2;
+    unsigned char *out = indices + row * width;
+    for (int i = 0; i < width; ++i) {
+      const int t = dither_row | ((x + i) & 3);
+      const int index = (terminal->lut_red[t][pixels[i * 4 + 0]] * GREEN_LEVELS
+                       + terminal->lut_green[t][pixels[i * 4 + 1]])
+                       * BLUE_LEVELS + terminal->lut_blue[t][pixels[i * 4 + 2]];
+      out[i] = index;
+      used[index] = true;
+    }
+  }
+
+  /* pixels left unset are transparent, as the last band may run past the
+   * bottom of the tile */
+  struct buffer *out = &terminal->out;
+  buffer_printf(out, "\x1bP0;1;0q\"1;1;%d;%d", width, height);
+  for (int i = 0; i < PALETTE_SIZE; ++i) {
+    if (used[i]) {
+      const int r = i / (GREEN_LEVELS * BLUE_LEVELS);
+      const int g = i / BLUE_LEVELS % GREEN_LEVELS;
+      const int b = i % BLUE_LEVELS;
+      buffer_printf(out, "#%d;2;%d;%d;%d", i, r * 100 / (RED_LEVELS - 1),
+          g * 100 / (GREEN_LEVELS - 1), b * 100 / (BLUE_LEVELS - 1));
+    }
+  }
+
+  /* each band of six rows is sent a colour at a time, each column a
+   * character with a bit for each row in that colour */
+  unsigned char *masks = terminal->masks;
+  for (int band = 0; band < height; band += 6) {
+    bool in_band[PALETTE_SIZE] = {false};
+    unsigned char colours[PALETTE_SIZE];
+    int num_colours = 0;
+
+    for (int row = band; row < band + 6 && row < height; ++row) {
+      const unsigned char *line = indices + row * width;
+      for (int i = 0; i < width; ++i) {
+        const int c = line[i];
+        if (!in_band[c]) {
+          in_band[c] = true;
+          colours[num_colours++] = c;
+        }
+        masks[c * width + i] |= 1 << (row - band);
+      }
+    }
+
+    for (int k = 0; k < num_colours; ++k) {
+      unsigned char *mask = masks + colours[k] * width;
+      buffer_printf(out, k ? "$#%d" : "#%d", colours[k]);
+
+      /* runs of the same character are compressed, and trailing empty
+       * columns left out */
+      int end = width;
+      while (end > 0 && !mask[end - 1]) {
+        --end;
+      }
+      for (int i = 0; i < end;) {
+        int run = 1;
+        while (i + run < end && mask[i + run] == mask[i]) {
+          ++run;
+        }
+        put_run(out, 63 + mask[i], run);
+        i += run;
+      }
+      memset(mask, 0, width);
+    }
+
+    if (band + 6 < height) {
+      buffer_append(out, "-", 1);
+    }
+  }
+  buffer_append(out, "\x1b\\", 2);
+}
+
+void imv_terminal_present(struct imv_terminal *terminal)
+{
+  const int tile_width = TILE_COLS * terminal->cell_width;
+  const int tile_height = TILE_ROWS * terminal->cell_height;
+
+  for (int ty = 0; ty < terminal->tiles_tall; ++ty) {
+    for (int tx = 0; tx < terminal->tiles_wide; ++tx) {
+      const int x = tx * tile_width;
+      const int y = ty * tile_height;
+      const int width = x + tile_width > terminal->width
+                      ? terminal->width - x : tile_width;
+      const int height = y + tile_height > terminal->height
+                       ? terminal->height - y : tile_height;
+      const int index = tx + ty * terminal->tiles_wide;
+
+      const uint64_t hash = hash_tile(terminal, x, y, width, height);
+      if (!terminal->redraw_all && hash == terminal->hashes[index]) {
+        continue;
+      }
+      terminal->hashes[index] = hash;
+
+      buffer_printf(&terminal->out, "\x1b[%d;%dH",
+          ty * TILE_ROWS + 1, tx * TILE_COLS + 1);
+      if (terminal->protocol == IMV_TERMINAL_KITTY) {
+        send_kitty(terminal, index + 1, x, y, width, height);
+      } else {
+        send_sixel(terminal, x, y, width, height);
+      }
+    }
+  }
+  terminal->redraw_all = false;
+
+  if (terminal->status_dirty) {
+    terminal->status_dirty = false;
+    buffer_printf(&terminal->out, "\x1b[%d;1H\x1b[2K", terminal->rows);
+    int col = 0;
+    for (const char *c = terminal->status; *c && col < terminal->cols; ++c) {
+      /* control characters would upset the terminal */
+      if ((unsigned char)*c >= ' ' && *c != 0x7f) {
+        buffer_append(&terminal->out, c, 1);
+        /* continuation bytes of UTF-8 don't take up a column */
+        if (((unsigned char)*c & 0xc0) != 0x80) {
+          ++col;
+        }
+      }
+    }
+  }
+
+  flush(terminal);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,78 @@
+#ifndef IMV_TERMINAL_H
+#define IMV_TERMINAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <SDL2/SDL.h>
+
+/* How images are sent to the terminal */
+enum imv_terminal_protocol {
+  IMV_TERMINAL_KITTY, /* kitty's graphics protocol, in full colour */
+  IMV_TERMINAL_SIXEL, /* DEC sixel graphics, dithered to a fixed palette */
+};
+
+/* A key pressed in the terminal, as SDL would have reported it from a US
+ * keyboard */
+struct imv_terminal_key {
+  SDL_Keycode sym;
+  Uint16 mod;
+  /* the text typed, empty if none */
+  char text[8];
+};
+
+/* Called from the terminal's input thread when there are keys to read, or
+ * the terminal has been resized */
+typedef void (*imv_terminal_callback)(void *data);
+
+struct imv_terminal;
+
+/* Guess which protocol the terminal imv is running in supports, from its
+ * environment */
+enum imv_terminal_protocol imv_terminal_detect(void);
+
+/* Takes over the controlling terminal to show images in, switching to its
+ * alternate screen and reading keys from it on a thread of its own. The
+ * bottom line is kept for a status line. Returns NULL if there's no
+ * terminal.
+ */
+struct imv_terminal *imv_terminal_create(enum imv_terminal_protocol protocol,
+    imv_terminal_callback callback, void *data);
+
+/* Gives the terminal back as it was, and cleans up an imv_terminal
+ * instance */
+void imv_terminal_free(struct imv_terminal *terminal);
+
+/* Get the size of the area images are shown in, in pixels */
+void imv_terminal_get_size(const struct imv_terminal *terminal,
+    int *width, int *height);
+
+/* Check whether the terminal has been resized since last asked, picking up
+ * the new size if so. Everything is sent again on the next present */
+bool imv_terminal_poll_resize(struct imv_terminal *terminal);
+
+/* Get the next key pressed. Returns false if there are none waiting */
+bool imv_terminal_next_key(struct imv_terminal *terminal,
+    struct imv_terminal_key *key);
+
+/* Decode the key at the start of buf, returning how many bytes it took up,
+ * or 0 if buf is empty. If wait is set, 0 is also returned when buf holds
+ * only the start of a key's sequence, to be decoded once the rest has been
+ * read. Otherwise a lone escape is taken to be the escape key */
+size_t imv_terminal_decode_key(const char *buf, size_t len, bool wait,
+    struct imv_terminal_key *key);
+
+/* Get the buffer to draw the next frame into, of the size given by
+ * imv_terminal_get_size, in RGBA byte order. pitch is set to the length of
+ * each row in bytes */
+unsigned char *imv_terminal_frame(struct imv_terminal *terminal, int *pitch);
+
+/* Set the text of the status line */
+void imv_terminal_set_status(struct imv_terminal *terminal, const char *text);
+
+/* Send the parts of the frame that have changed since the last present to
+ * the terminal, along with the status line if it's changed */
+void imv_terminal_present(struct imv_terminal *terminal);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
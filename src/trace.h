@@ -0,0 +1,51 @@
+#ifndef IMV_TRACE_H
+#define IMV_TRACE_H
+
+/* Static tracepoints for tools such as bpftrace and perf, under the "imv"
+ * provider. Built in with USDT=yes in config.mk, which needs sys/sdt.h from
+ * SystemTap. Each compiles to a single nop, costing nothing until a tracer
+ * attaches to it. Without USDT they're compiled out entirely.
+ *
+ * The probes and their arguments are:
+ *
+ *   navigate(index, path)         a different image was selected
+ *   open(path)                    opening an image to find a backend for it
+ *   open_done(path, result, backend)
+ *                                 the image was opened, result being a
+ *                                 backend_result, backend NULL on failure
+ *   decode_start(path)            asked a source to decode its image
+ *   decode_done(path, backend, width, height, bytes)
+ *                                 its bitmap arrived; width and height are
+ *                                 0 if decoding failed
+ *   upload_start(width, height)   uploading a bitmap to textures
+ *   upload_done(width, height)
+ *   texture_hit(width, height)    a texture was reused from the pool
+ *   texture_miss(width, height)   a texture had to be created
+ *   present_start()               presenting the main window
+ *   present_done()
+ */
+
+#ifdef IMV_USDT
+#include <sys/sdt.h>
+
+#define IMV_TRACE0(name) DTRACE_PROBE(imv, name)
+#define IMV_TRACE1(name, a) DTRACE_PROBE1(imv, name, a)
+#define IMV_TRACE2(name, a, b) DTRACE_PROBE2(imv, name, a, b)
+#define IMV_TRACE3(name, a, b, c) DTRACE_PROBE3(imv, name, a, b, c)
+#define IMV_TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(imv, name, a, b, c, d, e)
+#else
+/* the arguments are still checked, but never evaluated */
+#define IMV_TRACE0(name) do {} while (0)
+#define IMV_TRACE1(name, a) do { (void)sizeof (a); } while (0)
+#define IMV_TRACE2(name, a, b) \
+  do { (void)sizeof (a); (void)sizeof (b); } while (0)
+#define IMV_TRACE3(name, a, b, c) \
+  do { (void)sizeof (a); (void)sizeof (b); (void)sizeof (c); } while (0)
+#define IMV_TRACE5(name, a, b, c, d, e) \
+  do { (void)sizeof (a); (void)sizeof (b); (void)sizeof (c); \
+       (void)sizeof (d); (void)sizeof (e); } while (0)
+#endif
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,268 @@
+#include "watchdog.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <execinfo.h>
+#define IMV_HAVE_BACKTRACE
+#endif
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Sent to the main thread to have it print its stack. Ignored by default,
+ * so harmless should it arrive any other time */
+#define BACKTRACE_SIGNAL SIGURG
+
+/* Depth of the backtraces printed */
+#define BACKTRACE_DEPTH 64
+
+static const char *stage_names[IMV_NUM_STAGES] = {
+  "events",
+  "navigation",
+  "update",
+  "upload",
+  "render",
+  "present",
+};
+
+static const char *stage_verbs[IMV_NUM_STAGES] = {
+  "handling events",
+  "navigating",
+  "updating",
+  "uploading",
+  "rendering",
+  "presenting",
+};
+
+struct imv_watchdog {
+  unsigned long threshold;
+  bool backtrace;
+  pthread_t main_thread;
+  pthread_t thread;
+
+  /* everything below is shared with the thread */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool quit;
+
+  /* the iteration in progress, if running. Times are in milliseconds */
+  bool running;
+  bool reported;
+  double start;
+  double stage_start;
+  enum imv_watchdog_stage stage;
+  double stage_times[IMV_NUM_STAGES];
+  char image[PATH_MAX];
+
+#ifdef IMV_HAVE_BACKTRACE
+  struct sigaction old_action;
+#endif
+};
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+#ifdef IMV_HAVE_BACKTRACE
+static void print_backtrace(int sig)
+{
+  (void)sig;
+  void *frames[BACKTRACE_DEPTH];
+  const int depth = backtrace(frames, BACKTRACE_DEPTH);
+  backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+}
+#endif
+
+static void *watch(void *data)
+{
+  struct imv_watchdog *watchdog = data;
+
+  /* look in often enough to catch a stall soon after it passes the
+   * threshold */
+  long poll = watchdog->threshold / 4;
+  if (poll < 10) {
+    poll = 10;
+  } else if (poll > 250) {
+    poll = 250;
+  }
+
+  pthread_mutex_lock(&watchdog->lock);
+  while (!watchdog->quit) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += poll * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&watchdog->cond, &watchdog->lock, &deadline);
+
+    const double elapsed = now_ms() - watchdog->start;
+    if (watchdog->quit || !watchdog->running || watchdog->reported
+        || elapsed < watchdog->threshold) {
+      continue;
+    }
+
+    watchdog->reported = true;
+    fprintf(stderr, "Stall: main loop busy for %.0f ms so far, %s, with %s\n",
+        elapsed, stage_verbs[watchdog->stage],
+        watchdog->image[0] ? watchdog->image : "no image");
+
+#ifdef IMV_HAVE_BACKTRACE
+    if (watchdog->backtrace) {
+      pthread_kill(watchdog->main_thread, BACKTRACE_SIGNAL);
+    }
+#endif
+  }
+  pthread_mutex_unlock(&watchdog->lock);
+  return NULL;
+}
+
+struct imv_watchdog *imv_watchdog_create(unsigned long threshold,
+                                         bool with_backtrace)
+{
+  struct imv_watchdog *watchdog = calloc(1, sizeof *watchdog);
+  watchdog->threshold = threshold;
+  watchdog->main_thread = pthread_self();
+  pthread_mutex_init(&watchdog->lock, NULL);
+  pthread_cond_init(&watchdog->cond, NULL);
+
+#ifdef IMV_HAVE_BACKTRACE
+  if (with_backtrace) {
+    /* the first backtrace may load libgcc, which can't be done safely in a
+     * signal handler, so get that over with now */
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = &print_backtrace;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    watchdog->backtrace = !sigaction(BACKTRACE_SIGNAL, &action,
+        &watchdog->old_action);
+  }
+#else
+  if (with_backtrace) {
+    fprintf(stderr, "Backtraces of stalls are unsupported on this platform.\n");
+  }
+#endif
+
+  if (pthread_create(&watchdog->thread, NULL, &watch, watchdog)) {
+#ifdef IMV_HAVE_BACKTRACE
+    if (watchdog->backtrace) {
+      sigaction(BACKTRACE_SIGNAL, &watchdog->old_action, NULL);
+    }
+#endif
+    pthread_cond_destroy(&watchdog->cond);
+    pthread_mutex_destroy(&watchdog->lock);
+    free(watchdog);
+    return NULL;
+  }
+
+  return watchdog;
+}
+
+void imv_watchdog_free(struct imv_watchdog *watchdog)
+{
+  if (!watchdog) {
+    return;
+  }
+
+  pthread_mutex_lock(&watchdog->lock);
+  watchdog->quit = true;
+  pthread_cond_signal(&watchdog->cond);
+  pthread_mutex_unlock(&watchdog->lock);
+  pthread_join(watchdog->thread, NULL);
+
+#ifdef IMV_HAVE_BACKTRACE
+  if (watchdog->backtrace) {
+    sigaction(BACKTRACE_SIGNAL, &watchdog->old_action, NULL);
+  }
+#endif
+
+  pthread_cond_destroy(&watchdog->cond);
+  pthread_mutex_destroy(&watchdog->lock);
+  free(watchdog);
+}
+
+void imv_watchdog_begin(struct imv_watchdog *watchdog)
+{
+  const double now = now_ms();
+  pthread_mutex_lock(&watchdog->lock);
+  watchdog->running = true;
+  watchdog->reported = false;
+  watchdog->start = now;
+  watchdog->stage_start = now;
+  watchdog->stage = IMV_STAGE_EVENTS;
+  for (int i = 0; i < IMV_NUM_STAGES; ++i) {
+    watchdog->stage_times[i] = 0;
+  }
+  pthread_mutex_unlock(&watchdog->lock);
+}
+
+enum imv_watchdog_stage imv_watchdog_stage(struct imv_watchdog *watchdog,
+    enum imv_watchdog_stage stage)
+{
+  const double now = now_ms();
+  pthread_mutex_lock(&watchdog->lock);
+  const enum imv_watchdog_stage previous = watchdog->stage;
+  watchdog->stage_times[previous] += now - watchdog->stage_start;
+  watchdog->stage_start = now;
+  watchdog->stage = stage;
+  pthread_mutex_unlock(&watchdog->lock);
+  return previous;
+}
+
+void imv_watchdog_set_image(struct imv_watchdog *watchdog, const char *path)
+{
+  pthread_mutex_lock(&watchdog->lock);
+  snprintf(watchdog->image, sizeof watchdog->image, "%s", path ? path : "");
+  pthread_mutex_unlock(&watchdog->lock);
+}
+
+void imv_watchdog_end(struct imv_watchdog *watchdog)
+{
+  imv_watchdog_stage(watchdog, watchdog->stage);
+
+  pthread_mutex_lock(&watchdog->lock);
+  watchdog->running = false;
+  const double elapsed = watchdog->stage_start - watchdog->start;
+  if (elapsed < watchdog->threshold) {
+    pthread_mutex_unlock(&watchdog->lock);
+    return;
+  }
+
+  enum imv_watchdog_stage worst = IMV_STAGE_EVENTS;
+  for (int i = 0; i < IMV_NUM_STAGES; ++i) {
+    if (watchdog->stage_times[i] > watchdog->stage_times[worst]) {
+      worst = i;
+    }
+  }
+
+  char breakdown[256];
+  size_t len = 0;
+  for (int i = 0; i < IMV_NUM_STAGES && len < sizeof breakdown; ++i) {
+    len += snprintf(breakdown + len, sizeof breakdown - len, "%s%s %.0f",
+        i ? ", " : "", stage_names[i], watchdog->stage_times[i]);
+  }
+
+  fprintf(stderr, "Stall: main loop took %.0f ms, %.0f ms of it %s, with %s "
+      "(%s)\n", elapsed, watchdog->stage_times[worst], stage_verbs[worst],
+      watchdog->image[0] ? watchdog->image : "no image", breakdown);
+  pthread_mutex_unlock(&watchdog->lock);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,51 @@
+#ifndef IMV_WATCHDOG_H
+#define IMV_WATCHDOG_H
+
+#include <stdbool.h>
+
+/* The stages of an iteration of imv's main loop */
+enum imv_watchdog_stage {
+  IMV_STAGE_EVENTS,     /* handling input and other events */
+  IMV_STAGE_NAVIGATION, /* moving between images, and opening them */
+  IMV_STAGE_UPDATE,     /* animation, slideshows and other upkeep */
+  IMV_STAGE_UPLOAD,     /* uploading bitmaps to textures */
+  IMV_STAGE_RENDER,     /* drawing the window */
+  IMV_STAGE_PRESENT,    /* presenting what was drawn */
+  IMV_NUM_STAGES
+};
+
+struct imv_watchdog;
+
+/* Creates an instance of imv_watchdog, which times each stage of the main
+ * loop's iterations and reports to stderr any iteration that takes longer
+ * than threshold milliseconds, with the stage and image to blame. A thread
+ * of its own reports iterations still running past the threshold, so that
+ * a hang is reported while it lasts. If with_backtrace is set, the main
+ * thread's stack is printed then too, where the platform allows. Must be
+ * created on the main thread. Returns NULL if the thread can't be started.
+ */
+struct imv_watchdog *imv_watchdog_create(unsigned long threshold,
+                                         bool with_backtrace);
+
+/* Stops the watchdog's thread and cleans up an imv_watchdog instance */
+void imv_watchdog_free(struct imv_watchdog *watchdog);
+
+/* Mark the start of an iteration, which begins with handling events */
+void imv_watchdog_begin(struct imv_watchdog *watchdog);
+
+/* Move on to another stage of the iteration. Returns the stage moved on
+ * from, to return to after a stage nested within another, e.g. an upload
+ * while handling events */
+enum imv_watchdog_stage imv_watchdog_stage(struct imv_watchdog *watchdog,
+    enum imv_watchdog_stage stage);
+
+/* Set the path of the image being shown, or NULL for none */
+void imv_watchdog_set_image(struct imv_watchdog *watchdog, const char *path);
+
+/* Mark the end of an iteration, before waiting for something to do, and
+ * report it if it took too long */
+void imv_watchdog_end(struct imv_watchdog *watchdog);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
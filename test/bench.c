@@ -0,0 +1,281 @@
+/* Micro-benchmarks for imv's core data structures.
+ *
+ * Reports the wall-clock time and heap allocations per operation for the
+ * navigator, list, bind and command subsystems, so that changes to their
+ * data structures can be judged with numbers.
+ *
+ * Usage: bench [max_entries]
+ *
+ * max_entries bounds the navigator and list sizes benchmarked, stepping up
+ * by powers of ten from 1000. It defaults to 1000000; pass 10000000 to
+ * include the 10M entry runs.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <SDL2/SDL.h>
+
+#include "binds.h"
+#include "commands.h"
+#include "list.h"
+#include "navigator.h"
+
+/* Allocation counting. The bench target is linked with --wrap for each of
+ * these, so every call made from imv's own code is routed through here.
+ */
+static size_t num_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+void *__wrap_malloc(size_t size)
+{
+  ++num_allocs;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  ++num_allocs;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  ++num_allocs;
+  return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+  ++num_allocs;
+  return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n)
+{
+  ++num_allocs;
+  return __real_strndup(s, n);
+}
+
+struct bench {
+  struct timespec start;
+  size_t start_allocs;
+};
+
+static void bench_start(struct bench *b)
+{
+  b->start_allocs = num_allocs;
+  clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void bench_end(struct bench *b, const char *name, size_t n, size_t ops)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  const double ns = (end.tv_sec - b->start.tv_sec) * 1e9
+                  + (end.tv_nsec - b->start.tv_nsec);
+  const size_t allocs = num_allocs - b->start_allocs;
+  printf("%-28s %10zu %10zu %14.1f %12.2f\n", name, n, ops,
+      ns / ops, (double)allocs / ops);
+}
+
+/* Small deterministic PRNG so runs are comparable */
+static unsigned long rng_state = 1;
+
+static size_t rng(size_t max)
+{
+  rng_state = rng_state * 6364136223846793005UL + 1442695040888963407UL;
+  return (size_t)(rng_state >> 33) % max;
+}
+
+static void path_for(char *buf, size_t len, size_t i)
+{
+  snprintf(buf, len, "/nonexistent/imv-bench/dir%03zu/image%08zu.jpg",
+      i % 1000, i);
+}
+
+static void bench_navigator(size_t n)
+{
+  struct bench b;
+  char path[128];
+  const size_t ops = 100;
+
+  struct imv_navigator *nav = imv_navigator_create();
+
+  bench_start(&b);
+  for (size_t i = 0; i < n; ++i) {
+    path_for(path, sizeof path, i);
+    imv_navigator_add(nav, path, 0);
+  }
+  bench_end(&b, "navigator_add", n, n);
+
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    path_for(path, sizeof path, rng(n));
+    imv_navigator_find_path(nav, path);
+  }
+  bench_end(&b, "navigator_find_path", n, ops);
+
+  /* a basename-only lookup misses the exact match pass and scans twice */
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    snprintf(path, sizeof path, "image%08zu.jpg", rng(n));
+    imv_navigator_find_path(nav, path);
+  }
+  bench_end(&b, "navigator_find_path_base", n, ops);
+
+  const size_t sel_ops = 1000000;
+  bench_start(&b);
+  for (size_t i = 0; i < sel_ops; ++i) {
+    imv_navigator_select_rel(nav, (i & 1) ? -1 : 1);
+    imv_navigator_select_rel(nav, 1);
+  }
+  bench_end(&b, "navigator_select_rel", n, 2 * sel_ops);
+
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    /* removed paths may be picked again, which is a miss: still a full scan */
+    path_for(path, sizeof path, rng(n));
+    imv_navigator_remove(nav, path);
+  }
+  bench_end(&b, "navigator_remove", n, ops);
+
+  imv_navigator_free(nav);
+}
+
+static void bench_list(size_t n)
+{
+  struct bench b;
+  const size_t ops = 1000;
+  static int item;
+
+  struct list *list = list_create();
+
+  bench_start(&b);
+  for (size_t i = 0; i < n; ++i) {
+    list_append(list, &item);
+  }
+  bench_end(&b, "list_append", n, n);
+
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    list_insert(list, rng(list->len), &item);
+  }
+  bench_end(&b, "list_insert", n, ops);
+
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    list_remove(list, rng(list->len));
+  }
+  bench_end(&b, "list_remove", n, ops);
+
+  list_free(list);
+}
+
+static void press_key(struct imv_binds *binds, SDL_Keycode key)
+{
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = SDL_KEYDOWN;
+  event.key.keysym.sym = key;
+  imv_bind_handle_event(binds, &event);
+}
+
+static void bench_binds(size_t n)
+{
+  struct bench b;
+  const size_t ops = 100000;
+
+  /* n distinct three-key sequences: "aaa", "aab", ... */
+  struct imv_binds *binds = imv_binds_create();
+  for (size_t i = 0; i < n; ++i) {
+    char keys[4] = {
+      'a' + (i / 676) % 26,
+      'a' + (i / 26) % 26,
+      'a' + i % 26,
+      0
+    };
+    struct list *list = imv_bind_parse_keys(keys);
+    imv_binds_add(binds, list, "noop");
+    list_free(list);
+  }
+
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    const size_t bind = rng(n);
+    press_key(binds, 'a' + (bind / 676) % 26);
+    press_key(binds, 'a' + (bind / 26) % 26);
+    press_key(binds, 'a' + bind % 26);
+  }
+  bench_end(&b, "bind_handle_event", n, 3 * ops);
+
+  imv_binds_free(binds);
+}
+
+static void noop_handler(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  (void)data;
+}
+
+static void bench_commands(size_t n)
+{
+  struct bench b;
+  const size_t ops = 100000;
+  char cmd[64];
+
+  struct imv_commands *cmds = imv_commands_create();
+  for (size_t i = 0; i < n; ++i) {
+    snprintf(cmd, sizeof cmd, "command%06zu", i);
+    imv_command_register(cmds, cmd, &noop_handler);
+  }
+
+  bench_start(&b);
+  for (size_t i = 0; i < ops; ++i) {
+    snprintf(cmd, sizeof cmd, "command%06zu 10 -20", rng(n));
+    imv_command_exec(cmds, cmd, NULL);
+  }
+  bench_end(&b, "command_exec", n, ops);
+
+  imv_commands_free(cmds);
+}
+
+int main(int argc, char **argv)
+{
+  size_t max_entries = 1000000;
+  if (argc > 1) {
+    max_entries = strtoul(argv[1], NULL, 10);
+  }
+
+  printf("%-28s %10s %10s %14s %12s\n",
+      "benchmark", "n", "ops", "ns/op", "allocs/op");
+
+  for (size_t n = 1000; n <= max_entries; n *= 10) {
+    bench_navigator(n);
+  }
+
+  for (size_t n = 1000; n <= max_entries; n *= 10) {
+    bench_list(n);
+  }
+
+  for (size_t n = 10; n <= 10000; n *= 10) {
+    bench_binds(n);
+  }
+
+  for (size_t n = 16; n <= 4096; n *= 16) {
+    bench_commands(n);
+  }
+
+  return 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
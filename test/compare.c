@@ -0,0 +1,137 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compare.h"
+
+/* odd sizes, to cover partial SSIM blocks and the non-vector ends of rows */
+#define WIDTH 37
+#define HEIGHT 21
+
+static struct imv_bitmap *create_bitmap(enum imv_pixelformat format)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = WIDTH;
+  bmp->height = HEIGHT;
+  bmp->format = format;
+  bmp->opaque = true;
+  bmp->mapped = 0;
+  bmp->data = malloc(WIDTH * HEIGHT * 4);
+
+  uint32_t *pixels = (uint32_t*)bmp->data;
+  for (int i = 0; i < WIDTH * HEIGHT; ++i) {
+    pixels[i] = 0xff000000 | (i * 7 & 0xff) << 16 | (i * 3 & 0xff) << 8
+              | (i & 0xff);
+  }
+  return bmp;
+}
+
+static void test_compare_identical(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap *a = create_bitmap(IMV_ABGR);
+  struct imv_bitmap *b = create_bitmap(IMV_ABGR);
+  struct imv_compare_stats stats;
+
+  struct imv_bitmap *heatmap = imv_compare(a, b, &stats);
+  assert_non_null(heatmap);
+  assert_int_equal(heatmap->width, WIDTH);
+  assert_int_equal(heatmap->height, HEIGHT);
+  assert_int_equal(stats.max_error, 0);
+  assert_true(stats.mean_error == 0);
+  assert_true(isinf(stats.psnr));
+  assert_true(fabs(stats.ssim - 1) < 1e-9);
+
+  const uint32_t *pixels = (const uint32_t*)heatmap->data;
+  for (int i = 0; i < WIDTH * HEIGHT; ++i) {
+    assert_int_equal(pixels[i], 0xff000000);
+  }
+
+  imv_bitmap_free(heatmap);
+  imv_bitmap_free(a);
+  imv_bitmap_free(b);
+}
+
+static void test_compare_difference(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap *a = create_bitmap(IMV_ABGR);
+  struct imv_bitmap *b = create_bitmap(IMV_ABGR);
+  struct imv_compare_stats stats;
+
+  /* one channel of one pixel in the vector part of a row, one at the end of
+   * a row, and a change in alpha, which is ignored */
+  uint32_t *pixels = (uint32_t*)b->data;
+  const int first = 5 * WIDTH + 2;
+  const int second = 17 * WIDTH + WIDTH - 1;
+  pixels[first] = (pixels[first] & ~0xffu) | ((pixels[first] & 0xff) ^ 0x10);
+  pixels[second] = (pixels[second] & ~0xff00u)
+                 | ((pixels[second] & 0xff00) ^ 0x0400);
+  pixels[0] &= 0x00ffffff;
+
+  struct imv_bitmap *heatmap = imv_compare(a, b, &stats);
+  assert_non_null(heatmap);
+  assert_int_equal(stats.max_error, 16);
+  assert_true(fabs(stats.mean_error - 20.0 / (3 * WIDTH * HEIGHT)) < 1e-9);
+  const double mse = (16.0 * 16 + 4 * 4) / (3 * WIDTH * HEIGHT);
+  assert_true(fabs(stats.psnr - 10 * log10(255 * 255 / mse)) < 1e-9);
+  assert_true(stats.ssim < 1);
+
+  const uint32_t *heat = (const uint32_t*)heatmap->data;
+  assert_int_equal(heat[0], 0xff000000);
+  assert_true(heat[first] != 0xff000000);
+  assert_true(heat[second] != 0xff000000);
+  assert_true((heat[first] & 0xff) > (heat[second] & 0xff));
+
+  imv_bitmap_free(heatmap);
+  imv_bitmap_free(a);
+  imv_bitmap_free(b);
+}
+
+static void test_compare_formats(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap *a = create_bitmap(IMV_ABGR);
+  struct imv_bitmap *b = create_bitmap(IMV_ARGB);
+  struct imv_compare_stats stats;
+
+  /* the same colours with red and blue swapped into ARGB order */
+  uint32_t *pixels = (uint32_t*)b->data;
+  for (int i = 0; i < WIDTH * HEIGHT; ++i) {
+    const uint32_t p = pixels[i];
+    pixels[i] = (p & 0xff00ff00) | (p >> 16 & 0xff) | (p & 0xff) << 16;
+  }
+
+  struct imv_bitmap *heatmap = imv_compare(a, b, &stats);
+  assert_non_null(heatmap);
+  assert_int_equal(stats.max_error, 0);
+  imv_bitmap_free(heatmap);
+
+  b->width = WIDTH - 1;
+  assert_null(imv_compare(a, b, &stats));
+  b->width = WIDTH;
+
+  imv_bitmap_free(a);
+  imv_bitmap_free(b);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_compare_identical),
+    cmocka_unit_test(test_compare_difference),
+    cmocka_unit_test(test_compare_formats),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
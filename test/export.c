@@ -0,0 +1,169 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "export.h"
+
+#define WIDTH 37
+#define HEIGHT 21
+
+static struct imv_bitmap *create_bitmap(void)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = WIDTH;
+  bmp->height = HEIGHT;
+  bmp->format = IMV_ARGB;
+  bmp->opaque = true;
+  bmp->mapped = 0;
+  bmp->data = malloc(WIDTH * HEIGHT * 4);
+
+  /* each pixel holds its own position */
+  uint32_t *pixels = (uint32_t*)bmp->data;
+  for (int y = 0; y < HEIGHT; ++y) {
+    for (int x = 0; x < WIDTH; ++x) {
+      pixels[y * WIDTH + x] = 0xff000000 | y << 8 | x;
+    }
+  }
+  return bmp;
+}
+
+/* Map an export read only, as another process would */
+static const unsigned char *map_export(const struct imv_export *export,
+    size_t *len)
+{
+  int fd = open(imv_export_path(export), O_RDONLY);
+  if (fd < 0) {
+    fd = shm_open(imv_export_path(export), O_RDONLY, 0);
+  }
+  assert_true(fd >= 0);
+
+  struct stat st;
+  assert_int_equal(fstat(fd, &st), 0);
+  *len = st.st_size;
+  void *data = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+  assert_true(data != MAP_FAILED);
+
+  /* it can't be changed once exported */
+  assert_true(mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+      == MAP_FAILED);
+  close(fd);
+  return data;
+}
+
+static void test_export_whole(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap *bmp = create_bitmap();
+  const struct imv_export_region all = {0, 0, WIDTH, HEIGHT};
+  struct imv_export *export = imv_export_create(bmp, WIDTH, HEIGHT,
+      &all, &all);
+  assert_non_null(export);
+
+  size_t len;
+  const unsigned char *data = map_export(export, &len);
+  struct imv_export_header header;
+  memcpy(&header, data, sizeof header);
+  assert_int_equal(header.magic, IMV_EXPORT_MAGIC);
+  assert_int_equal(header.version, IMV_EXPORT_VERSION);
+  assert_int_equal(header.format, IMV_EXPORT_ARGB);
+  assert_int_equal(header.bytes_per_pixel, 4);
+  assert_int_equal(header.width, WIDTH);
+  assert_int_equal(header.height, HEIGHT);
+  assert_int_equal(header.stride, WIDTH * 4);
+  assert_int_equal(header.region_width, WIDTH);
+  assert_int_equal(header.region_height, HEIGHT);
+  assert_true(header.data_offset >= sizeof header);
+  assert_int_equal(len, header.data_offset + header.stride * HEIGHT);
+  assert_memory_equal(data + header.data_offset, bmp->data,
+      WIDTH * HEIGHT * 4);
+
+  munmap((void*)data, len);
+  imv_export_free(export);
+  imv_bitmap_free(bmp);
+}
+
+static void test_export_region(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap *bmp = create_bitmap();
+  const struct imv_export_region all = {0, 0, WIDTH, HEIGHT};
+
+  /* clipped to the bitmap */
+  const struct imv_export_region region = {30, 5, 20, 4};
+  struct imv_export *export = imv_export_create(bmp, WIDTH, HEIGHT,
+      &all, &region);
+  assert_non_null(export);
+
+  const struct imv_export_header *header = imv_export_header(export);
+  assert_int_equal(header->width, WIDTH - 30);
+  assert_int_equal(header->height, 4);
+  assert_int_equal(header->region_x, 30);
+  assert_int_equal(header->region_y, 5);
+
+  size_t len;
+  const unsigned char *data = map_export(export, &len);
+  const uint32_t *pixels = (const uint32_t*)(data + header->data_offset);
+  assert_int_equal(pixels[0], 0xff000000 | 5 << 8 | 30);
+  assert_int_equal(pixels[header->stride / 4 * 3 + 6],
+      0xff000000 | 8 << 8 | 36);
+
+  munmap((void*)data, len);
+  imv_export_free(export);
+
+  /* nothing left to export */
+  const struct imv_export_region outside = {WIDTH, 0, 10, 10};
+  assert_null(imv_export_create(bmp, WIDTH, HEIGHT, &all, &outside));
+
+  imv_bitmap_free(bmp);
+}
+
+static void test_export_reduced(void **state)
+{
+  (void)state;
+
+  /* the bitmap shows the right half of an image twice its size */
+  struct imv_bitmap *bmp = create_bitmap();
+  const struct imv_export_region covered = {WIDTH * 2, 0, WIDTH * 2,
+                                            HEIGHT * 2};
+  const struct imv_export_region region = {WIDTH * 2 + 10, 4, 6, 6};
+  struct imv_export *export = imv_export_create(bmp, WIDTH * 4, HEIGHT * 2,
+      &covered, &region);
+  assert_non_null(export);
+
+  const struct imv_export_header *header = imv_export_header(export);
+  assert_int_equal(header->image_width, WIDTH * 4);
+  assert_int_equal(header->width, 3);
+  assert_int_equal(header->height, 3);
+
+  size_t len;
+  const unsigned char *data = map_export(export, &len);
+  const uint32_t *pixels = (const uint32_t*)(data + header->data_offset);
+  assert_int_equal(pixels[0], 0xff000000 | 2 << 8 | 5);
+
+  munmap((void*)data, len);
+  imv_export_free(export);
+  imv_bitmap_free(bmp);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_export_whole),
+    cmocka_unit_test(test_export_region),
+    cmocka_unit_test(test_export_reduced),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,204 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fileops.h"
+
+/* the result of the last batch, handed over from the I/O thread */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct imv_fileops_result *last_result;
+
+static void callback(struct imv_fileops_result *result, void *data)
+{
+  (void)data;
+  pthread_mutex_lock(&lock);
+  last_result = result;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Queue one operation and wait for it to finish */
+static struct imv_fileops_result *run(enum imv_fileop op, const char *path,
+    const char *dest)
+{
+  struct imv_fileops *ops = imv_fileops_create(&callback, NULL);
+  assert_non_null(ops);
+  imv_fileops_queue(ops, op, path, dest);
+
+  pthread_mutex_lock(&lock);
+  while (!last_result) {
+    pthread_cond_wait(&cond, &lock);
+  }
+  struct imv_fileops_result *result = last_result;
+  last_result = NULL;
+  pthread_mutex_unlock(&lock);
+
+  imv_fileops_free(ops);
+  return result;
+}
+
+static void write_file(const char *path, const char *contents)
+{
+  FILE *f = fopen(path, "w");
+  assert_non_null(f);
+  fputs(contents, f);
+  fclose(f);
+}
+
+static void assert_contents(const char *path, const char *contents)
+{
+  char buf[64] = {0};
+  FILE *f = fopen(path, "r");
+  assert_non_null(f);
+  assert_true(fread(buf, 1, sizeof buf - 1, f) > 0);
+  fclose(f);
+  assert_string_equal(buf, contents);
+}
+
+/* Fills buf, of PATH_MAX bytes, with dir/name, failing if it doesn't fit */
+static void join_path(char *buf, const char *dir, const char *name)
+{
+  assert_true(snprintf(buf, PATH_MAX, "%s/%s", dir, name) < PATH_MAX);
+}
+
+static void make_dir(char *buf, const char *parent, const char *name)
+{
+  join_path(buf, parent, name);
+  assert_int_equal(mkdir(buf, 0700), 0);
+}
+
+/* Each test works in a directory of its own, by its real path as the trash
+ * records it */
+static int setup(void **state)
+{
+  char dir[] = "/tmp/imv-test-fileops-XXXXXX";
+  if (!mkdtemp(dir)) {
+    return -1;
+  }
+  *state = realpath(dir, NULL);
+  return *state ? 0 : -1;
+}
+
+static int teardown(void **state)
+{
+  char cmd[PATH_MAX + 16];
+  int ret = -1;
+  if (snprintf(cmd, sizeof cmd, "rm -rf '%s'", (char*)*state)
+      < (int)sizeof cmd) {
+    ret = system(cmd);
+  }
+  free(*state);
+  return ret;
+}
+
+static void test_copy(void **state)
+{
+  const char *root = *state;
+  char src[PATH_MAX], dir[PATH_MAX], dest[PATH_MAX];
+  join_path(src, root, "a.png");
+  make_dir(dir, root, "copies");
+  join_path(dest, dir, "a.png");
+  write_file(src, "original");
+
+  struct imv_fileops_result *result = run(IMV_FILEOP_COPY, src, dir);
+  assert_int_equal(result->done[IMV_FILEOP_COPY], 1);
+  assert_int_equal(result->failed, 0);
+  imv_fileops_result_free(result);
+  assert_contents(src, "original");
+  assert_contents(dest, "original");
+
+  /* never overwrites */
+  write_file(src, "changed");
+  result = run(IMV_FILEOP_COPY, src, dir);
+  assert_int_equal(result->done[IMV_FILEOP_COPY], 0);
+  assert_int_equal(result->failed, 1);
+  imv_fileops_result_free(result);
+  assert_contents(dest, "original");
+}
+
+static void test_move(void **state)
+{
+  const char *root = *state;
+  char src[PATH_MAX], dir[PATH_MAX], dest[PATH_MAX];
+  join_path(src, root, "b.png");
+  make_dir(dir, root, "moved");
+  join_path(dest, dir, "b.png");
+
+  /* one already there is left alone, and the file stays put */
+  write_file(dest, "existing");
+  write_file(src, "original");
+  struct imv_fileops_result *result = run(IMV_FILEOP_MOVE, src, dir);
+  assert_int_equal(result->failed, 1);
+  assert_int_equal(result->unmoved->len, 1);
+  assert_string_equal(result->unmoved->items[0], src);
+  imv_fileops_result_free(result);
+  assert_contents(dest, "existing");
+  assert_contents(src, "original");
+
+  assert_int_equal(unlink(dest), 0);
+  result = run(IMV_FILEOP_MOVE, src, dir);
+  assert_int_equal(result->done[IMV_FILEOP_MOVE], 1);
+  assert_int_equal(result->failed, 0);
+  assert_int_equal(result->unmoved->len, 0);
+  imv_fileops_result_free(result);
+  assert_contents(dest, "original");
+  assert_int_not_equal(access(src, F_OK), 0);
+}
+
+static void test_trash(void **state)
+{
+  const char *root = *state;
+  char src[PATH_MAX], data_home[PATH_MAX], path[PATH_MAX];
+  join_path(src, root, "c.png");
+  make_dir(data_home, root, "data");
+  setenv("XDG_DATA_HOME", data_home, 1);
+
+  /* the second takes the next free name */
+  for (int i = 0; i < 2; ++i) {
+    write_file(src, i ? "second" : "first");
+    struct imv_fileops_result *result = run(IMV_FILEOP_TRASH, src, NULL);
+    assert_int_equal(result->done[IMV_FILEOP_TRASH], 1);
+    assert_int_equal(result->failed, 0);
+    imv_fileops_result_free(result);
+    assert_int_not_equal(access(src, F_OK), 0);
+  }
+
+  join_path(path, data_home, "Trash/files/c.png");
+  assert_contents(path, "first");
+  join_path(path, data_home, "Trash/files/c.png.2");
+  assert_contents(path, "second");
+
+  join_path(path, data_home, "Trash/info/c.png.2.trashinfo");
+  char buf[PATH_MAX + 64] = {0};
+  FILE *f = fopen(path, "r");
+  assert_non_null(f);
+  assert_true(fread(buf, 1, sizeof buf - 1, f) > 0);
+  fclose(f);
+  char expected[PATH_MAX + 32];
+  assert_true(snprintf(expected, sizeof expected, "[Trash Info]\nPath=%s\n",
+        src) < (int)sizeof expected);
+  assert_memory_equal(buf, expected, strlen(expected));
+  assert_non_null(strstr(buf, "DeletionDate="));
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test_setup_teardown(test_copy, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_move, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_trash, setup, teardown),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
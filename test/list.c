@@ -37,10 +37,42 @@ static void test_split_string(void **state)
   list_deep_free(list);
 }
 
+static void test_insert_remove(void **state)
+{
+  (void)state;
+
+  int items[200];
+  struct list *list = list_create();
+
+  /* enough items to force the list to grow */
+  for(int i = 0; i < 200; i += 2) {
+    list_append(list, &items[i]);
+  }
+  for(int i = 1; i < 200; i += 2) {
+    list_insert(list, i, &items[i]);
+  }
+  assert_true(list->len == 200);
+  for(int i = 0; i < 200; ++i) {
+    assert_true(list->items[i] == &items[i]);
+  }
+
+  list_remove(list, 0);
+  list_remove(list, 100);
+  list_remove(list, list->len - 1);
+  assert_true(list->len == 197);
+  assert_true(list->items[0] == &items[1]);
+  assert_true(list->items[99] == &items[100]);
+  assert_true(list->items[100] == &items[102]);
+  assert_true(list->items[196] == &items[198]);
+
+  list_free(list);
+}
+
 int main(void)
 {
   const struct CMUnitTest tests[] = {
     cmocka_unit_test(test_split_string),
+    cmocka_unit_test(test_insert_remove),
   };
 
   return cmocka_run_group_tests(tests, NULL, NULL);
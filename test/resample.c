@@ -0,0 +1,121 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resample.h"
+
+static struct imv_bitmap *create_bitmap(int width, int height,
+    uint32_t colour)
+{
+  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = IMV_ABGR;
+  bmp->opaque = false;
+  bmp->mapped = 0;
+  bmp->data = malloc(width * height * 4);
+
+  uint32_t *pixels = (uint32_t*)bmp->data;
+  for (int i = 0; i < width * height; ++i) {
+    pixels[i] = colour;
+  }
+  return bmp;
+}
+
+static void test_resample_uniform(void **state)
+{
+  (void)state;
+
+  /* a flat colour stays the same however it's resampled, even over part
+   * pixels at the edges */
+  struct imv_bitmap *bmp = create_bitmap(50, 30, 0xff336699);
+  struct imv_bitmap *out = imv_resample(bmp, 1.5, 2.25, 45, 26.5, 13, 7,
+      NULL, NULL);
+  assert_non_null(out);
+  assert_int_equal(out->width, 13);
+  assert_int_equal(out->height, 7);
+  assert_int_equal(out->format, IMV_ABGR);
+
+  const uint32_t *pixels = (const uint32_t*)out->data;
+  for (int i = 0; i < 13 * 7; ++i) {
+    assert_int_equal(pixels[i], 0xff336699);
+  }
+
+  imv_bitmap_free(out);
+  imv_bitmap_free(bmp);
+}
+
+static void test_resample_linear_light(void **state)
+{
+  (void)state;
+
+  /* black and white columns average to half the light, which is 188 in
+   * sRGB rather than the 128 of averaging the encoded values */
+  struct imv_bitmap *bmp = create_bitmap(4, 2, 0xff000000);
+  uint32_t *pixels = (uint32_t*)bmp->data;
+  for (int i = 0; i < 8; i += 2) {
+    pixels[i] = 0xffffffff;
+  }
+
+  struct imv_bitmap *out = imv_resample(bmp, 0, 0, 4, 2, 2, 1, NULL, NULL);
+  assert_non_null(out);
+  const uint32_t *result = (const uint32_t*)out->data;
+  assert_int_equal(result[0], 0xffbcbcbc);
+  assert_int_equal(result[1], 0xffbcbcbc);
+
+  imv_bitmap_free(out);
+  imv_bitmap_free(bmp);
+}
+
+static void test_resample_alpha(void **state)
+{
+  (void)state;
+
+  /* transparent pixels don't bleed their colour into their neighbours */
+  struct imv_bitmap *bmp = create_bitmap(2, 2, 0xff0000ff);
+  uint32_t *pixels = (uint32_t*)bmp->data;
+  pixels[1] = 0x0000ff00;
+  pixels[3] = 0x0000ff00;
+
+  struct imv_bitmap *out = imv_resample(bmp, 0, 0, 2, 2, 1, 1, NULL, NULL);
+  assert_non_null(out);
+  assert_int_equal(*(const uint32_t*)out->data, 0x800000ff);
+
+  imv_bitmap_free(out);
+  imv_bitmap_free(bmp);
+}
+
+static bool always_cancelled(void *data)
+{
+  (void)data;
+  return true;
+}
+
+static void test_resample_fails(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap *bmp = create_bitmap(8, 8, 0xffffffff);
+  assert_null(imv_resample(bmp, 0, 0, 8, 8, 4, 4, &always_cancelled, NULL));
+  assert_null(imv_resample(bmp, 4, 0, 8, 8, 4, 4, NULL, NULL));
+  assert_null(imv_resample(bmp, 0, 0, 8, 8, 0, 4, NULL, NULL));
+  imv_bitmap_free(bmp);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_resample_uniform),
+    cmocka_unit_test(test_resample_linear_light),
+    cmocka_unit_test(test_resample_alpha),
+    cmocka_unit_test(test_resample_fails),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,120 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include "terminal.h"
+
+static void test_decode_plain_keys(void **state)
+{
+  (void)state;
+
+  struct imv_terminal_key key;
+
+  assert_int_equal(imv_terminal_decode_key("q", 1, false, &key), 1);
+  assert_int_equal(key.sym, 'q');
+  assert_int_equal(key.mod, 0);
+  assert_string_equal(key.text, "q");
+
+  /* shifted keys are reported as SDL would from a US keyboard */
+  assert_int_equal(imv_terminal_decode_key("G", 1, false, &key), 1);
+  assert_int_equal(key.sym, 'g');
+  assert_true(key.mod & KMOD_SHIFT);
+  assert_string_equal(key.text, "G");
+
+  assert_int_equal(imv_terminal_decode_key(":", 1, false, &key), 1);
+  assert_int_equal(key.sym, SDLK_SEMICOLON);
+  assert_true(key.mod & KMOD_SHIFT);
+  assert_string_equal(key.text, ":");
+
+  assert_int_equal(imv_terminal_decode_key("\r", 1, false, &key), 1);
+  assert_int_equal(key.sym, SDLK_RETURN);
+  assert_string_equal(key.text, "");
+
+  assert_int_equal(imv_terminal_decode_key("\x7f", 1, false, &key), 1);
+  assert_int_equal(key.sym, SDLK_BACKSPACE);
+
+  assert_int_equal(imv_terminal_decode_key("\x03", 1, false, &key), 1);
+  assert_int_equal(key.sym, 'c');
+  assert_true(key.mod & KMOD_CTRL);
+
+  assert_int_equal(imv_terminal_decode_key("", 0, false, &key), 0);
+}
+
+static void test_decode_sequences(void **state)
+{
+  (void)state;
+
+  struct imv_terminal_key key;
+
+  assert_int_equal(imv_terminal_decode_key("\x1b[Cq", 4, false, &key), 3);
+  assert_int_equal(key.sym, SDLK_RIGHT);
+  assert_int_equal(key.mod, 0);
+
+  assert_int_equal(imv_terminal_decode_key("\x1bOA", 3, false, &key), 3);
+  assert_int_equal(key.sym, SDLK_UP);
+
+  assert_int_equal(imv_terminal_decode_key("\x1b[1;5D", 6, false, &key), 6);
+  assert_int_equal(key.sym, SDLK_LEFT);
+  assert_true(key.mod & KMOD_CTRL);
+  assert_false(key.mod & KMOD_SHIFT);
+
+  assert_int_equal(imv_terminal_decode_key("\x1b[6~", 4, false, &key), 4);
+  assert_int_equal(key.sym, SDLK_PAGEDOWN);
+
+  /* a lone escape is the escape key, and one before a key is Alt */
+  assert_int_equal(imv_terminal_decode_key("\x1b", 1, false, &key), 1);
+  assert_int_equal(key.sym, SDLK_ESCAPE);
+
+  assert_int_equal(imv_terminal_decode_key("\x1bx", 2, false, &key), 2);
+  assert_int_equal(key.sym, 'x');
+  assert_true(key.mod & KMOD_ALT);
+  assert_string_equal(key.text, "");
+}
+
+static void test_decode_split(void **state)
+{
+  (void)state;
+
+  struct imv_terminal_key key;
+
+  /* the start of a sequence is left until the rest arrives */
+  char buf[8] = "\x1b[";
+  assert_int_equal(imv_terminal_decode_key(buf, 2, true, &key), 0);
+  strcat(buf, "C");
+  assert_int_equal(imv_terminal_decode_key(buf, 3, true, &key), 3);
+  assert_int_equal(key.sym, SDLK_RIGHT);
+
+  assert_int_equal(imv_terminal_decode_key("\x1b", 1, true, &key), 0);
+  assert_int_equal(imv_terminal_decode_key("\xc3", 1, true, &key), 0);
+
+  /* unless no more is coming */
+  assert_int_equal(imv_terminal_decode_key("\x1b[", 2, false, &key), 1);
+  assert_int_equal(key.sym, SDLK_ESCAPE);
+}
+
+static void test_decode_utf8(void **state)
+{
+  (void)state;
+
+  struct imv_terminal_key key;
+
+  assert_int_equal(imv_terminal_decode_key("\xc3\xa9x", 3, false, &key), 2);
+  assert_int_equal(key.sym, SDLK_UNKNOWN);
+  assert_string_equal(key.text, "\xc3\xa9");
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_decode_plain_keys),
+    cmocka_unit_test(test_decode_sequences),
+    cmocka_unit_test(test_decode_split),
+    cmocka_unit_test(test_decode_utf8),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */